@@ -1,7 +1,171 @@
 use anonymous_tokens::sk::pp::{KeyPair, PublicParams, Token, TokenBlinded, TokenSigned};
+use pyo3::buffer::PyBuffer;
 use pyo3::exceptions::PyValueError;
 use pyo3::prelude::*;
 use pyo3::types::PyBytes;
+use rayon::prelude::*;
+
+mod token_store;
+use token_store::TokenStore;
+
+// The token_list frame of common/wire.json: u8 version, u8 id, u32 token
+// length, u32 length of the tokens, then the tokens back to back
+const WIRE_VERSION: u8 = 1;
+const WIRE_TOKEN_LIST: u8 = 13;
+const TOKEN_LIST_PREFIX_LEN: usize = 10;
+
+fn read_u32(buf: &[u8], off: usize) -> usize {
+    u32::from_le_bytes([buf[off], buf[off + 1], buf[off + 2], buf[off + 3]]) as usize
+}
+
+fn split_token_list(token_list: &[u8]) -> PyResult<Vec<&[u8]>> {
+    if token_list.len() < TOKEN_LIST_PREFIX_LEN {
+        return Err(PyErr::new::<PyValueError, _>("Token list too short"));
+    }
+    if token_list[0] != WIRE_VERSION || token_list[1] != WIRE_TOKEN_LIST {
+        return Err(PyErr::new::<PyValueError, _>("Not a token list frame of this version"));
+    }
+    let token_len = read_u32(token_list, 2);
+    let tokens = &token_list[TOKEN_LIST_PREFIX_LEN..];
+    if read_u32(token_list, 6) != tokens.len() {
+        return Err(PyErr::new::<PyValueError, _>("Token list length does not match its frame"));
+    }
+
+    if tokens.is_empty() {
+        return Ok(Vec::new());
+    }
+    if token_len == 0 || tokens.len() % token_len != 0 {
+        return Err(PyErr::new::<PyValueError, _>("Token list length is not a multiple of the token length"));
+    }
+    Ok(tokens.chunks(token_len).collect())
+}
+
+fn join_token_list(tokens: &[Vec<u8>]) -> Vec<u8> {
+    let token_len = tokens.first().map_or(0, |t| t.len());
+    let tokens_len: usize = tokens.iter().map(|t| t.len()).sum();
+    let mut token_list = Vec::with_capacity(TOKEN_LIST_PREFIX_LEN + tokens_len);
+    token_list.push(WIRE_VERSION);
+    token_list.push(WIRE_TOKEN_LIST);
+    token_list.extend_from_slice(&(token_len as u32).to_le_bytes());
+    token_list.extend_from_slice(&(tokens_len as u32).to_le_bytes());
+    for token in tokens {
+        token_list.extend_from_slice(token);
+    }
+    token_list
+}
+
+fn serialize_to_py<T: serde::Serialize>(py: Python, value: &T) -> PyResult<Py<PyBytes>> {
+    match bincode::serialize(value) {
+        Err(e) => Err(PyErr::new::<PyValueError, _>(format!("{}", e))),
+        Ok(s) => Ok(PyBytes::new(py, &s).into())
+    }
+}
+
+fn deserialize_from_py<T: serde::de::DeserializeOwned>(bytes: &PyBytes) -> PyResult<T> {
+    bincode::deserialize(bytes.as_bytes())
+        .map_err(|e| PyErr::new::<PyValueError, _>(format!("{}", e)))
+}
+
+/*
+ * A keypair parsed once, to pass to every call in place of the keypair.bin
+ * bytes. Keeps the serialized public params so get_public_params is a copy
+ * of a reference. Pickles as its bytes, so it can go to worker processes.
+ */
+#[pyclass]
+struct KeyPairHandle {
+    keypair: KeyPair,
+    keypair_bytes: Py<PyBytes>,
+    public_params_bytes: Py<PyBytes>,
+}
+
+#[pymethods]
+impl KeyPairHandle {
+    #[new]
+    fn new(py: Python, keypair_bytes: &PyBytes) -> PyResult<Self> {
+        let keypair: KeyPair = deserialize_from_py(keypair_bytes)?;
+        let public_params_bytes = serialize_to_py(py, &PublicParams::from(&keypair))?;
+        Ok(KeyPairHandle { keypair, keypair_bytes: keypair_bytes.into(), public_params_bytes })
+    }
+
+    fn public_params(&self, py: Python) -> Py<PyBytes> {
+        self.public_params_bytes.clone_ref(py)
+    }
+
+    fn __reduce__(&self, py: Python) -> (PyObject, (Py<PyBytes>,)) {
+        (py.get_type::<KeyPairHandle>().to_object(py), (self.keypair_bytes.clone_ref(py),))
+    }
+}
+
+// Public params parsed once, for generate_token on the app server and mule
+#[pyclass]
+struct PublicParamsHandle {
+    public_params: PublicParams,
+    public_params_bytes: Py<PyBytes>,
+}
+
+#[pymethods]
+impl PublicParamsHandle {
+    #[new]
+    fn new(public_params_bytes: &PyBytes) -> PyResult<Self> {
+        let public_params: PublicParams = deserialize_from_py(public_params_bytes)?;
+        Ok(PublicParamsHandle { public_params, public_params_bytes: public_params_bytes.into() })
+    }
+
+    fn to_bytes(&self, py: Python) -> Py<PyBytes> {
+        self.public_params_bytes.clone_ref(py)
+    }
+
+    fn __reduce__(&self, py: Python) -> (PyObject, (Py<PyBytes>,)) {
+        (py.get_type::<PublicParamsHandle>().to_object(py), (self.public_params_bytes.clone_ref(py),))
+    }
+}
+
+// Every call takes either a handle or the serialized bytes it was made from
+enum KeyPairArg<'py> {
+    Handle(PyRef<'py, KeyPairHandle>),
+    Parsed(KeyPair),
+}
+
+impl std::ops::Deref for KeyPairArg<'_> {
+    type Target = KeyPair;
+
+    fn deref(&self) -> &KeyPair {
+        match self {
+            KeyPairArg::Handle(handle) => &handle.keypair,
+            KeyPairArg::Parsed(keypair) => keypair,
+        }
+    }
+}
+
+fn keypair_arg<'py>(py: Python<'py>, keypair_obj: &'py PyObject) -> PyResult<KeyPairArg<'py>> {
+    if let Ok(handle) = keypair_obj.extract::<PyRef<KeyPairHandle>>(py) {
+        return Ok(KeyPairArg::Handle(handle));
+    }
+    Ok(KeyPairArg::Parsed(deserialize_from_py(keypair_obj.downcast::<PyBytes>(py)?)?))
+}
+
+enum PublicParamsArg<'py> {
+    Handle(PyRef<'py, PublicParamsHandle>),
+    Parsed(PublicParams),
+}
+
+impl std::ops::Deref for PublicParamsArg<'_> {
+    type Target = PublicParams;
+
+    fn deref(&self) -> &PublicParams {
+        match self {
+            PublicParamsArg::Handle(handle) => &handle.public_params,
+            PublicParamsArg::Parsed(public_params) => public_params,
+        }
+    }
+}
+
+fn public_params_arg<'py>(py: Python<'py>, public_params_obj: &'py PyObject) -> PyResult<PublicParamsArg<'py>> {
+    if let Ok(handle) = public_params_obj.extract::<PyRef<PublicParamsHandle>>(py) {
+        return Ok(PublicParamsArg::Handle(handle));
+    }
+    Ok(PublicParamsArg::Parsed(deserialize_from_py(public_params_obj.downcast::<PyBytes>(py)?)?))
+}
 
 #[pyfunction]
 fn generate_keypair(py: Python) -> PyResult<PyObject> {
@@ -17,9 +181,12 @@ fn generate_keypair(py: Python) -> PyResult<PyObject> {
 
 #[pyfunction]
 fn get_public_params(py: Python, keypair_obj: PyObject) -> PyResult<PyObject> {
-    let keypair_bytes = keypair_obj.downcast::<PyBytes>(py).unwrap();
-    let keypair: KeyPair = bincode::deserialize(&keypair_bytes.as_bytes()).unwrap();
-    let public_params = PublicParams::from(&keypair);
+    if let Ok(handle) = keypair_obj.extract::<PyRef<KeyPairHandle>>(py) {
+        return Ok(handle.public_params(py).to_object(py));
+    }
+
+    let keypair = keypair_arg(py, &keypair_obj)?;
+    let public_params = PublicParams::from(&*keypair);
 
     let serialized = bincode::serialize(&public_params);
     match serialized {
@@ -33,8 +200,7 @@ fn generate_token(py: Python, public_params_obj: PyObject) -> PyResult<PyObject>
 
     let mut csrng = rand::rngs::OsRng;
 
-    let public_params_bytes = public_params_obj.downcast::<PyBytes>(py).unwrap();
-    let public_params: PublicParams = bincode::deserialize(&public_params_bytes.as_bytes()).unwrap();
+    let public_params = public_params_arg(py, &public_params_obj)?;
     let blinded_token = public_params.generate_token(&mut csrng);
 
     let serialized = bincode::serialize(&blinded_token);
@@ -46,8 +212,7 @@ fn generate_token(py: Python, public_params_obj: PyObject) -> PyResult<PyObject>
 
 #[pyfunction]
 fn sign_token(py: Python, keypair_obj: PyObject, blinded_token_obj: PyObject) -> PyResult<PyObject> {
-    let keypair_bytes = keypair_obj.downcast::<PyBytes>(py).unwrap();
-    let keypair: KeyPair = bincode::deserialize(&keypair_bytes.as_bytes()).unwrap();
+    let keypair = keypair_arg(py, &keypair_obj)?;
 
     let blinded_token_bytes = blinded_token_obj.downcast::<PyBytes>(py).unwrap();
     let blinded_token: TokenBlinded = bincode::deserialize(&blinded_token_bytes.as_bytes()).unwrap();
@@ -86,9 +251,8 @@ fn unblind_token(py: Python, blinded_token_obj: PyObject, signed_token_obj: PyOb
 
 #[pyfunction]
 fn verify_token(py: Python, keypair_obj: PyObject, token_obj: PyObject) -> PyResult<bool> {
-    let keypair_bytes = keypair_obj.downcast::<PyBytes>(py).unwrap();
-    let keypair: KeyPair = bincode::deserialize(&keypair_bytes.as_bytes()).unwrap();
-    
+    let keypair = keypair_arg(py, &keypair_obj)?;
+
     let token_bytes = token_obj.downcast::<PyBytes>(py).unwrap();
     let token: Token = bincode::deserialize(&token_bytes.as_bytes()).unwrap();
 
@@ -96,14 +260,91 @@ fn verify_token(py: Python, keypair_obj: PyObject, token_obj: PyObject) -> PyRes
     Ok(result.is_ok())
 }
 
+/*
+ * Splits a TokenList into a list of token bytes in one call, for
+ * payloads.TokenList.deserialize. Takes bytes or any contiguous buffer, so a
+ * memoryview into a request body can be split without slicing it out first;
+ * only the tokens themselves are copied, into their bytes objects.
+ */
+#[pyfunction]
+fn split_tokens(py: Python, token_list: PyBuffer<u8>) -> PyResult<Vec<Py<PyBytes>>> {
+    if !token_list.is_c_contiguous() {
+        return Err(PyErr::new::<PyValueError, _>("Token list must be a contiguous buffer"));
+    }
+    // the buffer stays exported while token_list lives, and holding the GIL
+    // keeps Python code from writing to it until the tokens are copied out
+    let bytes = unsafe {
+        std::slice::from_raw_parts(token_list.buf_ptr() as *const u8, token_list.len_bytes())
+    };
+    Ok(split_token_list(bytes)?.into_iter().map(|token| PyBytes::new(py, token).into()).collect())
+}
+
+/*
+ * Signs a TokenList of blinded tokens and returns a TokenList of signed ones.
+ * The keypair is parsed once and the tokens are signed in parallel without
+ * holding the GIL.
+ */
+#[pyfunction]
+fn sign_tokens_batch(py: Python, keypair_obj: PyObject, token_list_obj: PyObject) -> PyResult<PyObject> {
+    let keypair_arg = keypair_arg(py, &keypair_obj)?;
+    let keypair: &KeyPair = &keypair_arg;
+    let token_list = token_list_obj.downcast::<PyBytes>(py)?.as_bytes();
+    let blinded_tokens = split_token_list(token_list)?;
+
+    let signed_tokens: Result<Vec<Vec<u8>>, String> = py.allow_threads(|| {
+        blinded_tokens.par_iter().map(|blinded_token_bytes| {
+            let blinded_token: TokenBlinded = bincode::deserialize(blinded_token_bytes)
+                .map_err(|e| format!("{}", e))?;
+            let signed_token = keypair.sign(&blinded_token.to_bytes())
+                .ok_or_else(|| String::from("Failed to sign token"))?;
+            bincode::serialize(&signed_token).map_err(|e| format!("{}", e))
+        }).collect()
+    });
+
+    match signed_tokens {
+        Err(e) => Err(PyErr::new::<PyValueError, _>(e)),
+        Ok(s) => Ok(PyBytes::new(py, &join_token_list(&s)).to_object(py))
+    }
+}
+
+/*
+ * Verifies a TokenList of tokens and returns one byte per token, 1 if it is
+ * valid and 0 if not (including tokens that don't parse). Parallel and
+ * without the GIL like sign_tokens_batch.
+ */
+#[pyfunction]
+fn verify_tokens_batch(py: Python, keypair_obj: PyObject, token_list_obj: PyObject) -> PyResult<PyObject> {
+    let keypair_arg = keypair_arg(py, &keypair_obj)?;
+    let keypair: &KeyPair = &keypair_arg;
+    let token_list = token_list_obj.downcast::<PyBytes>(py)?.as_bytes();
+    let tokens = split_token_list(token_list)?;
+
+    let results: Vec<u8> = py.allow_threads(|| {
+        tokens.par_iter().map(|token_bytes| {
+            match bincode::deserialize::<Token>(token_bytes) {
+                Ok(token) => keypair.verify(&token).is_ok() as u8,
+                Err(_) => 0,
+            }
+        }).collect()
+    });
+
+    Ok(PyBytes::new(py, &results).to_object(py))
+}
+
 #[pymodule]
 fn tokenlib(_py: Python, m: &PyModule) -> PyResult<()> {
+    m.add_class::<KeyPairHandle>()?;
+    m.add_class::<PublicParamsHandle>()?;
+    m.add_class::<TokenStore>()?;
     m.add_wrapped(wrap_pyfunction!(generate_keypair))?;
     m.add_wrapped(wrap_pyfunction!(get_public_params))?;
     m.add_wrapped(wrap_pyfunction!(generate_token))?;
     m.add_wrapped(wrap_pyfunction!(sign_token))?;
     m.add_wrapped(wrap_pyfunction!(unblind_token))?;
     m.add_wrapped(wrap_pyfunction!(verify_token))?;
+    m.add_wrapped(wrap_pyfunction!(sign_tokens_batch))?;
+    m.add_wrapped(wrap_pyfunction!(verify_tokens_batch))?;
+    m.add_wrapped(wrap_pyfunction!(split_tokens))?;
     Ok(())
 }
 
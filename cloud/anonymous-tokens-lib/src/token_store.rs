@@ -0,0 +1,427 @@
+// Persistent double-spend index for redeemed tokens.
+//
+// A store is a directory of shard files. Each shard is an open-addressing
+// hash table in a memory-mapped file: a 64 byte header, then slots of a
+// 16 byte BLAKE2b fingerprint of the token followed by a fixed-length value
+// (the redeeming mule's id, or nothing for a plain set). An all-zero
+// fingerprint marks an empty slot. A key's shard and its first probe both
+// come from its fingerprint, and probing never leaves the shard, so each
+// shard has its own lock and batches touching different shards don't wait
+// on each other.
+//
+// A slot's value is written before its fingerprint, so a slot is either
+// empty or complete once it is visible. A shard that passes 3/4 load is
+// rehashed into a file twice its size, which replaces the old one with a
+// rename.
+//
+// The key count in a shard's header is only up to date after a flush. The
+// header's dirty flag goes to disk before the first change after one, and
+// a shard opened with it still set is recounted from its slots.
+
+use std::fs::{self, OpenOptions};
+use std::io;
+use std::path::{Path, PathBuf};
+use std::sync::{Mutex, MutexGuard};
+
+use blake2::digest::consts::U16;
+use blake2::{Blake2b, Digest};
+use memmap2::MmapMut;
+use pyo3::exceptions::{PyIOError, PyValueError};
+use pyo3::prelude::*;
+use pyo3::types::PyBytes;
+
+const MAGIC: &[u8; 8] = b"TOKSTOR1";
+const HEADER_LEN: usize = 64;
+const DIRTY_OFF: usize = 32;
+const FP_LEN: usize = 16;
+const META_FILE: &str = "store.meta";
+
+type Fingerprint = [u8; FP_LEN];
+
+fn fingerprint(key: &[u8]) -> Fingerprint {
+    let mut fp: Fingerprint = Blake2b::<U16>::digest(key).into();
+    if fp == [0; FP_LEN] {
+        fp[0] = 1;
+    }
+    fp
+}
+
+fn fp_word(fp: &Fingerprint, half: usize) -> u64 {
+    let mut word = [0u8; 8];
+    word.copy_from_slice(&fp[half * 8..half * 8 + 8]);
+    u64::from_le_bytes(word)
+}
+
+fn read_u64(buf: &[u8], off: usize) -> u64 {
+    let mut word = [0u8; 8];
+    word.copy_from_slice(&buf[off..off + 8]);
+    u64::from_le_bytes(word)
+}
+
+fn invalid(path: &Path, what: &str) -> io::Error {
+    io::Error::new(io::ErrorKind::InvalidData, format!("{}: {}", path.display(), what))
+}
+
+struct Shard {
+    path: PathBuf,
+    map: MmapMut,
+    capacity: u64,  // slots, a power of two
+    count: u64,
+    value_len: usize,
+    dirty: bool,    // changed since the last flush
+}
+
+impl Shard {
+    fn slot_len(&self) -> usize {
+        FP_LEN + self.value_len
+    }
+
+    fn slot_off(&self, index: u64) -> usize {
+        HEADER_LEN + index as usize * self.slot_len()
+    }
+
+    fn create(path: &Path, capacity: u64, value_len: usize) -> io::Result<Shard> {
+        let file = OpenOptions::new().read(true).write(true).create(true).truncate(true).open(path)?;
+        file.set_len((HEADER_LEN + capacity as usize * (FP_LEN + value_len)) as u64)?;
+
+        let mut map = unsafe { MmapMut::map_mut(&file)? };
+        map[0..8].copy_from_slice(MAGIC);
+        map[8..12].copy_from_slice(&(value_len as u32).to_le_bytes());
+        map[16..24].copy_from_slice(&capacity.to_le_bytes());
+
+        let mut shard = Shard { path: path.to_path_buf(), map, capacity, count: 0, value_len, dirty: false };
+        shard.store_count();
+        Ok(shard)
+    }
+
+    fn open(path: &Path, value_len: usize) -> io::Result<Shard> {
+        let file = OpenOptions::new().read(true).write(true).open(path)?;
+        let map = unsafe { MmapMut::map_mut(&file)? };
+
+        if map.len() < HEADER_LEN || &map[0..8] != MAGIC {
+            return Err(invalid(path, "not a token store shard"));
+        }
+        if u32::from_le_bytes([map[8], map[9], map[10], map[11]]) as usize != value_len {
+            return Err(invalid(path, "value length differs from the store's"));
+        }
+        let capacity = read_u64(&map, 16);
+        let count = read_u64(&map, 24);
+        if !capacity.is_power_of_two() || map.len() != HEADER_LEN + capacity as usize * (FP_LEN + value_len) {
+            return Err(invalid(path, "bad shard size"));
+        }
+
+        let mut shard = Shard { path: path.to_path_buf(), map, capacity, count, value_len, dirty: false };
+        // changed and not flushed before the process or host went down
+        if shard.map[DIRTY_OFF] != 0 || count > capacity {
+            shard.count = shard.occupied();
+            shard.store_count();
+            shard.dirty = true;
+        }
+        Ok(shard)
+    }
+
+    fn occupied(&self) -> u64 {
+        (0..self.capacity)
+            .filter(|&index| {
+                let off = self.slot_off(index);
+                self.map[off..off + FP_LEN].iter().any(|&b| b != 0)
+            })
+            .count() as u64
+    }
+
+    // Sets the dirty flag on disk before the first change after a flush
+    fn mark_dirty(&mut self) -> io::Result<()> {
+        if !self.dirty {
+            self.map[DIRTY_OFF] = 1;
+            self.map.flush_range(0, HEADER_LEN)?;
+            self.dirty = true;
+        }
+        Ok(())
+    }
+
+    fn flush(&mut self) -> io::Result<()> {
+        self.store_count();
+        self.map.flush()?;
+        if self.dirty {
+            self.map[DIRTY_OFF] = 0;
+            self.map.flush_range(0, HEADER_LEN)?;
+            self.dirty = false;
+        }
+        Ok(())
+    }
+
+    fn store_count(&mut self) {
+        let count = self.count.to_le_bytes();
+        self.map[24..32].copy_from_slice(&count);
+    }
+
+    // Slot holding fp, or the empty slot where it would go
+    fn find(&self, fp: &Fingerprint) -> (u64, bool) {
+        let mask = self.capacity - 1;
+        let mut index = fp_word(fp, 1) & mask;
+        loop {
+            let off = self.slot_off(index);
+            let slot_fp = &self.map[off..off + FP_LEN];
+            if slot_fp == fp {
+                return (index, true);
+            }
+            if slot_fp.iter().all(|&b| b == 0) {
+                return (index, false);
+            }
+            index = (index + 1) & mask;
+        }
+    }
+
+    fn put(&mut self, index: u64, fp: &Fingerprint, value: &[u8]) {
+        let off = self.slot_off(index);
+        self.map[off + FP_LEN..off + FP_LEN + self.value_len].copy_from_slice(value);
+        self.map[off..off + FP_LEN].copy_from_slice(fp);
+        self.count += 1;
+    }
+
+    // None if fp was added, or the value it was added with before
+    fn add_if_not_exists(&mut self, fp: &Fingerprint, value: &[u8]) -> io::Result<Option<Vec<u8>>> {
+        let (mut index, found) = self.find(fp);
+        if found {
+            let off = self.slot_off(index) + FP_LEN;
+            return Ok(Some(self.map[off..off + self.value_len].to_vec()));
+        }
+
+        if (self.count + 1) * 4 > self.capacity * 3 {
+            self.grow()?;
+            index = self.find(fp).0;
+        }
+        self.mark_dirty()?;
+        self.put(index, fp, value);
+        Ok(None)
+    }
+
+    // Grows ahead of time so that additional more tokens fit without growing
+    fn reserve(&mut self, additional: u64) -> io::Result<()> {
+        while (self.count + additional) * 4 > self.capacity * 3 {
+            self.grow()?;
+        }
+        Ok(())
+    }
+
+    fn grow(&mut self) -> io::Result<()> {
+        let tmp = self.path.with_extension("grow");
+        let mut bigger = Shard::create(&tmp, self.capacity * 2, self.value_len)?;
+
+        for index in 0..self.capacity {
+            let off = self.slot_off(index);
+            let slot = &self.map[off..off + self.slot_len()];
+            if slot[..FP_LEN].iter().all(|&b| b == 0) {
+                continue;
+            }
+            let mut fp: Fingerprint = [0; FP_LEN];
+            fp.copy_from_slice(&slot[..FP_LEN]);
+            let (new_index, _) = bigger.find(&fp);
+            bigger.put(new_index, &fp, &slot[FP_LEN..]);
+        }
+
+        bigger.store_count();
+        bigger.map.flush()?;
+        fs::rename(&tmp, &self.path)?;
+        bigger.path = self.path.clone();
+        *self = bigger;
+        Ok(())
+    }
+}
+
+fn io_err(e: io::Error) -> PyErr {
+    PyErr::new::<PyIOError, _>(format!("{}", e))
+}
+
+/*
+ * Persistent set of tokens, each with an optional fixed-length value.
+ * add_batch checks and inserts a whole batch atomically: it holds the lock
+ * of every shard the batch touches, taken in shard order, for the duration.
+ */
+#[pyclass]
+pub struct TokenStore {
+    shards: Vec<Mutex<Shard>>,
+    value_len: usize,
+}
+
+impl TokenStore {
+    fn shard_of(&self, fp: &Fingerprint) -> usize {
+        (fp_word(fp, 0) % self.shards.len() as u64) as usize
+    }
+
+    fn lock(&self, index: usize) -> MutexGuard<Shard> {
+        self.shards[index].lock().unwrap_or_else(|e| e.into_inner())
+    }
+
+    fn add_batch_inner(&self, keys: &[&[u8]], values: &[&[u8]]) -> io::Result<Vec<Option<Vec<u8>>>> {
+        let fps: Vec<Fingerprint> = keys.iter().map(|key| fingerprint(key)).collect();
+        let shard_of: Vec<usize> = fps.iter().map(|fp| self.shard_of(fp)).collect();
+
+        let mut touched = shard_of.clone();
+        touched.sort_unstable();
+        touched.dedup();
+        let mut guards: Vec<MutexGuard<Shard>> = touched.iter().map(|&i| self.lock(i)).collect();
+
+        // every shard grows before anything is inserted, so a failed grow
+        // leaves the store without any of the batch
+        for (guard, shard) in guards.iter_mut().zip(touched.iter()) {
+            let additional = shard_of.iter().filter(|&&s| s == *shard).count() as u64;
+            guard.reserve(additional)?;
+        }
+
+        let zeros = vec![0u8; self.value_len];
+        let mut results = Vec::with_capacity(keys.len());
+        for (j, fp) in fps.iter().enumerate() {
+            let guard = &mut guards[touched.binary_search(&shard_of[j]).unwrap()];
+            let value = if values.is_empty() { &zeros[..] } else { values[j] };
+            results.push(guard.add_if_not_exists(fp, value)?);
+        }
+
+        for guard in guards.iter_mut() {
+            guard.store_count();
+        }
+        Ok(results)
+    }
+
+    fn previous_to_py(&self, py: Python, previous: Option<Vec<u8>>) -> Option<PyObject> {
+        previous.map(|value| {
+            if self.value_len == 0 {
+                true.to_object(py)
+            } else {
+                PyBytes::new(py, &value).to_object(py)
+            }
+        })
+    }
+}
+
+#[pymethods]
+impl TokenStore {
+    /*
+     * Opens the store in directory path, creating it if needed. num_shards
+     * and shard_capacity only apply to a new store; value_len must match
+     * the one the store was created with.
+     */
+    #[new]
+    #[pyo3(signature = (path, value_len=0, num_shards=64, shard_capacity=65536))]
+    fn new(path: &str, value_len: usize, num_shards: usize, shard_capacity: u64) -> PyResult<Self> {
+        let dir = PathBuf::from(path);
+        fs::create_dir_all(&dir).map_err(io_err)?;
+
+        let meta_path = dir.join(META_FILE);
+        let num_shards = match fs::read_to_string(&meta_path) {
+            Ok(meta) => {
+                let fields: Vec<usize> = meta.split_whitespace().filter_map(|f| f.parse().ok()).collect();
+                if fields.len() != 2 || fields[0] == 0 {
+                    return Err(PyErr::new::<PyValueError, _>(format!("{}: bad store meta", meta_path.display())));
+                }
+                if fields[1] != value_len {
+                    return Err(PyErr::new::<PyValueError, _>(format!(
+                        "{}: store has {} byte values, not {}", path, fields[1], value_len)));
+                }
+                fields[0]
+            }
+            Err(e) if e.kind() == io::ErrorKind::NotFound => {
+                if num_shards == 0 {
+                    return Err(PyErr::new::<PyValueError, _>("num_shards must be positive"));
+                }
+                fs::write(&meta_path, format!("{} {}\n", num_shards, value_len)).map_err(io_err)?;
+                num_shards
+            }
+            Err(e) => return Err(io_err(e)),
+        };
+
+        let capacity = shard_capacity.max(16).next_power_of_two();
+        let mut shards = Vec::with_capacity(num_shards);
+        for i in 0..num_shards {
+            let shard_path = dir.join(format!("shard-{:04}.tbl", i));
+            // a rehash that didn't finish left the old shard in place
+            let _ = fs::remove_file(shard_path.with_extension("grow"));
+
+            let shard = if shard_path.exists() {
+                Shard::open(&shard_path, value_len)
+            } else {
+                Shard::create(&shard_path, capacity, value_len)
+            };
+            shards.push(Mutex::new(shard.map_err(io_err)?));
+        }
+
+        Ok(TokenStore { shards, value_len })
+    }
+
+    /*
+     * Adds keys that aren't in the store yet. Returns, in input order, None
+     * for each key that was added and the value stored with it before for
+     * each one that was already there (True for a store without values).
+     * A key repeated within the batch is added once; later copies see it.
+     */
+    #[pyo3(signature = (keys, values=None))]
+    fn add_batch(&self, py: Python, keys: Vec<&PyBytes>, values: Option<Vec<&PyBytes>>) -> PyResult<Vec<Option<PyObject>>> {
+        let key_bytes: Vec<&[u8]> = keys.iter().map(|key| key.as_bytes()).collect();
+        let value_bytes: Vec<&[u8]> = match &values {
+            None => Vec::new(),
+            Some(values) => {
+                if values.len() != keys.len() {
+                    return Err(PyErr::new::<PyValueError, _>("keys and values differ in length"));
+                }
+                values.iter().map(|value| value.as_bytes()).collect()
+            }
+        };
+        if value_bytes.iter().any(|value| value.len() != self.value_len) {
+            return Err(PyErr::new::<PyValueError, _>(format!("values must be {} bytes", self.value_len)));
+        }
+
+        let results = py.allow_threads(|| self.add_batch_inner(&key_bytes, &value_bytes)).map_err(io_err)?;
+        Ok(results.into_iter().map(|previous| self.previous_to_py(py, previous)).collect())
+    }
+
+    #[pyo3(signature = (key, value=None))]
+    fn add_if_not_exists(&self, py: Python, key: &PyBytes, value: Option<&PyBytes>) -> PyResult<Option<PyObject>> {
+        let mut results = self.add_batch(py, vec![key], value.map(|v| vec![v]))?;
+        Ok(results.pop().unwrap())
+    }
+
+    // Writes every shard back to disk
+    fn flush(&self, py: Python) -> PyResult<()> {
+        py.allow_threads(|| -> io::Result<()> {
+            for i in 0..self.shards.len() {
+                self.lock(i).flush()?;
+            }
+            Ok(())
+        }).map_err(io_err)
+    }
+
+    #[getter]
+    fn num_shards(&self) -> usize {
+        self.shards.len()
+    }
+
+    /*
+     * Fingerprints of the keys in one shard, each the key's 16 byte BLAKE2b
+     * (hashlib.blake2b(key, digest_size=16)). Lets a filter in front of the
+     * store be rebuilt without the keys themselves.
+     */
+    fn shard_fingerprints(&self, py: Python, index: usize) -> PyResult<Vec<PyObject>> {
+        if index >= self.shards.len() {
+            return Err(PyErr::new::<PyValueError, _>("no such shard"));
+        }
+        let shard = self.lock(index);
+        let mut fps = Vec::with_capacity(shard.count as usize);
+        for slot in 0..shard.capacity {
+            let off = shard.slot_off(slot);
+            let fp = &shard.map[off..off + FP_LEN];
+            if fp.iter().any(|&b| b != 0) {
+                fps.push(PyBytes::new(py, fp).to_object(py));
+            }
+        }
+        Ok(fps)
+    }
+
+    fn __contains__(&self, key: &PyBytes) -> bool {
+        let fp = fingerprint(key.as_bytes());
+        self.lock(self.shard_of(&fp)).find(&fp).1
+    }
+
+    fn __len__(&self) -> usize {
+        (0..self.shards.len()).map(|i| self.lock(i).count as usize).sum()
+    }
+}
@@ -2,37 +2,56 @@
 import config
 import json
 import os
-import requests
 import tokenlib # type: ignore
 import util
 import payloads
+import wire
+import platform_tokendb
+import token_reservoir
 
-# number of tokens to request from the provider at one time, increase if you're
-# expecting a lot of traffic
+# smallest number of tokens to request from the provider at one time; the
+# reservoir asks for more when deliveries come in faster
 TOKEN_REQUEST_SIZE = 10
 
 # -- App Server State --
 provider_url = os.environ.get('PROVIDER_URL') 
 use_tls = os.environ.get('SERVER_TLS') == 'true'
+# keep-alive connections to the provider, shared by all request threads
+provider_session = util.PooledSession()
 
-# public parameters for token generation
+# public parameters for token generation, a tokenlib.PublicParamsHandle
 public_params = None
-# list of unused tokens to be handed out to mules
-unused_tokens = []
-# set of observed payload hashes
-seen_hashes = set()
-# map of sensor ID -> public ECDSA key. Here we just have one sensor with a known id-key pair
-sensor_public_keys = {
-    bytes.fromhex('ffffffffffffffffffffffffffffff01'): util.load_public_key('sensor-public-ecc.pem')
-}
-# map of pending data hashes -> [nonce, token] pairs
-pending_deliveries = {}
-
-
-def get_public_params() -> bytes:
-    return payloads.PublicParams.deserialize(
-        requests.get(provider_url + '/public_params', verify=use_tls).content
-    )
+# unused tokens to be handed out to mules, refilled in the background and kept
+# on disk at APP_TOKEN_RESERVOIR across restarts; created by start()
+reservoir = None
+# hashes of payloads already delivered, kept on disk under APP_SEEN_HASHES so a
+# restart doesn't accept them again
+seen_hashes = platform_tokendb.BloomSet(
+    os.environ.get('APP_SEEN_HASHES', 'seen_hashes'),
+    capacity=int(os.environ.get('APP_SEEN_CAPACITY', 1000000))
+)
+# signing and AES keys, plus sensor ID -> public ECDSA key. Here we just have
+# one sensor with a known id-key pair. Loaded once; SIGHUP reloads them.
+keys = util.KeyManager(
+    private_key_file=util.PRIVATE_ECC_KEYFILE,
+    aes_key_file=util.AES_KEYFILE,
+    public_key_files={
+        bytes.fromhex('ffffffffffffffffffffffffffffff01'): 'sensor-public-ecc.pem'
+    }
+)
+# map of pending data hashes -> [nonce, token] pairs. A predelivery whose data
+# never arrives is dropped after APP_PENDING_TTL seconds, or sooner once there
+# are more than APP_PENDING_MAX of them.
+pending_deliveries = platform_tokendb.ExpiringDict(
+    max_entries=int(os.environ.get('APP_PENDING_MAX', 100000)),
+    ttl=float(os.environ.get('APP_PENDING_TTL', 3600))
+)
+
+
+def get_public_params():
+    return tokenlib.PublicParamsHandle(payloads.PublicParams.deserialize(
+        provider_session.get(provider_url + '/public_params', verify=use_tls).content
+    ))
 
 
 # ALGORITHM 1: TOKEN PURCHASE
@@ -42,34 +61,61 @@ def get_more_tokens(num_tokens: int) -> list[bytes]:
     global public_params
 
     # if we didn't query the app server for the public parameters yet, do so now
-    if not public_params:
+    if public_params is None:
         public_params = get_public_params()
 
     blinded_tokens = [tokenlib.generate_token(public_params) for _ in range(num_tokens)]
     blinded_token_bytes = payloads.TokenList.serialize(blinded_tokens)
-    signed_tokens = payloads.TokenList.deserialize(
-        requests.post(
-            provider_url + '/sign_tokens',
-            verify=use_tls,
-            headers = {'Content-type': 'application/octet-stream'},
-            data=blinded_token_bytes
-        ).content
+    response = provider_session.post(
+        provider_url + '/sign_tokens',
+        verify=use_tls,
+        headers = {'Content-type': 'application/octet-stream'},
+        data=blinded_token_bytes
     )
+    # the reservoir backs off and retries on this
+    response.raise_for_status()
+    signed_tokens = payloads.TokenList.deserialize(response.content)
 
     return [tokenlib.unblind_token(b_token, s_token) for b_token, s_token in zip(blinded_tokens, signed_tokens)]
 
 
-# ALGORITHM 2(a): PAYLOAD DELIVERY (HASH PAYLOAD)
-def deliver_hash_payload(payload) -> str:
+def start():
 
-    global unused_tokens
-    global provider_url
-    global seen_hashes 
-    global sensor_public_keys
-    global pending_deliveries
+    global reservoir
+
+    reservoir = token_reservoir.TokenReservoir(
+        get_more_tokens,
+        os.environ.get('APP_TOKEN_RESERVOIR', 'unused_tokens.bin'),
+        low=int(os.environ.get('APP_TOKENS_LOW', 20)),
+        high=int(os.environ.get('APP_TOKENS_HIGH', 100)),
+        min_batch=TOKEN_REQUEST_SIZE
+    )
+    reservoir.start()
 
-    p_hash, sig_hash = payloads.SignedHashPayload.deserialize(payload)
-    sensor_id, data_hash = payloads.HashPayload.deserialize(p_hash)
+
+def shutdown():
+    if reservoir is not None:
+        reservoir.stop()
+    seen_hashes.flush()
+
+
+# takes n unused tokens from the reservoir, None if it ran dry
+def take_tokens(num_tokens: int) -> list[bytes]:
+    return reservoir.take(num_tokens)
+
+
+# checks a signed hash payload, returns its data hash or None if it should be dropped
+def check_hash_payload(payload) -> bytes:
+
+    global seen_hashes
+    global keys
+
+    try:
+        p_hash, sig_hash = payloads.SignedHashPayload.deserialize(payload)
+        sensor_id, data_hash = payloads.HashPayload.deserialize(p_hash)
+    except wire.WireError:
+        print(f'Malformed hash payload ({len(payload)} bytes)')
+        return None
     print(f'data_hash: {util.encode_bytes_b64(data_hash)}')
 
     # if the payload hash is already in the set of payload hashes, abort by returning nothing
@@ -78,56 +124,147 @@ def deliver_hash_payload(payload) -> str:
         return None
 
     # verify the signature, abort if it fails
-    if sensor_id not in sensor_public_keys:
+    if sensor_id not in keys:
         print(f'Unknown sensor ID: {sensor_id}')
         return None
         
-    if not util.verify_ecdsa(sensor_public_keys[sensor_id], p_hash, sig_hash):
+    if not keys.verify(sensor_id, p_hash, sig_hash):
         print(f'Invalid signature for sensor ID: {sensor_id}')
         return None
 
-    # generate random nonce and get an unused token
-    protocol_nonce = util.get_random_bytes(config.DELIVER_NONCE_BYTES)
-    if len(unused_tokens) == 0:
-        unused_tokens += get_more_tokens(TOKEN_REQUEST_SIZE)
-    token = unused_tokens.pop()
+    return data_hash
+
+
+# records a pending delivery for an accepted hash and signs the predelivery payload
+def predeliver(data_hash, token) -> bytes:
+
+    global pending_deliveries
 
+    # generate random nonce to go with the token
+    protocol_nonce = util.get_random_bytes(config.DELIVER_NONCE_BYTES)
     pending_deliveries[data_hash] = [protocol_nonce, token]
 
-    aes_key = util.load_aes_key()
-    encrypted_token = util.encrypt_aes(aes_key, token)
+    encrypted_token = keys.encrypt_aes(token)
 
     payload = payloads.PredeliveryPayload.serialize(protocol_nonce, data_hash, encrypted_token)
-    sig = util.sign_ecdsa(util.load_private_key(), payload)
+    sig = keys.sign(payload)
     return payloads.SignedPredeliveryPayload.serialize(
         payload, sig
     )
 
 
-# ALGORITHM 2(b) PAYLOAD DELIVERY (DATA PAYLOAD) 
-def deliver_data(payload) -> str:
+# ALGORITHM 2(a): PAYLOAD DELIVERY (HASH PAYLOAD)
+def deliver_hash_payload(payload) -> str:
+
+    data_hash = check_hash_payload(payload)
+    if data_hash is None:
+        return None
+
+    tokens = take_tokens(1)
+    if tokens is None:
+        print('Out of tokens')
+        return None
+    return predeliver(data_hash, tokens[0])
+
+
+# ALGORITHM 2(a), batched: a PayloadList of signed hash payloads in, a PayloadList
+# of signed predelivery payloads out (empty where a payload was dropped). Tokens
+# are requested once for the whole batch.
+def deliver_hash_payload_batch(payload) -> bytes:
+
+    try:
+        hash_payloads = payloads.PayloadList.deserialize(memoryview(payload))
+    except wire.WireError:
+        print(f'Malformed hash payload batch ({len(payload)} bytes)')
+        return None
+
+    data_hashes = []
+    batch_hashes = set()
+    for hash_payload in hash_payloads:
+        data_hash = check_hash_payload(hash_payload)
+        # a hash twice in one batch would hand out two tokens for one delivery
+        if data_hash in batch_hashes:
+            print(f'Payload hash repeated in batch: {util.encode_bytes_b64(data_hash)}')
+            data_hash = None
+        if data_hash is not None:
+            batch_hashes.add(data_hash)
+        data_hashes.append(data_hash)
+
+    tokens = take_tokens(len(batch_hashes))
+    if tokens is None:
+        print(f'Out of tokens for a batch of {len(batch_hashes)}')
+        data_hashes = [None] * len(data_hashes)
+
+    results = []
+    for data_hash in data_hashes:
+        if data_hash is None:
+            results.append(b'')
+        else:
+            results.append(predeliver(data_hash, tokens.pop()))
+
+    return payloads.PayloadList.serialize(results)
+
+
+# hands out the token for delivered data, None if its hash wasn't predelivered
+def redeem_delivery(data) -> bytes:
 
     global pending_deliveries
+    global seen_hashes
 
-    # Yay! We can do something with the data now!
-    data = payloads.Data.deserialize(payload)
+    # a duplicate is turned away before it can take the pending token
+    data_hash = util.hash_sha256(data)
+    if data_hash in seen_hashes:
+        print(f'Payload hash already delivered: {util.encode_bytes_b64(data_hash)}')
+        return None
 
     # hash the data payload and check if it's in the set of pending payload hashes
-    data_hash = util.hash_sha256(data)
-    if data_hash not in pending_deliveries:
+    # (one pop, so two concurrent deliveries of the same data can't both get the token)
+    pending = pending_deliveries.pop(data_hash, None)
+    if pending is None:
         print(f'Unknown data hash: {util.encode_bytes_b64(data_hash)}')
         return None
     
+    # another delivery of the same hash may have added it since the check
+    # above; only the first to add it gets the token
+    if not seen_hashes.add(data_hash):
+        print(f'Payload hash already delivered: {util.encode_bytes_b64(data_hash)}')
+        return None
+
     # get the nonce and token from the pending deliveries
-    nonce, token = pending_deliveries[data_hash]
-    del pending_deliveries[data_hash]
+    nonce, token = pending
 
     token_payload = payloads.TokenPayload.serialize(nonce, token, data_hash)
     return payloads.SignedTokenPayload.serialize(
-        token_payload, util.sign_ecdsa(util.load_private_key(), token_payload)
+        token_payload, keys.sign(token_payload)
     )
 
 
+# ALGORITHM 2(b) PAYLOAD DELIVERY (DATA PAYLOAD) 
+def deliver_data(payload) -> str:
+
+    # Yay! We can do something with the data now!
+    data = payloads.Data.deserialize(payload)
+    return redeem_delivery(data)
+
+
+# ALGORITHM 2(b), batched: a PayloadList of data blobs in, a PayloadList of
+# signed token payloads out (empty where the data wasn't predelivered)
+def deliver_data_batch(payload) -> bytes:
+
+    try:
+        data_payloads = payloads.PayloadList.deserialize(memoryview(payload))
+    except wire.WireError:
+        print(f'Malformed data batch ({len(payload)} bytes)')
+        return None
+
+    results = []
+    for data_payload in data_payloads:
+        data = payloads.Data.deserialize(data_payload)
+        results.append(redeem_delivery(data) or b'')
+
+    return payloads.PayloadList.serialize(results)
+
+
 # ALGORITHM 4(c): RECEIVE COMPLAINT DATA
 def deliver_complaint_data(payload) -> bool: 
     # Yay! We can do something with the complaint data now!
@@ -0,0 +1,57 @@
+# bench_tokendb.py
+# Microbenchmark for StringSet.add_new_elements at redemption batch sizes,
+# against the previous implementation that ran every insert through a
+# 256-thread ThreadPoolExecutor.
+#
+#   python bench_tokendb.py [--sizes 10,700,10000] [--calls 20]
+import argparse
+import os
+import time
+from concurrent.futures import ThreadPoolExecutor
+
+import platform_tokendb
+
+
+class ThreadPoolStringSet(platform_tokendb.StringSet):
+
+    def add_new_elements(self, keys, values=None, max_workers=256):
+        if values is None:
+            values = [True] * len(keys)
+        with ThreadPoolExecutor(max_workers=max_workers) as executor:
+            results = executor.map(self.add_if_not_exists, keys, values)
+        return list(results)
+
+
+# seconds per add_new_elements call, each call redeeming fresh tokens
+# plus a tenth of the previous call's (the duplicates a provider sees)
+def time_calls(string_set, batch_size, calls):
+    mule_id = os.urandom(16)
+    batches = []
+    previous = []
+    for _ in range(calls):
+        batch = [os.urandom(64) for _ in range(batch_size - len(previous) // 10)] + previous[:len(previous) // 10]
+        batches.append(batch)
+        previous = batch
+
+    start = time.perf_counter()
+    results = [string_set.add_new_elements(batch, [mule_id] * len(batch)) for batch in batches]
+    elapsed = time.perf_counter() - start
+
+    duplicates = sum(1 for result in results for previous_id in result if previous_id is not None)
+    return elapsed / calls, duplicates
+
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description='StringSet.add_new_elements microbenchmark')
+    parser.add_argument('--sizes', help="Comma separated tokens per call", default='10,700,10000')
+    parser.add_argument('--calls', help="Calls per size", type=int, default=20)
+    args = parser.parse_args()
+
+    print(f'{"tokens":>7} {"impl":>12} {"ms/call":>9} {"tokens/s":>11} {"dups":>6}')
+    for batch_size in [int(size) for size in args.sizes.split(',')]:
+        timings = {}
+        for name, cls in (('threadpool', ThreadPoolStringSet), ('grouped', platform_tokendb.StringSet)):
+            per_call, duplicates = time_calls(cls(), batch_size, args.calls)
+            timings[name] = per_call
+            print(f'{batch_size:>7} {name:>12} {per_call * 1e3:>9.3f} {batch_size / per_call:>11.0f} {duplicates:>6}')
+        print(f'{batch_size:>7} {"speedup":>12} {timings["threadpool"] / timings["grouped"]:>8.1f}x')
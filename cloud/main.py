@@ -1,29 +1,25 @@
 # main.py
 
 from fastapi import FastAPI, Request, HTTPException, Response # type: ignore
+import asyncio
+from concurrent.futures import ThreadPoolExecutor
 import inspect
 import os
-import threading
+import signal
 from typing import Any, Dict
 
 import appserver # Assuming app.py is in the same directory
 import provider  # Assuming provider.py is in the same directory
+import util
 
 
 app = FastAPI()
 mode = os.environ.get('SERVER_MODE') 
 
-
-class FunctionThread(threading.Thread):
-    def __init__(self, target, args=(), kwargs=None):
-        super().__init__()
-        self.target = target
-        self.args = args
-        self.kwargs = kwargs if kwargs else {}
-        self.result = None
-
-    def run(self):
-        self.result = self.target(*self.args, **self.kwargs)
+# token and crypto work runs on a fixed pool of threads so the event loop keeps
+# serving other endpoints meanwhile; SERVER_THREADS bounds how many run at once
+server_threads = util.server_threads()
+executor = ThreadPoolExecutor(max_workers=server_threads, thread_name_prefix=f'{mode}-worker')
 
 
 async def make_threaded_call(request: Request, fn):
@@ -31,25 +27,59 @@ async def make_threaded_call(request: Request, fn):
     params = dict(request.query_params)
     body_bytes = await request.body()
 
-    print(f'Calling {fn.__name__} with params {params} and body {body_bytes}')
+    print(f'Calling {fn.__name__} with params {params} and {len(body_bytes)} body bytes')
 
     def call_function_threaded():
         return fn(**params, payload=body_bytes)
 
-    thread = FunctionThread(target=call_function_threaded)
-    thread.start()
-    thread.join()
+    result = await asyncio.get_running_loop().run_in_executor(executor, call_function_threaded)
 
-    if thread.result is None:
+    if result is None:
         raise HTTPException(status_code=500, detail=f'{mode} error')
 
-    return Response(content=thread.result, media_type='application/octet-stream')
+    return Response(content=result, media_type='application/octet-stream')
+
+
+def server_keys():
+    return provider.keys if mode == 'provider' else appserver.keys
+
+
+# SIGHUP re-reads the key files, e.g. after a rotation
+@app.on_event('startup')
+async def startup():
+    asyncio.get_running_loop().add_signal_handler(signal.SIGHUP, server_keys().reload)
+    if mode == 'app':
+        appserver.start()
+
+
+@app.on_event('shutdown')
+def shutdown():
+    executor.shutdown(wait=True)
+    if mode == 'provider':
+        provider.shutdown()
+    else:
+        appserver.shutdown()
 
 
 @app.get('/')
 async def root():
     return {'status': f'{mode} running'}
 
+
+@app.get('/metrics')
+async def metrics():
+    result = {'keys': server_keys().metrics()}
+    if mode == 'app' and appserver.reservoir is not None:
+        low, high = appserver.reservoir.watermarks()
+        result['tokens'] = {'available': len(appserver.reservoir), 'low': low, 'high': high}
+    if mode == 'app':
+        result['pending_deliveries'] = {
+            'count': len(appserver.pending_deliveries),
+            'expired': appserver.pending_deliveries.expired
+        }
+        result['seen_hashes'] = len(appserver.seen_hashes)
+    return result
+
 if mode == 'provider':
 
     @app.get('/public_params')
@@ -99,6 +129,15 @@ elif mode == 'app':
     async def deliver(request: Request):
         return await make_threaded_call(request, appserver.deliver_data)
 
+    # batched variants, bodies and responses are payloads.PayloadList frames
+    @app.post('/deliver_hash_batch')
+    async def deliver_hash_batch(request: Request):
+        return await make_threaded_call(request, appserver.deliver_hash_payload_batch)
+
+    @app.post('/deliver_data_batch')
+    async def deliver_data_batch(request: Request):
+        return await make_threaded_call(request, appserver.deliver_data_batch)
+
     @app.post('/deliver_complaint_data')
     async def deliver_complaint_data(request: Request):
         return await make_threaded_call(request, appserver.deliver_complaint_data)
@@ -1,5 +1,11 @@
 
 import struct
+import wire
+
+try:
+    from tokenlib import split_tokens as _split_tokens # type: ignore
+except ImportError:
+    _split_tokens = None
 
 
 SHA256_BYTES = 32
@@ -19,83 +25,117 @@ class PublicParams:
         return response_body
 
 
+# a wire.TokenList frame: the token length, then the tokens back to back
 class TokenList:
 
-    # assumes that they all have the same size
+    # assumes that they all have the same size; one copy of the tokens
     @staticmethod
     def serialize(tokens: list[bytes]) -> bytes:
         token_len = 0 if len(tokens) == 0 else len(tokens[0])
-        concat_tokens = b''.join(tokens)
-        return struct.pack(f'I{len(concat_tokens)}s', token_len, concat_tokens)
+        return wire.TokenList.encode(token_len, tokens)
     
+    # response_body may be bytes or a memoryview (see TokenRedemptionPayload);
+    # tokenlib splits it natively where it's available
+    @staticmethod
+    def deserialize(response_body) -> list[bytes]:
+        if _split_tokens is not None:
+            return _split_tokens(response_body)
+
+        # the same checks as tokenlib's
+        token_bytes, view = wire.TokenList.decode(memoryview(response_body).cast('B'))
+        if len(view) == 0:
+            return []
+        if token_bytes == 0 or len(view) % token_bytes != 0:
+            raise wire.WireError('Token list length is not a multiple of the token length')
+        return [bytes(view[idx:idx + token_bytes]) for idx in range(0, len(view), token_bytes)]
+
+
+# variable-length items, for batched calls: a wire.PayloadList frame of the
+# count and [len_0, item_0, len_1, item_1, ...]; an empty item stands for a
+# failed entry in a batch of results
+class PayloadList:
+
+    @staticmethod
+    def serialize(items: list[bytes]) -> bytes:
+        parts = []
+        for item in items:
+            parts.append(struct.pack('<I', len(item)))
+            parts.append(item)
+        return wire.PayloadList.encode(len(items), parts)
+
+    # items are slices of response_body: pass a memoryview to get views into
+    # the body instead of copies. Raises wire.WireError if it is truncated
     @staticmethod
     def deserialize(response_body: bytes) -> list[bytes]:
-        tokens = []
-        token_bytes = struct.unpack_from('I', response_body, offset=0)[0]
+        count, body = wire.PayloadList.decode(response_body)
+        items = []
 
-        idx = 4
-        while idx < len(response_body):
-            tokens.append(response_body[idx:idx + token_bytes])
-            idx += token_bytes
+        idx = 0
+        for _ in range(count):
+            if len(body) < idx + 4:
+                raise wire.WireError('truncated payload list')
+            item_bytes = struct.unpack_from('<I', body, offset=idx)[0]
+            idx += 4
+            if idx + item_bytes > len(body):
+                raise wire.WireError('truncated payload list')
+            items.append(body[idx:idx + item_bytes])
+            idx += item_bytes
+        if idx != len(body):
+            raise wire.WireError('payload list has trailing bytes')
 
-        return tokens
+        return items
 
 
+# Everything below is framed by wire.py, generated from common/wire.json; the
+# classes keep their serialize/deserialize names for the servers and clients.
+
 # P_hash = [id_s, H(d)]
 class HashPayload:
 
     @staticmethod
     def serialize(sensor_id, data_hash) -> bytes:
-        return struct.pack('16s32s', sensor_id, data_hash)
+        return wire.HashPayload.encode(sensor_id, data_hash)
     
-    # returns (sensor_id, payload_hash, payload_sig)
+    # returns (sensor_id, data_hash)
     @staticmethod
     def deserialize(response_body: bytes) -> tuple[bytes, bytes]:
-        return struct.unpack('16s32s', response_body)
+        return wire.HashPayload.decode(response_body)
 
 
 class SignedHashPayload:
 
     @staticmethod
     def serialize(hash_payload, signature) -> bytes:
-        return struct.pack('48s64s', hash_payload, signature)
+        return wire.SignedHashPayload.encode(hash_payload, signature)
     
     # results (hash_payload, signature)
     @staticmethod
     def deserialize(response_body: bytes) -> tuple[bytes, bytes]:
-        return struct.unpack('48s64s', response_body)
+        return wire.SignedHashPayload.decode(response_body)
 
 
 class PredeliveryPayload:
 
     @staticmethod
     def serialize(protocol_nonce, data_hash, encrypted_token) -> bytes:
-        return b''.join([
-            struct.pack('16s32s', protocol_nonce, data_hash),
-            encrypted_token
-        ])
+        return wire.PredeliveryPayload.encode(protocol_nonce, data_hash, encrypted_token)
     
     # returns (protocol_nonce, data_hash, encrypted_token)
     @staticmethod
     def deserialize(response_body: bytes) -> tuple[bytes, bytes, bytes]:
-        protocol_nonce, data_hash = struct.unpack_from('16s32s', response_body, offset=0)
-        encrypted_token = response_body[48:]
-        return protocol_nonce, data_hash, encrypted_token
+        return wire.PredeliveryPayload.decode(response_body)
 
 
 class SignedPredeliveryPayload:
 
     @staticmethod
     def serialize(predelivery_payload, signature) -> bytes:
-        return b''.join([
-            predelivery_payload,
-            signature
-        ])
+        return wire.SignedPredeliveryPayload.encode(predelivery_payload, signature)
     
     # returns (predelivery_payload, signature)
     @staticmethod
     def deserialize(response_body: bytes) -> tuple[bytes, bytes]:
-        return response_body[:-SIGNATURE_BYTES], response_body[-SIGNATURE_BYTES:]
+        return wire.SignedPredeliveryPayload.decode(response_body)
     
 
 class Data:
@@ -113,118 +153,106 @@ class TokenPayload:
 
     @staticmethod
     def serialize(protocol_nonce, token, data_hash) -> bytes:
-        return struct.pack('16s64s32s', protocol_nonce, token, data_hash)
+        return wire.TokenPayload.encode(protocol_nonce, token, data_hash)
     
     # returns (protocol_nonce, token, data_hash)
     @staticmethod
     def deserialize(response_body: bytes) -> tuple[bytes, bytes, bytes]:
-        return struct.unpack('16s64s32s', response_body)
+        return wire.TokenPayload.decode(response_body)
 
 
 class SignedTokenPayload:
 
     @staticmethod
     def serialize(token_payload, signature) -> bytes:
-        return b''.join([
-            token_payload,
-            signature
-        ])
+        return wire.SignedTokenPayload.encode(token_payload, signature)
     
     # returns (token_payload, signature)
     @staticmethod
     def deserialize(response_body: bytes) -> tuple[bytes, bytes]:
-        return response_body[:-SIGNATURE_BYTES], response_body[-SIGNATURE_BYTES:]
+        return wire.SignedTokenPayload.decode(response_body)
 
 
 class TokenRedemptionPayload:
 
     @staticmethod
     def serialize(mule_id, token_bytes) -> bytes:
-        return b''.join([
-            mule_id,
-            token_bytes
-        ])
+        return wire.TokenRedemptionPayload.encode(mule_id, token_bytes)
     
-    # returns (mule_id, list[tokens])
+    # returns (mule_id, token_bytes); token_bytes is a memoryview into
+    # response_body, so the token list isn't copied before it's split
     @staticmethod
-    def deserialize(response_body: bytes) -> tuple[bytes,  bytes]:
-
-        mule_id = response_body[:16]
-        token_bytes = response_body[16:]
-
-        return mule_id, token_bytes
+    def deserialize(response_body: bytes) -> tuple[bytes, memoryview]:
+        return wire.TokenRedemptionPayload.decode(memoryview(response_body))
 
 
 class ComplaintPayload:
 
+    # complaint_record_type is one byte, b'\x00' (incorrect) or b'\x01' (missing)
     @staticmethod
     def serialize(complaint_token, blinded_token, appserver_id, complaint_record_type, complaint_record) -> bytes:
-        return struct.pack(f'64s160s16sc{len(complaint_record)}s',
-                           complaint_token, blinded_token, appserver_id, complaint_record_type, complaint_record)
+        return wire.ComplaintPayload.encode(complaint_token, blinded_token, appserver_id,
+                                            complaint_record_type[0], complaint_record)
     
     # returns (complaint_token, blinded_token, appserver_id, complaint_record_type, complaint_record)
     @staticmethod
     def deserialize(response_body: bytes) -> tuple[bytes, bytes, bytes, int, bytes]:
-        complaint_token, blinded_token, appserver_id, complaint_record_type = \
-            struct.unpack_from('64s160s16sc', response_body[:241], offset=0)
-        complaint_record = response_body[241:]
-        return complaint_token, blinded_token, appserver_id, int.from_bytes(complaint_record_type, 'big'), complaint_record
+        return wire.ComplaintPayload.decode(response_body)
 
 
 class IncorrectComplaintRecord:
     
     @staticmethod
     def serialize(signed_pre_payload, signed_token_payload) -> bytes:
-        pre_bytes = len(signed_pre_payload)
-        token_bytes = len(signed_token_payload)
-
-        return struct.pack(f'I{pre_bytes}s{len(signed_token_payload)}s',
-                           pre_bytes, signed_pre_payload, signed_token_payload)
+        return wire.IncorrectComplaintRecord.encode(signed_pre_payload, signed_token_payload)
     
     @staticmethod
     def deserialize(response_body: bytes) -> tuple[bytes, bytes]:
-        pre_bytes = struct.unpack('I', response_body[:4])
-        signed_pre_payload = response_body[4:4 + pre_bytes]
-        signed_token_payload = response_body[4 + pre_bytes:]
-        return signed_pre_payload, signed_token_payload
+        return wire.IncorrectComplaintRecord.decode(response_body)
 
 
 class MissingComplaintRecord:
 
     @staticmethod
     def serialize(signed_pre_payload, data) -> bytes:
-        pre_bytes = len(signed_pre_payload)
-        return struct.pack(f'I{pre_bytes}s{len(data)}s',
-                           pre_bytes, signed_pre_payload, data)
+        return wire.MissingComplaintRecord.encode(signed_pre_payload, data)
     
     @staticmethod
     def deserialize(response_body: bytes) -> tuple[bytes, bytes]:
-        pre_bytes = struct.unpack('I', response_body[:4])[0]
-        signed_pre_payload = response_body[4:4 + pre_bytes]
-        data = response_body[4 + pre_bytes:]
-        return signed_pre_payload, data
+        return wire.MissingComplaintRecord.decode(response_body)
 
 
 class NewEpochRequest:
     
     @staticmethod
     def serialize(mule_id, complaint_token_bytes) -> bytes:
-        return mule_id + complaint_token_bytes
+        return wire.NewEpochRequest.encode(mule_id, complaint_token_bytes)
     
     @staticmethod
     def deserialize(response_body: bytes) -> tuple[bytes, bytes]:
-        return response_body[:16], response_body[16:]
+        return wire.NewEpochRequest.decode(response_body)
 
 
 class NewEpochResponse:
 
     @staticmethod
     def serialize(complaint_token_bytes, duplicate_token_bytes) -> bytes:
-        return struct.pack(f'II{len(complaint_token_bytes)}s{len(duplicate_token_bytes)}s',
-                           len(complaint_token_bytes), len(duplicate_token_bytes),
-                           complaint_token_bytes, duplicate_token_bytes)
+        return wire.NewEpochResponse.encode(complaint_token_bytes, duplicate_token_bytes)
     
     @staticmethod
     def deserialize(response_body: bytes) -> tuple[bytes, bytes]:
-        complaint_token_bytes_len, duplicate_token_bytes_len = struct.unpack('II', response_body[:8])
-        return response_body[8:8 + complaint_token_bytes_len], response_body[8 + complaint_token_bytes_len:]
\ No newline at end of file
+        return wire.NewEpochResponse.decode(response_body)
+
+
+# What a sensor hands a mule: its signed hash payload and the (encrypted) data
+# the hash covers, built ahead of the encounter
+class SensorDelivery:
+
+    @staticmethod
+    def serialize(signed_hash_payload, data) -> bytes:
+        return wire.SensorDelivery.encode(signed_hash_payload, data)
+
+    # returns (signed_hash_payload, data)
+    @staticmethod
+    def deserialize(response_body: bytes) -> tuple[bytes, bytes]:
+        return wire.SensorDelivery.decode(response_body)
@@ -1,40 +1,190 @@
+import os
+import queue
+import shutil
 import sqlite3
-from concurrent.futures import ProcessPoolExecutor
+import struct
+import threading
+from concurrent.futures import Future
+import wire
 
 DEBUG = False
 
 class KeyValueDatabase:
+    """Per-mule redeemed token counts in SQLite.
+
+    One connection in WAL mode serves every thread. Increments go through a
+    single writer thread: it takes everything queued since its last commit,
+    sums it per mule and applies it as one executemany UPSERT transaction,
+    so concurrent redemptions share a commit (and its fsync). Callers block
+    until their increments are committed."""
+
     def __init__(self, db_name='mules.db'): 
         self.db_name = db_name
+        self._conn = sqlite3.connect(db_name, check_same_thread=False, isolation_level=None)
+        self._conn_lock = threading.Lock()
+        self._pending = queue.Queue()
         self._init_db()
 
+        self._writer = threading.Thread(target=self._write_loop, name='mule-ledger', daemon=True)
+        self._writer.start()
+
     def _init_db(self):
-        with sqlite3.connect(self.db_name, check_same_thread=False) as conn:
-            conn.execute('''CREATE TABLE IF NOT EXISTS mules (
-                                mule_id TEXT PRIMARY KEY,
-                                count INTEGER NOT NULL
-                            )''')
-            conn.commit()
+        with self._conn_lock:
+            self._conn.execute('PRAGMA journal_mode=WAL')
+            self._conn.execute('PRAGMA synchronous=FULL')
+            self._conn.execute('''CREATE TABLE IF NOT EXISTS mules (
+                                    mule_id TEXT PRIMARY KEY,
+                                    count INTEGER NOT NULL
+                                )''')
+
+    def _write_loop(self):
+        while True:
+            batch = [self._pending.get()]
+            # group commit: take whatever else queued up meanwhile
+            while True:
+                try:
+                    batch.append(self._pending.get_nowait())
+                except queue.Empty:
+                    break
+
+            stop = any(increments is None for increments, _ in batch)
+            totals = {}
+            for increments, _ in batch:
+                for mule_id, increment in increments or ():
+                    totals[mule_id] = totals.get(mule_id, 0) + increment
+
+            error = None
+            try:
+                self._commit(totals)
+            except sqlite3.Error as e:
+                error = e
+
+            for _, done in batch:
+                if error is None:
+                    done.set_result(None)
+                else:
+                    done.set_exception(error)
+            if stop:
+                return
+
+    def _commit(self, totals):
+        if not totals:
+            return
+        with self._conn_lock:
+            self._conn.execute('BEGIN IMMEDIATE')
+            try:
+                self._conn.executemany('''INSERT INTO mules (mule_id, count)
+                                           VALUES (?, ?)
+                                           ON CONFLICT(mule_id) DO UPDATE
+                                           SET count = count + excluded.count''',
+                                       totals.items())
+                self._conn.execute('COMMIT')
+            except sqlite3.Error:
+                self._conn.execute('ROLLBACK')
+                raise
 
     def increment_count(self, mule_id, increment):
-        with sqlite3.connect(self.db_name, check_same_thread=False) as conn:
-            conn.execute('''INSERT OR IGNORE INTO mules (mule_id, count)
-                            VALUES (?, 0)''', (mule_id,))
-            conn.execute('''UPDATE mules
-                            SET count = count + ?
-                            WHERE mule_id = ?''', (increment, mule_id))
-            conn.commit()
+        self.batch_increment_counts([(mule_id, increment)])
 
+    # applies (mule_id, increment) pairs atomically, returns once committed
     def batch_increment_counts(self, mule_id_increments):
-        with ProcessPoolExecutor(max_workers=32) as executor:
-            executor.map(lambda x: self.increment_count(x[0], x[1]), mule_id_increments)
+        increments = list(mule_id_increments)
+        if not increments:
+            return
+        done = Future()
+        self._pending.put((increments, done))
+        done.result()
 
     def get_counts(self):
-        with sqlite3.connect(self.db_name, check_same_thread=False) as conn:
-            cursor = conn.execute('''SELECT mule_id, count
-                                     FROM mules''')
+        with self._conn_lock:
+            cursor = self._conn.execute('''SELECT mule_id, count
+                                           FROM mules''')
             return {row[0]: row[1] for row in cursor}
 
+    def close(self):
+        done = Future()
+        self._pending.put((None, done))
+        done.result()
+        self._writer.join()
+        with self._conn_lock:
+            self._conn.close()
+
+class DuplicateStore:
+    """Double-spent tokens per mule and epoch, as evidence for new_epoch.
+
+    Each (epoch, mule) pair is one append-only file, path/<epoch>/<mule id
+    hex>, laid out as a payloads.TokenList: the token length, then the
+    tokens. An append writes the new tokens to the end of the file, and
+    reading a mule's list back is one file read with no parsing. A file
+    stops growing at max_per_mule tokens, so replaying a batch over and over
+    costs a mule's own evidence nothing extra. Epochs older than keep_epochs
+    are deleted once a newer one is written."""
+
+    def __init__(self, path='duplicates', max_per_mule=100000, keep_epochs=2):
+        self.path = path
+        self.max_per_mule = max_per_mule
+        self.keep_epochs = keep_epochs
+        self._lock = threading.Lock()
+        self._latest_epoch = None
+        os.makedirs(path, exist_ok=True)
+
+    def _file(self, epoch, mule_id):
+        return os.path.join(self.path, str(epoch), mule_id.hex())
+
+    def _append_one(self, path, tokens):
+        with open(path, 'a+b') as f:
+            size = f.seek(0, os.SEEK_END)
+            if size == 0:
+                token_len = len(tokens[0])
+                f.write(struct.pack('I', token_len))
+                size = 4
+            else:
+                f.seek(0)
+                token_len = struct.unpack('I', f.read(4))[0]
+
+            room = self.max_per_mule - (size - 4) // token_len
+            kept = [token for token in tokens if len(token) == token_len][:max(room, 0)]
+            f.write(b''.join(kept))
+            return len(tokens) - len(kept)
+
+    # mule_tokens maps mule id -> tokens to add; returns how many were dropped at the cap
+    def append(self, epoch, mule_tokens):
+        dropped = 0
+        with self._lock:
+            os.makedirs(os.path.join(self.path, str(epoch)), exist_ok=True)
+            for mule_id, tokens in mule_tokens.items():
+                if tokens:
+                    dropped += self._append_one(self._file(epoch, mule_id), tokens)
+
+            if self._latest_epoch != epoch:
+                self._latest_epoch = epoch
+                self._prune(epoch)
+        return dropped
+
+    def _prune(self, epoch):
+        for name in os.listdir(self.path):
+            if name.isdigit() and int(name) <= epoch - self.keep_epochs:
+                shutil.rmtree(os.path.join(self.path, name), ignore_errors=True)
+
+    # serialized payloads.TokenList of the mule's tokens across the given epochs
+    def token_list(self, mule_id, epochs):
+        header, bodies = None, []
+        with self._lock:
+            for epoch in epochs:
+                try:
+                    with open(self._file(epoch, mule_id), 'rb') as f:
+                        contents = f.read()
+                except FileNotFoundError:
+                    continue
+                if header is None:
+                    header = contents[:4]
+                if contents[:4] == header:
+                    bodies.append(contents[4:])
+
+        if header is None:
+            return wire.TokenList.encode(0, b'')
+        return wire.TokenList.encode(struct.unpack('I', header)[0], bodies)
+
 if DEBUG:
     db = KeyValueDatabase()
 
@@ -44,4 +194,3 @@ if DEBUG:
 
     # Retrieve the current counts
     print(db.get_counts())
-
@@ -1,6 +1,12 @@
+import collections
 import hashlib
-from concurrent.futures import ThreadPoolExecutor
+import math
+import mmap
+import os
+import struct
 import threading
+import time
+import tokenlib # type: ignore
 
 DEBUG = False
 class ConcurrentDict:
@@ -15,28 +21,218 @@ class ConcurrentDict:
                 return None
             return self._dict[key]
 
+    # items are (index, key, value); writes each result to results[index]
+    # while taking the lock once for all of them
+    def add_many_if_not_exist(self, items, results):
+        with self._dict_lock:
+            for index, key, value in items:
+                if key not in self._dict:
+                    self._dict[key] = value
+                else:
+                    results[index] = self._dict[key]
+
 class StringSet:
     def __init__(self, num_shards=32):
         self._shards = [ConcurrentDict() for _ in range(num_shards)]
 
-    def _get_shard(self, key):
+    def _shard_index(self, key):
         if isinstance(key, str):
             key = key.encode()
-        hash_key = hashlib.blake2b(key).hexdigest()
-        shard_index = int(hash_key, 16) % len(self._shards)
-        return self._shards[shard_index]
+        hash_key = hashlib.blake2b(key, digest_size=8).digest()
+        return int.from_bytes(hash_key, 'little') % len(self._shards)
+
+    def _get_shard(self, key):
+        return self._shards[self._shard_index(key)]
 
     def add_if_not_exists(self, key, value=True):
         shard = self._get_shard(key)
         return shard.add_if_not_exists(key, value)
 
-    def add_new_elements(self, keys, values=None, max_workers=256):
+    # groups keys by shard and takes each shard lock once; results in input order
+    def add_new_elements(self, keys, values=None):
         if values is None:
             values = [True] * len(keys)
-        with ThreadPoolExecutor(max_workers=max_workers) as executor:
-            results = executor.map(self.add_if_not_exists, keys, values)
+
+        groups = {}
+        for index, (key, value) in enumerate(zip(keys, values)):
+            groups.setdefault(self._shard_index(key), []).append((index, key, value))
+
+        results = [None] * len(keys)
+        for shard_index, items in groups.items():
+            self._shards[shard_index].add_many_if_not_exist(items, results)
         return results
 
+class PersistentStringSet:
+    """StringSet's interface on tokenlib.TokenStore, a sharded hash table in
+    memory-mapped files under path. Survives restarts, and keeps no Python
+    object per key. value_len fixes the size of stored values (0 for a set);
+    a key added without a value reads back as True. Stored values carry a
+    leading flag byte, 1 for a value and 0 for none, so any value_len bytes
+    (all zeros included) read back as themselves."""
+
+    def __init__(self, path, value_len=0):
+        self._value_len = value_len
+        self._no_value = bytes(value_len + 1)
+        self._store = tokenlib.TokenStore(path, value_len + 1 if value_len else 0)
+
+    def _encode(self, value):
+        return self._no_value if value is True or value is None else b'\x01' + value
+
+    def _decode(self, previous):
+        if previous is None:
+            return None
+        return True if previous[0] == 0 else previous[1:]
+
+    def add_if_not_exists(self, key, value=True):
+        if isinstance(key, str):
+            key = key.encode()
+        if self._value_len == 0:
+            return self._store.add_if_not_exists(key)
+        return self._decode(self._store.add_if_not_exists(key, self._encode(value)))
+
+    # checks and adds the whole batch atomically, results in input order
+    def add_new_elements(self, keys, values=None):
+        keys = [key.encode() if isinstance(key, str) else key for key in keys]
+        if self._value_len == 0:
+            return self._store.add_batch(keys)
+        if values is None:
+            values = [True] * len(keys)
+        results = self._store.add_batch(keys, [self._encode(value) for value in values])
+        return [self._decode(previous) for previous in results]
+
+    def __contains__(self, key):
+        if isinstance(key, str):
+            key = key.encode()
+        return key in self._store
+
+    # every key's 16 byte BLAKE2b, a shard at a time
+    def fingerprints(self):
+        for shard in range(self._store.num_shards):
+            yield from self._store.shard_fingerprints(shard)
+
+    def flush(self):
+        self._store.flush()
+
+    def __len__(self):
+        return len(self._store)
+
+class BloomSet:
+    """A PersistentStringSet under path/exact with a Bloom filter in front of
+    it, in the memory-mapped file path/bloom.bin. Most lookups of new keys
+    stop at the filter; a filter hit is confirmed against the exact set, so
+    answers are exact. The filter is sized for capacity keys at error_rate
+    false positives and keeps working past that, only with more lookups in
+    the exact set. Memory use is the filter plus whatever pages the OS
+    keeps of the exact set's files."""
+
+    _MAGIC = b'BLM1'
+
+    def __init__(self, path, capacity=1000000, error_rate=0.01):
+        os.makedirs(path, exist_ok=True)
+        self._exact = PersistentStringSet(os.path.join(path, 'exact'))
+        self._lock = threading.Lock()
+
+        self._bits = max(64, int(-capacity * math.log(error_rate) / math.log(2) ** 2))
+        self._hashes = max(1, round(self._bits / capacity * math.log(2)))
+        header = self._MAGIC + struct.pack('QQ', self._bits, self._hashes)
+        size = len(header) + (self._bits + 7) // 8
+
+        bloom_path = os.path.join(path, 'bloom.bin')
+        fd = os.open(bloom_path, os.O_RDWR | os.O_CREAT)
+        try:
+            existing = os.read(fd, len(header))
+            if existing != header:
+                os.ftruncate(fd, 0)
+                os.ftruncate(fd, size)
+                os.pwrite(fd, header, 0)
+            self._map = mmap.mmap(fd, size)
+        finally:
+            os.close(fd)
+        self._offset = len(header)
+
+        # a new or resized filter knows nothing of keys already in the exact
+        # set; the exact set keeps the digest _positions starts from, so the
+        # filter is rebuilt from it
+        if existing != header and len(self._exact) != 0:
+            self._rebuild()
+
+    def _rebuild(self):
+        start = time.monotonic()
+        for digest in self._exact.fingerprints():
+            for bit in self._positions_of(digest):
+                self._map[self._offset + bit // 8] |= 1 << (bit % 8)
+        self._map.flush()
+        print(f'Rebuilt the Bloom filter from {len(self._exact)} keys in {time.monotonic() - start:.1f}s')
+
+    def _positions_of(self, digest):
+        h1, h2 = struct.unpack('QQ', digest)
+        return [(h1 + i * h2) % self._bits for i in range(self._hashes)]
+
+    def _positions(self, key):
+        return self._positions_of(hashlib.blake2b(key, digest_size=16).digest())
+
+    def __contains__(self, key):
+        for bit in self._positions(key):
+            if not self._map[self._offset + bit // 8] & (1 << (bit % 8)):
+                return False
+        return key in self._exact
+
+    # True if key was added, False if it was already there
+    def add(self, key):
+        added = self._exact.add_if_not_exists(key) is None
+        with self._lock:
+            for bit in self._positions(key):
+                self._map[self._offset + bit // 8] |= 1 << (bit % 8)
+        return added
+
+    def flush(self):
+        self._map.flush()
+        self._exact.flush()
+
+    def __len__(self):
+        return len(self._exact)
+
+
+class ExpiringDict:
+    """A dict that holds at most max_entries, each for at most ttl seconds.
+    Every key lives for the same ttl, so insertion order is expiry order and
+    both limits are enforced by dropping the oldest entries."""
+
+    def __init__(self, max_entries=100000, ttl=3600.0):
+        self.max_entries = max_entries
+        self.ttl = ttl
+        self._entries = collections.OrderedDict()
+        self._lock = threading.Lock()
+        self.expired = 0
+
+    # called with the lock held
+    def _evict(self, now):
+        while self._entries:
+            key, (deadline, _) = next(iter(self._entries.items()))
+            if deadline > now and len(self._entries) <= self.max_entries:
+                break
+            del self._entries[key]
+            self.expired += 1
+
+    def __setitem__(self, key, value):
+        now = time.monotonic()
+        with self._lock:
+            self._entries.pop(key, None)
+            self._entries[key] = (now + self.ttl, value)
+            self._evict(now)
+
+    def pop(self, key, default=None):
+        now = time.monotonic()
+        with self._lock:
+            self._evict(now)
+            entry = self._entries.pop(key, None)
+        return default if entry is None else entry[1]
+
+    def __len__(self):
+        with self._lock:
+            self._evict(time.monotonic())
+            return len(self._entries)
+
 if DEBUG:
     sharded_dict = StringSet()
     keys = ['key1', 'key2', 'key3', 'key4', 'key5']
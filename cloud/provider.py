@@ -4,44 +4,99 @@ import tokenlib # type: ignore
 import util
 import platform_db
 import platform_tokendb
-import requests
 import json
 from Crypto.Random import get_random_bytes # type: ignore
 import payloads
 import os
+import time
+import multiprocessing
+from concurrent.futures import ProcessPoolExecutor
+import token_workers
 
-# load keypair (generated with gen_keypair.py)
+# load keypair (generated with gen_keypair.py), parsed once and passed to every
+# tokenlib call; the handles also keep the serialized public params
 with open('keypair.bin', 'rb') as f:
-    _keypair = f.read()
+    _keypair = tokenlib.KeyPairHandle(f.read())
 
 with open('complaints-keypair.bin', 'rb') as f:
-    _complaint_keypair = f.read()
+    _complaint_keypair = tokenlib.KeyPairHandle(f.read())
 
 # -- Provider State --
 use_tls = os.environ.get('SERVER_TLS') == 'true'
-# map of known appserver id -> {'public_key': <>, 'url': <>}
+# keep-alive connections to the app servers, shared by all request threads
+appserver_session = util.PooledSession()
+# map of known appserver id -> {'url': <>}
 appservers = {
     (0).to_bytes(16, 'big'): {
-        'public_key': util.load_public_key('appserver-public-ecc.pem'),
         'url': 'http://appserver:8080'
     }
 }
+# the AES key shared with the app servers, and appserver id -> public ECDSA key.
+# Loaded once; SIGHUP reloads them.
+keys = util.KeyManager(
+    aes_key_file=util.AES_KEYFILE,
+    public_key_files={
+        (0).to_bytes(16, 'big'): 'appserver-public-ecc.pem'
+    }
+)
 # database of redeemed token counts per-mule
 mule_db = platform_db.KeyValueDatabase()
-# database of per-mule duplicate tokens
-mule_duplicate_db = {}
-# database of already-redeemed delivery tokens
-token_db = platform_tokendb.StringSet()
+# duplicate tokens per mule and epoch, on disk; new_epoch hands them back.
+# An epoch is PROVIDER_EPOCH_SECONDS long, and a mule keeps at most
+# PROVIDER_MAX_DUPLICATES of them per epoch.
+epoch_seconds = int(os.environ.get('PROVIDER_EPOCH_SECONDS', 86400))
+mule_duplicate_db = platform_db.DuplicateStore(
+    os.environ.get('PROVIDER_DUPLICATE_DB', 'duplicates'),
+    max_per_mule=int(os.environ.get('PROVIDER_MAX_DUPLICATES', 100000))
+)
+# redeemed-token databases live on disk under PROVIDER_TOKEN_DB, so a restart
+# doesn't forget what was already spent
+token_db_dir = os.environ.get('PROVIDER_TOKEN_DB', 'tokendb')
+# database of already-redeemed delivery tokens -> redeeming mule id
+token_db = platform_tokendb.PersistentStringSet(os.path.join(token_db_dir, 'tokens'), value_len=16)
 # database of already-redeemed complaint tokens
-complaint_token_db = platform_tokendb.StringSet()
+complaint_token_db = platform_tokendb.PersistentStringSet(os.path.join(token_db_dir, 'complaint_tokens'))
 # database of duplicates with filed complaints
-complaint_duplicate_token_db = platform_tokendb.StringSet()
+complaint_duplicate_token_db = platform_tokendb.PersistentStringSet(os.path.join(token_db_dir, 'complaint_duplicates'))
+
+# With PROVIDER_CRYPTO_PROCESSES > 0, batches of token signing and verification
+# are split across that many worker processes. Only the keypair and tokens
+# cross over; every database above stays in this process, so duplicate
+# detection still sees all redemptions.
+crypto_processes = int(os.environ.get('PROVIDER_CRYPTO_PROCESSES', '0'))
+crypto_pool = ProcessPoolExecutor(
+    max_workers=crypto_processes,
+    mp_context=multiprocessing.get_context('spawn')
+) if crypto_processes > 0 else None
+
+
+def _map_tokens(fn, keypair, tokens):
+    # small batches aren't worth the round trip to another process
+    if crypto_pool is None or len(tokens) < 2 * crypto_processes:
+        return fn(keypair, tokens)
+
+    chunk = -(-len(tokens) // crypto_processes)
+    futures = [crypto_pool.submit(fn, keypair, tokens[i:i + chunk])
+               for i in range(0, len(tokens), chunk)]
+    return [result for future in futures for result in future.result()]
+
+
+def current_epoch():
+    return int(time.time()) // epoch_seconds
+
+
+def shutdown():
+    if crypto_pool is not None:
+        crypto_pool.shutdown(wait=True)
+    for db in (token_db, complaint_token_db, complaint_duplicate_token_db):
+        db.flush()
+    mule_db.close()
 
 
 # ALGORITHM 1(a) TOKEN PURCHASE (PUBLIC PARAMS)
 def get_public_params(payload=None) -> bytes:
     return payloads.PublicParams.serialize(
-        tokenlib.get_public_params(_keypair)
+        _keypair.public_params()
     )
 
 
@@ -49,9 +104,9 @@ def get_public_params(payload=None) -> bytes:
 def sign_tokens(payload) -> bytes:
     print('sign tokens', payload)
     blinded_tokens = payloads.TokenList.deserialize(payload)
-    return payloads.TokenList.serialize([
-        tokenlib.sign_token(_keypair, token) for token in blinded_tokens
-    ])
+    return payloads.TokenList.serialize(
+        _map_tokens(token_workers.sign_tokens, _keypair, blinded_tokens)
+    )
 
 
 # ALGORITHM 3: TOKEN REDEMPTION
@@ -66,26 +121,39 @@ def redeem_tokens(payload) -> bytes:
 
     valid_tokens = []
     invalid_tokens = []
-    for token in decoded_tokens:
-        if tokenlib.verify_token(_keypair, token):
+    verified = _map_tokens(token_workers.verify_tokens, _keypair, decoded_tokens)
+    for token, is_valid in zip(decoded_tokens, verified):
+        if is_valid:
             valid_tokens.append(token)
         else:
             invalid_tokens.append(token)
 
     duplicate_mule_list = token_db.add_new_elements(valid_tokens, [mule_id] * len(valid_tokens))
     duplicate_tokens = 0
+    # every count change of this redemption, committed together
+    increments = {}
+    # duplicate evidence per mule, appended once per mule
+    evidence = {mule_id: []}
     for token, previous_mule_id in zip(valid_tokens, duplicate_mule_list):
         if previous_mule_id == None:
             continue
 
-        mule_duplicate_db[previous_mule_id] = mule_duplicate_db.get(previous_mule_id, []) + [token]
-        mule_db.increment_count(previous_mule_id, -1)
+        # True: spent through a complaint, there is no earlier mule to charge
+        if previous_mule_id is not True:
+            evidence.setdefault(previous_mule_id, []).append(token)
+            increments[previous_mule_id] = increments.get(previous_mule_id, 0) - 1
+        evidence[mule_id].append(token)
 
-        mule_duplicate_db[mule_id] = mule_duplicate_db.get(mule_id, []) + [token]
         duplicate_tokens += 1
 
     num_successfully_redeemed = len(valid_tokens) - duplicate_tokens
-    mule_db.increment_count(mule_id, num_successfully_redeemed)
+    increments[mule_id] = increments.get(mule_id, 0) + num_successfully_redeemed
+    mule_db.batch_increment_counts(increments.items())
+
+    if duplicate_tokens:
+        dropped = mule_duplicate_db.append(current_epoch(), evidence)
+        if dropped:
+            print(f'Duplicate evidence cap reached, dropped {dropped} tokens')
 
     return payloads.TokenList.serialize(invalid_tokens)
 
@@ -93,7 +161,7 @@ def redeem_tokens(payload) -> bytes:
 # ALGORITHM 4(a): COMPLAINT (PUBLIC PARAMS)
 def get_complaint_public_params(payload=None) -> bytes:
     return payloads.PublicParams.serialize(
-        tokenlib.get_public_params(_complaint_keypair)
+        _complaint_keypair.public_params()
     )
 
 
@@ -133,15 +201,12 @@ def complain(payload) -> bytes:
         return None
 
     pre_payload, pre_signature = payloads.SignedPredeliveryPayload.deserialize(signed_predeliver_payload)
-    if not util.verify_ecdsa(appservers[appserver_id]['public_key'], pre_payload, pre_signature):
+    if not keys.verify(appserver_id, pre_payload, pre_signature):
         print('Invalid predelivery signature')
         return None
 
     _, data_hash, encrypted_token = payloads.PredeliveryPayload.deserialize(pre_payload)
-    decrypted_token = util.decrypt_aes(
-        util.load_aes_key(),
-        encrypted_token
-    )
+    decrypted_token = keys.decrypt_aes(encrypted_token)
     if not tokenlib.verify_token(_keypair, decrypted_token):
         # if the token fails to verify after the signature worked, then the appserver is at fault
         # send a new token
@@ -156,7 +221,7 @@ def complain(payload) -> bytes:
     if complaint_type == 0:
         # check the token signature
         token_payload, token_signature = payloads.SignedTokenPayload.deserialize(signed_token_payload)
-        if not util.verify_ecdsa(appservers[appserver_id]['public_key'], token_payload, token_signature):
+        if not keys.verify(appserver_id, token_payload, token_signature):
             print('Invalid token payload signature')
             return None
 
@@ -180,7 +245,7 @@ def complain(payload) -> bytes:
 
         # send data to AS
         print('Sending data to appserver at ', appservers[appserver_id]['url'] + '/deliver_data')
-        requests.post(
+        appserver_session.post(
             appservers[appserver_id]['url'] + '/deliver_complaint_data',
             verify=use_tls,
             headers = {'Content-Type': 'application/octet-stream'},
@@ -199,11 +264,12 @@ def new_epoch(payload):
     mule_id, blinded_token_bytes = payloads.NewEpochRequest.deserialize(payload)
     blinded_tokens = payloads.TokenList.deserialize(blinded_token_bytes)
 
-    signed_tokens = [tokenlib.sign_token(_complaint_keypair, b_t) for b_t in blinded_tokens]
+    signed_tokens = _map_tokens(token_workers.sign_tokens, _complaint_keypair, blinded_tokens)
     signed_token_bytes = payloads.TokenList.serialize(signed_tokens)
 
-    duplicate_tokens = mule_duplicate_db.get(mule_id, [])
-    duplicate_token_bytes = payloads.TokenList.serialize(duplicate_tokens)
+    # duplicates from the epoch that just ended and the one under way
+    epoch = current_epoch()
+    duplicate_token_bytes = mule_duplicate_db.token_list(mule_id, [epoch - 1, epoch])
 
     return payloads.NewEpochResponse.serialize(signed_token_bytes, duplicate_token_bytes)
 
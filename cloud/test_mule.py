@@ -5,6 +5,7 @@ import util
 import json
 import struct
 import payloads
+import time
 import tokenlib # type: ignore
 
 def check_servers(provider_url, appserver_url):
@@ -248,10 +249,95 @@ def complain_deliver(_provider_url, appserver_url):
     return True, new_token
 
 
+def make_signed_hash_payloads(count, data_bytes=512):
+
+    sensor_id_bytes = (0xffffffffffffffffffffffffffffff01).to_bytes(16, 'big')
+    sensor_private_key = util.load_private_key('sensor-private-ecc.pem')
+
+    datas, signed_hash_payloads = [], []
+    for _ in range(count):
+        data = util.get_random_bytes(data_bytes)
+        hash_payload = payloads.HashPayload.serialize(sensor_id_bytes, util.hash_sha256(data))
+        datas.append(data)
+        signed_hash_payloads.append(payloads.SignedHashPayload.serialize(
+            hash_payload,
+            util.sign_ecdsa(sensor_private_key, hash_payload)
+        ))
+
+    return datas, signed_hash_payloads
+
+
+def post_bytes(session, url, data):
+    response = session.post(url,
+                verify = False,
+                headers = {'Content-Type': 'application/octet-stream'},
+                data = data
+    )
+    if response.status_code != 200:
+        raise RuntimeError(f'{url} returned status code {response.status_code}')
+    return response.content
+
+
+# delivers one payload per round trip on the unbatched endpoints, returns tokens received
+def deliver_single(session, appserver_url, datas, signed_hash_payloads):
+    tokens = 0
+    for data, signed_hash_payload in zip(datas, signed_hash_payloads):
+        post_bytes(session, appserver_url + '/deliver_hash', signed_hash_payload)
+        post_bytes(session, appserver_url + '/deliver_data', payloads.Data.serialize(data))
+        tokens += 1
+    return tokens
+
+
+# delivers all payloads in two round trips, returns tokens received
+def deliver_batch(session, appserver_url, datas, signed_hash_payloads):
+    predeliveries = payloads.PayloadList.deserialize(post_bytes(
+        session, appserver_url + '/deliver_hash_batch',
+        payloads.PayloadList.serialize(signed_hash_payloads)))
+
+    accepted = [data for data, pre in zip(datas, predeliveries) if pre]
+    token_payloads = payloads.PayloadList.deserialize(post_bytes(
+        session, appserver_url + '/deliver_data_batch',
+        payloads.PayloadList.serialize([payloads.Data.serialize(data) for data in accepted])))
+
+    return sum(1 for token_payload in token_payloads if token_payload)
+
+
+# payloads/s for each batch size, signing happens before the clock starts
+def bench_delivery(appserver_url, batch_sizes, num_payloads):
+
+    session = requests.Session()
+    print(f'  {"batch":>8} {"payloads":>9} {"tokens":>7} {"seconds":>8} {"payloads/s":>11}')
+
+    for batch_size in batch_sizes:
+        count = max(num_payloads, batch_size) // batch_size * batch_size
+        datas, signed_hash_payloads = make_signed_hash_payloads(count)
+
+        tokens = 0
+        start = time.perf_counter()
+        for i in range(0, count, batch_size):
+            batch = (datas[i:i + batch_size], signed_hash_payloads[i:i + batch_size])
+            if batch_size == 1:
+                tokens += deliver_single(session, appserver_url, *batch)
+            else:
+                tokens += deliver_batch(session, appserver_url, *batch)
+        elapsed = time.perf_counter() - start
+
+        name = 'single' if batch_size == 1 else str(batch_size)
+        print(f'  {name:>8} {count:>9} {tokens:>7} {elapsed:>8.2f} {count / elapsed:>11.1f}')
+        if tokens != count:
+            print(f'  Error: only {tokens} of {count} payloads got a token')
+            return False
+
+    return True
+
+
 if __name__ == '__main__':
     parser = argparse.ArgumentParser(description='Test mule for running against local provider/app server docker containers')
     parser.add_argument('--provider', help="Provider url", default='http://localhost:8000')
     parser.add_argument('--appserver', help="App server url", default='http://localhost:8080')
+    parser.add_argument('--bench', action='store_true', help="Measure delivery payloads/s per batch size instead of the protocol walkthrough")
+    parser.add_argument('--bench-sizes', help="Comma separated batch sizes, 1 uses the unbatched endpoints", default='1,10,100,1000')
+    parser.add_argument('--bench-payloads', help="Payloads delivered per batch size", type=int, default=1000)
     args = parser.parse_args()
 
     print('\n== Test Mule ==\n')
@@ -263,6 +349,15 @@ if __name__ == '__main__':
     else:
         print('done!')
 
+    if args.bench:
+        print('benchmarking payload delivery...')
+        sizes = [int(size) for size in args.bench_sizes.split(',')]
+        if not bench_delivery(args.appserver, sizes, args.bench_payloads):
+            print('failed :(, exiting...')
+            exit(1)
+        print('done!\n')
+        exit(0)
+
     print('getting public parameters from provider...')
     result = get_public_params(args.provider)
     if result is None:
@@ -0,0 +1,70 @@
+# test_token_reservoir.py
+# TokenReservoir against a fake provider, no servers needed:
+#
+#   python -m unittest test_token_reservoir
+import os
+import tempfile
+import threading
+import unittest
+
+import token_reservoir
+
+
+class FakeProvider:
+
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.batches = []
+        self.count = 0
+
+    def fetch(self, n):
+        with self.lock:
+            self.batches.append(n)
+            first = self.count
+            self.count += n
+        # distinct tokens of one size, like the provider's
+        return [i.to_bytes(32, 'little') for i in range(first, first + n)]
+
+
+class TokenReservoirTest(unittest.TestCase):
+
+    def setUp(self):
+        self.dir = tempfile.TemporaryDirectory()
+        self.provider = FakeProvider()
+        self.reservoir = token_reservoir.TokenReservoir(
+            self.provider.fetch, os.path.join(self.dir.name, 'reservoir'),
+            low=20, high=100, min_batch=10, max_batch=300)
+        self.reservoir.start()
+
+    def tearDown(self):
+        self.reservoir.stop()
+        self.dir.cleanup()
+
+    def test_take_within_watermarks(self):
+        tokens = self.reservoir.take(50, timeout=5.0)
+        self.assertEqual(len(tokens), 50)
+        self.assertEqual(len(set(tokens)), 50)
+
+    def test_take_above_high_watermark(self):
+        # more than high and than one max_batch round trip
+        tokens = self.reservoir.take(1000, timeout=10.0)
+        self.assertIsNotNone(tokens)
+        self.assertEqual(len(tokens), 1000)
+        self.assertEqual(len(set(tokens)), 1000)
+        self.assertTrue(all(n <= 300 for n in self.provider.batches))
+
+    def test_tokens_survive_restart(self):
+        first = self.reservoir.take(30, timeout=5.0)
+        left = len(self.reservoir)
+        self.reservoir.stop()
+
+        self.reservoir = token_reservoir.TokenReservoir(
+            self.provider.fetch, self.reservoir.path)
+        self.assertEqual(len(self.reservoir), left)
+        self.reservoir.start()
+        second = self.reservoir.take(left, timeout=5.0)
+        self.assertFalse(set(first) & set(second))
+
+
+if __name__ == '__main__':
+    unittest.main()
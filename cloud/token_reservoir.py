@@ -0,0 +1,169 @@
+# token_reservoir.py
+# Unblinded tokens fetched ahead of time, so handing one to a mule never waits
+# on the provider. A background thread tops the reservoir up whenever it falls
+# below the low watermark, and both watermarks grow with the observed delivery
+# rate and fetch latency.
+import os
+import struct
+import threading
+import time
+import payloads
+
+
+class TokenReservoir:
+
+    # fetch(n) returns n unblinded tokens (a provider round trip). The tokens
+    # are kept in the file at path as [u64 taken | TokenList]: a refill writes
+    # a new file and renames it over the old one, and each take overwrites the
+    # taken count in place and syncs it before the tokens are returned. A
+    # crash can then only lose tokens, never hand the same token out twice.
+    def __init__(self, fetch, path, low=20, high=100, min_batch=10, max_batch=1000,
+                 horizon=10.0):
+        self.fetch = fetch
+        self.path = path
+        self.base_low = low
+        self.base_high = high
+        self.min_batch = min_batch
+        self.max_batch = max_batch
+        # seconds of deliveries the high watermark should cover
+        self.horizon = horizon
+
+        self._cond = threading.Condition()
+        self._tokens = []
+        self._next = 0
+        self._taken_since = 0
+        # tokens that waiting takes still need, so a take above the high
+        # watermark gets refilled for too
+        self._demand = 0
+        self._rate = 0.0
+        self._fetch_seconds = 0.0
+        self._stopped = False
+        self._thread = None
+        self._file = None
+        self._load()
+
+    def _load(self):
+        try:
+            with open(self.path, 'rb') as f:
+                contents = f.read()
+            taken = struct.unpack_from('Q', contents, 0)[0]
+            tokens = payloads.TokenList.deserialize(contents[8:])
+            self._tokens = tokens[taken:]
+        except (FileNotFoundError, struct.error, ValueError):
+            self._tokens = []
+        self._write()
+
+    # called with the condition held
+    def _write(self):
+        tmp = self.path + '.tmp'
+        with open(tmp, 'wb') as f:
+            f.write(struct.pack('Q', 0))
+            f.write(payloads.TokenList.serialize(self._tokens[self._next:]))
+            f.flush()
+            os.fsync(f.fileno())
+        os.replace(tmp, self.path)
+
+        del self._tokens[:self._next]
+        self._next = 0
+        if self._file is not None:
+            self._file.close()
+        self._file = open(self.path, 'r+b', buffering=0)
+
+    def __len__(self):
+        with self._cond:
+            return len(self._tokens) - self._next
+
+    def watermarks(self):
+        low = max(self.base_low, int(2 * self._rate * self._fetch_seconds))
+        high = max(self.base_high, 2 * low, int(self._rate * self.horizon))
+        return low, high
+
+    def start(self):
+        self._thread = threading.Thread(target=self._run, name='token-refill', daemon=True)
+        self._thread.start()
+
+    def stop(self):
+        with self._cond:
+            self._stopped = True
+            self._cond.notify_all()
+        if self._thread is not None:
+            self._thread.join()
+        with self._cond:
+            self._file.close()
+
+    # n tokens, waiting up to timeout seconds for a refill if there aren't
+    # enough yet; None if the reservoir stayed short
+    def take(self, n, timeout=10.0) -> list[bytes]:
+        if n == 0:
+            return []
+
+        deadline = time.monotonic() + timeout
+        with self._cond:
+            if len(self._tokens) - self._next < n:
+                self._demand += n
+                try:
+                    while len(self._tokens) - self._next < n:
+                        self._cond.notify_all()
+                        remaining = deadline - time.monotonic()
+                        if remaining <= 0 or self._stopped:
+                            return None
+                        self._cond.wait(remaining)
+                finally:
+                    self._demand -= n
+
+            tokens = self._tokens[self._next:self._next + n]
+            self._next += n
+            self._taken_since += n
+            os.pwrite(self._file.fileno(), struct.pack('Q', self._next), 0)
+            os.fsync(self._file.fileno())
+
+            low, _ = self.watermarks()
+            if len(self._tokens) - self._next < low:
+                self._cond.notify_all()
+        return tokens
+
+    def _run(self):
+        last = time.monotonic()
+        backoff = 1.0
+        refilled = False
+        while True:
+            with self._cond:
+                # still short after a refill: fetch the next piece right away
+                if not refilled:
+                    self._cond.wait(1.0)
+                refilled = False
+                if self._stopped:
+                    return
+
+                # deliveries per second, smoothed over windows of at least a second
+                now = time.monotonic()
+                if now - last >= 1.0:
+                    self._rate = 0.7 * self._rate + 0.3 * self._taken_since / (now - last)
+                    self._taken_since = 0
+                    last = now
+
+                low, high = self.watermarks()
+                available = len(self._tokens) - self._next
+                if available >= low and available >= self._demand:
+                    continue
+                # up to max_batch per round trip, a large demand takes several
+                want = max(high, self._demand) - available
+                batch = min(max(want, self.min_batch), self.max_batch)
+
+            # the provider round trip runs without the lock, so takes go on meanwhile
+            started = time.monotonic()
+            try:
+                tokens = self.fetch(batch)
+            except Exception as e:
+                print(f'Token refill of {batch} failed, retrying in {backoff:.0f}s: {e}')
+                time.sleep(backoff)
+                backoff = min(2 * backoff, 30.0)
+                continue
+            backoff = 1.0
+
+            with self._cond:
+                self._fetch_seconds = 0.7 * self._fetch_seconds + 0.3 * (time.monotonic() - started)
+                self._tokens += tokens
+                self._write()
+                self._cond.notify_all()
+            refilled = True
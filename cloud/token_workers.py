@@ -0,0 +1,22 @@
+# token_workers.py
+# tokenlib work that depends on nothing but the keypair and the tokens, so it
+# can run in a worker process. Nothing here touches provider state.
+import payloads
+import tokenlib # type: ignore
+
+
+# keypair is a tokenlib.KeyPairHandle (it pickles as its bytes for worker
+# processes); the batch calls sign/verify on all cores without the GIL
+def sign_tokens(keypair, blinded_tokens: list[bytes]) -> list[bytes]:
+    if len(blinded_tokens) == 0:
+        return []
+    return payloads.TokenList.deserialize(
+        tokenlib.sign_tokens_batch(keypair, payloads.TokenList.serialize(blinded_tokens))
+    )
+
+
+def verify_tokens(keypair, tokens: list[bytes]) -> list[bool]:
+    if len(tokens) == 0:
+        return []
+    return [result == 1 for result in
+            tokenlib.verify_tokens_batch(keypair, payloads.TokenList.serialize(tokens))]
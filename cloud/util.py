@@ -5,7 +5,12 @@ from Crypto.PublicKey import ECC # type: ignore
 from Crypto.Cipher import AES # type: ignore
 from Crypto.Random import get_random_bytes # type: ignore
 from Crypto.Signature import DSS # type: ignore
-import struct
+import requests
+from requests.adapters import HTTPAdapter
+from urllib3.util.retry import Retry
+import os
+import threading
+import wire
 
 
 PUBLIC_ECC_KEYFILE = 'appserver-public-ecc.pem'
@@ -83,15 +88,129 @@ def encrypt_aes(key, data) -> bytes:
     cipher = AES.new(key, AES.MODE_GCM, nonce=nonce)
     ciphertext, tag = cipher.encrypt_and_digest(data)
 
-    ct_bytes, tag_bytes = len(ciphertext), len(tag)
-    return struct.pack(f'II12s{ct_bytes}s{tag_bytes}s', ct_bytes, tag_bytes, nonce, ciphertext, tag)
+    return wire.EncryptedToken.encode(nonce, ciphertext, tag)
 
 
+# None if the blob is malformed or fails authentication
 def decrypt_aes(key, encrypted_blob):
-    ct_bytes, tag_bytes, nonce = struct.unpack_from('II12s', encrypted_blob, offset=0)
-    ciphertext, tag = struct.unpack_from(f'{ct_bytes}s{tag_bytes}s', encrypted_blob, offset=(2*4 + 12))
     try:
+        nonce, ciphertext, tag = wire.EncryptedToken.decode(encrypted_blob)
         cipher = AES.new(key, AES.MODE_GCM, nonce=nonce)
         return cipher.decrypt_and_verify(ciphertext, tag)
     except (ValueError, KeyError):
         return None
+
+
+class KeyManager:
+    """Keys a server signs, verifies and encrypts with, loaded once.
+
+    Requests go through this instead of the load_* functions so that no
+    delivery reads or parses a key file. The signer and each verifier are
+    built once per load; GCM still needs a fresh cipher per nonce, so only
+    the key bytes are kept for it. reload() reads every file again and swaps
+    the new set in only if all of them loaded, so a bad file on SIGHUP
+    leaves the old keys in use."""
+
+    def __init__(self, private_key_file=None, aes_key_file=None, public_key_files=None):
+        self.private_key_file = private_key_file
+        self.aes_key_file = aes_key_file
+        # name (e.g. sensor id) -> public key PEM file
+        self.public_key_files = dict(public_key_files or {})
+        self._lock = threading.Lock()
+        self._metrics = {'loads': 0, 'load_errors': 0, 'signs': 0, 'verifies': 0}
+        self.reload()
+
+    def reload(self):
+        try:
+            private_key = load_private_key(self.private_key_file) if self.private_key_file else None
+            aes_key = None
+            if self.aes_key_file:
+                with open(self.aes_key_file, 'rb') as f:
+                    aes_key = f.read()
+            verifiers = {
+                name: DSS.new(load_public_key(filename), 'fips-186-3')
+                for name, filename in self.public_key_files.items()
+            }
+        except (OSError, ValueError) as e:
+            with self._lock:
+                self._metrics['load_errors'] += 1
+            # the first load has nothing to fall back on
+            if self._metrics['loads'] == 0:
+                raise
+            print(f'Key reload failed, keeping current keys: {e}')
+            return False
+
+        # one tuple, so a request never sees half of an old set and half of a new one
+        self._keys = (
+            DSS.new(private_key, 'fips-186-3') if private_key else None,
+            aes_key,
+            verifiers,
+        )
+        with self._lock:
+            self._metrics['loads'] += 1
+        return True
+
+    def __contains__(self, name):
+        return name in self._keys[2]
+
+    def sign(self, message):
+        signer = self._keys[0]
+        with self._lock:
+            self._metrics['signs'] += 1
+        return signer.sign(SHA256.new(message))
+
+    def verify(self, name, message, signature):
+        verifier = self._keys[2][name]
+        with self._lock:
+            self._metrics['verifies'] += 1
+        try:
+            verifier.verify(SHA256.new(message), signature)
+            return True
+        except ValueError:
+            return False
+
+    def encrypt_aes(self, data) -> bytes:
+        return encrypt_aes(self._keys[1], data)
+
+    def decrypt_aes(self, encrypted_blob):
+        return decrypt_aes(self._keys[1], encrypted_blob)
+
+    def metrics(self) -> dict:
+        with self._lock:
+            return dict(self._metrics)
+
+
+# worker threads of a server (main.py's executor), each of which may call
+# the other server at once
+def server_threads() -> int:
+    return int(os.environ.get('SERVER_THREADS', os.cpu_count() or 4))
+
+
+class PooledSession(requests.Session):
+    """requests.Session for calls between the provider and app servers.
+
+    Connections are kept alive and pooled (pool_size per host, by default
+    one per server thread), every request gets a default (connect, read)
+    timeout, and failed connections and 502/503/504 responses are retried
+    with exponential backoff. POSTs are retried too: every inter-service
+    call can be repeated safely, since signing blinded tokens again only
+    yields another valid signature and complaint data is idempotent."""
+
+    def __init__(self, pool_size=None, timeout=(3.05, 30), retries=3, backoff=0.2):
+        super().__init__()
+        if pool_size is None:
+            pool_size = server_threads()
+        self.timeout = timeout
+        retry = Retry(
+            total=retries,
+            backoff_factor=backoff,
+            status_forcelist=(502, 503, 504),
+            allowed_methods=None,
+        )
+        adapter = HTTPAdapter(pool_connections=4, pool_maxsize=pool_size, max_retries=retry)
+        self.mount('http://', adapter)
+        self.mount('https://', adapter)
+
+    def request(self, method, url, **kwargs):
+        kwargs.setdefault('timeout', self.timeout)
+        return super().request(method, url, **kwargs)
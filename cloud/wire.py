@@ -0,0 +1,211 @@
+# wire.py
+# Codec for the frames in common/wire.json. Generated by common/gen_wire.py;
+# edit those, not this file. See common/wire.h for the frame layout.
+import struct
+
+VERSION = 1
+
+
+class WireError(ValueError):
+    pass
+
+
+class _Message:
+
+    # fields in spec order; fixed-size byte fields must have exactly their size.
+    # A variable field may also be a list of parts, joined straight into the
+    # frame
+    @classmethod
+    def encode(cls, *fields) -> bytes:
+        if len(fields) != len(cls.FIELDS):
+            raise TypeError(f'{cls.__name__} takes {len(cls.FIELDS)} fields')
+        values = [fields[cls.FIELDS.index(name)] for name in cls._fixed + cls._variable]
+        fixed = values[:len(cls._fixed)]
+        variable = values[len(cls._fixed):]
+        for name, value, size in zip(cls._fixed, fixed, cls._sizes):
+            if size and len(value) != size:
+                raise WireError(f'{cls.__name__}.{name} is {len(value)} bytes, not {size}')
+        parts = [value if isinstance(value, list) else [value] for value in variable]
+        prefix = cls._prefix.pack(VERSION, cls.ID, *fixed, *[sum(map(len, value)) for value in parts])
+        return b''.join([prefix, *[part for value in parts for part in value]])
+
+    # fields in spec order; variable fields are slices of buf, so views if
+    # buf is a memoryview
+    @classmethod
+    def decode(cls, buf) -> tuple:
+        if len(buf) < cls._prefix.size:
+            raise WireError(f'{cls.__name__}: {len(buf)} bytes is too short')
+        values = cls._prefix.unpack_from(buf)
+        if values[0] != VERSION:
+            raise WireError(f'{cls.__name__}: version {values[0]}, expected {VERSION}')
+        if values[1] != cls.ID:
+            raise WireError(f'{cls.__name__}: message id {values[1]}, expected {cls.ID}')
+
+        fields = list(values[2:2 + len(cls._fixed)])
+        offset = cls._prefix.size
+        for length in values[2 + len(cls._fixed):]:
+            fields.append(buf[offset:offset + length])
+            offset += length
+        if offset != len(buf):
+            raise WireError(f'{cls.__name__}: fields add up to {offset} bytes, frame is {len(buf)}')
+        return tuple(fields[index] for index in cls._order)
+
+
+class HashPayload(_Message):
+    ID = 1
+    FIELDS = ('sensor_id', 'data_hash')
+    _prefix = struct.Struct('<BB16s32s')
+    _fixed = ('sensor_id', 'data_hash')
+    _sizes = (16, 32)
+    _variable = ()
+    _order = (0, 1)
+
+
+class SignedHashPayload(_Message):
+    ID = 2
+    FIELDS = ('hash_payload', 'signature')
+    _prefix = struct.Struct('<BB64sI')
+    _fixed = ('signature',)
+    _sizes = (64,)
+    _variable = ('hash_payload',)
+    _order = (1, 0)
+
+
+class PredeliveryPayload(_Message):
+    ID = 3
+    FIELDS = ('protocol_nonce', 'data_hash', 'encrypted_token')
+    _prefix = struct.Struct('<BB16s32sI')
+    _fixed = ('protocol_nonce', 'data_hash')
+    _sizes = (16, 32)
+    _variable = ('encrypted_token',)
+    _order = (0, 1, 2)
+
+
+class SignedPredeliveryPayload(_Message):
+    ID = 4
+    FIELDS = ('predelivery_payload', 'signature')
+    _prefix = struct.Struct('<BB64sI')
+    _fixed = ('signature',)
+    _sizes = (64,)
+    _variable = ('predelivery_payload',)
+    _order = (1, 0)
+
+
+class TokenPayload(_Message):
+    ID = 5
+    FIELDS = ('protocol_nonce', 'token', 'data_hash')
+    _prefix = struct.Struct('<BB16s64s32s')
+    _fixed = ('protocol_nonce', 'token', 'data_hash')
+    _sizes = (16, 64, 32)
+    _variable = ()
+    _order = (0, 1, 2)
+
+
+class SignedTokenPayload(_Message):
+    ID = 6
+    FIELDS = ('token_payload', 'signature')
+    _prefix = struct.Struct('<BB64sI')
+    _fixed = ('signature',)
+    _sizes = (64,)
+    _variable = ('token_payload',)
+    _order = (1, 0)
+
+
+class TokenRedemptionPayload(_Message):
+    ID = 7
+    FIELDS = ('mule_id', 'token_list')
+    _prefix = struct.Struct('<BB16sI')
+    _fixed = ('mule_id',)
+    _sizes = (16,)
+    _variable = ('token_list',)
+    _order = (0, 1)
+
+
+class ComplaintPayload(_Message):
+    ID = 8
+    FIELDS = ('complaint_token', 'blinded_token', 'appserver_id', 'record_type', 'record')
+    _prefix = struct.Struct('<BB64s160s16sBI')
+    _fixed = ('complaint_token', 'blinded_token', 'appserver_id', 'record_type')
+    _sizes = (64, 160, 16, 0)
+    _variable = ('record',)
+    _order = (0, 1, 2, 3, 4)
+
+
+class IncorrectComplaintRecord(_Message):
+    ID = 9
+    FIELDS = ('signed_predelivery_payload', 'signed_token_payload')
+    _prefix = struct.Struct('<BBII')
+    _fixed = ()
+    _sizes = ()
+    _variable = ('signed_predelivery_payload', 'signed_token_payload')
+    _order = (0, 1)
+
+
+class MissingComplaintRecord(_Message):
+    ID = 10
+    FIELDS = ('signed_predelivery_payload', 'data')
+    _prefix = struct.Struct('<BBII')
+    _fixed = ()
+    _sizes = ()
+    _variable = ('signed_predelivery_payload', 'data')
+    _order = (0, 1)
+
+
+class NewEpochRequest(_Message):
+    ID = 11
+    FIELDS = ('mule_id', 'complaint_token_list')
+    _prefix = struct.Struct('<BB16sI')
+    _fixed = ('mule_id',)
+    _sizes = (16,)
+    _variable = ('complaint_token_list',)
+    _order = (0, 1)
+
+
+class NewEpochResponse(_Message):
+    ID = 12
+    FIELDS = ('complaint_token_list', 'duplicate_token_list')
+    _prefix = struct.Struct('<BBII')
+    _fixed = ()
+    _sizes = ()
+    _variable = ('complaint_token_list', 'duplicate_token_list')
+    _order = (0, 1)
+
+
+class TokenList(_Message):
+    ID = 13
+    FIELDS = ('token_len', 'tokens')
+    _prefix = struct.Struct('<BBII')
+    _fixed = ('token_len',)
+    _sizes = (0,)
+    _variable = ('tokens',)
+    _order = (0, 1)
+
+
+class PayloadList(_Message):
+    ID = 14
+    FIELDS = ('count', 'items')
+    _prefix = struct.Struct('<BBII')
+    _fixed = ('count',)
+    _sizes = (0,)
+    _variable = ('items',)
+    _order = (0, 1)
+
+
+class EncryptedToken(_Message):
+    ID = 15
+    FIELDS = ('nonce', 'ciphertext', 'tag')
+    _prefix = struct.Struct('<BB12s16sI')
+    _fixed = ('nonce', 'tag')
+    _sizes = (12, 16)
+    _variable = ('ciphertext',)
+    _order = (0, 2, 1)
+
+
+class SensorDelivery(_Message):
+    ID = 16
+    FIELDS = ('signed_hash_payload', 'data')
+    _prefix = struct.Struct('<BBII')
+    _fixed = ()
+    _sizes = ()
+    _variable = ('signed_hash_payload', 'data')
+    _order = (0, 1)
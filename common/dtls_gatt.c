@@ -0,0 +1,301 @@
+#include <string.h>
+#include "mbedtls/ssl.h"
+#include "mbedtls/net_sockets.h"
+#include "dtls_gatt.h"
+
+void dtls_gatt_init(struct dtls_gatt *t, const struct dtls_gatt_ops *ops,
+                    void *link, uint8_t window)
+{
+    t->ops = ops;
+    t->link = link;
+    t->window = window == 0 ? 1 : (window > XFER_MAX_WINDOW ? XFER_MAX_WINDOW : window);
+    dtls_gatt_reset(t);
+}
+
+void dtls_gatt_reset(struct dtls_gatt *t)
+{
+    t->busy = false;
+    t->tx_len = 0;
+    t->tx_inflight = 0;
+    t->tx_meta_pending = false;
+    t->rx_pos = 0;
+    t->rx_active = false;
+    t->rx_proposal_pending = false;
+    t->rx_meta_pending = false;
+}
+
+void dtls_gatt_on_meta(struct dtls_gatt *t, const uint8_t *meta, size_t len)
+{
+    if (len < XFER_META_LEN) {
+        return;
+    }
+
+    if (meta[XFER_META_STATE] == XFER_STATE_ACK) {
+        //window answer or ack for our transfer
+        if (t->tx_inflight != 0) {
+            xfer_tx_on_meta(&t->tx, meta, len);
+        }
+    }
+    else if (meta[XFER_META_STATE] == XFER_STATE_SENDING) {
+        //the peer only proposes again once we acked all of its last
+        //transfer, so one still coming in means it started over
+        if (t->rx_active && !xfer_rx_done(&t->rx)) {
+            t->rx_active = false;
+            t->rx_meta_pending = false;
+        }
+        memcpy(t->rx_proposal, meta, XFER_META_LEN);
+        t->rx_proposal_pending = true;
+    }
+}
+
+void dtls_gatt_on_chunk(struct dtls_gatt *t, const uint8_t *data, uint16_t len)
+{
+    if (!t->rx_active || xfer_rx_done(&t->rx)) {
+        return;
+    }
+
+    int ret = xfer_rx_on_chunk(&t->rx, data, len);
+    if (ret == 1) {
+        //cumulative, a newer ack replaces one the stack had no room for
+        xfer_rx_meta(&t->rx, t->rx_meta);
+        t->rx_meta_pending = true;
+    }
+}
+
+// Starts the next incoming transfer once the last one has been read
+static void rx_answer(struct dtls_gatt *t)
+{
+    if (t->rx_active || !t->rx_proposal_pending) {
+        return;
+    }
+    t->rx_proposal_pending = false;
+
+    if (xfer_rx_start(&t->rx, t->rx_buf, sizeof(t->rx_buf), t->rx_proposal,
+                      XFER_MAX_CHUNK_SIZE, t->window) != 0) {
+        //can't take it; the peer's datagrams are lost and DTLS resends
+        return;
+    }
+    t->rx_active = true;
+    t->rx_pos = 0;
+    xfer_rx_meta(&t->rx, t->rx_meta);
+    t->rx_meta_pending = true;
+}
+
+// Proposes everything queued as the next transfer
+static void tx_start(struct dtls_gatt *t)
+{
+    if (t->tx_inflight != 0 || t->tx_len == 0) {
+        return;
+    }
+
+    //a queue of DTLS_GATT_BUF_LEN always fits XFER_MAX_CHUNKS chunks
+    if (xfer_tx_init(&t->tx, t->tx_buf, t->tx_len, t->ops->chunk_size(t->link), t->window) != 0) {
+        t->tx_len = 0;
+        return;
+    }
+    t->tx_inflight = t->tx_len;
+    xfer_tx_meta(&t->tx, t->tx_meta);
+    t->tx_meta_pending = true;
+}
+
+// Drops the acked transfer and moves datagrams queued since to the front
+static void tx_finish(struct dtls_gatt *t)
+{
+    if (t->tx_inflight == 0 || !xfer_tx_done(&t->tx)) {
+        return;
+    }
+    memmove(t->tx_buf, &t->tx_buf[t->tx_inflight], t->tx_len - t->tx_inflight);
+    t->tx_len -= t->tx_inflight;
+    t->tx_inflight = 0;
+}
+
+int dtls_gatt_pump(struct dtls_gatt *t)
+{
+    const uint8_t *chunk;
+    uint16_t chunk_len;
+    int ret;
+
+    t->busy = false;
+    rx_answer(t);
+    tx_finish(t);
+    tx_start(t);
+
+    if (t->rx_meta_pending) {
+        ret = t->ops->send(t->link, DTLS_GATT_CHR_META, t->rx_meta, XFER_META_LEN);
+        if (ret < 0) {
+            return ret;
+        }
+        t->rx_meta_pending = ret != 0;
+    }
+
+    if (t->tx_meta_pending) {
+        ret = t->ops->send(t->link, DTLS_GATT_CHR_META, t->tx_meta, XFER_META_LEN);
+        if (ret < 0) {
+            return ret;
+        }
+        t->tx_meta_pending = ret != 0;
+    }
+
+    while (!t->tx_meta_pending && t->tx_inflight != 0 &&
+           (chunk_len = xfer_tx_peek(&t->tx, &chunk)) != 0) {
+        ret = t->ops->send(t->link, DTLS_GATT_CHR_DATA, chunk, chunk_len);
+        if (ret < 0) {
+            return ret;
+        }
+        if (ret != 0) {
+            break;
+        }
+        xfer_tx_advance(&t->tx);
+    }
+
+    t->busy = t->rx_meta_pending || t->tx_meta_pending ||
+              (t->tx_inflight != 0 && xfer_tx_peek(&t->tx, &chunk) != 0);
+    return 0;
+}
+
+bool dtls_gatt_idle(const struct dtls_gatt *t)
+{
+    return t->tx_len == 0 || (t->tx_inflight == t->tx_len && xfer_tx_done(&t->tx));
+}
+
+// Pumps and, if the platform can block, waits up to timeout_ms for the
+// peer. Returns 0, or a negative error if the link is gone.
+static int pump_and_wait(struct dtls_gatt *t, uint32_t timeout_ms)
+{
+    int ret = dtls_gatt_pump(t);
+    if (ret < 0) {
+        return ret;
+    }
+    if (t->busy && timeout_ms > DTLS_GATT_RETRY_MS) {
+        timeout_ms = DTLS_GATT_RETRY_MS;
+    }
+    return t->ops->wait(t->link, timeout_ms);
+}
+
+int dtls_gatt_send(void *ctx, const unsigned char *buf, size_t len)
+{
+    struct dtls_gatt *t = ctx;
+
+    if (len + DTLS_GATT_LEN_HDR > sizeof(t->tx_buf)) {
+        return MBEDTLS_ERR_NET_BUFFER_TOO_SMALL;
+    }
+
+    while (t->tx_len + DTLS_GATT_LEN_HDR + len > sizeof(t->tx_buf)) {
+        if (t->ops->wait == NULL) {
+            return MBEDTLS_ERR_SSL_WANT_WRITE;
+        }
+        //wait for acks to make room
+        int ret = pump_and_wait(t, DTLS_GATT_RETRY_MS);
+        if (ret < 0) {
+            return ret;
+        }
+        tx_finish(t);
+    }
+
+    t->tx_buf[t->tx_len] = (uint8_t)(len & 0xff);
+    t->tx_buf[t->tx_len + 1] = (uint8_t)(len >> 8);
+    memcpy(&t->tx_buf[t->tx_len + DTLS_GATT_LEN_HDR], buf, len);
+    t->tx_len += DTLS_GATT_LEN_HDR + len;
+    return (int)len;
+}
+
+int dtls_gatt_recv(void *ctx, unsigned char *buf, size_t len)
+{
+    struct dtls_gatt *t = ctx;
+
+    //whatever mbedtls queued before it started waiting goes out first
+    int ret = dtls_gatt_pump(t);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (!t->rx_active || !xfer_rx_done(&t->rx)) {
+        return MBEDTLS_ERR_SSL_WANT_READ;
+    }
+
+    const uint8_t *p = &t->rx_buf[t->rx_pos];
+    size_t left = t->rx.len - t->rx_pos;
+    size_t dgram_len = left >= DTLS_GATT_LEN_HDR ? (size_t)(p[0] | (p[1] << 8)) : 0;
+
+    if (left < DTLS_GATT_LEN_HDR || dgram_len > left - DTLS_GATT_LEN_HDR) {
+        //malformed transfer, drop the rest of it
+        t->rx_active = false;
+        dtls_gatt_pump(t);
+        return MBEDTLS_ERR_SSL_WANT_READ;
+    }
+
+    //like a UDP socket, a datagram longer than buf is truncated
+    size_t copy_len = dgram_len < len ? dgram_len : len;
+    memcpy(buf, p + DTLS_GATT_LEN_HDR, copy_len);
+    t->rx_pos += DTLS_GATT_LEN_HDR + dgram_len;
+
+    if (t->rx_pos >= t->rx.len) {
+        //read out, the peer can send its next transfer
+        t->rx_active = false;
+        ret = dtls_gatt_pump(t);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    return (int)copy_len;
+}
+
+int dtls_gatt_recv_timeout(void *ctx, unsigned char *buf, size_t len, uint32_t timeout)
+{
+    struct dtls_gatt *t = ctx;
+
+    if (t->ops->wait == NULL) {
+        return dtls_gatt_recv(ctx, buf, len);
+    }
+
+    uint32_t start = t->ops->now_ms(t->link);
+    for (;;) {
+        int ret = dtls_gatt_recv(ctx, buf, len);
+        if (ret != MBEDTLS_ERR_SSL_WANT_READ) {
+            return ret;
+        }
+
+        uint32_t remaining = UINT32_MAX;
+        if (timeout != 0) {
+            uint32_t elapsed = t->ops->now_ms(t->link) - start;
+            if (elapsed >= timeout) {
+                return MBEDTLS_ERR_SSL_TIMEOUT;
+            }
+            remaining = timeout - elapsed;
+        }
+
+        ret = pump_and_wait(t, remaining);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+}
+
+void dtls_gatt_set_delay(void *data, uint32_t int_ms, uint32_t fin_ms)
+{
+    struct dtls_gatt_timer *timer = data;
+
+    timer->int_ms = int_ms;
+    timer->fin_ms = fin_ms;
+    if (fin_ms != 0) {
+        timer->start_ms = timer->now_ms(timer->clock);
+    }
+}
+
+int dtls_gatt_get_delay(void *data)
+{
+    struct dtls_gatt_timer *timer = data;
+
+    if (timer->fin_ms == 0) {
+        return -1;
+    }
+
+    uint32_t elapsed = timer->now_ms(timer->clock) - timer->start_ms;
+    if (elapsed >= timer->fin_ms) {
+        return 2;
+    }
+    if (elapsed >= timer->int_ms) {
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,160 @@
+/*
+ * DTLS record transport over the data and metadata characteristics
+ *
+ * Carries mbedtls datagrams between the sensor and the mule as windowed
+ * xfer transfers, in both directions at once: the sensor notifies, the
+ * mule writes without response, and each side tells the other's proposals
+ * (XFER_STATE_SENDING) from its acks (XFER_STATE_ACK) by the metadata
+ * state. dtls_gatt_send only queues a datagram; the next pump sends
+ * everything queued since the last transfer as one, so a whole handshake
+ * flight costs one proposal and one final ack instead of one per record.
+ * A transfer holds one or more datagrams, each prefixed with its length as
+ * 2 bytes little endian.
+ *
+ * The module never touches a radio stack. The platform hands it a send
+ * function and calls dtls_gatt_on_meta / dtls_gatt_on_chunk with what the
+ * peer sent, then dtls_gatt_pump whenever the stack may have room again.
+ * On an event-driven platform (the sensor) the bio callbacks never block
+ * and the dtls_set_delay/dtls_get_delay timers drive retransmission. A
+ * platform that runs the connection in its own task (the mule) also
+ * provides wait, and dtls_gatt_recv_timeout blocks on it for up to the
+ * timeout mbedtls asks for.
+ */
+
+#ifndef DTLS_GATT_H
+#define DTLS_GATT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "xfer.h"
+
+// Queued outgoing datagrams, and the incoming transfer being received or
+// read; one handshake flight has to fit
+#ifndef DTLS_GATT_BUF_LEN
+#define DTLS_GATT_BUF_LEN 2048
+#endif
+
+// How long a blocking send or recv waits before pumping again while the
+// stack had no room
+#ifndef DTLS_GATT_RETRY_MS
+#define DTLS_GATT_RETRY_MS 10
+#endif
+
+// For mbedtls_ssl_conf_handshake_timeout. The default first retransmission
+// after 1 s comes before a flight even arrives at the sensor's connection
+// intervals, and the link never loses one, so only resend once the peer
+// must have dropped it
+#ifndef DTLS_GATT_HS_TIMEOUT_MIN_MS
+#define DTLS_GATT_HS_TIMEOUT_MIN_MS 16000
+#endif
+#ifndef DTLS_GATT_HS_TIMEOUT_MAX_MS
+#define DTLS_GATT_HS_TIMEOUT_MAX_MS 60000
+#endif
+
+#define DTLS_GATT_LEN_HDR 2     // length prefix of each datagram in a transfer
+
+#define DTLS_GATT_CHR_META 0
+#define DTLS_GATT_CHR_DATA 1
+
+#define DTLS_GATT_BUSY 1        // send: no room in the stack, pump again later
+
+struct dtls_gatt_ops {
+    // Sends one value on DTLS_GATT_CHR_META or DTLS_GATT_CHR_DATA. Returns
+    // 0, DTLS_GATT_BUSY, or a negative mbedtls error if the link is gone.
+    int (*send)(void *link, int chr, const uint8_t *buf, uint16_t len);
+
+    // Chunk size for the next outgoing transfer, see xfer_chunk_size
+    uint16_t (*chunk_size)(void *link);
+
+    // Blocks until the peer sent something or timeout_ms passed, handing
+    // it to dtls_gatt_on_*. Returns 0 either way, or a negative mbedtls
+    // error if the link is gone. NULL if the platform must not block.
+    int (*wait)(void *link, uint32_t timeout_ms);
+
+    // Millisecond clock for wait's deadlines, only needed with wait
+    uint32_t (*now_ms)(void *link);
+};
+
+struct dtls_gatt {
+    const struct dtls_gatt_ops *ops;
+    void *link;
+    uint8_t window;             // largest window we propose or agree to
+    bool busy;                  // the last pump ran out of room in the stack
+
+    // Outgoing: the transfer in flight is tx_buf[0, tx_inflight), datagrams
+    // queued since follow it up to tx_len
+    uint8_t tx_buf[DTLS_GATT_BUF_LEN];
+    size_t tx_len;
+    size_t tx_inflight;
+    struct xfer_tx tx;
+    uint8_t tx_meta[XFER_META_LEN];
+    bool tx_meta_pending;       // proposal not handed to the stack yet
+
+    // Incoming: one transfer, read out a datagram at a time from rx_pos
+    uint8_t rx_buf[DTLS_GATT_BUF_LEN];
+    size_t rx_pos;
+    struct xfer_rx rx;
+    bool rx_active;             // rx started and not read out yet
+    uint8_t rx_proposal[XFER_META_LEN];
+    bool rx_proposal_pending;   // peer's next transfer, answered once rx is read
+    uint8_t rx_meta[XFER_META_LEN];
+    bool rx_meta_pending;       // window answer or ack not handed to the stack yet
+};
+
+// window is capped to XFER_MAX_WINDOW
+void dtls_gatt_init(struct dtls_gatt *t, const struct dtls_gatt_ops *ops,
+                    void *link, uint8_t window);
+
+// Drops everything queued or received, for a new connection
+void dtls_gatt_reset(struct dtls_gatt *t);
+
+// Metadata and data values the peer sent; call dtls_gatt_pump afterwards
+void dtls_gatt_on_meta(struct dtls_gatt *t, const uint8_t *meta, size_t len);
+void dtls_gatt_on_chunk(struct dtls_gatt *t, const uint8_t *data, uint16_t len);
+
+// Hands the stack whatever the windows and its room allow. Returns 0, or
+// the negative error of ops->send if the link is gone.
+int dtls_gatt_pump(struct dtls_gatt *t);
+
+// True once every datagram sent so far has been acked by the peer
+bool dtls_gatt_idle(const struct dtls_gatt *t);
+
+/*
+ * mbedtls bio callbacks, ctx is the struct dtls_gatt:
+ *
+ *   mbedtls_ssl_set_bio(&ssl, &t, dtls_gatt_send, dtls_gatt_recv,
+ *                       dtls_gatt_recv_timeout);
+ *
+ * send queues a whole datagram and returns len, or MBEDTLS_ERR_SSL_WANT_WRITE
+ * while the queue is full (blocking with ops->wait). recv returns one
+ * datagram or MBEDTLS_ERR_SSL_WANT_READ. recv_timeout is recv without
+ * ops->wait, and with it blocks for up to timeout ms (0: until data or a
+ * disconnect) and then returns MBEDTLS_ERR_SSL_TIMEOUT.
+ */
+int dtls_gatt_send(void *ctx, const unsigned char *buf, size_t len);
+int dtls_gatt_recv(void *ctx, unsigned char *buf, size_t len);
+int dtls_gatt_recv_timeout(void *ctx, unsigned char *buf, size_t len, uint32_t timeout);
+
+/*
+ * Handshake timers on a millisecond clock, with the semantics of
+ * mbedtls_timing_set_delay / mbedtls_timing_get_delay:
+ *
+ *   mbedtls_ssl_set_timer_cb(&ssl, &timer, dtls_gatt_set_delay,
+ *                            dtls_gatt_get_delay);
+ *
+ * For platforms that poll. One that sleeps until an event (the sensor)
+ * needs timers that wake it instead.
+ */
+struct dtls_gatt_timer {
+    uint32_t (*now_ms)(void *clock);
+    void *clock;
+    uint32_t start_ms;
+    uint32_t int_ms;
+    uint32_t fin_ms;
+};
+
+void dtls_gatt_set_delay(void *data, uint32_t int_ms, uint32_t fin_ms);
+int dtls_gatt_get_delay(void *data);
+
+#endif // DTLS_GATT_H
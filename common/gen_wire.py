@@ -0,0 +1,331 @@
+#!/usr/bin/env python3
+# gen_wire.py
+# Generates the C header (common/wire.h) and the Python codec (cloud/wire.py)
+# for the frames described in common/wire.json, so every device encodes and
+# parses them the same way.
+#
+# Frame layout, all integers little endian:
+#   u8 version | u8 message id | fixed-size fields, in spec order |
+#   u32 length of each variable field, in spec order | variable field bytes
+# Every fixed field and every length sits at a constant offset, so a frame is
+# parsed with one pass over its prefix, and the lengths have to add up to the
+# frame length exactly. A C encoder leaves a variable field alone if it
+# already points at its place in the output, so it can be built there first.
+#
+#   python3 gen_wire.py [wire.json] [wire.h] [../cloud/wire.py]
+import json
+import os
+import sys
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+
+
+def load(path):
+    with open(path) as f:
+        spec = json.load(f)
+
+    ids = set()
+    for message in spec['messages']:
+        if message['id'] in ids or not 0 < message['id'] < 256:
+            raise SystemExit(f'{message["name"]}: bad or repeated id {message["id"]}')
+        ids.add(message['id'])
+        for name, kind in message['fields']:
+            if kind not in ('u8', 'u32', 'bytes') and not (isinstance(kind, int) and kind > 0):
+                raise SystemExit(f'{message["name"]}.{name}: unknown type {kind!r}')
+    return spec
+
+
+def fixed_fields(message):
+    return [(name, kind) for name, kind in message['fields'] if kind != 'bytes']
+
+
+def var_fields(message):
+    return [name for name, kind in message['fields'] if kind == 'bytes']
+
+
+def field_size(kind):
+    return {'u8': 1, 'u32': 4}.get(kind, kind)
+
+
+def prefix_len(message):
+    return 2 + sum(field_size(kind) for _, kind in fixed_fields(message)) + 4 * len(var_fields(message))
+
+
+def camel(name):
+    return ''.join(part.title() for part in name.split('_'))
+
+
+# -- C --
+
+def c_message(message):
+    name = message['name']
+    upper = name.upper()
+    out = []
+
+    out.append(f'#define WIRE_{upper} {message["id"]}')
+    out.append(f'#define WIRE_{upper}_PREFIX_LEN {prefix_len(message)}')
+    for field, kind in fixed_fields(message):
+        if isinstance(kind, int):
+            out.append(f'#define WIRE_{upper}_{field.upper()}_LEN {kind}')
+    out.append('')
+
+    out.append(f'struct wire_{name} {{')
+    for field, kind in message['fields']:
+        if kind == 'u8':
+            out.append(f'    uint8_t {field};')
+        elif kind == 'u32':
+            out.append(f'    uint32_t {field};')
+        elif kind == 'bytes':
+            out.append(f'    const uint8_t *{field};')
+            out.append(f'    uint32_t {field}_len;')
+        else:
+            out.append(f'    const uint8_t *{field};   /* {kind} bytes */')
+    out.append('};')
+    out.append('')
+
+    # length
+    out.append(f'static inline size_t wire_{name}_len(const struct wire_{name} *m)')
+    out.append('{')
+    terms = [f'WIRE_{upper}_PREFIX_LEN'] + [f'(size_t)m->{field}_len' for field in var_fields(message)]
+    if not var_fields(message):
+        out.append('    (void)m;')
+    out.append(f'    return {" + ".join(terms)};')
+    out.append('}')
+    out.append('')
+
+    # encode
+    out.append(f'static inline int wire_{name}_encode(const struct wire_{name} *m, uint8_t *buf, size_t cap)')
+    out.append('{')
+    out.append(f'    size_t len = wire_{name}_len(m);')
+    out.append('    size_t off = 2;')
+    out.append('')
+    out.append('    if (len > cap || len > INT32_MAX) {')
+    out.append('        return WIRE_ERR_SPACE;')
+    out.append('    }')
+    out.append('    buf[0] = WIRE_VERSION;')
+    out.append(f'    buf[1] = WIRE_{upper};')
+    for field, kind in fixed_fields(message):
+        if kind == 'u8':
+            out.append(f'    buf[off] = m->{field};')
+            out.append('    off += 1;')
+        elif kind == 'u32':
+            out.append(f'    wire_put_u32(&buf[off], m->{field});')
+            out.append('    off += 4;')
+        else:
+            out.append(f'    memcpy(&buf[off], m->{field}, {kind});')
+            out.append(f'    off += {kind};')
+    for field in var_fields(message):
+        out.append(f'    wire_put_u32(&buf[off], m->{field}_len);')
+        out.append('    off += 4;')
+    for field in var_fields(message):
+        out.append(f'    if (m->{field}_len > 0 && m->{field} != &buf[off]) {{')
+        out.append(f'        memcpy(&buf[off], m->{field}, m->{field}_len);')
+        out.append('    }')
+        out.append(f'    off += m->{field}_len;')
+    out.append('    return (int)off;')
+    out.append('}')
+    out.append('')
+
+    # decode
+    out.append(f'static inline int wire_{name}_decode(struct wire_{name} *m, const uint8_t *buf, size_t len)')
+    out.append('{')
+    out.append('    size_t off = 2;')
+    out.append(f'    int rc = wire_check_header(buf, len, WIRE_{upper}, WIRE_{upper}_PREFIX_LEN);')
+    out.append('')
+    out.append('    if (rc != WIRE_OK) {')
+    out.append('        return rc;')
+    out.append('    }')
+    for field, kind in fixed_fields(message):
+        if kind == 'u8':
+            out.append(f'    m->{field} = buf[off];')
+            out.append('    off += 1;')
+        elif kind == 'u32':
+            out.append(f'    m->{field} = wire_get_u32(&buf[off]);')
+            out.append('    off += 4;')
+        else:
+            out.append(f'    m->{field} = &buf[off];')
+            out.append(f'    off += {kind};')
+    for field in var_fields(message):
+        out.append(f'    m->{field}_len = wire_get_u32(&buf[off]);')
+        out.append('    off += 4;')
+    for field in var_fields(message):
+        out.append(f'    if (m->{field}_len > len - off) {{')
+        out.append('        return WIRE_ERR_LEN;')
+        out.append('    }')
+        out.append(f'    m->{field} = &buf[off];')
+        out.append(f'    off += m->{field}_len;')
+    out.append('    return off == len ? WIRE_OK : WIRE_ERR_LEN;')
+    out.append('}')
+    return '\n'.join(out)
+
+
+def gen_c(spec):
+    parts = [f'''/*
+ * Wire frames shared by the sensor, the mule and the cloud
+ *
+ * Generated from wire.json by gen_wire.py; edit those, not this file.
+ *
+ * A frame is: u8 version | u8 message id | fixed-size fields |
+ * u32 length of each variable field | variable field bytes, little endian.
+ * Encoding writes into a caller buffer and decoding points the struct's
+ * fields into the frame, so neither allocates or copies more than the frame.
+ * Decoding checks the version, message id and that the field lengths add up
+ * to the frame length exactly.
+ */
+
+#ifndef WIRE_H
+#define WIRE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define WIRE_VERSION {spec["version"]}
+
+#define WIRE_OK            0
+#define WIRE_ERR_SHORT    -1   // shorter than the fixed prefix
+#define WIRE_ERR_VERSION  -2
+#define WIRE_ERR_TYPE     -3   // a different message
+#define WIRE_ERR_LEN      -4   // field lengths don't add up to the frame length
+#define WIRE_ERR_SPACE    -5   // the frame doesn't fit the buffer
+
+static inline void wire_put_u32(uint8_t *p, uint32_t v)
+{{
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+    p[2] = (uint8_t)(v >> 16);
+    p[3] = (uint8_t)(v >> 24);
+}}
+
+static inline uint32_t wire_get_u32(const uint8_t *p)
+{{
+    return p[0] | (p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}}
+
+// Message id of a frame, or a WIRE_ERR_* code
+static inline int wire_message_id(const uint8_t *buf, size_t len)
+{{
+    if (len < 2) {{
+        return WIRE_ERR_SHORT;
+    }}
+    if (buf[0] != WIRE_VERSION) {{
+        return WIRE_ERR_VERSION;
+    }}
+    return buf[1];
+}}
+
+static inline int wire_check_header(const uint8_t *buf, size_t len, uint8_t id, size_t prefix_len)
+{{
+    int rc = wire_message_id(buf, len);
+    if (rc < 0) {{
+        return rc;
+    }}
+    if (rc != id) {{
+        return WIRE_ERR_TYPE;
+    }}
+    return len < prefix_len ? WIRE_ERR_SHORT : WIRE_OK;
+}}
+''']
+    for message in spec['messages']:
+        parts.append(c_message(message))
+    parts.append('#endif\n')
+    return '\n\n'.join(parts)
+
+
+# -- Python --
+
+def py_message(message):
+    fmt = '<BB'
+    for _, kind in fixed_fields(message):
+        fmt += {'u8': 'B', 'u32': 'I'}.get(kind, f'{kind}s')
+    fmt += 'I' * len(var_fields(message))
+
+    fixed = [name for name, _ in fixed_fields(message)]
+    variable = var_fields(message)
+    # where each field of the spec order lands in (fixed values + variable values)
+    order = [fixed.index(name) if kind != 'bytes' else len(fixed) + variable.index(name)
+             for name, kind in message['fields']]
+    sizes = [kind if isinstance(kind, int) else 0 for _, kind in fixed_fields(message)]
+    return f'''class {camel(message["name"])}(_Message):
+    ID = {message["id"]}
+    FIELDS = {tuple(name for name, _ in message["fields"])!r}
+    _prefix = struct.Struct({fmt!r})
+    _fixed = {tuple(fixed)!r}
+    _sizes = {tuple(sizes)!r}
+    _variable = {tuple(variable)!r}
+    _order = {tuple(order)!r}
+'''
+
+
+def gen_py(spec):
+    parts = [f'''# wire.py
+# Codec for the frames in common/wire.json. Generated by common/gen_wire.py;
+# edit those, not this file. See common/wire.h for the frame layout.
+import struct
+
+VERSION = {spec["version"]}
+
+
+class WireError(ValueError):
+    pass
+
+
+class _Message:
+
+    # fields in spec order; fixed-size byte fields must have exactly their size.
+    # A variable field may also be a list of parts, joined straight into the
+    # frame
+    @classmethod
+    def encode(cls, *fields) -> bytes:
+        if len(fields) != len(cls.FIELDS):
+            raise TypeError(f'{{cls.__name__}} takes {{len(cls.FIELDS)}} fields')
+        values = [fields[cls.FIELDS.index(name)] for name in cls._fixed + cls._variable]
+        fixed = values[:len(cls._fixed)]
+        variable = values[len(cls._fixed):]
+        for name, value, size in zip(cls._fixed, fixed, cls._sizes):
+            if size and len(value) != size:
+                raise WireError(f'{{cls.__name__}}.{{name}} is {{len(value)}} bytes, not {{size}}')
+        parts = [value if isinstance(value, list) else [value] for value in variable]
+        prefix = cls._prefix.pack(VERSION, cls.ID, *fixed, *[sum(map(len, value)) for value in parts])
+        return b''.join([prefix, *[part for value in parts for part in value]])
+
+    # fields in spec order; variable fields are slices of buf, so views if
+    # buf is a memoryview
+    @classmethod
+    def decode(cls, buf) -> tuple:
+        if len(buf) < cls._prefix.size:
+            raise WireError(f'{{cls.__name__}}: {{len(buf)}} bytes is too short')
+        values = cls._prefix.unpack_from(buf)
+        if values[0] != VERSION:
+            raise WireError(f'{{cls.__name__}}: version {{values[0]}}, expected {{VERSION}}')
+        if values[1] != cls.ID:
+            raise WireError(f'{{cls.__name__}}: message id {{values[1]}}, expected {{cls.ID}}')
+
+        fields = list(values[2:2 + len(cls._fixed)])
+        offset = cls._prefix.size
+        for length in values[2 + len(cls._fixed):]:
+            fields.append(buf[offset:offset + length])
+            offset += length
+        if offset != len(buf):
+            raise WireError(f'{{cls.__name__}}: fields add up to {{offset}} bytes, frame is {{len(buf)}}')
+        return tuple(fields[index] for index in cls._order)
+''']
+    for message in spec['messages']:
+        parts.append(py_message(message))
+    return '\n\n'.join(parts)
+
+
+def main():
+    spec_path = sys.argv[1] if len(sys.argv) > 1 else os.path.join(HERE, 'wire.json')
+    c_path = sys.argv[2] if len(sys.argv) > 2 else os.path.join(HERE, 'wire.h')
+    py_path = sys.argv[3] if len(sys.argv) > 3 else os.path.join(HERE, '..', 'cloud', 'wire.py')
+
+    spec = load(spec_path)
+    with open(c_path, 'w') as f:
+        f.write(gen_c(spec))
+    with open(py_path, 'w') as f:
+        f.write(gen_py(spec))
+
+
+if __name__ == '__main__':
+    main()
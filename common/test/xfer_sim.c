@@ -0,0 +1,177 @@
+/*
+ * Host-side simulated BLE link for the windowed chunk transfer in xfer.c
+ *
+ * Models a connection as a sequence of connection events. In every event
+ * the central (mule) sends its queued metadata writes and the peripheral
+ * (sensor) sends its queued notifications, each side limited to a number
+ * of PDUs per event. Both sides only react to what they received once the
+ * event is over, which is how a SoftDevice / NimBLE application sees it.
+ *
+ * Prints goodput for a range of window sizes and exits non-zero if any
+ * transfer delivers corrupted data.
+ *
+ *   xfer_sim [payload_bytes] [att_mtu] [ll_octets] [conn_interval_ms] [pdus_per_event] [loss_percent]
+ *
+ * The chunk size is derived from att_mtu and ll_octets with
+ * xfer_chunk_size(), as the sensor does on a real link.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "xfer.h"
+
+#define MAX_PAYLOAD (XFER_MAX_CHUNKS * XFER_MAX_CHUNK_SIZE)
+#define QUEUE_LEN   (XFER_MAX_WINDOW + 4)
+#define MAX_EVENTS  100000
+
+enum pkt_kind { PKT_META, PKT_DATA };
+
+struct pkt {
+    enum pkt_kind kind;
+    uint16_t len;
+    uint8_t data[XFER_MAX_CHUNK_SIZE];
+};
+
+struct queue {
+    struct pkt pkts[QUEUE_LEN];
+    int head;
+    int count;
+};
+
+static void queue_push(struct queue *q, enum pkt_kind kind, const uint8_t *data, uint16_t len)
+{
+    struct pkt *p = &q->pkts[(q->head + q->count) % QUEUE_LEN];
+    p->kind = kind;
+    p->len = len;
+    memcpy(p->data, data, len);
+    q->count += 1;
+}
+
+static struct pkt *queue_peek(struct queue *q)
+{
+    return q->count ? &q->pkts[q->head] : NULL;
+}
+
+static void queue_pop(struct queue *q)
+{
+    q->head = (q->head + 1) % QUEUE_LEN;
+    q->count -= 1;
+}
+
+// Moves up to pdus packets from one side to the other; a lost PDU is
+// retransmitted by the link layer in a later slot.
+static int link_deliver(struct queue *tx, struct queue *rx, int pdus, int loss_percent)
+{
+    int sent = 0;
+    for (int i = 0; i < pdus && tx->count; i++) {
+        if (rand() % 100 < loss_percent) {
+            continue;
+        }
+        struct pkt *p = queue_peek(tx);
+        queue_push(rx, p->kind, p->data, p->len);
+        queue_pop(tx);
+        sent += 1;
+    }
+    return sent;
+}
+
+// Runs one transfer and returns the number of connection events it took
+static int simulate(const uint8_t *payload, size_t len, uint16_t chunk_size,
+                    uint8_t window, int pdus, int loss_percent, uint8_t *out)
+{
+    struct xfer_tx tx;
+    struct xfer_rx rx;
+    struct queue sensor_tx = {0}, mule_tx = {0};
+    struct queue sensor_rx = {0}, mule_rx = {0};
+    uint8_t meta[XFER_META_LEN];
+    bool rx_started = false;
+
+    if (xfer_tx_init(&tx, payload, len, chunk_size, window) != 0) {
+        return -1;
+    }
+    xfer_tx_meta(&tx, meta);
+    queue_push(&sensor_tx, PKT_META, meta, sizeof(meta));
+
+    for (int event = 0; event < MAX_EVENTS; event++) {
+        // central transmits first in every connection event
+        link_deliver(&mule_tx, &sensor_rx, pdus, loss_percent);
+        link_deliver(&sensor_tx, &mule_rx, pdus, loss_percent);
+
+        // mule side: BLE_GAP_EVENT_NOTIFY_RX
+        for (struct pkt *p; (p = queue_peek(&mule_rx)); queue_pop(&mule_rx)) {
+            if (p->kind == PKT_META) {
+                if (xfer_rx_start(&rx, out, MAX_PAYLOAD, p->data, XFER_MAX_CHUNK_SIZE, XFER_MAX_WINDOW) == 0) {
+                    rx_started = true;
+                    xfer_rx_meta(&rx, meta);
+                    queue_push(&mule_tx, PKT_META, meta, sizeof(meta));
+                }
+            } else if (rx_started && xfer_rx_on_chunk(&rx, p->data, p->len) == 1) {
+                xfer_rx_meta(&rx, meta);
+                queue_push(&mule_tx, PKT_META, meta, sizeof(meta));
+            }
+        }
+
+        // sensor side: BLE_GATTS_EVT_WRITE on the metadata characteristic
+        for (struct pkt *p; (p = queue_peek(&sensor_rx)); queue_pop(&sensor_rx)) {
+            xfer_tx_on_meta(&tx, p->data, p->len);
+        }
+
+        if (xfer_tx_done(&tx)) {
+            return event + 1;
+        }
+
+        const uint8_t *chunk;
+        uint16_t chunk_len;
+        while (sensor_tx.count < QUEUE_LEN && (chunk_len = xfer_tx_peek(&tx, &chunk)) != 0) {
+            queue_push(&sensor_tx, PKT_DATA, chunk, chunk_len);
+            xfer_tx_advance(&tx);
+        }
+    }
+
+    return -1;
+}
+
+int main(int argc, char **argv)
+{
+    size_t len = argc > 1 ? (size_t)atoi(argv[1]) : 1000;
+    uint16_t att_mtu = argc > 2 ? (uint16_t)atoi(argv[2]) : 247;
+    uint16_t ll_octets = argc > 3 ? (uint16_t)atoi(argv[3]) : XFER_LL_OCTETS_MAX;
+    int conn_interval_ms = argc > 4 ? atoi(argv[4]) : 30;
+    int pdus = argc > 5 ? atoi(argv[5]) : 4;
+    int loss_percent = argc > 6 ? atoi(argv[6]) : 0;
+    uint16_t chunk_size = xfer_chunk_size(att_mtu, ll_octets);
+    static const uint8_t windows[] = {1, 2, 4, 8, 16};
+    static uint8_t payload[MAX_PAYLOAD];
+    static uint8_t out[MAX_PAYLOAD];
+    int failures = 0;
+
+    if (len > MAX_PAYLOAD || pdus <= 0) {
+        printf("usage: %s [payload_bytes] [att_mtu] [ll_octets] [conn_interval_ms] [pdus_per_event] [loss_percent]\n", argv[0]);
+        return 2;
+    }
+
+    srand(1);
+    for (size_t i = 0; i < len; i++) {
+        payload[i] = (uint8_t)rand();
+    }
+
+    printf("payload %zu B, mtu %u, ll %u B -> chunk %u B, interval %d ms, %d PDUs/event, %d%% loss\n",
+           len, att_mtu, ll_octets, chunk_size, conn_interval_ms, pdus, loss_percent);
+    printf("window  events   time_ms   goodput_B/s\n");
+
+    for (size_t i = 0; i < sizeof(windows); i++) {
+        memset(out, 0, sizeof(out));
+        int events = simulate(payload, len, chunk_size, windows[i], pdus, loss_percent, out);
+        if (events < 0 || memcmp(payload, out, len) != 0) {
+            printf("%6u  FAILED\n", windows[i]);
+            failures += 1;
+            continue;
+        }
+
+        double time_ms = (double)events * conn_interval_ms;
+        printf("%6u  %6d  %8.0f  %12.1f\n", windows[i], events, time_ms, len / (time_ms / 1000.0));
+    }
+
+    return failures ? 1 : 0;
+}
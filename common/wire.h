@@ -0,0 +1,1017 @@
+/*
+ * Wire frames shared by the sensor, the mule and the cloud
+ *
+ * Generated from wire.json by gen_wire.py; edit those, not this file.
+ *
+ * A frame is: u8 version | u8 message id | fixed-size fields |
+ * u32 length of each variable field | variable field bytes, little endian.
+ * Encoding writes into a caller buffer and decoding points the struct's
+ * fields into the frame, so neither allocates or copies more than the frame.
+ * Decoding checks the version, message id and that the field lengths add up
+ * to the frame length exactly.
+ */
+
+#ifndef WIRE_H
+#define WIRE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define WIRE_VERSION 1
+
+#define WIRE_OK            0
+#define WIRE_ERR_SHORT    -1   // shorter than the fixed prefix
+#define WIRE_ERR_VERSION  -2
+#define WIRE_ERR_TYPE     -3   // a different message
+#define WIRE_ERR_LEN      -4   // field lengths don't add up to the frame length
+#define WIRE_ERR_SPACE    -5   // the frame doesn't fit the buffer
+
+static inline void wire_put_u32(uint8_t *p, uint32_t v)
+{
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+    p[2] = (uint8_t)(v >> 16);
+    p[3] = (uint8_t)(v >> 24);
+}
+
+static inline uint32_t wire_get_u32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// Message id of a frame, or a WIRE_ERR_* code
+static inline int wire_message_id(const uint8_t *buf, size_t len)
+{
+    if (len < 2) {
+        return WIRE_ERR_SHORT;
+    }
+    if (buf[0] != WIRE_VERSION) {
+        return WIRE_ERR_VERSION;
+    }
+    return buf[1];
+}
+
+static inline int wire_check_header(const uint8_t *buf, size_t len, uint8_t id, size_t prefix_len)
+{
+    int rc = wire_message_id(buf, len);
+    if (rc < 0) {
+        return rc;
+    }
+    if (rc != id) {
+        return WIRE_ERR_TYPE;
+    }
+    return len < prefix_len ? WIRE_ERR_SHORT : WIRE_OK;
+}
+
+
+#define WIRE_HASH_PAYLOAD 1
+#define WIRE_HASH_PAYLOAD_PREFIX_LEN 50
+#define WIRE_HASH_PAYLOAD_SENSOR_ID_LEN 16
+#define WIRE_HASH_PAYLOAD_DATA_HASH_LEN 32
+
+struct wire_hash_payload {
+    const uint8_t *sensor_id;   /* 16 bytes */
+    const uint8_t *data_hash;   /* 32 bytes */
+};
+
+static inline size_t wire_hash_payload_len(const struct wire_hash_payload *m)
+{
+    (void)m;
+    return WIRE_HASH_PAYLOAD_PREFIX_LEN;
+}
+
+static inline int wire_hash_payload_encode(const struct wire_hash_payload *m, uint8_t *buf, size_t cap)
+{
+    size_t len = wire_hash_payload_len(m);
+    size_t off = 2;
+
+    if (len > cap || len > INT32_MAX) {
+        return WIRE_ERR_SPACE;
+    }
+    buf[0] = WIRE_VERSION;
+    buf[1] = WIRE_HASH_PAYLOAD;
+    memcpy(&buf[off], m->sensor_id, 16);
+    off += 16;
+    memcpy(&buf[off], m->data_hash, 32);
+    off += 32;
+    return (int)off;
+}
+
+static inline int wire_hash_payload_decode(struct wire_hash_payload *m, const uint8_t *buf, size_t len)
+{
+    size_t off = 2;
+    int rc = wire_check_header(buf, len, WIRE_HASH_PAYLOAD, WIRE_HASH_PAYLOAD_PREFIX_LEN);
+
+    if (rc != WIRE_OK) {
+        return rc;
+    }
+    m->sensor_id = &buf[off];
+    off += 16;
+    m->data_hash = &buf[off];
+    off += 32;
+    return off == len ? WIRE_OK : WIRE_ERR_LEN;
+}
+
+#define WIRE_SIGNED_HASH_PAYLOAD 2
+#define WIRE_SIGNED_HASH_PAYLOAD_PREFIX_LEN 70
+#define WIRE_SIGNED_HASH_PAYLOAD_SIGNATURE_LEN 64
+
+struct wire_signed_hash_payload {
+    const uint8_t *hash_payload;
+    uint32_t hash_payload_len;
+    const uint8_t *signature;   /* 64 bytes */
+};
+
+static inline size_t wire_signed_hash_payload_len(const struct wire_signed_hash_payload *m)
+{
+    return WIRE_SIGNED_HASH_PAYLOAD_PREFIX_LEN + (size_t)m->hash_payload_len;
+}
+
+static inline int wire_signed_hash_payload_encode(const struct wire_signed_hash_payload *m, uint8_t *buf, size_t cap)
+{
+    size_t len = wire_signed_hash_payload_len(m);
+    size_t off = 2;
+
+    if (len > cap || len > INT32_MAX) {
+        return WIRE_ERR_SPACE;
+    }
+    buf[0] = WIRE_VERSION;
+    buf[1] = WIRE_SIGNED_HASH_PAYLOAD;
+    memcpy(&buf[off], m->signature, 64);
+    off += 64;
+    wire_put_u32(&buf[off], m->hash_payload_len);
+    off += 4;
+    if (m->hash_payload_len > 0 && m->hash_payload != &buf[off]) {
+        memcpy(&buf[off], m->hash_payload, m->hash_payload_len);
+    }
+    off += m->hash_payload_len;
+    return (int)off;
+}
+
+static inline int wire_signed_hash_payload_decode(struct wire_signed_hash_payload *m, const uint8_t *buf, size_t len)
+{
+    size_t off = 2;
+    int rc = wire_check_header(buf, len, WIRE_SIGNED_HASH_PAYLOAD, WIRE_SIGNED_HASH_PAYLOAD_PREFIX_LEN);
+
+    if (rc != WIRE_OK) {
+        return rc;
+    }
+    m->signature = &buf[off];
+    off += 64;
+    m->hash_payload_len = wire_get_u32(&buf[off]);
+    off += 4;
+    if (m->hash_payload_len > len - off) {
+        return WIRE_ERR_LEN;
+    }
+    m->hash_payload = &buf[off];
+    off += m->hash_payload_len;
+    return off == len ? WIRE_OK : WIRE_ERR_LEN;
+}
+
+#define WIRE_PREDELIVERY_PAYLOAD 3
+#define WIRE_PREDELIVERY_PAYLOAD_PREFIX_LEN 54
+#define WIRE_PREDELIVERY_PAYLOAD_PROTOCOL_NONCE_LEN 16
+#define WIRE_PREDELIVERY_PAYLOAD_DATA_HASH_LEN 32
+
+struct wire_predelivery_payload {
+    const uint8_t *protocol_nonce;   /* 16 bytes */
+    const uint8_t *data_hash;   /* 32 bytes */
+    const uint8_t *encrypted_token;
+    uint32_t encrypted_token_len;
+};
+
+static inline size_t wire_predelivery_payload_len(const struct wire_predelivery_payload *m)
+{
+    return WIRE_PREDELIVERY_PAYLOAD_PREFIX_LEN + (size_t)m->encrypted_token_len;
+}
+
+static inline int wire_predelivery_payload_encode(const struct wire_predelivery_payload *m, uint8_t *buf, size_t cap)
+{
+    size_t len = wire_predelivery_payload_len(m);
+    size_t off = 2;
+
+    if (len > cap || len > INT32_MAX) {
+        return WIRE_ERR_SPACE;
+    }
+    buf[0] = WIRE_VERSION;
+    buf[1] = WIRE_PREDELIVERY_PAYLOAD;
+    memcpy(&buf[off], m->protocol_nonce, 16);
+    off += 16;
+    memcpy(&buf[off], m->data_hash, 32);
+    off += 32;
+    wire_put_u32(&buf[off], m->encrypted_token_len);
+    off += 4;
+    if (m->encrypted_token_len > 0 && m->encrypted_token != &buf[off]) {
+        memcpy(&buf[off], m->encrypted_token, m->encrypted_token_len);
+    }
+    off += m->encrypted_token_len;
+    return (int)off;
+}
+
+static inline int wire_predelivery_payload_decode(struct wire_predelivery_payload *m, const uint8_t *buf, size_t len)
+{
+    size_t off = 2;
+    int rc = wire_check_header(buf, len, WIRE_PREDELIVERY_PAYLOAD, WIRE_PREDELIVERY_PAYLOAD_PREFIX_LEN);
+
+    if (rc != WIRE_OK) {
+        return rc;
+    }
+    m->protocol_nonce = &buf[off];
+    off += 16;
+    m->data_hash = &buf[off];
+    off += 32;
+    m->encrypted_token_len = wire_get_u32(&buf[off]);
+    off += 4;
+    if (m->encrypted_token_len > len - off) {
+        return WIRE_ERR_LEN;
+    }
+    m->encrypted_token = &buf[off];
+    off += m->encrypted_token_len;
+    return off == len ? WIRE_OK : WIRE_ERR_LEN;
+}
+
+#define WIRE_SIGNED_PREDELIVERY_PAYLOAD 4
+#define WIRE_SIGNED_PREDELIVERY_PAYLOAD_PREFIX_LEN 70
+#define WIRE_SIGNED_PREDELIVERY_PAYLOAD_SIGNATURE_LEN 64
+
+struct wire_signed_predelivery_payload {
+    const uint8_t *predelivery_payload;
+    uint32_t predelivery_payload_len;
+    const uint8_t *signature;   /* 64 bytes */
+};
+
+static inline size_t wire_signed_predelivery_payload_len(const struct wire_signed_predelivery_payload *m)
+{
+    return WIRE_SIGNED_PREDELIVERY_PAYLOAD_PREFIX_LEN + (size_t)m->predelivery_payload_len;
+}
+
+static inline int wire_signed_predelivery_payload_encode(const struct wire_signed_predelivery_payload *m, uint8_t *buf, size_t cap)
+{
+    size_t len = wire_signed_predelivery_payload_len(m);
+    size_t off = 2;
+
+    if (len > cap || len > INT32_MAX) {
+        return WIRE_ERR_SPACE;
+    }
+    buf[0] = WIRE_VERSION;
+    buf[1] = WIRE_SIGNED_PREDELIVERY_PAYLOAD;
+    memcpy(&buf[off], m->signature, 64);
+    off += 64;
+    wire_put_u32(&buf[off], m->predelivery_payload_len);
+    off += 4;
+    if (m->predelivery_payload_len > 0 && m->predelivery_payload != &buf[off]) {
+        memcpy(&buf[off], m->predelivery_payload, m->predelivery_payload_len);
+    }
+    off += m->predelivery_payload_len;
+    return (int)off;
+}
+
+static inline int wire_signed_predelivery_payload_decode(struct wire_signed_predelivery_payload *m, const uint8_t *buf, size_t len)
+{
+    size_t off = 2;
+    int rc = wire_check_header(buf, len, WIRE_SIGNED_PREDELIVERY_PAYLOAD, WIRE_SIGNED_PREDELIVERY_PAYLOAD_PREFIX_LEN);
+
+    if (rc != WIRE_OK) {
+        return rc;
+    }
+    m->signature = &buf[off];
+    off += 64;
+    m->predelivery_payload_len = wire_get_u32(&buf[off]);
+    off += 4;
+    if (m->predelivery_payload_len > len - off) {
+        return WIRE_ERR_LEN;
+    }
+    m->predelivery_payload = &buf[off];
+    off += m->predelivery_payload_len;
+    return off == len ? WIRE_OK : WIRE_ERR_LEN;
+}
+
+#define WIRE_TOKEN_PAYLOAD 5
+#define WIRE_TOKEN_PAYLOAD_PREFIX_LEN 114
+#define WIRE_TOKEN_PAYLOAD_PROTOCOL_NONCE_LEN 16
+#define WIRE_TOKEN_PAYLOAD_TOKEN_LEN 64
+#define WIRE_TOKEN_PAYLOAD_DATA_HASH_LEN 32
+
+struct wire_token_payload {
+    const uint8_t *protocol_nonce;   /* 16 bytes */
+    const uint8_t *token;   /* 64 bytes */
+    const uint8_t *data_hash;   /* 32 bytes */
+};
+
+static inline size_t wire_token_payload_len(const struct wire_token_payload *m)
+{
+    (void)m;
+    return WIRE_TOKEN_PAYLOAD_PREFIX_LEN;
+}
+
+static inline int wire_token_payload_encode(const struct wire_token_payload *m, uint8_t *buf, size_t cap)
+{
+    size_t len = wire_token_payload_len(m);
+    size_t off = 2;
+
+    if (len > cap || len > INT32_MAX) {
+        return WIRE_ERR_SPACE;
+    }
+    buf[0] = WIRE_VERSION;
+    buf[1] = WIRE_TOKEN_PAYLOAD;
+    memcpy(&buf[off], m->protocol_nonce, 16);
+    off += 16;
+    memcpy(&buf[off], m->token, 64);
+    off += 64;
+    memcpy(&buf[off], m->data_hash, 32);
+    off += 32;
+    return (int)off;
+}
+
+static inline int wire_token_payload_decode(struct wire_token_payload *m, const uint8_t *buf, size_t len)
+{
+    size_t off = 2;
+    int rc = wire_check_header(buf, len, WIRE_TOKEN_PAYLOAD, WIRE_TOKEN_PAYLOAD_PREFIX_LEN);
+
+    if (rc != WIRE_OK) {
+        return rc;
+    }
+    m->protocol_nonce = &buf[off];
+    off += 16;
+    m->token = &buf[off];
+    off += 64;
+    m->data_hash = &buf[off];
+    off += 32;
+    return off == len ? WIRE_OK : WIRE_ERR_LEN;
+}
+
+#define WIRE_SIGNED_TOKEN_PAYLOAD 6
+#define WIRE_SIGNED_TOKEN_PAYLOAD_PREFIX_LEN 70
+#define WIRE_SIGNED_TOKEN_PAYLOAD_SIGNATURE_LEN 64
+
+struct wire_signed_token_payload {
+    const uint8_t *token_payload;
+    uint32_t token_payload_len;
+    const uint8_t *signature;   /* 64 bytes */
+};
+
+static inline size_t wire_signed_token_payload_len(const struct wire_signed_token_payload *m)
+{
+    return WIRE_SIGNED_TOKEN_PAYLOAD_PREFIX_LEN + (size_t)m->token_payload_len;
+}
+
+static inline int wire_signed_token_payload_encode(const struct wire_signed_token_payload *m, uint8_t *buf, size_t cap)
+{
+    size_t len = wire_signed_token_payload_len(m);
+    size_t off = 2;
+
+    if (len > cap || len > INT32_MAX) {
+        return WIRE_ERR_SPACE;
+    }
+    buf[0] = WIRE_VERSION;
+    buf[1] = WIRE_SIGNED_TOKEN_PAYLOAD;
+    memcpy(&buf[off], m->signature, 64);
+    off += 64;
+    wire_put_u32(&buf[off], m->token_payload_len);
+    off += 4;
+    if (m->token_payload_len > 0 && m->token_payload != &buf[off]) {
+        memcpy(&buf[off], m->token_payload, m->token_payload_len);
+    }
+    off += m->token_payload_len;
+    return (int)off;
+}
+
+static inline int wire_signed_token_payload_decode(struct wire_signed_token_payload *m, const uint8_t *buf, size_t len)
+{
+    size_t off = 2;
+    int rc = wire_check_header(buf, len, WIRE_SIGNED_TOKEN_PAYLOAD, WIRE_SIGNED_TOKEN_PAYLOAD_PREFIX_LEN);
+
+    if (rc != WIRE_OK) {
+        return rc;
+    }
+    m->signature = &buf[off];
+    off += 64;
+    m->token_payload_len = wire_get_u32(&buf[off]);
+    off += 4;
+    if (m->token_payload_len > len - off) {
+        return WIRE_ERR_LEN;
+    }
+    m->token_payload = &buf[off];
+    off += m->token_payload_len;
+    return off == len ? WIRE_OK : WIRE_ERR_LEN;
+}
+
+#define WIRE_TOKEN_REDEMPTION_PAYLOAD 7
+#define WIRE_TOKEN_REDEMPTION_PAYLOAD_PREFIX_LEN 22
+#define WIRE_TOKEN_REDEMPTION_PAYLOAD_MULE_ID_LEN 16
+
+struct wire_token_redemption_payload {
+    const uint8_t *mule_id;   /* 16 bytes */
+    const uint8_t *token_list;
+    uint32_t token_list_len;
+};
+
+static inline size_t wire_token_redemption_payload_len(const struct wire_token_redemption_payload *m)
+{
+    return WIRE_TOKEN_REDEMPTION_PAYLOAD_PREFIX_LEN + (size_t)m->token_list_len;
+}
+
+static inline int wire_token_redemption_payload_encode(const struct wire_token_redemption_payload *m, uint8_t *buf, size_t cap)
+{
+    size_t len = wire_token_redemption_payload_len(m);
+    size_t off = 2;
+
+    if (len > cap || len > INT32_MAX) {
+        return WIRE_ERR_SPACE;
+    }
+    buf[0] = WIRE_VERSION;
+    buf[1] = WIRE_TOKEN_REDEMPTION_PAYLOAD;
+    memcpy(&buf[off], m->mule_id, 16);
+    off += 16;
+    wire_put_u32(&buf[off], m->token_list_len);
+    off += 4;
+    if (m->token_list_len > 0 && m->token_list != &buf[off]) {
+        memcpy(&buf[off], m->token_list, m->token_list_len);
+    }
+    off += m->token_list_len;
+    return (int)off;
+}
+
+static inline int wire_token_redemption_payload_decode(struct wire_token_redemption_payload *m, const uint8_t *buf, size_t len)
+{
+    size_t off = 2;
+    int rc = wire_check_header(buf, len, WIRE_TOKEN_REDEMPTION_PAYLOAD, WIRE_TOKEN_REDEMPTION_PAYLOAD_PREFIX_LEN);
+
+    if (rc != WIRE_OK) {
+        return rc;
+    }
+    m->mule_id = &buf[off];
+    off += 16;
+    m->token_list_len = wire_get_u32(&buf[off]);
+    off += 4;
+    if (m->token_list_len > len - off) {
+        return WIRE_ERR_LEN;
+    }
+    m->token_list = &buf[off];
+    off += m->token_list_len;
+    return off == len ? WIRE_OK : WIRE_ERR_LEN;
+}
+
+#define WIRE_COMPLAINT_PAYLOAD 8
+#define WIRE_COMPLAINT_PAYLOAD_PREFIX_LEN 247
+#define WIRE_COMPLAINT_PAYLOAD_COMPLAINT_TOKEN_LEN 64
+#define WIRE_COMPLAINT_PAYLOAD_BLINDED_TOKEN_LEN 160
+#define WIRE_COMPLAINT_PAYLOAD_APPSERVER_ID_LEN 16
+
+struct wire_complaint_payload {
+    const uint8_t *complaint_token;   /* 64 bytes */
+    const uint8_t *blinded_token;   /* 160 bytes */
+    const uint8_t *appserver_id;   /* 16 bytes */
+    uint8_t record_type;
+    const uint8_t *record;
+    uint32_t record_len;
+};
+
+static inline size_t wire_complaint_payload_len(const struct wire_complaint_payload *m)
+{
+    return WIRE_COMPLAINT_PAYLOAD_PREFIX_LEN + (size_t)m->record_len;
+}
+
+static inline int wire_complaint_payload_encode(const struct wire_complaint_payload *m, uint8_t *buf, size_t cap)
+{
+    size_t len = wire_complaint_payload_len(m);
+    size_t off = 2;
+
+    if (len > cap || len > INT32_MAX) {
+        return WIRE_ERR_SPACE;
+    }
+    buf[0] = WIRE_VERSION;
+    buf[1] = WIRE_COMPLAINT_PAYLOAD;
+    memcpy(&buf[off], m->complaint_token, 64);
+    off += 64;
+    memcpy(&buf[off], m->blinded_token, 160);
+    off += 160;
+    memcpy(&buf[off], m->appserver_id, 16);
+    off += 16;
+    buf[off] = m->record_type;
+    off += 1;
+    wire_put_u32(&buf[off], m->record_len);
+    off += 4;
+    if (m->record_len > 0 && m->record != &buf[off]) {
+        memcpy(&buf[off], m->record, m->record_len);
+    }
+    off += m->record_len;
+    return (int)off;
+}
+
+static inline int wire_complaint_payload_decode(struct wire_complaint_payload *m, const uint8_t *buf, size_t len)
+{
+    size_t off = 2;
+    int rc = wire_check_header(buf, len, WIRE_COMPLAINT_PAYLOAD, WIRE_COMPLAINT_PAYLOAD_PREFIX_LEN);
+
+    if (rc != WIRE_OK) {
+        return rc;
+    }
+    m->complaint_token = &buf[off];
+    off += 64;
+    m->blinded_token = &buf[off];
+    off += 160;
+    m->appserver_id = &buf[off];
+    off += 16;
+    m->record_type = buf[off];
+    off += 1;
+    m->record_len = wire_get_u32(&buf[off]);
+    off += 4;
+    if (m->record_len > len - off) {
+        return WIRE_ERR_LEN;
+    }
+    m->record = &buf[off];
+    off += m->record_len;
+    return off == len ? WIRE_OK : WIRE_ERR_LEN;
+}
+
+#define WIRE_INCORRECT_COMPLAINT_RECORD 9
+#define WIRE_INCORRECT_COMPLAINT_RECORD_PREFIX_LEN 10
+
+struct wire_incorrect_complaint_record {
+    const uint8_t *signed_predelivery_payload;
+    uint32_t signed_predelivery_payload_len;
+    const uint8_t *signed_token_payload;
+    uint32_t signed_token_payload_len;
+};
+
+static inline size_t wire_incorrect_complaint_record_len(const struct wire_incorrect_complaint_record *m)
+{
+    return WIRE_INCORRECT_COMPLAINT_RECORD_PREFIX_LEN + (size_t)m->signed_predelivery_payload_len + (size_t)m->signed_token_payload_len;
+}
+
+static inline int wire_incorrect_complaint_record_encode(const struct wire_incorrect_complaint_record *m, uint8_t *buf, size_t cap)
+{
+    size_t len = wire_incorrect_complaint_record_len(m);
+    size_t off = 2;
+
+    if (len > cap || len > INT32_MAX) {
+        return WIRE_ERR_SPACE;
+    }
+    buf[0] = WIRE_VERSION;
+    buf[1] = WIRE_INCORRECT_COMPLAINT_RECORD;
+    wire_put_u32(&buf[off], m->signed_predelivery_payload_len);
+    off += 4;
+    wire_put_u32(&buf[off], m->signed_token_payload_len);
+    off += 4;
+    if (m->signed_predelivery_payload_len > 0 && m->signed_predelivery_payload != &buf[off]) {
+        memcpy(&buf[off], m->signed_predelivery_payload, m->signed_predelivery_payload_len);
+    }
+    off += m->signed_predelivery_payload_len;
+    if (m->signed_token_payload_len > 0 && m->signed_token_payload != &buf[off]) {
+        memcpy(&buf[off], m->signed_token_payload, m->signed_token_payload_len);
+    }
+    off += m->signed_token_payload_len;
+    return (int)off;
+}
+
+static inline int wire_incorrect_complaint_record_decode(struct wire_incorrect_complaint_record *m, const uint8_t *buf, size_t len)
+{
+    size_t off = 2;
+    int rc = wire_check_header(buf, len, WIRE_INCORRECT_COMPLAINT_RECORD, WIRE_INCORRECT_COMPLAINT_RECORD_PREFIX_LEN);
+
+    if (rc != WIRE_OK) {
+        return rc;
+    }
+    m->signed_predelivery_payload_len = wire_get_u32(&buf[off]);
+    off += 4;
+    m->signed_token_payload_len = wire_get_u32(&buf[off]);
+    off += 4;
+    if (m->signed_predelivery_payload_len > len - off) {
+        return WIRE_ERR_LEN;
+    }
+    m->signed_predelivery_payload = &buf[off];
+    off += m->signed_predelivery_payload_len;
+    if (m->signed_token_payload_len > len - off) {
+        return WIRE_ERR_LEN;
+    }
+    m->signed_token_payload = &buf[off];
+    off += m->signed_token_payload_len;
+    return off == len ? WIRE_OK : WIRE_ERR_LEN;
+}
+
+#define WIRE_MISSING_COMPLAINT_RECORD 10
+#define WIRE_MISSING_COMPLAINT_RECORD_PREFIX_LEN 10
+
+struct wire_missing_complaint_record {
+    const uint8_t *signed_predelivery_payload;
+    uint32_t signed_predelivery_payload_len;
+    const uint8_t *data;
+    uint32_t data_len;
+};
+
+static inline size_t wire_missing_complaint_record_len(const struct wire_missing_complaint_record *m)
+{
+    return WIRE_MISSING_COMPLAINT_RECORD_PREFIX_LEN + (size_t)m->signed_predelivery_payload_len + (size_t)m->data_len;
+}
+
+static inline int wire_missing_complaint_record_encode(const struct wire_missing_complaint_record *m, uint8_t *buf, size_t cap)
+{
+    size_t len = wire_missing_complaint_record_len(m);
+    size_t off = 2;
+
+    if (len > cap || len > INT32_MAX) {
+        return WIRE_ERR_SPACE;
+    }
+    buf[0] = WIRE_VERSION;
+    buf[1] = WIRE_MISSING_COMPLAINT_RECORD;
+    wire_put_u32(&buf[off], m->signed_predelivery_payload_len);
+    off += 4;
+    wire_put_u32(&buf[off], m->data_len);
+    off += 4;
+    if (m->signed_predelivery_payload_len > 0 && m->signed_predelivery_payload != &buf[off]) {
+        memcpy(&buf[off], m->signed_predelivery_payload, m->signed_predelivery_payload_len);
+    }
+    off += m->signed_predelivery_payload_len;
+    if (m->data_len > 0 && m->data != &buf[off]) {
+        memcpy(&buf[off], m->data, m->data_len);
+    }
+    off += m->data_len;
+    return (int)off;
+}
+
+static inline int wire_missing_complaint_record_decode(struct wire_missing_complaint_record *m, const uint8_t *buf, size_t len)
+{
+    size_t off = 2;
+    int rc = wire_check_header(buf, len, WIRE_MISSING_COMPLAINT_RECORD, WIRE_MISSING_COMPLAINT_RECORD_PREFIX_LEN);
+
+    if (rc != WIRE_OK) {
+        return rc;
+    }
+    m->signed_predelivery_payload_len = wire_get_u32(&buf[off]);
+    off += 4;
+    m->data_len = wire_get_u32(&buf[off]);
+    off += 4;
+    if (m->signed_predelivery_payload_len > len - off) {
+        return WIRE_ERR_LEN;
+    }
+    m->signed_predelivery_payload = &buf[off];
+    off += m->signed_predelivery_payload_len;
+    if (m->data_len > len - off) {
+        return WIRE_ERR_LEN;
+    }
+    m->data = &buf[off];
+    off += m->data_len;
+    return off == len ? WIRE_OK : WIRE_ERR_LEN;
+}
+
+#define WIRE_NEW_EPOCH_REQUEST 11
+#define WIRE_NEW_EPOCH_REQUEST_PREFIX_LEN 22
+#define WIRE_NEW_EPOCH_REQUEST_MULE_ID_LEN 16
+
+struct wire_new_epoch_request {
+    const uint8_t *mule_id;   /* 16 bytes */
+    const uint8_t *complaint_token_list;
+    uint32_t complaint_token_list_len;
+};
+
+static inline size_t wire_new_epoch_request_len(const struct wire_new_epoch_request *m)
+{
+    return WIRE_NEW_EPOCH_REQUEST_PREFIX_LEN + (size_t)m->complaint_token_list_len;
+}
+
+static inline int wire_new_epoch_request_encode(const struct wire_new_epoch_request *m, uint8_t *buf, size_t cap)
+{
+    size_t len = wire_new_epoch_request_len(m);
+    size_t off = 2;
+
+    if (len > cap || len > INT32_MAX) {
+        return WIRE_ERR_SPACE;
+    }
+    buf[0] = WIRE_VERSION;
+    buf[1] = WIRE_NEW_EPOCH_REQUEST;
+    memcpy(&buf[off], m->mule_id, 16);
+    off += 16;
+    wire_put_u32(&buf[off], m->complaint_token_list_len);
+    off += 4;
+    if (m->complaint_token_list_len > 0 && m->complaint_token_list != &buf[off]) {
+        memcpy(&buf[off], m->complaint_token_list, m->complaint_token_list_len);
+    }
+    off += m->complaint_token_list_len;
+    return (int)off;
+}
+
+static inline int wire_new_epoch_request_decode(struct wire_new_epoch_request *m, const uint8_t *buf, size_t len)
+{
+    size_t off = 2;
+    int rc = wire_check_header(buf, len, WIRE_NEW_EPOCH_REQUEST, WIRE_NEW_EPOCH_REQUEST_PREFIX_LEN);
+
+    if (rc != WIRE_OK) {
+        return rc;
+    }
+    m->mule_id = &buf[off];
+    off += 16;
+    m->complaint_token_list_len = wire_get_u32(&buf[off]);
+    off += 4;
+    if (m->complaint_token_list_len > len - off) {
+        return WIRE_ERR_LEN;
+    }
+    m->complaint_token_list = &buf[off];
+    off += m->complaint_token_list_len;
+    return off == len ? WIRE_OK : WIRE_ERR_LEN;
+}
+
+#define WIRE_NEW_EPOCH_RESPONSE 12
+#define WIRE_NEW_EPOCH_RESPONSE_PREFIX_LEN 10
+
+struct wire_new_epoch_response {
+    const uint8_t *complaint_token_list;
+    uint32_t complaint_token_list_len;
+    const uint8_t *duplicate_token_list;
+    uint32_t duplicate_token_list_len;
+};
+
+static inline size_t wire_new_epoch_response_len(const struct wire_new_epoch_response *m)
+{
+    return WIRE_NEW_EPOCH_RESPONSE_PREFIX_LEN + (size_t)m->complaint_token_list_len + (size_t)m->duplicate_token_list_len;
+}
+
+static inline int wire_new_epoch_response_encode(const struct wire_new_epoch_response *m, uint8_t *buf, size_t cap)
+{
+    size_t len = wire_new_epoch_response_len(m);
+    size_t off = 2;
+
+    if (len > cap || len > INT32_MAX) {
+        return WIRE_ERR_SPACE;
+    }
+    buf[0] = WIRE_VERSION;
+    buf[1] = WIRE_NEW_EPOCH_RESPONSE;
+    wire_put_u32(&buf[off], m->complaint_token_list_len);
+    off += 4;
+    wire_put_u32(&buf[off], m->duplicate_token_list_len);
+    off += 4;
+    if (m->complaint_token_list_len > 0 && m->complaint_token_list != &buf[off]) {
+        memcpy(&buf[off], m->complaint_token_list, m->complaint_token_list_len);
+    }
+    off += m->complaint_token_list_len;
+    if (m->duplicate_token_list_len > 0 && m->duplicate_token_list != &buf[off]) {
+        memcpy(&buf[off], m->duplicate_token_list, m->duplicate_token_list_len);
+    }
+    off += m->duplicate_token_list_len;
+    return (int)off;
+}
+
+static inline int wire_new_epoch_response_decode(struct wire_new_epoch_response *m, const uint8_t *buf, size_t len)
+{
+    size_t off = 2;
+    int rc = wire_check_header(buf, len, WIRE_NEW_EPOCH_RESPONSE, WIRE_NEW_EPOCH_RESPONSE_PREFIX_LEN);
+
+    if (rc != WIRE_OK) {
+        return rc;
+    }
+    m->complaint_token_list_len = wire_get_u32(&buf[off]);
+    off += 4;
+    m->duplicate_token_list_len = wire_get_u32(&buf[off]);
+    off += 4;
+    if (m->complaint_token_list_len > len - off) {
+        return WIRE_ERR_LEN;
+    }
+    m->complaint_token_list = &buf[off];
+    off += m->complaint_token_list_len;
+    if (m->duplicate_token_list_len > len - off) {
+        return WIRE_ERR_LEN;
+    }
+    m->duplicate_token_list = &buf[off];
+    off += m->duplicate_token_list_len;
+    return off == len ? WIRE_OK : WIRE_ERR_LEN;
+}
+
+#define WIRE_TOKEN_LIST 13
+#define WIRE_TOKEN_LIST_PREFIX_LEN 10
+
+struct wire_token_list {
+    uint32_t token_len;
+    const uint8_t *tokens;
+    uint32_t tokens_len;
+};
+
+static inline size_t wire_token_list_len(const struct wire_token_list *m)
+{
+    return WIRE_TOKEN_LIST_PREFIX_LEN + (size_t)m->tokens_len;
+}
+
+static inline int wire_token_list_encode(const struct wire_token_list *m, uint8_t *buf, size_t cap)
+{
+    size_t len = wire_token_list_len(m);
+    size_t off = 2;
+
+    if (len > cap || len > INT32_MAX) {
+        return WIRE_ERR_SPACE;
+    }
+    buf[0] = WIRE_VERSION;
+    buf[1] = WIRE_TOKEN_LIST;
+    wire_put_u32(&buf[off], m->token_len);
+    off += 4;
+    wire_put_u32(&buf[off], m->tokens_len);
+    off += 4;
+    if (m->tokens_len > 0 && m->tokens != &buf[off]) {
+        memcpy(&buf[off], m->tokens, m->tokens_len);
+    }
+    off += m->tokens_len;
+    return (int)off;
+}
+
+static inline int wire_token_list_decode(struct wire_token_list *m, const uint8_t *buf, size_t len)
+{
+    size_t off = 2;
+    int rc = wire_check_header(buf, len, WIRE_TOKEN_LIST, WIRE_TOKEN_LIST_PREFIX_LEN);
+
+    if (rc != WIRE_OK) {
+        return rc;
+    }
+    m->token_len = wire_get_u32(&buf[off]);
+    off += 4;
+    m->tokens_len = wire_get_u32(&buf[off]);
+    off += 4;
+    if (m->tokens_len > len - off) {
+        return WIRE_ERR_LEN;
+    }
+    m->tokens = &buf[off];
+    off += m->tokens_len;
+    return off == len ? WIRE_OK : WIRE_ERR_LEN;
+}
+
+#define WIRE_PAYLOAD_LIST 14
+#define WIRE_PAYLOAD_LIST_PREFIX_LEN 10
+
+struct wire_payload_list {
+    uint32_t count;
+    const uint8_t *items;
+    uint32_t items_len;
+};
+
+static inline size_t wire_payload_list_len(const struct wire_payload_list *m)
+{
+    return WIRE_PAYLOAD_LIST_PREFIX_LEN + (size_t)m->items_len;
+}
+
+static inline int wire_payload_list_encode(const struct wire_payload_list *m, uint8_t *buf, size_t cap)
+{
+    size_t len = wire_payload_list_len(m);
+    size_t off = 2;
+
+    if (len > cap || len > INT32_MAX) {
+        return WIRE_ERR_SPACE;
+    }
+    buf[0] = WIRE_VERSION;
+    buf[1] = WIRE_PAYLOAD_LIST;
+    wire_put_u32(&buf[off], m->count);
+    off += 4;
+    wire_put_u32(&buf[off], m->items_len);
+    off += 4;
+    if (m->items_len > 0 && m->items != &buf[off]) {
+        memcpy(&buf[off], m->items, m->items_len);
+    }
+    off += m->items_len;
+    return (int)off;
+}
+
+static inline int wire_payload_list_decode(struct wire_payload_list *m, const uint8_t *buf, size_t len)
+{
+    size_t off = 2;
+    int rc = wire_check_header(buf, len, WIRE_PAYLOAD_LIST, WIRE_PAYLOAD_LIST_PREFIX_LEN);
+
+    if (rc != WIRE_OK) {
+        return rc;
+    }
+    m->count = wire_get_u32(&buf[off]);
+    off += 4;
+    m->items_len = wire_get_u32(&buf[off]);
+    off += 4;
+    if (m->items_len > len - off) {
+        return WIRE_ERR_LEN;
+    }
+    m->items = &buf[off];
+    off += m->items_len;
+    return off == len ? WIRE_OK : WIRE_ERR_LEN;
+}
+
+#define WIRE_ENCRYPTED_TOKEN 15
+#define WIRE_ENCRYPTED_TOKEN_PREFIX_LEN 34
+#define WIRE_ENCRYPTED_TOKEN_NONCE_LEN 12
+#define WIRE_ENCRYPTED_TOKEN_TAG_LEN 16
+
+struct wire_encrypted_token {
+    const uint8_t *nonce;   /* 12 bytes */
+    const uint8_t *ciphertext;
+    uint32_t ciphertext_len;
+    const uint8_t *tag;   /* 16 bytes */
+};
+
+static inline size_t wire_encrypted_token_len(const struct wire_encrypted_token *m)
+{
+    return WIRE_ENCRYPTED_TOKEN_PREFIX_LEN + (size_t)m->ciphertext_len;
+}
+
+static inline int wire_encrypted_token_encode(const struct wire_encrypted_token *m, uint8_t *buf, size_t cap)
+{
+    size_t len = wire_encrypted_token_len(m);
+    size_t off = 2;
+
+    if (len > cap || len > INT32_MAX) {
+        return WIRE_ERR_SPACE;
+    }
+    buf[0] = WIRE_VERSION;
+    buf[1] = WIRE_ENCRYPTED_TOKEN;
+    memcpy(&buf[off], m->nonce, 12);
+    off += 12;
+    memcpy(&buf[off], m->tag, 16);
+    off += 16;
+    wire_put_u32(&buf[off], m->ciphertext_len);
+    off += 4;
+    if (m->ciphertext_len > 0 && m->ciphertext != &buf[off]) {
+        memcpy(&buf[off], m->ciphertext, m->ciphertext_len);
+    }
+    off += m->ciphertext_len;
+    return (int)off;
+}
+
+static inline int wire_encrypted_token_decode(struct wire_encrypted_token *m, const uint8_t *buf, size_t len)
+{
+    size_t off = 2;
+    int rc = wire_check_header(buf, len, WIRE_ENCRYPTED_TOKEN, WIRE_ENCRYPTED_TOKEN_PREFIX_LEN);
+
+    if (rc != WIRE_OK) {
+        return rc;
+    }
+    m->nonce = &buf[off];
+    off += 12;
+    m->tag = &buf[off];
+    off += 16;
+    m->ciphertext_len = wire_get_u32(&buf[off]);
+    off += 4;
+    if (m->ciphertext_len > len - off) {
+        return WIRE_ERR_LEN;
+    }
+    m->ciphertext = &buf[off];
+    off += m->ciphertext_len;
+    return off == len ? WIRE_OK : WIRE_ERR_LEN;
+}
+
+#define WIRE_SENSOR_DELIVERY 16
+#define WIRE_SENSOR_DELIVERY_PREFIX_LEN 10
+
+struct wire_sensor_delivery {
+    const uint8_t *signed_hash_payload;
+    uint32_t signed_hash_payload_len;
+    const uint8_t *data;
+    uint32_t data_len;
+};
+
+static inline size_t wire_sensor_delivery_len(const struct wire_sensor_delivery *m)
+{
+    return WIRE_SENSOR_DELIVERY_PREFIX_LEN + (size_t)m->signed_hash_payload_len + (size_t)m->data_len;
+}
+
+static inline int wire_sensor_delivery_encode(const struct wire_sensor_delivery *m, uint8_t *buf, size_t cap)
+{
+    size_t len = wire_sensor_delivery_len(m);
+    size_t off = 2;
+
+    if (len > cap || len > INT32_MAX) {
+        return WIRE_ERR_SPACE;
+    }
+    buf[0] = WIRE_VERSION;
+    buf[1] = WIRE_SENSOR_DELIVERY;
+    wire_put_u32(&buf[off], m->signed_hash_payload_len);
+    off += 4;
+    wire_put_u32(&buf[off], m->data_len);
+    off += 4;
+    if (m->signed_hash_payload_len > 0 && m->signed_hash_payload != &buf[off]) {
+        memcpy(&buf[off], m->signed_hash_payload, m->signed_hash_payload_len);
+    }
+    off += m->signed_hash_payload_len;
+    if (m->data_len > 0 && m->data != &buf[off]) {
+        memcpy(&buf[off], m->data, m->data_len);
+    }
+    off += m->data_len;
+    return (int)off;
+}
+
+static inline int wire_sensor_delivery_decode(struct wire_sensor_delivery *m, const uint8_t *buf, size_t len)
+{
+    size_t off = 2;
+    int rc = wire_check_header(buf, len, WIRE_SENSOR_DELIVERY, WIRE_SENSOR_DELIVERY_PREFIX_LEN);
+
+    if (rc != WIRE_OK) {
+        return rc;
+    }
+    m->signed_hash_payload_len = wire_get_u32(&buf[off]);
+    off += 4;
+    m->data_len = wire_get_u32(&buf[off]);
+    off += 4;
+    if (m->signed_hash_payload_len > len - off) {
+        return WIRE_ERR_LEN;
+    }
+    m->signed_hash_payload = &buf[off];
+    off += m->signed_hash_payload_len;
+    if (m->data_len > len - off) {
+        return WIRE_ERR_LEN;
+    }
+    m->data = &buf[off];
+    off += m->data_len;
+    return off == len ? WIRE_OK : WIRE_ERR_LEN;
+}
+
+#endif
@@ -0,0 +1,185 @@
+#include <string.h>
+#include "xfer.h"
+
+// Receiver acks every half window so the sender never stalls on a full window
+static uint8_t ack_interval(uint8_t window)
+{
+    return window > 1 ? window / 2 : 1;
+}
+
+uint16_t xfer_chunk_size(uint16_t att_mtu, uint16_t ll_max_tx_octets)
+{
+    uint16_t att_payload = att_mtu > XFER_ATT_NOTIFY_HDR_LEN ?
+                           att_mtu - XFER_ATT_NOTIFY_HDR_LEN : 0;
+    uint16_t pdu_payload = ll_max_tx_octets > XFER_L2CAP_HDR_LEN + XFER_ATT_NOTIFY_HDR_LEN ?
+                           ll_max_tx_octets - XFER_L2CAP_HDR_LEN - XFER_ATT_NOTIFY_HDR_LEN : 0;
+    uint16_t chunk_size = att_payload < pdu_payload ? att_payload : pdu_payload;
+
+    if (chunk_size < XFER_MIN_CHUNK_SIZE) {
+        return XFER_MIN_CHUNK_SIZE;
+    }
+    if (chunk_size > XFER_MAX_CHUNK_SIZE) {
+        return XFER_MAX_CHUNK_SIZE;
+    }
+    return chunk_size;
+}
+
+uint16_t xfer_meta_chunk_size(const uint8_t *meta)
+{
+    return (uint16_t)(meta[XFER_META_CHUNK_SIZE] | (meta[XFER_META_CHUNK_SIZE + 1] << 8));
+}
+
+void xfer_meta_set_chunk_size(uint8_t *meta, uint16_t chunk_size)
+{
+    meta[XFER_META_CHUNK_SIZE] = (uint8_t)(chunk_size & 0xff);
+    meta[XFER_META_CHUNK_SIZE + 1] = (uint8_t)(chunk_size >> 8);
+}
+
+int xfer_tx_init(struct xfer_tx *tx, const uint8_t *buf, size_t len,
+                 uint16_t chunk_size, uint8_t window)
+{
+    if (chunk_size == 0) {
+        return -1;
+    }
+
+    size_t num_chunks = (len + chunk_size - 1) / chunk_size;
+    if (num_chunks > XFER_MAX_CHUNKS) {
+        return -1;
+    }
+
+    memset(tx, 0, sizeof(*tx));
+    tx->buf = buf;
+    tx->len = len;
+    tx->chunk_size = chunk_size;
+    tx->num_chunks = (uint8_t)num_chunks;
+    tx->window = window == 0 ? 1 : (window > XFER_MAX_WINDOW ? XFER_MAX_WINDOW : window);
+    return 0;
+}
+
+void xfer_tx_meta(const struct xfer_tx *tx, uint8_t *meta)
+{
+    meta[XFER_META_NUM_CHUNKS] = tx->num_chunks;
+    meta[XFER_META_ACKED] = 0;
+    meta[XFER_META_STATE] = XFER_STATE_SENDING;
+    meta[XFER_META_WINDOW] = tx->window;
+    xfer_meta_set_chunk_size(meta, tx->chunk_size);
+}
+
+uint16_t xfer_tx_peek(const struct xfer_tx *tx, const uint8_t **chunk)
+{
+    if (!tx->negotiated || tx->next >= tx->num_chunks ||
+            tx->next - tx->acked >= tx->window) {
+        return 0;
+    }
+
+    size_t offset = (size_t)tx->next * tx->chunk_size;
+    size_t remaining = tx->len - offset;
+    *chunk = &tx->buf[offset];
+    return (uint16_t)(remaining < tx->chunk_size ? remaining : tx->chunk_size);
+}
+
+void xfer_tx_advance(struct xfer_tx *tx)
+{
+    if (tx->next < tx->num_chunks) {
+        tx->next += 1;
+    }
+}
+
+void xfer_tx_on_meta(struct xfer_tx *tx, const uint8_t *meta, size_t len)
+{
+    if (len < XFER_META_LEN || meta[XFER_META_NUM_CHUNKS] != tx->num_chunks ||
+            xfer_meta_chunk_size(meta) != tx->chunk_size) {
+        return;
+    }
+
+    uint8_t window = meta[XFER_META_WINDOW];
+    if (window != 0) {
+        if (window < tx->window) {
+            tx->window = window;
+        }
+        tx->negotiated = true;
+    }
+
+    // acks only ever move forward and never past what was sent
+    uint8_t acked = meta[XFER_META_ACKED];
+    if (acked > tx->acked && acked <= tx->next) {
+        tx->acked = acked;
+    }
+}
+
+bool xfer_tx_done(const struct xfer_tx *tx)
+{
+    return tx->acked == tx->num_chunks;
+}
+
+int xfer_rx_start(struct xfer_rx *rx, uint8_t *buf, size_t cap,
+                  const uint8_t *meta, uint16_t max_chunk_size, uint8_t max_window)
+{
+    uint8_t num_chunks = meta[XFER_META_NUM_CHUNKS];
+    uint8_t window = meta[XFER_META_WINDOW];
+    uint16_t chunk_size = xfer_meta_chunk_size(meta);
+
+    // the last chunk may be short, so only the full ones must fit
+    if (chunk_size == 0 || chunk_size > max_chunk_size || num_chunks == 0 ||
+            (size_t)(num_chunks - 1) * chunk_size >= cap) {
+        return -1;
+    }
+
+    if (window == 0) {
+        window = 1;
+    }
+    if (window > max_window) {
+        window = max_window;
+    }
+
+    memset(rx, 0, sizeof(*rx));
+    rx->buf = buf;
+    rx->cap = cap;
+    rx->chunk_size = chunk_size;
+    rx->num_chunks = num_chunks;
+    rx->window = window;
+    return 0;
+}
+
+uint8_t *xfer_rx_slot(struct xfer_rx *rx, uint16_t len)
+{
+    if (rx->received >= rx->num_chunks || len > rx->chunk_size ||
+            rx->len + len > rx->cap) {
+        return NULL;
+    }
+    return &rx->buf[rx->len];
+}
+
+int xfer_rx_commit(struct xfer_rx *rx, uint16_t len)
+{
+    rx->len += len;
+    rx->received += 1;
+
+    return rx->received == rx->num_chunks ||
+           rx->received - rx->acked >= ack_interval(rx->window);
+}
+
+int xfer_rx_on_chunk(struct xfer_rx *rx, const uint8_t *data, uint16_t len)
+{
+    uint8_t *slot = xfer_rx_slot(rx, len);
+    if (slot == NULL) {
+        return -1;
+    }
+    memcpy(slot, data, len);
+    return xfer_rx_commit(rx, len);
+}
+
+void xfer_rx_meta(struct xfer_rx *rx, uint8_t *meta)
+{
+    meta[XFER_META_NUM_CHUNKS] = rx->num_chunks;
+    meta[XFER_META_ACKED] = rx->received;
+    meta[XFER_META_STATE] = XFER_STATE_ACK;
+    meta[XFER_META_WINDOW] = rx->window;
+    xfer_meta_set_chunk_size(meta, rx->chunk_size);
+    rx->acked = rx->received;
+}
+
+bool xfer_rx_done(const struct xfer_rx *rx)
+{
+    return rx->num_chunks != 0 && rx->received == rx->num_chunks;
+}
@@ -0,0 +1,124 @@
+/*
+ * Sliding-window chunk transfer shared by the sensor and the mule
+ *
+ * A payload is split into chunk_size pieces that are pushed as GATT
+ * notifications on the data characteristic. Notifications on one link are
+ * delivered reliably and in order by the link layer, so the receiver only
+ * counts chunks and acknowledges cumulatively through the metadata
+ * characteristic. The sender keeps up to `window` unacknowledged chunks in
+ * flight instead of waiting for an ack after every chunk.
+ *
+ * The sender picks the chunk size from the negotiated ATT MTU and LL data
+ * length (xfer_chunk_size) so every notification fills exactly one LL data
+ * PDU, and carries it in the metadata so the receiver can place chunks.
+ */
+
+#ifndef XFER_H
+#define XFER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Metadata characteristic layout
+#define XFER_META_NUM_CHUNKS 0  // number of chunks in the payload
+#define XFER_META_ACKED      1  // chunks received so far (cumulative ack)
+#define XFER_META_STATE      2  // one of XFER_STATE_*
+#define XFER_META_WINDOW     3  // proposed (sender) / agreed (receiver) window
+#define XFER_META_CHUNK_SIZE 4  // chunk size in bytes, 2 bytes little endian
+#define XFER_META_LEN        6
+
+#define XFER_STATE_IDLE    0x00
+#define XFER_STATE_SENDING 0x01  // sender's proposal
+#define XFER_STATE_DONE    0x02
+#define XFER_STATE_ACK     0x03  // receiver's window answer and acks, so a
+                                 // link can carry transfers both ways
+
+#define XFER_MAX_CHUNKS 255
+#define XFER_MAX_WINDOW 16
+
+// Sizes used to fit one notification in one LL data PDU
+#define XFER_ATT_MTU_DEFAULT    23
+#define XFER_LL_OCTETS_DEFAULT  27
+#define XFER_LL_OCTETS_MAX      251
+#define XFER_L2CAP_HDR_LEN      4
+#define XFER_ATT_NOTIFY_HDR_LEN 3
+#define XFER_MIN_CHUNK_SIZE (XFER_ATT_MTU_DEFAULT - XFER_ATT_NOTIFY_HDR_LEN)
+#define XFER_MAX_CHUNK_SIZE (XFER_LL_OCTETS_MAX - XFER_L2CAP_HDR_LEN - XFER_ATT_NOTIFY_HDR_LEN)
+
+struct xfer_tx {
+    const uint8_t *buf;
+    size_t len;
+    uint16_t chunk_size;
+    uint8_t num_chunks;
+    uint8_t window;     // proposed until negotiated, then agreed
+    uint8_t next;       // index of the next chunk to send
+    uint8_t acked;      // chunks acknowledged by the receiver
+    bool negotiated;    // receiver has answered with its window
+};
+
+struct xfer_rx {
+    uint8_t *buf;
+    size_t cap;
+    size_t len;         // bytes received so far
+    uint16_t chunk_size;
+    uint8_t num_chunks;
+    uint8_t window;
+    uint8_t received;   // chunks received so far
+    uint8_t acked;      // value of `received` in the last ack sent
+};
+
+// Largest chunk that fits both one ATT notification and one LL data PDU
+uint16_t xfer_chunk_size(uint16_t att_mtu, uint16_t ll_max_tx_octets);
+
+uint16_t xfer_meta_chunk_size(const uint8_t *meta);
+void xfer_meta_set_chunk_size(uint8_t *meta, uint16_t chunk_size);
+
+/*
+ * Sender
+ */
+
+// Returns 0, or -1 if the payload does not fit in XFER_MAX_CHUNKS chunks
+int xfer_tx_init(struct xfer_tx *tx, const uint8_t *buf, size_t len,
+                 uint16_t chunk_size, uint8_t window);
+
+// Fills meta with the transfer proposal to send before any chunk
+void xfer_tx_meta(const struct xfer_tx *tx, uint8_t *meta);
+
+// Length of the next chunk if the window allows sending it now, else 0
+uint16_t xfer_tx_peek(const struct xfer_tx *tx, const uint8_t **chunk);
+
+// Marks the chunk returned by xfer_tx_peek as handed to the radio
+void xfer_tx_advance(struct xfer_tx *tx);
+
+// Applies a metadata write from the receiver (window answer or ack)
+void xfer_tx_on_meta(struct xfer_tx *tx, const uint8_t *meta, size_t len);
+
+bool xfer_tx_done(const struct xfer_tx *tx);
+
+/*
+ * Receiver
+ */
+
+// Starts a transfer from the sender's proposal; the agreed window is the
+// smaller of the proposal and max_window. Returns 0, or -1 if the payload
+// cannot fit in cap bytes or its chunks are larger than max_chunk_size.
+int xfer_rx_start(struct xfer_rx *rx, uint8_t *buf, size_t cap,
+                  const uint8_t *meta, uint16_t max_chunk_size, uint8_t max_window);
+
+// Where the next chunk of len bytes goes, or NULL if it would overflow
+uint8_t *xfer_rx_slot(struct xfer_rx *rx, uint16_t len);
+
+// Accounts for a chunk copied into the slot. Returns 1 if an ack is due.
+int xfer_rx_commit(struct xfer_rx *rx, uint16_t len);
+
+// xfer_rx_slot + memcpy + xfer_rx_commit. Returns 1 if an ack is due, 0 if
+// not, -1 on overflow.
+int xfer_rx_on_chunk(struct xfer_rx *rx, const uint8_t *data, uint16_t len);
+
+// Fills meta with the current cumulative ack and records it as sent
+void xfer_rx_meta(struct xfer_rx *rx, uint8_t *meta);
+
+bool xfer_rx_done(const struct xfer_rx *rx);
+
+#endif // XFER_H
@@ -63,6 +63,9 @@ struct peer {
     /** Callback that gets executed when service discovery completes. */
     peer_disc_fn *disc_cb;
     void *disc_cb_arg;
+
+    /** Application state for this connection, owned by the application. */
+    void *app_ctx;
 };
 
 int peer_disc_all(uint16_t conn_handle, peer_disc_fn *disc_cb,
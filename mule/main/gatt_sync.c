@@ -0,0 +1,79 @@
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "host/ble_hs.h"
+#include "gatt_sync.h"
+
+int
+gatt_sync_init(struct gatt_sync *sync, unsigned notify_depth)
+{
+    memset(sync, 0, sizeof(*sync));
+
+    sync->notify = xQueueCreate(notify_depth, sizeof(struct gatt_sync_evt));
+    if (sync->notify == NULL) {
+        return BLE_HS_ENOMEM;
+    }
+    return 0;
+}
+
+static void
+gatt_sync_send(QueueHandle_t queue, struct gatt_sync_evt *evt)
+{
+    /* Never block the host task; if the application fell that far behind
+     * the transfer is lost anyway and times out on its side. */
+    if (xQueueSend(queue, evt, 0) != pdTRUE) {
+        MODLOG_DFLT(ERROR, "gatt_sync queue full; dropping attr_handle=%d\n",
+                    evt->attr_handle);
+        os_mbuf_free_chain(evt->om);
+    }
+}
+
+void
+gatt_sync_reset(struct gatt_sync *sync)
+{
+    struct gatt_sync_evt evt;
+
+    while (xQueueReceive(sync->notify, &evt, 0) == pdTRUE) {
+        os_mbuf_free_chain(evt.om);
+    }
+}
+
+void
+gatt_sync_post_notify(struct gatt_sync *sync, struct ble_gap_event *event)
+{
+    struct gatt_sync_evt evt = {
+        .conn_handle = event->notify_rx.conn_handle,
+        .attr_handle = event->notify_rx.attr_handle,
+        .om = event->notify_rx.om,
+    };
+
+    event->notify_rx.om = NULL;
+    gatt_sync_send(sync->notify, &evt);
+}
+
+void
+gatt_sync_post_status(struct gatt_sync *sync, uint16_t conn_handle, int status)
+{
+    struct gatt_sync_evt evt = {
+        .conn_handle = conn_handle,
+        .status = status,
+    };
+
+    gatt_sync_send(sync->notify, &evt);
+}
+
+void
+gatt_sync_post_disconnect(struct gatt_sync *sync, uint16_t conn_handle)
+{
+    gatt_sync_post_status(sync, conn_handle, BLE_HS_ENOTCONN);
+}
+
+int
+gatt_sync_next_notify(struct gatt_sync *sync, struct gatt_sync_evt *evt,
+                      TickType_t timeout)
+{
+    if (xQueueReceive(sync->notify, evt, timeout) != pdTRUE) {
+        return BLE_HS_ETIMEOUT;
+    }
+    return 0;
+}
@@ -0,0 +1,59 @@
+/*
+ * Blocking delivery of notifications and link events
+ *
+ * NimBLE calls back on its host task. The GAP handler only moves the event
+ * onto a FreeRTOS queue, and the application task blocks on that queue
+ * with a timeout instead of spinning on flags set across cores.
+ *
+ * Values travel as the os_mbuf NimBLE received them in, so nothing is
+ * copied on the host task; whoever takes an event off a queue owns its mbuf.
+ */
+
+#ifndef H_GATT_SYNC_
+#define H_GATT_SYNC_
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "host/ble_hs.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct gatt_sync_evt {
+    uint16_t conn_handle;
+    uint16_t attr_handle;
+    int status;             /* 0, or a NimBLE error (BLE_HS_ENOTCONN on disconnect) */
+    struct os_mbuf *om;     /* value, NULL if there is none */
+};
+
+struct gatt_sync {
+    QueueHandle_t notify;   /* notifications, statuses and disconnects */
+};
+
+int gatt_sync_init(struct gatt_sync *sync, unsigned notify_depth);
+
+/* Drops everything queued, once the connection it belonged to is gone */
+void gatt_sync_reset(struct gatt_sync *sync);
+
+/* From the GAP event handler; takes ownership of the notification mbuf */
+void gatt_sync_post_notify(struct gatt_sync *sync, struct ble_gap_event *event);
+
+/* Wakes the waiting task with an event that only carries a status */
+void gatt_sync_post_status(struct gatt_sync *sync, uint16_t conn_handle, int status);
+
+/* From the GAP event handler, wakes a task waiting on a dropped link */
+void gatt_sync_post_disconnect(struct gatt_sync *sync, uint16_t conn_handle);
+
+/*
+ * Waits for the next notification or disconnect. Returns 0 or
+ * BLE_HS_ETIMEOUT; the caller frees evt->om with os_mbuf_free_chain.
+ */
+int gatt_sync_next_notify(struct gatt_sync *sync, struct gatt_sync_evt *evt,
+                          TickType_t timeout);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
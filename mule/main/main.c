@@ -5,11 +5,14 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <inttypes.h>
-#include <math.h>
 #include "sdkconfig.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
 #include "esp_chip_info.h"
 #include "esp_flash.h"
 #include "nvs.h"
@@ -26,6 +29,11 @@
 #include "services/gap/ble_svc_gap.h"
 #include "blecent.h"
 #include "esp_central.h"
+#include "gatt_sync.h"
+#include "payload_log.h"
+#include "payload_log_esp.h"
+#include "xfer.h"
+#include "dtls_gatt.h"
 
 // mbedtls and/or crypto headers
 #include "mbedtls/ctr_drbg.h"
@@ -34,6 +42,7 @@
 #include "mbedtls/error.h"
 #include "mbedtls/esp_debug.h"
 #include "mbedtls/platform.h"
+#include "mbedtls/sha256.h"
 #include "mbedtls/ssl.h"
 #include "mbedtls/timing.h"
 #include "mbedtls/net_sockets.h"
@@ -68,87 +77,75 @@ static const ble_uuid_t *metadata_chr_uuid = BLE_UUID128_DECLARE(
     0xB5, 0x4D, 0x22, 0x2B, 0x12, 0x89, 0xE6, 0x32
 );
 
-#define CHUNK_SIZE 200
-#define MAX_PAYLOADS 10
 #define READ_TIMEOUT_MS 1000
-#define MAX_RETRY       5
+#define MULE_MAX_WINDOW XFER_MAX_WINDOW
+#define FRAME_HDR_LEN   4    // length in front of every sensor frame, little endian
+#define RECORD_BUF_LEN  1024 // the sensor's records are smaller, longer ones are read in pieces
+#define LL_MAX_TX_TIME  2120 // us to send XFER_LL_OCTETS_MAX on the 1M PHY
 #define SERVER_NAME "SENSOR_LAB11"
 
-uint8_t sensor_state [CHUNK_SIZE];
-uint8_t sensor_state_data [1500]; // for storing the data 
-uint8_t sensor_state_str [1500]; //for storing the certs 
-uint8_t metadata_state [3];
+#define MAX_SENSORS     MYNEWT_VAL(BLE_MAX_CONNECTIONS)
 
-uint8_t big_data [10000];
-uint8_t *payloads [MAX_PAYLOADS];
-int num_payloads;
+// Sensor tasks run on the core NimBLE is not pinned to
+#define MULE_APP_CORE   (1 - CONFIG_BT_NIMBLE_PINNED_TO_CORE)
+#define MULE_APP_STACK  12288 // the DTLS handshake runs on it
+#define MULE_APP_PRIO   5
+#define NOTIFY_DEPTH    (2 * MULE_MAX_WINDOW)
 
+uint8_t sensor_state [XFER_MAX_CHUNK_SIZE];
+uint8_t sensor_state_str [1500]; //for storing the certs
 
-static const char *tag = "MULE_LAB11"; // The Mule is an ESP32 device
-static int mule_ble_gap_event(struct ble_gap_event *event, void *arg);
-
-uint16_t ble_conn_handle;
-uint16_t metadata_attr_handle;
-uint16_t sensor_attr_handle;
-
-//Silly semaphore to signal when data has been written 
-bool sema_metadata;
-bool sema_data; 
+#define PAYLOAD_PARTITION "payloads"
+#define PAYLOAD_MIN_LEN 128  // shortest payload the index has a slot for
+#define PAYLOAD_BATCH   1024 // bytes collected before a flash write
 
-void ble_store_config_init();
+// Payloads collected but not uploaded yet, shared by the sensor tasks
+static struct plog payload_log;
+static struct plog_flash payload_flash;
+static struct plog_slot *payload_slots;   // sized from the partition
+static SemaphoreHandle_t payload_lock;
 
 /*
-* App call back for read of characteristic has completed
+* Everything the mule keeps per connected sensor, hung off its struct peer.
+* Each context has its own sensor_task, so transfers from several sensors
+* run at the same time. A context only changes hands through free_ctxs and
+* its gatt_sync queues.
 */
-static int ble_on_read(uint16_t conn_handle, const struct ble_gatt_error *error,
-                        struct ble_gatt_attr *attr, void *arg) {
-    
-    MODLOG_DFLT(INFO, "Read complete; status=%d conn_handle=%d", error->status,conn_handle);
-    if (error->status == 0) {
-        MODLOG_DFLT(INFO, " attr_handle=%d value=", attr->handle);
-        print_mbuf(attr->om);
-    }
-    MODLOG_DFLT(INFO, "\n");
-
-    // put data into buffer depending on which characteristic was read
-    if (attr->handle == metadata_attr_handle) {
-        printf("Metadata recieved!\n");
-        memcpy(metadata_state, attr->om->om_data, attr->om->om_len);
-        sema_metadata = 1;
-    } else if (attr->handle == sensor_attr_handle) {
-        printf("Data recieved!\n");
-        memcpy(sensor_state, attr->om->om_data, attr->om->om_len);
-        sema_data = 1;
-    }
+struct sensor_ctx {
+    uint16_t conn_handle;
+    uint16_t meta_handle;       // value handles, known once subscribed
+    uint16_t data_handle;
+    uint16_t ll_tx_octets;      // LL data length the controller agreed to
+    uint8_t sensor_state_data [1500]; // for storing the data
+    struct gatt_sync sync;      // GATT completions and notifications for this link
+
+    // DTLS session with the sensor, records go over the two characteristics
+    struct dtls_gatt transport;
+    struct dtls_gatt_timer timer;
+    mbedtls_ssl_context ssl;
+    mbedtls_ssl_config conf;
+    mbedtls_entropy_context entropy;
+    mbedtls_ctr_drbg_context ctr_drbg;
+    uint8_t chunk [XFER_MAX_CHUNK_SIZE]; // notification handed to the transport
+};
 
-    return 0; //TODO: should it sometimes return an error?
-}
+static struct sensor_ctx sensor_ctxs[MAX_SENSORS];
+static QueueHandle_t free_ctxs; // contexts not bound to a connection
 
-/*
-* App call back for write of characteristic has completed
-*/
-static int ble_on_write(uint16_t conn_handle, const struct ble_gatt_error *error,
-                        struct ble_gatt_attr *attr, void *arg) {
 
-    MODLOG_DFLT(INFO,"Write complete; status=%d conn_handle=%d attr_handle=%d\n",
-                error->status, conn_handle, attr->handle);
-    return 0;
-}
+static const char *tag = "MULE_LAB11"; // The Mule is an ESP32 device
+static int mule_ble_gap_event(struct ble_gap_event *event, void *arg);
+static void sensor_scan_if_free(void);
 
 /*
-* App call back for subscribe to data characteristic has completed
+* Largest chunk that fits one ATT PDU on this connection's negotiated MTU,
+* and one LL data PDU on its negotiated data length
 */
-static int ble_on_subscribe(uint16_t conn_handle, const struct ble_gatt_error *error,
-                            struct ble_gatt_attr *attr, void *arg) {
-
-    MODLOG_DFLT(INFO, "Subscribe data complete; status=%d conn_handle=%d attr_handle=%d\n",
-                error->status, conn_handle, attr->handle);
-
-    // write out MTU size to console 
-    MODLOG_DFLT(INFO, "MTU size: %d\n", ble_att_mtu(conn_handle));
-    return 0;
+static uint16_t mule_chunk_size(const struct sensor_ctx *ctx) {
+    return xfer_chunk_size(ble_att_mtu(ctx->conn_handle), ctx->ll_tx_octets);
 }
 
+void ble_store_config_init();
 
 /*
 * App call back for subscribe to metadata characteristic has completed
@@ -156,221 +153,341 @@ static int ble_on_subscribe(uint16_t conn_handle, const struct ble_gatt_error *e
 static int ble_on_subscribe_meta(uint16_t conn_handle, const struct ble_gatt_error *error,
                             struct ble_gatt_attr *attr, void *arg) {
 
+    struct sensor_ctx *ctx = arg;
+
     MODLOG_DFLT(INFO, "Subscribe meta complete; status=%d conn_handle=%d attr_handle=%d\n",
                 error->status, conn_handle, attr->handle);
+
+    if (error->status == 0) {
+        //both characteristics notify now, wake the sensor's task
+        gatt_sync_post_status(&ctx->sync, conn_handle, 0);
+    }
     return 0;
 }
 
-static void ble_read(const struct peer *peer, struct peer_chr *chr) {   
-    
-    //const struct peer_chr *chr;
+/*
+* App call back for subscribe to data characteristic has completed, the
+* metadata subscription goes next since ATT allows one request at a time
+*/
+static int ble_on_subscribe(uint16_t conn_handle, const struct ble_gatt_error *error,
+                            struct ble_gatt_attr *attr, void *arg) {
+
+    const struct peer_dsc *dsc_meta;
+    uint8_t value_meta[2];
     int rc;
 
-    /* Find the UUID. */
+    MODLOG_DFLT(INFO, "Subscribe data complete; status=%d conn_handle=%d attr_handle=%d\n",
+                error->status, conn_handle, attr->handle);
 
-    //print the one we are looking for 
-    //char chr_uuid_str[37];
-    //char svc_uuid_str[37];
-    //ble_uuid_to_str(sensor_svc_uuid, svc_uuid_str);
-    //printf("service UUID: %s\n", svc_uuid_str);
-    //ble_uuid_to_str(sensor_chr_uuid, chr_uuid_str);
-    //printf("characteristic UUID: %s\n", chr_uuid_str);
-    
-    //chr =  peer_chr_find_uuid(peer, sensor_svc_uuid, sensor_chr_uuid);
-    
-    if (chr == NULL) {
-        printf("Error: Peer doesn't support NEBULA\n");
-    }
+    // write out MTU size to console
+    MODLOG_DFLT(INFO, "MTU size: %d\n", ble_att_mtu(conn_handle));
 
-    /* Read the characteristic. */
-    rc = ble_gattc_read(peer->conn_handle, chr->chr.val_handle,
-                        ble_on_read, NULL);
-    if (rc != 0) {
-        printf("Error: Failed to read characteristic; rc=%d\n", rc);
+    if (error->status != 0) {
+        return 0;
     }
-}
 
-static void ble_write(const struct peer *peer, uint8_t *buf, const struct peer_chr *chr, size_t len) {
-
-    //const struct peer_chr *chr;
-    int rc;
+    /* Find the metadata UUID */
+    dsc_meta = peer_dsc_find_uuid(peer_find(conn_handle), sensor_svc_uuid, metadata_chr_uuid,
+                            BLE_UUID16_DECLARE(BLE_GATT_DSC_CLT_CFG_UUID16));
+    if (dsc_meta == NULL) {
+        printf("Error: Peer doesn't support NEBULA metadata\n");
+        return 0;
+    }
 
-    printf('in ble_write\n');
-    
-    /* Find the UUID. */
-    // chr = peer_chr_find_uuid(peer, sensor_svc_uuid, chr);
-    // if (chr == NULL) {
-    //     printf("Error: Peer doesn't support NEBULA\n");
-    // }
-
-    //TODO: still need to output this error where chr is found 
-    //printf("buf[0]%d\n", buf[0]);
-
-    /* Write the characteristic. */
-    rc = ble_gattc_write_flat(peer->conn_handle, chr->chr.val_handle,
-                              buf, len, ble_on_write, NULL);
+    printf("subscribing to metadata\n");
+    value_meta[0] = 1;
+    value_meta[1] = 0;
+    rc = ble_gattc_write_flat(conn_handle, dsc_meta->dsc.handle,
+                              value_meta, sizeof(value_meta), ble_on_subscribe_meta, arg);
     if (rc != 0) {
-        printf("Error: Failed to write characteristic; rc=%d\n", rc);
+        MODLOG_DFLT(ERROR, "Error: Failed to subscribe to meta characteristic; "
+                           "rc=%d\n", rc);
     }
+    return 0;
 }
 
 static void ble_subscribe(const struct peer *peer) {
 
-    //const struct peer_chr *chr;
+    struct sensor_ctx *ctx = peer->app_ctx;
+    const struct peer_chr *chr_metadata;
+    const struct peer_chr *chr_data;
     const struct peer_dsc *dsc;
-    const struct peer_dsc *dsc_meta;
     uint8_t value[2];
-    uint8_t value_meta[2];
     int rc;
 
-    /* Find the UUID. */
+    /* Find the UUIDs, the sensor task only works with the value handles */
+    chr_metadata = peer_chr_find_uuid(peer, sensor_svc_uuid, metadata_chr_uuid);
+    chr_data = peer_chr_find_uuid(peer, sensor_svc_uuid, sensor_chr_uuid);
     dsc = peer_dsc_find_uuid(peer, sensor_svc_uuid, sensor_chr_uuid,
                             BLE_UUID16_DECLARE(BLE_GATT_DSC_CLT_CFG_UUID16));
-    if (dsc == NULL) {
+    if (chr_metadata == NULL || chr_data == NULL || dsc == NULL) {
         printf("Error: Peer doesn't support NEBULA\n");
+        ble_gap_terminate(peer->conn_handle, BLE_ERR_REM_USER_CONN_TERM);
+        return;
     }
+    ctx->meta_handle = chr_metadata->chr.val_handle;
+    ctx->data_handle = chr_data->chr.val_handle;
 
-    /* Find the metadata UUID */
-    dsc_meta = peer_dsc_find_uuid(peer, sensor_svc_uuid, metadata_chr_uuid,
-                            BLE_UUID16_DECLARE(BLE_GATT_DSC_CLT_CFG_UUID16));
-
-    if (dsc_meta == NULL) {
-        printf("Error: Peer doesn't support NEBULA metadata\n");
-    }
-
-    sensor_attr_handle = dsc->dsc.handle;
-    metadata_attr_handle = dsc_meta->dsc.handle;
-
-    /* Subscribe to the characteristics. */
+    /* Subscribe to the data characteristic, ble_on_subscribe does metadata */
     value[0] = 1;
     value[1] = 0;
     rc = ble_gattc_write_flat(peer->conn_handle, dsc->dsc.handle,
-                              value, sizeof(value), ble_on_subscribe, NULL);
+                              value, sizeof(value), ble_on_subscribe, ctx);
     if (rc != 0) {
         MODLOG_DFLT(ERROR, "Error: Failed to subscribe to characteristic; "
                            "rc=%d\n", rc);
     }
+}
 
-    printf("subscribing to metadata\n");
-    //delay 1 second
-    vTaskDelay(1000 / portTICK_PERIOD_MS);
+/*
+* Transport send op: write without response, so chunks and acks don't wait
+* on an ATT round trip
+*/
+static int mule_link_send(void *link, int chr, const uint8_t *buf, uint16_t len)
+{
+    struct sensor_ctx *ctx = link;
+    uint16_t val_handle = chr == DTLS_GATT_CHR_META ? ctx->meta_handle : ctx->data_handle;
+    int rc;
 
-    value_meta[0] = 1;
-    value_meta[1] = 0;
-    rc = ble_gattc_write_flat(peer->conn_handle, dsc_meta->dsc.handle,
-                              value_meta, sizeof(value_meta), ble_on_subscribe_meta, NULL);
+    rc = ble_gattc_write_no_rsp_flat(ctx->conn_handle, val_handle, buf, len);
+    if (rc == 0) {
+        return 0;
+    }
+    if (rc == BLE_HS_ENOMEM || rc == BLE_HS_EBUSY) {
+        //out of mbufs, the transport retries once notifications drained some
+        return DTLS_GATT_BUSY;
+    }
+    if (rc == BLE_HS_ENOTCONN) {
+        return MBEDTLS_ERR_NET_CONN_RESET;
+    }
+    printf("Error: Failed to write characteristic without response; rc=%d\n", rc);
+    return MBEDTLS_ERR_NET_SEND_FAILED;
+}
 
-    if (rc != 0) {
-        MODLOG_DFLT(ERROR, "Error: Failed to subscribe to meta characteristic; "
-                           "rc=%d\n", rc);
+static uint16_t mule_link_chunk_size(void *link)
+{
+    struct sensor_ctx *ctx = link;
+    return mule_chunk_size(ctx);
+}
+
+/*
+* Transport wait op: blocks on the context's gatt_sync for the next
+* notification and hands it to the transport
+*/
+static int mule_link_wait(void *link, uint32_t timeout_ms)
+{
+    struct sensor_ctx *ctx = link;
+    struct gatt_sync_evt evt;
+    TickType_t timeout = timeout_ms == UINT32_MAX ? portMAX_DELAY : pdMS_TO_TICKS(timeout_ms);
+
+    if (gatt_sync_next_notify(&ctx->sync, &evt, timeout) != 0) {
+        return 0;
+    }
+    if (evt.status != 0) {
+        return MBEDTLS_ERR_NET_CONN_RESET;
+    }
+    if (evt.om == NULL) {
+        return 0;
     }
 
-    return;
+    uint16_t len = OS_MBUF_PKTLEN(evt.om);
+    if (len > sizeof(ctx->chunk)) {
+        len = sizeof(ctx->chunk);
+    }
+    os_mbuf_copydata(evt.om, 0, len, ctx->chunk);
+    os_mbuf_free_chain(evt.om);
 
+    if (evt.attr_handle == ctx->meta_handle) {
+        dtls_gatt_on_meta(&ctx->transport, ctx->chunk, len);
+    }
+    else if (evt.attr_handle == ctx->data_handle) {
+        dtls_gatt_on_chunk(&ctx->transport, ctx->chunk, len);
+    }
+    return 0;
 }
 
-int ble_write_long(void *p_ble_conn_handle, const unsigned char *buf, size_t len)
+static uint32_t mule_link_now_ms(void *link)
 {
-    // //wait for connection to be established
-    // while (ble_gap_conn_active() == 0) {
-    //     //wait  
-    //     printf("waiting for BLE connection\n");
-    //     vTaskDelay(1000 / portTICK_PERIOD_MS);
-    // }
-
-    //get peer from connection handle and peer chrs from uuids
-    const struct peer *peer = peer_find(ble_conn_handle);
-    const struct peer_chr *chr_metadata = peer_chr_find_uuid(peer, sensor_svc_uuid, metadata_chr_uuid);
-    const struct peer_chr *chr_data = peer_chr_find_uuid(peer, sensor_svc_uuid, sensor_chr_uuid);
-
-    //call ble_write to set metadata
-    metadata_state[0] = ceil(len/(float)CHUNK_SIZE);
-    metadata_state[1] = 0x00;
-    ble_write(peer, metadata_state, chr_metadata, 2);
-
-    //Send data packets in chunks
-    int counter = 0; 
-    int num_sent_packets = 0; 
-    while (len >= CHUNK_SIZE) {
-        int temp = counter + CHUNK_SIZE;
-        ble_write(peer, &buf[counter], chr_data, CHUNK_SIZE);
-        len = len - CHUNK_SIZE;
-        counter = counter + CHUNK_SIZE;
-        num_sent_packets += 1;
-
-        //wait for ack to send next packet 
-        //ble_read(peer, chr_metadata);
-        while (metadata_state[1] != num_sent_packets) {
-            printf("waiting for ack\n");
-            printf("metadata state: %d\n", metadata_state[1]);
-            // delay 1 second
-            vTaskDelay(1000 / portTICK_PERIOD_MS);
-        }
+    return (uint32_t)(xTaskGetTickCount() * portTICK_PERIOD_MS);
+}
 
-        printf("metadata state: %d\n", metadata_state[1]);
+static const struct dtls_gatt_ops mule_link_ops = {
+    .send = mule_link_send,
+    .chunk_size = mule_link_chunk_size,
+    .wait = mule_link_wait,
+    .now_ms = mule_link_now_ms,
+};
 
-    }
+/*
+* Logs a collected payload under its SHA-256 until it is uploaded.
+* A payload already waiting in the log is not stored twice.
+*/
+static void payload_store(struct sensor_ctx *ctx, const uint8_t *data, size_t len)
+{
+    uint8_t hash[PLOG_HASH_LEN];
+    uint32_t count;
+    int rc;
 
-    // Send remaining data 
-    //ble_write(peer, &buf[counter], chr_data, len);
+    mbedtls_sha256(data, len, hash, 0);
 
-    //write complete put back in listening mode
-    metadata_state[0] = 0;
-    metadata_state[1] = 0;
-    metadata_state[2] = 0;
-    ble_write(peer, metadata_state, chr_metadata, 3);
+    xSemaphoreTake(payload_lock, portMAX_DELAY);
+    rc = plog_append(&payload_log, hash, data, len, NULL);
+    count = plog_count(&payload_log);
+    xSemaphoreGive(payload_lock);
 
-    return len;
+    if (rc == PLOG_ERR_EXISTS) {
+        printf("duplicate payload; conn_handle=%d\n", ctx->conn_handle);
+    }
+    else if (rc != PLOG_OK) {
+        ESP_LOGE(tag, "payload log append failed; rc=%d", rc);
+    }
+    else {
+        printf("payload logged; conn_handle=%d %" PRIu32 " pending\n", ctx->conn_handle, count);
+    }
 }
 
+/*
+* Hands a context back once its sensor disconnected
+*/
+static void sensor_ctx_release(struct sensor_ctx *ctx)
+{
+    printf("sensor gone; conn_handle=%d\n", ctx->conn_handle);
+
+    //whatever this sensor gave us survives a reset from here on
+    xSemaphoreTake(payload_lock, portMAX_DELAY);
+    plog_flush(&payload_log);
+    xSemaphoreGive(payload_lock);
+
+    gatt_sync_reset(&ctx->sync);
+    xQueueSend(free_ctxs, &ctx, portMAX_DELAY);
 
-int ble_read_long(void *p_ble_conn_handle, unsigned char *buf, size_t len) 
+    //room for another sensor
+    sensor_scan_if_free();
+}
+
+/*
+* Runs the DTLS handshake with the sensor, as its client. Returns 0 or an
+* mbedtls error; MBEDTLS_ERR_NET_CONN_RESET if the sensor disconnected.
+*/
+static int sensor_handshake(struct sensor_ctx *ctx)
 {
-    // //wait for connection to be established TODO??
-    // while (ble_gap_conn_active() == 0) {
-    //     //wait  
-    //     printf("waiting for BLE connection\n");
-    //     vTaskDelay(1000 / portTICK_PERIOD_MS);
-    // }
-
-    //get peer from connection handle and peer chrs from uuids 
-    const struct peer *peer = peer_find(ble_conn_handle);
-    const struct peer_chr *chr_metadata = peer_chr_find_uuid(peer, sensor_svc_uuid, metadata_chr_uuid);
-    const struct peer_chr *chr_data = peer_chr_find_uuid(peer, sensor_svc_uuid, sensor_chr_uuid);
-
-    // call ble_read to get metadata 
-    ble_read(peer, chr_metadata);
-    while (sema_metadata == 0) {
-        //wait for callback to finish
+    int ret;
+
+    dtls_gatt_reset(&ctx->transport);
+    mbedtls_ssl_session_reset(&ctx->ssl);
+    if ((ret = mbedtls_ssl_set_hostname(&ctx->ssl, SERVER_NAME)) != 0) {
+        return ret;
     }
-    //now the read data is in metadata_state
-    int num_chunks = metadata_state[0]; 
-    int num_recieved_chunks = metadata_state[1];
-
-    //set the sema back to 0 since we are done with the metadata for now
-    sema_metadata = 0;
-
-    while (num_recieved_chunks < num_chunks) {
-        //call ble_read to get the next data chunk 
-        ble_read(peer, chr_data);
-        while (sema_data == 0) {
-            //wait for callback to finish
-        }
-        //now the read data is in sensor_state 
-        memcpy(&buf[num_recieved_chunks*CHUNK_SIZE], sensor_state, CHUNK_SIZE);
-        //set the sema back to 0 since we are done copying data 
-        sema_data = 0;
+
+    //the sensor's HelloVerifyRequest is answered inside the handshake
+    do {
+        ret = mbedtls_ssl_handshake(&ctx->ssl);
+    } while (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE);
+
+    if (ret == 0) {
+        printf("DTLS handshake done; conn_handle=%d %s\n",
+               ctx->conn_handle, mbedtls_ssl_get_ciphersuite(&ctx->ssl));
     }
+    return ret;
+}
+
+/*
+* Reads the sensor's frames off the DTLS session. Each one is its length
+* (FRAME_HDR_LEN bytes) followed by the frame, split across records as
+* the sensor likes. Returns once the sensor is gone.
+*/
+static void sensor_collect(struct sensor_ctx *ctx)
+{
+    uint8_t hdr[FRAME_HDR_LEN];
+    size_t hdr_len = 0;
+    size_t frame_len = 0;
+    size_t frame_pos = 0;
+    uint8_t record[RECORD_BUF_LEN];
+    int len;
+
+    for (;;) {
+        len = mbedtls_ssl_read(&ctx->ssl, record, sizeof(record));
+        if (len == MBEDTLS_ERR_SSL_TIMEOUT || len == MBEDTLS_ERR_SSL_WANT_READ) {
+            //sensor has nothing for us right now
+            continue;
+        }
+        if (len == MBEDTLS_ERR_NET_CONN_RESET || len == MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY ||
+                len == 0) {
+            return;
+        }
+        if (len < 0) {
+            //can't serve this sensor, the disconnect ends the loop
+            printf("DTLS read failed; conn_handle=%d -0x%x\n", ctx->conn_handle, -len);
+            ble_gap_terminate(ctx->conn_handle, BLE_ERR_REM_USER_CONN_TERM);
+            continue;
+        }
 
-    //recieve the leftover data 
-    ble_read(peer, chr_data);
-    while (sema_data == 0) {
-        //wait for callback to finish
+        for (int i = 0; i < len; i++) {
+            if (hdr_len < FRAME_HDR_LEN) {
+                hdr[hdr_len++] = record[i];
+                if (hdr_len == FRAME_HDR_LEN) {
+                    frame_len = hdr[0] | (hdr[1] << 8) | ((size_t)hdr[2] << 16) | ((size_t)hdr[3] << 24);
+                    frame_pos = 0;
+                }
+            }
+            else {
+                //a frame too large for us is skipped, not stored cut short
+                if (frame_pos < sizeof(ctx->sensor_state_data)) {
+                    ctx->sensor_state_data[frame_pos] = record[i];
+                }
+                frame_pos++;
+            }
+
+            if (hdr_len == FRAME_HDR_LEN && frame_pos == frame_len) {
+                if (frame_len > sizeof(ctx->sensor_state_data)) {
+                    printf("frame too large; conn_handle=%d %d bytes\n", ctx->conn_handle, (int)frame_len);
+                }
+                else {
+                    printf("transfer complete; conn_handle=%d %d bytes\n", ctx->conn_handle, (int)frame_len);
+                    payload_store(ctx, ctx->sensor_state_data, frame_len);
+                }
+                hdr_len = 0;
+            }
+        }
     }
-    //now the read data is in sensor_state
-    memcpy(&buf[num_recieved_chunks*CHUNK_SIZE], sensor_state, len - num_recieved_chunks*CHUNK_SIZE);
+}
 
-    return len;
+/*
+* Collects payloads from the sensor bound to ctx once it has subscribed.
+* Blocks on the context's gatt_sync between GATT events and never spins.
+*/
+static void sensor_task(void *param)
+{
+    struct sensor_ctx *ctx = param;
+    struct gatt_sync_evt evt;
+    int ret;
+
+    for (;;) {
+        //wait until the sensor subscribed, or dropped before it could
+        do {
+            gatt_sync_next_notify(&ctx->sync, &evt, portMAX_DELAY);
+            os_mbuf_free_chain(evt.om);
+        } while (evt.status == 0 && evt.attr_handle != 0);
+
+        if (evt.status == 0) {
+            printf("sensor ready; conn_handle=%d\n", ctx->conn_handle);
+            ret = sensor_handshake(ctx);
+            if (ret == 0) {
+                sensor_collect(ctx);
+            }
+            else if (ret != MBEDTLS_ERR_NET_CONN_RESET) {
+                printf("DTLS handshake failed; conn_handle=%d -0x%x\n", ctx->conn_handle, -ret);
+                ble_gap_terminate(ctx->conn_handle, BLE_ERR_REM_USER_CONN_TERM);
+                //wait for the disconnect before the context goes back
+                do {
+                    gatt_sync_next_notify(&ctx->sync, &evt, portMAX_DELAY);
+                    os_mbuf_free_chain(evt.om);
+                } while (evt.status == 0);
+            }
+        }
+
+        sensor_ctx_release(ctx);
+    }
 }
 
 
@@ -411,6 +528,20 @@ sensor_scan(void)
     }
 }
 
+/*
+* Keeps scanning as long as there is a free context to serve a new sensor;
+* the controller interleaves scanning with the connection events of the
+* sensors being served.
+*/
+static void
+sensor_scan_if_free(void)
+{
+    if (uxQueueMessagesWaiting(free_ctxs) > 0 &&
+            !ble_gap_disc_active() && !ble_gap_conn_active()) {
+        sensor_scan();
+    }
+}
+
 /**
  * Called when service discovery of the specified peer has completed.
  */
@@ -506,6 +637,11 @@ mule_connect_if_sensor(void *disc)
         return;
     }
 
+    //Every context is busy with a sensor already
+    if (uxQueueMessagesWaiting(free_ctxs) == 0) {
+        return;
+    }
+
     /* Scanning must be stopped before a connection can be initiated. */
     rc = ble_gap_disc_cancel();
     if (rc != 0) {
@@ -552,6 +688,8 @@ mule_ble_gap_event(struct ble_gap_event *event, void *arg)
 {
     struct ble_gap_conn_desc desc;
     struct ble_hs_adv_fields fields;
+    struct sensor_ctx *ctx;
+    struct peer *peer;
     int rc;
 
     switch (event->type) {
@@ -577,31 +715,61 @@ mule_ble_gap_event(struct ble_gap_event *event, void *arg)
             print_conn_desc(&desc);
             MODLOG_DFLT(INFO, "\n");
 
+            //Bind a free sensor context to the connection
+            if (xQueueReceive(free_ctxs, &ctx, 0) != pdTRUE) {
+                MODLOG_DFLT(ERROR, "No free sensor context\n");
+                ble_gap_terminate(event->connect.conn_handle, BLE_ERR_REM_USER_CONN_TERM);
+                return 0;
+            }
+
             //Remember peer
             rc = peer_add(event->connect.conn_handle);
             if (rc != 0) {
                 MODLOG_DFLT(ERROR, "Failed to add peer; rc=%d\n", rc);
+                xQueueSend(free_ctxs, &ctx, 0);
+                ble_gap_terminate(event->connect.conn_handle, BLE_ERR_REM_USER_CONN_TERM);
                 return 0;
             }
+            ctx->conn_handle = event->connect.conn_handle;
+#ifdef BLE_GAP_EVENT_DATA_LEN_CHG
+            //raised by BLE_GAP_EVENT_DATA_LEN_CHG once the update is through
+            ctx->ll_tx_octets = XFER_LL_OCTETS_DEFAULT;
+#else
+            //this NimBLE doesn't report the outcome, assume the request below
+            ctx->ll_tx_octets = XFER_LL_OCTETS_MAX;
+#endif
+            peer_find(event->connect.conn_handle)->app_ctx = ctx;
+
+            //Ask for our preferred MTU and the longest LL data PDUs so the
+            //sensor can size chunks to fill one PDU each
+            rc = ble_gattc_exchange_mtu(event->connect.conn_handle, NULL, NULL);
+            if (rc != 0) {
+                MODLOG_DFLT(ERROR, "Failed to exchange MTU; rc=%d\n", rc);
+            }
+            rc = ble_gap_set_data_len(event->connect.conn_handle, XFER_LL_OCTETS_MAX, LL_MAX_TX_TIME);
+            if (rc != 0) {
+                MODLOG_DFLT(ERROR, "Failed to set data length; rc=%d\n", rc);
+            }
 
             //Perform service discovery 
             rc = peer_disc_all(event->connect.conn_handle,
                         ble_on_disc_complete, NULL);
             if(rc != 0) {
+                //the disconnect hands ctx back to free_ctxs
                 MODLOG_DFLT(ERROR, "Failed to discover services; rc=%d\n", rc);
+                ble_gap_terminate(event->connect.conn_handle, BLE_ERR_REM_USER_CONN_TERM);
                 return 0;
             }
 
-            //Save the connection handle for future reference
-            ble_conn_handle = event->connect.conn_handle;
-
         } else {
-            //Connection attempt failed; resume scanning
+            //Connection attempt failed
             MODLOG_DFLT(ERROR, "Error: Connection failed; status=%d\n",
                         event->connect.status);
-            sensor_scan();
         }
 
+        //Keep looking for sensors while this one is served
+        sensor_scan_if_free();
+
         return 0;
 
     case BLE_GAP_EVENT_DISCONNECT:
@@ -610,16 +778,22 @@ mule_ble_gap_event(struct ble_gap_event *event, void *arg)
         print_conn_desc(&event->disconnect.conn);
         MODLOG_DFLT(INFO, "\n");
 
-        //Forget about peer
+        //Forget about peer, its task releases the context
+        peer = peer_find(event->disconnect.conn.conn_handle);
+        if (peer != NULL && peer->app_ctx != NULL) {
+            ctx = peer->app_ctx;
+            gatt_sync_post_disconnect(&ctx->sync, event->disconnect.conn.conn_handle);
+        }
         peer_delete(event->disconnect.conn.conn_handle);
 
         //Resume scanning
-        sensor_scan();
+        sensor_scan_if_free();
         return 0;
 
     case BLE_GAP_EVENT_DISC_COMPLETE:
         MODLOG_DFLT(INFO, "discovery complete; reason=%d\n",
                     event->disc_complete.reason);
+        sensor_scan_if_free();
         return 0;
 
     // case BLE_GAP_EVENT_ENC_CHANGE:
@@ -633,58 +807,35 @@ mule_ble_gap_event(struct ble_gap_event *event, void *arg)
 
     case BLE_GAP_EVENT_NOTIFY_RX:
         /* Peer sent us a notification or indication. */
-        MODLOG_DFLT(INFO, "received %s; conn_handle=%d attr_handle=%d "
-                    "attr_len=%d; value=",
+        MODLOG_DFLT(DEBUG, "received %s; conn_handle=%d attr_handle=%d "
+                    "attr_len=%d\n",
                     event->notify_rx.indication ?
                     "indication" :
                     "notification",
                     event->notify_rx.conn_handle,
                     event->notify_rx.attr_handle,
                     OS_MBUF_PKTLEN(event->notify_rx.om));
-        
-        print_mbuf(event->notify_rx.om);
-        printf("\n");
- 
-        //if data is sensor state, update sensor state buffer and metadata buffer
-        if (event->notify_rx.attr_handle == metadata_attr_handle -1 ) { //literally no clue why -1
-            //update metadata buffer
-            os_mbuf_copydata(event->notify_rx.om,0,OS_MBUF_PKTLEN(event->notify_rx.om),metadata_state);
-            sema_metadata = 1;
 
+        //metadata and chunks are handled by the sensor's task
+        peer = peer_find(event->notify_rx.conn_handle);
+        if (peer == NULL || peer->app_ctx == NULL) {
+            return 0;
         }
-        else if (event->notify_rx.attr_handle == sensor_attr_handle - 1) { //literally no clue why -1
-            //check metadata to find out where to put the data 
-            int number_of_chunks = metadata_state[0];
-            int number_recieved_chunks = metadata_state[1];
-            int readiness = metadata_state[2];
-
-            printf("number recieved chunks %d\n", number_recieved_chunks);
-            
-            //update sensor state buffer
-            printf("len of recieved data: %d\n", event->notify_rx.om->om_len);
-            os_mbuf_copydata(event->notify_rx.om,0,OS_MBUF_PKTLEN(event->notify_rx.om),&sensor_state_data[number_recieved_chunks*CHUNK_SIZE]);
-            
-            metadata_state[1] += 1; //adding a packet to the metadata
-            sema_data = 1;
-            sema_metadata = 1;
-
-            printf("writing ack to sensor%d\n", metadata_state[1]);
-
-            //write an ack to the sensor
-            struct peer *peer = peer_find(event->notify_rx.conn_handle);
-            struct peer_chr *chr = peer_chr_find_uuid(peer, sensor_svc_uuid, metadata_chr_uuid);
-            ble_write(peer, metadata_state, chr, 3);
-        }
-        else {
-            printf("unknown characteristic data\n");
-        }
-
-        printf("metadata total chunks: %d\n",metadata_state[0]);
-        printf("metadata chunks recieved: %d\n",metadata_state[1]);
-        printf("metadata readiness: %d\n",metadata_state[2]);
+        ctx = peer->app_ctx;
+        gatt_sync_post_notify(&ctx->sync, event);
+        return 0;
 
-        
+#ifdef BLE_GAP_EVENT_DATA_LEN_CHG
+    case BLE_GAP_EVENT_DATA_LEN_CHG:
+        MODLOG_DFLT(INFO, "data length update; conn_handle=%d max_tx_octets=%d\n",
+                    event->data_len_chg.conn_handle, event->data_len_chg.max_tx_octets);
+        peer = peer_find(event->data_len_chg.conn_handle);
+        if (peer != NULL && peer->app_ctx != NULL) {
+            ctx = peer->app_ctx;
+            ctx->ll_tx_octets = event->data_len_chg.max_tx_octets;
+        }
         return 0;
+#endif
 
     case BLE_GAP_EVENT_MTU:
         MODLOG_DFLT(INFO, "mtu update event; conn_handle=%d cid=%d mtu=%d\n",
@@ -732,227 +883,56 @@ static void ble_on_sync(void) {
 }
 
 
-void mbedtls_stuff() {
-    printf("Starting the mbedtls client stuff\n");
-
-    int ret, len;
-    //mbedtls_net_context server_fd;
-    uint32_t flags;
-    unsigned char buf[1024];
+/*
+* Sets up the DTLS client for one sensor context. Each context has its own
+* DRBG so sensor tasks never share one.
+*/
+static int sensor_tls_init(struct sensor_ctx *ctx)
+{
     const char *pers = "dtls_client";
-    int retry_left = MAX_RETRY;
+    int ret;
 
-    mbedtls_entropy_context entropy;
-    mbedtls_ctr_drbg_context ctr_drbg;
-    mbedtls_ssl_context ssl;
-    mbedtls_ssl_config conf;
-    //mbedtls_x509_crt cacert;
-    mbedtls_timing_delay_context timer;
-
-//     ((void) argc);
-//     ((void) argv);
-
-// #if defined(MBEDTLS_DEBUG_C)
-//     mbedtls_debug_set_threshold(DEBUG_LEVEL);
-// #endif
-
-    /*
-     * 0. Initialize the RNG and the session data
-     */
-    //mbedtls_net_init(&server_fd);
-    mbedtls_ssl_init(&ssl);
-    mbedtls_ssl_config_init(&conf);
-    //mbedtls_x509_crt_init(&cacert);
-    mbedtls_ctr_drbg_init(&ctr_drbg);
+    mbedtls_ssl_init(&ctx->ssl);
+    mbedtls_ssl_config_init(&ctx->conf);
+    mbedtls_entropy_init(&ctx->entropy);
+    mbedtls_ctr_drbg_init(&ctx->ctr_drbg);
 
-    mbedtls_printf("\n  . Seeding the random number generator...");
-    
-
-    mbedtls_entropy_init(&entropy);
-    if ((ret = mbedtls_ctr_drbg_seed(&ctr_drbg, mbedtls_entropy_func, &entropy,
-                                     NULL,
-                                     0)) != 0) {
-        mbedtls_printf(" failed\n  ! mbedtls_ctr_drbg_seed returned %d\n", ret);
-        
+    if ((ret = mbedtls_ctr_drbg_seed(&ctx->ctr_drbg, mbedtls_entropy_func, &ctx->entropy,
+                                     (const unsigned char *)pers, strlen(pers))) != 0) {
+        printf("mbedtls_ctr_drbg_seed returned %d\n", ret);
+        return ret;
     }
 
-    mbedtls_printf(" ok\n");
-
-    //skip cert load and net connect stuff
-
-    mbedtls_printf("  . Setting up the DTLS structure...");
-    
-
-    if ((ret = mbedtls_ssl_config_defaults(&conf,
+    if ((ret = mbedtls_ssl_config_defaults(&ctx->conf,
                                            MBEDTLS_SSL_IS_CLIENT,
                                            MBEDTLS_SSL_TRANSPORT_DATAGRAM,
                                            MBEDTLS_SSL_PRESET_DEFAULT)) != 0) {
-        mbedtls_printf(" failed\n  ! mbedtls_ssl_config_defaults returned %d\n\n", ret);
-        
+        printf("mbedtls_ssl_config_defaults returned %d\n", ret);
+        return ret;
     }
 
     /* OPTIONAL is usually a bad choice for security, but makes interop easier
      * in this simplified example, in which the ca chain is hardcoded.
      * Production code should set a proper ca chain and use REQUIRED. */
-    mbedtls_ssl_conf_authmode(&conf, MBEDTLS_SSL_VERIFY_OPTIONAL);
-    //mbedtls_ssl_conf_ca_chain(&conf, &cacert, NULL);
-    mbedtls_ssl_conf_rng(&conf, mbedtls_ctr_drbg_random, &ctr_drbg);
-    //mbedtls_ssl_conf_dbg(&conf, my_debug, stdout);
-    mbedtls_ssl_conf_read_timeout(&conf, READ_TIMEOUT_MS);
-
-    if ((ret = mbedtls_ssl_setup(&ssl, &conf)) != 0) {
-        mbedtls_printf(" failed\n  ! mbedtls_ssl_setup returned %d\n\n", ret);
-        
-    }
-
-    if ((ret = mbedtls_ssl_set_hostname(&ssl, SERVER_NAME)) != 0) {
-        mbedtls_printf(" failed\n  ! mbedtls_ssl_set_hostname returned %d\n\n", ret);
-        
+    mbedtls_ssl_conf_authmode(&ctx->conf, MBEDTLS_SSL_VERIFY_OPTIONAL);
+    mbedtls_ssl_conf_rng(&ctx->conf, mbedtls_ctr_drbg_random, &ctx->ctr_drbg);
+    mbedtls_ssl_conf_read_timeout(&ctx->conf, READ_TIMEOUT_MS);
+    mbedtls_ssl_conf_handshake_timeout(&ctx->conf, DTLS_GATT_HS_TIMEOUT_MIN_MS,
+                                       DTLS_GATT_HS_TIMEOUT_MAX_MS);
+
+    if ((ret = mbedtls_ssl_setup(&ctx->ssl, &ctx->conf)) != 0) {
+        printf("mbedtls_ssl_setup returned %d\n", ret);
+        return ret;
     }
 
-    // mbedtls_ssl_set_bio(&ssl, &server_fd,
-    //                     mbedtls_net_send, mbedtls_net_recv, mbedtls_net_recv_timeout);
-
-    // mbedtls_ssl_set_timer_cb(&ssl, &timer, mbedtls_timing_set_delay,
-    //                          mbedtls_timing_get_delay);
-
-    // mbedtls_printf(" ok\n");
-
-
-
-    //int error_code;
-
-    /*
-    * Initialize the RNG and the session data
-    */
-
-    // initialize entropy and seed random generator
-    // mbedtls_entropy_context entropy;
-    // mbedtls_ctr_drbg_context ctr_drbg; 
-
-    // mbedtls_entropy_init(&entropy);
-    // mbedtls_ctr_drbg_init(&ctr_drbg);
-    // if ((error_code = mbedtls_ctr_drbg_seed(&ctr_drbg, mbedtls_entropy_func, &entropy, NULL, 0)) != 0) {
-    //     printf("error at line %d: mbedtls_ctr_drbg_seed returned %d\n", __LINE__, error_code);
-    //     abort();
-    // }
-
-    // // initialize TLS server parameters
-    // mbedtls_x509_crt srvcert;
-    // mbedtls_ssl_context ssl;
-    // mbedtls_ssl_config conf;
-    // mbedtls_pk_context pkey;
-    // mbedtls_timing_delay_context timer; 
-    // mbedtls_net_context listen_fd, client_fd;
-    // mbedtls_ssl_cookie_ctx cookie_ctx;
-
-    // mbedtls_net_init(&listen_fd);
-    // mbedtls_net_init(&client_fd);
-    // mbedtls_x509_crt_init(&srvcert);
-    // mbedtls_ssl_init(&ssl);
-    // mbedtls_ssl_config_init(&conf);
-    // mbedtls_pk_init(&pkey);
-    // mbedtls_ssl_cookie_init(&cookie_ctx);
-
-
-    // /*
-    // * Load the certificates and private RSA key
-    // */
-    
-    // // Initialize server with mule certificate
-    // const unsigned char *cert_data = mule_srv_crt;
-    // error_code = mbedtls_x509_crt_parse(
-    //     &srvcert,
-    //     cert_data,
-    //     mule_srv_crt_len
-    // );
-    // if (error_code) {
-    //     printf("error at line %d: mbedtls_x509_crt_parse returned %d\n", __LINE__, error_code);
-    //     abort();
-    // }
-
-    // const unsigned char *key_data = mule_srv_key;
-    // error_code = mbedtls_pk_parse_key(
-    //     &pkey,
-    //     key_data,
-    //     mule_srv_key_len, NULL, 0,
-    //     mbedtls_ctr_drbg_random, &ctr_drbg
-    // );
-    // if (error_code) {
-    //     printf("error at line %d: mbedtls_pk_parse_key returned %d\n", __LINE__, error_code);
-    //     abort();
-    // }
-    
-    // /*
-    // * Setup SSL stuff
-    // */
-    
-    // // Setup server
-    // error_code = mbedtls_ssl_config_defaults(
-    //     &conf,
-    //     MBEDTLS_SSL_IS_SERVER,
-    //     MBEDTLS_SSL_TRANSPORT_DATAGRAM, 
-    //     MBEDTLS_SSL_PRESET_DEFAULT
-    // );
-    // if (error_code) {
-    //     printf("error at line %d: mbedtls_ssl_config_defaults returned %d\n", __LINE__, error_code);
-    //     abort();
-    // }
-
-    // mbedtls_ssl_conf_rng(&conf, mbedtls_ctr_drbg_random, &ctr_drbg);
-    // //mbedtls_ssl_conf_dbg(&conf, my_debug, stdout);
-    // //mbedtls_ssl_conf_read_timeout(&conf, READ_TIMEOUT_MS);
-
-    // mbedtls_ssl_conf_ca_chain(&conf, srvcert.next, NULL);
-    // error_code = mbedtls_ssl_conf_own_cert(&conf, &srvcert, &pkey);
-    // if (error_code) {
-    //     printf("error at line %d: mbedtls_ssl_conf_own_cert returned %d\n", __LINE__, error_code);
-    //     abort();
-    // }
-    
-    // error_code = mbedtls_ssl_setup(&ssl, &conf);
-    // if (error_code) {
-    //     printf("error at line %d: mbedtls_ssl_setup returned %d\n", __LINE__, error_code);
-    //     abort();
-    // }
-
-    //waits for BLE connection to continue 
-    // while (ble_gap_conn_active() == 0) {
-    //     //wait  
-    //     printf("waiting for BLE connection\n");
-    //     vTaskDelay(1000 / portTICK_PERIOD_MS);
-    // }
-
-    // Set bio to call ble connection
-    mbedtls_ssl_set_bio(&ssl, ble_conn_handle, ble_write_long, ble_read_long, NULL);
-
-    mbedtls_ssl_set_timer_cb(&ssl, &timer, mbedtls_timing_set_delay,
-                              mbedtls_timing_get_delay);
-
-    // //Handshake 
-    // ret = mbedtls_ssl_handshake(&ssl);
-    // if (ret != 0) {
-    //     printf("error at line %d: mbedtls_ssl_handshake returned %d\n", __LINE__, ret);
-    //     char error_buf[100];
-    //     mbedtls_strerror(ret, error_buf, sizeof(error_buf));
-    //     printf("SSL/TLS handshake error: %s\n", error_buf);
-    //      //abort();
-    // }
-    // else {
-    //     printf("mbedtls handshake successful\n");
-    // }
-
-    // while(true) {
-    //     //wait for data
-    //     vTaskDelay(1000 / portTICK_PERIOD_MS);
-    // }
-
-    // mbedtls_ssl_session_reset(&ssl);
-    // // TODO call mbedtls_ssl_session_reset(&ssl) when new connection
-
-    // printf("mbedtls done\n");
-
+    //records go over the data and metadata characteristics, see dtls_gatt.h
+    dtls_gatt_init(&ctx->transport, &mule_link_ops, ctx, MULE_MAX_WINDOW);
+    mbedtls_ssl_set_bio(&ctx->ssl, &ctx->transport, dtls_gatt_send, NULL, dtls_gatt_recv_timeout);
 
+    ctx->timer.now_ms = mule_link_now_ms;
+    ctx->timer.clock = ctx;
+    mbedtls_ssl_set_timer_cb(&ctx->ssl, &ctx->timer, dtls_gatt_set_delay, dtls_gatt_get_delay);
+    return 0;
 }
 
 void mule_host_task(void *param)
@@ -1036,91 +1016,53 @@ void app_main() {
 
     ble_store_config_init();
 
-    //Start the muling task 
-    nimble_port_freertos_init(mule_host_task);
-    
-    printf("started connection\n");
-
-    while (true) {
-        printf(".");
-        vTaskDelay(1000 / portTICK_PERIOD_MS);
+    //Mount the payload log; sectors without a log header count as free
+    payload_lock = xSemaphoreCreateMutex();
+    if (payload_lock == NULL || plog_esp_flash_init(&payload_flash, PAYLOAD_PARTITION) != PLOG_OK) {
+        ESP_LOGE(tag, "error finding payload partition");
+        return;
     }
+    //one slot per record the partition can hold, so the index never fills
+    //before the flash does; 8192 slots (64 KB) for the 960 KB partition
+    uint32_t num_slots = plog_index_slots(payload_flash.size, PAYLOAD_MIN_LEN);
+    payload_slots = calloc(num_slots, sizeof(*payload_slots));
+    if (payload_slots == NULL) {
+        ESP_LOGE(tag, "error allocating %" PRIu32 " payload index slots", num_slots);
+        return;
+    }
+    rc = plog_open(&payload_log, &payload_flash, payload_slots, num_slots, PAYLOAD_BATCH);
+    if (rc != PLOG_OK) {
+        ESP_LOGE(tag, "error mounting payload log %d", rc);
+        return;
+    }
+    printf("payload log mounted; %" PRIu32 " pending, room for %" PRIu32 "\n",
+           plog_count(&payload_log), num_slots / 4 * 3);
 
-    //mbedtls handshake
-    //mbedtls_stuff();
-
-    //set up packet pointers to beginning of big_data
-    // for (int i = 0; i < MAX_PAYLOADS; i++) {
-    //     payloads[i] = big_data;
-    // }
-
-    // num_payloads = 0; // initialize the number of payloads to 0, TODO magic number
-    // while(num_payloads < 10) { // get data and send data to either server or back to sensor
-
-    //     //waits for BLE connection to continue 
-    //     // while (ble_gap_conn_active() == 0) {
-    //     //     //wait  
-    //     //     printf("waiting for BLE connection\n");
-    //     //     vTaskDelay(1000 / portTICK_PERIOD_MS);
-    //     // }
-
-    //     //waiting for data transfer 
-    //     if (metadata_state[2] != 2) {
-    //         //printf("waiting for data transfer\n");
-    //         //printf("metadata_state[2] = %d\n", metadata_state[2]);
-    //         vTaskDelay(1000 / portTICK_PERIOD_MS);
-    //         continue;
-    //     }
-    //     else {
-    //         printf("data transfer complete\n");
-    //         //copy to big buffer using payload pointers
-    //         memcpy(payloads[num_payloads], sensor_state_data, CHUNK_SIZE*metadata_state[0]); 
-    //         num_payloads++;
-
-    //         // TODO: do we have data to write to the sensor?
-    //         // TODO: is it time to upload our data? 
-    //         // Go back to waiting for data transfer state
-    //         vTaskDelay(1000 / portTICK_PERIOD_MS);
-    //         metadata_state[0] = 0;
-    //         metadata_state[1] = 0;
-    //         metadata_state[2] = 0;
-    //         ble_write_long(&ble_conn_handle, metadata_state, 3);
-             
-    //     }
-    // }
-
-    // //TODO: disconnect and wait to send data to server
-    // printf("disconnect BLE\n");
-    nimble_port_stop();
-
-    
-
-
-
-    //data transfer complete we can write data to server (or write back to sensor)
-    //int len = 1000;
-    //printf("sensor state data [0]%d\n", sensor_state_data[0]);
-    //len = ble_write_long(&ble_conn_handle, sensor_state_data, len);
-
-
-
-    //int len = 0;
-    //uint8_t data_buf[1000];
-    //len = ble_read_long(&ble_conn_handle, &data_buf, 1000);
-    //len = ble_write_long(&ble_conn_handle, &data_buf, len);
+    //One context and task per sensor we can be connected to
+    free_ctxs = xQueueCreate(MAX_SENSORS, sizeof(struct sensor_ctx *));
+    if (free_ctxs == NULL) {
+        ESP_LOGE(tag, "error creating sensor context queue");
+        return;
+    }
+    for (int i = 0; i < MAX_SENSORS; i++) {
+        struct sensor_ctx *ctx = &sensor_ctxs[i];
+        if (gatt_sync_init(&ctx->sync, NOTIFY_DEPTH) != 0) {
+            ESP_LOGE(tag, "error creating gatt queues");
+            return;
+        }
+        if (sensor_tls_init(ctx) != 0) {
+            ESP_LOGE(tag, "error setting up DTLS");
+            return;
+        }
+        xQueueSend(free_ctxs, &ctx, 0);
+        xTaskCreatePinnedToCore(sensor_task, "sensor", MULE_APP_STACK, ctx,
+                                MULE_APP_PRIO, NULL, MULE_APP_CORE);
+    }
 
+    //Start the muling task 
+    nimble_port_freertos_init(mule_host_task);
     
-    //get connection handle 
-
-    //mbedtls_stuff();
+    printf("started connection\n");
 
-    //TODO: clean up mbedtls stuff and restart 
-    
-    // for (int i = 30; i >= 0; i--) {
-    //     printf("Restarting in %d seconds...\n", i);
-    //     vTaskDelay(1000 / portTICK_PERIOD_MS);
-    // }
-    // printf("Restarting now.\n");
-    // fflush(stdout);
-    // esp_restart();
+    //the muling itself runs in the sensor tasks, app_main is done
 }
@@ -0,0 +1,590 @@
+#include <string.h>
+#include "payload_log.h"
+
+#define PLOG_SECTOR_MAGIC 0x474f4c50  /* "PLOG" */
+#define PLOG_RECORD_MAGIC 0x4c50
+#define PLOG_ERASED16     0xffff
+
+#define REC_MAGIC   0
+#define REC_LEN     2
+#define REC_STATE   4
+#define REC_HASH    8
+#define REC_CRC     40
+
+#define STATE_PENDING  0xff
+#define STATE_UPLOADED 0x00
+
+#define SLOT_EMPTY     0xffffffff
+#define SLOT_TOMBSTONE 0xfffffffe
+
+static uint16_t get16(const uint8_t *p) { return (uint16_t)(p[0] | (p[1] << 8)); }
+static uint32_t get32(const uint8_t *p) { return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24); }
+static void put16(uint8_t *p, uint16_t v) { p[0] = v & 0xff; p[1] = v >> 8; }
+static void put32(uint8_t *p, uint32_t v) { put16(p, v & 0xffff); put16(p + 2, v >> 16); }
+
+static uint32_t
+crc32_update(uint32_t crc, const uint8_t *buf, size_t len)
+{
+    static const uint32_t tab[16] = {
+        0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac,
+        0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+        0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c,
+        0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c,
+    };
+
+    crc = ~crc;
+    while (len--) {
+        crc ^= *buf++;
+        crc = (crc >> 4) ^ tab[crc & 0xf];
+        crc = (crc >> 4) ^ tab[crc & 0xf];
+    }
+    return ~crc;
+}
+
+static uint32_t
+record_crc(const uint8_t *hdr, const uint8_t *data, uint16_t len)
+{
+    uint32_t crc = crc32_update(0, &hdr[REC_LEN], 2);
+    crc = crc32_update(crc, &hdr[REC_HASH], PLOG_HASH_LEN);
+    return crc32_update(crc, data, len);
+}
+
+static uint32_t
+record_size(uint16_t len)
+{
+    return (PLOG_RECORD_HDR_LEN + len + 3) & ~3u;
+}
+
+static uint32_t
+sector_addr(uint32_t sector)
+{
+    return sector * PLOG_SECTOR_SIZE;
+}
+
+/* Reads log bytes, from the batch if they are not on flash yet */
+static int
+log_read(struct plog *log, uint32_t addr, void *buf, size_t len)
+{
+    uint32_t off = addr % PLOG_SECTOR_SIZE;
+
+    if (addr / PLOG_SECTOR_SIZE == log->head && off >= log->flushed_off) {
+        memcpy(buf, &log->batch[off - log->flushed_off], len);
+        return PLOG_OK;
+    }
+    if (log->flash->read(log->flash->ctx, addr, buf, len) != 0) {
+        return PLOG_ERR_IO;
+    }
+    return PLOG_OK;
+}
+
+/*
+ * Index
+ */
+
+static void
+index_clear(struct plog *log)
+{
+    for (uint32_t i = 0; i < log->num_slots; i++) {
+        log->slots[i].key = 0;
+        log->slots[i].addr = SLOT_EMPTY;
+    }
+    log->slots_used = 0;
+}
+
+static int
+index_find(struct plog *log, const uint8_t *hash, uint32_t *slot)
+{
+    uint32_t mask = log->num_slots - 1;
+    uint32_t key = get32(hash);
+    uint8_t rec_hash[PLOG_HASH_LEN];
+
+    for (uint32_t i = key & mask, n = 0; n < log->num_slots; i = (i + 1) & mask, n++) {
+        struct plog_slot *s = &log->slots[i];
+        if (s->addr == SLOT_EMPTY) {
+            break;
+        }
+        if (s->addr == SLOT_TOMBSTONE || s->key != key) {
+            continue;
+        }
+        if (log_read(log, s->addr + REC_HASH, rec_hash, sizeof(rec_hash)) != PLOG_OK) {
+            return PLOG_ERR_IO;
+        }
+        if (memcmp(rec_hash, hash, PLOG_HASH_LEN) == 0) {
+            *slot = i;
+            return PLOG_OK;
+        }
+    }
+    return PLOG_ERR_NOT_FOUND;
+}
+
+static void
+index_put(struct plog *log, const uint8_t *hash, uint32_t addr)
+{
+    uint32_t mask = log->num_slots - 1;
+    uint32_t key = get32(hash);
+    uint32_t i = key & mask;
+
+    while (log->slots[i].addr != SLOT_EMPTY && log->slots[i].addr != SLOT_TOMBSTONE) {
+        i = (i + 1) & mask;
+    }
+    if (log->slots[i].addr == SLOT_EMPTY) {
+        log->slots_used += 1;
+    }
+    log->slots[i].key = key;
+    log->slots[i].addr = addr;
+}
+
+static bool
+index_has_room(const struct plog *log)
+{
+    return log->slots_used < log->num_slots / 4 * 3;
+}
+
+/* Drops tombstones by re-indexing the pending records from the log */
+static int
+index_rebuild(struct plog *log)
+{
+    uint8_t hash[PLOG_HASH_LEN];
+    uint32_t addr = PLOG_NONE;
+    int rc;
+
+    index_clear(log);
+    while ((rc = plog_next(log, addr, &addr)) == PLOG_OK) {
+        if (log_read(log, addr + REC_HASH, hash, sizeof(hash)) != PLOG_OK) {
+            return PLOG_ERR_IO;
+        }
+        index_put(log, hash, addr);
+    }
+    return rc == PLOG_ERR_NOT_FOUND ? PLOG_OK : rc;
+}
+
+/*
+ * Sectors
+ */
+
+static void
+advance_tail(struct plog *log)
+{
+    while (log->tail != log->head && log->pending[log->tail] == 0) {
+        log->tail = (log->tail + 1) % log->num_sectors;
+    }
+}
+
+/* Closes the head sector and opens the next one, which must hold nothing pending */
+static int
+advance_head(struct plog *log)
+{
+    uint32_t next = (log->head + 1) % log->num_sectors;
+    int rc;
+
+    if (log->pending[next] != 0) {
+        return PLOG_ERR_FULL;
+    }
+
+    rc = plog_flush(log);
+    if (rc != PLOG_OK) {
+        return rc;
+    }
+    if (log->flash->erase(log->flash->ctx, sector_addr(next), PLOG_SECTOR_SIZE) != 0) {
+        return PLOG_ERR_IO;
+    }
+
+    /* the sector header goes out with the first batch */
+    log->head = next;
+    log->head_seq += 1;
+    log->flushed_off = 0;
+    log->write_off = PLOG_SECTOR_HDR_LEN;
+    memset(log->batch, 0xff, sizeof(log->batch));
+    put32(&log->batch[0], PLOG_SECTOR_MAGIC);
+    put32(&log->batch[4], log->head_seq);
+    put32(&log->batch[8], ~log->head_seq);
+
+    if (log->num_pending == 0) {
+        log->tail = log->head;
+    }
+    advance_tail(log);
+    return PLOG_OK;
+}
+
+static void
+reset_empty(struct plog *log)
+{
+    memset(log->pending, 0, sizeof(log->pending));
+    log->num_pending = 0;
+    log->head = log->num_sectors - 1;
+    log->head_seq = 0;
+    log->tail = 0;
+    /* nothing open, the first append opens sector 0 */
+    log->write_off = PLOG_SECTOR_SIZE;
+    log->flushed_off = PLOG_SECTOR_SIZE;
+    index_clear(log);
+}
+
+static int
+read_sector_seq(struct plog *log, uint32_t sector, uint32_t *seq)
+{
+    uint8_t hdr[PLOG_SECTOR_HDR_LEN];
+
+    if (log->flash->read(log->flash->ctx, sector_addr(sector), hdr, sizeof(hdr)) != 0) {
+        return PLOG_ERR_IO;
+    }
+    if (get32(&hdr[0]) != PLOG_SECTOR_MAGIC || get32(&hdr[4]) != ~get32(&hdr[8])) {
+        return PLOG_ERR_NOT_FOUND;
+    }
+    *seq = get32(&hdr[4]);
+    return PLOG_OK;
+}
+
+/*
+ * Indexes the valid pending records of one sector and returns where its
+ * written area ends. A record that fails its crc was torn by a reset; it
+ * is marked uploaded so walks skip it, and the sector is closed.
+ */
+static int
+recover_sector(struct plog *log, uint32_t sector, uint32_t *end)
+{
+    uint8_t hdr[PLOG_RECORD_HDR_LEN];
+    uint32_t off = PLOG_SECTOR_HDR_LEN;
+    /* the batch is not in use yet, borrow it for record data */
+    uint8_t *data = log->batch;
+
+    while (off + PLOG_RECORD_HDR_LEN <= PLOG_SECTOR_SIZE) {
+        uint32_t addr = sector_addr(sector) + off;
+        if (log->flash->read(log->flash->ctx, addr, hdr, sizeof(hdr)) != 0) {
+            return PLOG_ERR_IO;
+        }
+
+        uint16_t magic = get16(&hdr[REC_MAGIC]);
+        if (magic == PLOG_ERASED16) {
+            *end = off;
+            return PLOG_OK;
+        }
+
+        uint16_t len = get16(&hdr[REC_LEN]);
+        bool valid = magic == PLOG_RECORD_MAGIC && off + record_size(len) <= PLOG_SECTOR_SIZE;
+        if (valid) {
+            if (log->flash->read(log->flash->ctx, addr + PLOG_RECORD_HDR_LEN, data, len) != 0) {
+                return PLOG_ERR_IO;
+            }
+            valid = record_crc(hdr, data, len) == get32(&hdr[REC_CRC]);
+        }
+        if (!valid) {
+            if (magic == PLOG_RECORD_MAGIC && hdr[REC_STATE] == STATE_PENDING) {
+                uint8_t uploaded = STATE_UPLOADED;
+                log->flash->write(log->flash->ctx, addr + REC_STATE, &uploaded, 1);
+            }
+            *end = PLOG_SECTOR_SIZE;
+            return PLOG_OK;
+        }
+
+        if (hdr[REC_STATE] == STATE_PENDING) {
+            if (!index_has_room(log)) {
+                return PLOG_ERR_FULL;
+            }
+            index_put(log, &hdr[REC_HASH], addr);
+            log->pending[sector] += 1;
+            log->num_pending += 1;
+        }
+        off += record_size(len);
+    }
+
+    *end = PLOG_SECTOR_SIZE;
+    return PLOG_OK;
+}
+
+uint32_t
+plog_index_slots(uint32_t flash_size, uint16_t min_len)
+{
+    uint32_t per_sector = (PLOG_SECTOR_SIZE - PLOG_SECTOR_HDR_LEN) / record_size(min_len);
+    uint32_t records = flash_size / PLOG_SECTOR_SIZE * per_sector;
+    uint32_t slots = 1;
+
+    while (slots / 4 * 3 < records) {
+        slots <<= 1;
+    }
+    return slots;
+}
+
+int
+plog_open(struct plog *log, const struct plog_flash *flash,
+          struct plog_slot *slots, uint32_t num_slots, uint32_t batch_limit)
+{
+    uint32_t seq, head_seq = 0, head = PLOG_NONE;
+    uint32_t sector, count, end = PLOG_SECTOR_SIZE;
+    int rc;
+
+    if (flash->size % PLOG_SECTOR_SIZE != 0 || flash->size / PLOG_SECTOR_SIZE < 2 ||
+            flash->size / PLOG_SECTOR_SIZE > PLOG_MAX_SECTORS ||
+            num_slots == 0 || (num_slots & (num_slots - 1)) != 0) {
+        return PLOG_ERR_PARAM;
+    }
+
+    memset(log, 0, sizeof(*log));
+    log->flash = flash;
+    log->num_sectors = flash->size / PLOG_SECTOR_SIZE;
+    log->slots = slots;
+    log->num_slots = num_slots;
+    log->batch_limit = batch_limit;
+    reset_empty(log);
+
+    /* the head is the sector with the highest seq */
+    for (sector = 0; sector < log->num_sectors; sector++) {
+        rc = read_sector_seq(log, sector, &seq);
+        if (rc == PLOG_ERR_IO) {
+            return rc;
+        }
+        if (rc == PLOG_OK && (head == PLOG_NONE || seq > head_seq)) {
+            head = sector;
+            head_seq = seq;
+        }
+    }
+    if (head == PLOG_NONE) {
+        return PLOG_OK;
+    }
+
+    /* walk back while seq goes down by one to find the oldest sector */
+    log->tail = head;
+    for (count = 1; count < log->num_sectors; count++) {
+        sector = (log->tail + log->num_sectors - 1) % log->num_sectors;
+        rc = read_sector_seq(log, sector, &seq);
+        if (rc == PLOG_ERR_IO) {
+            return rc;
+        }
+        if (rc != PLOG_OK || seq != head_seq - count) {
+            break;
+        }
+        log->tail = sector;
+    }
+
+    /* replay oldest first */
+    for (sector = log->tail; ; sector = (sector + 1) % log->num_sectors) {
+        rc = recover_sector(log, sector, &end);
+        if (rc != PLOG_OK) {
+            return rc;
+        }
+        if (sector == head) {
+            break;
+        }
+    }
+
+    log->head = head;
+    log->head_seq = head_seq;
+    log->write_off = end;
+    log->flushed_off = end;
+    memset(log->batch, 0xff, sizeof(log->batch));
+    advance_tail(log);
+    return PLOG_OK;
+}
+
+int
+plog_format(struct plog *log)
+{
+    for (uint32_t sector = 0; sector < log->num_sectors; sector++) {
+        if (log->flash->erase(log->flash->ctx, sector_addr(sector), PLOG_SECTOR_SIZE) != 0) {
+            return PLOG_ERR_IO;
+        }
+    }
+    reset_empty(log);
+    return PLOG_OK;
+}
+
+int
+plog_flush(struct plog *log)
+{
+    if (log->write_off <= log->flushed_off) {
+        return PLOG_OK;
+    }
+
+    if (log->flash->write(log->flash->ctx, sector_addr(log->head) + log->flushed_off,
+                          log->batch, log->write_off - log->flushed_off) != 0) {
+        return PLOG_ERR_IO;
+    }
+    log->flushed_off = log->write_off;
+    memset(log->batch, 0xff, sizeof(log->batch));
+    return PLOG_OK;
+}
+
+int
+plog_append(struct plog *log, const uint8_t hash[PLOG_HASH_LEN],
+            const void *data, uint16_t len, uint32_t *addr)
+{
+    uint32_t slot, size = record_size(len);
+    int rc;
+
+    if (len > PLOG_MAX_DATA_LEN) {
+        return PLOG_ERR_TOO_BIG;
+    }
+
+    rc = index_find(log, hash, &slot);
+    if (rc != PLOG_ERR_NOT_FOUND) {
+        return rc == PLOG_OK ? PLOG_ERR_EXISTS : rc;
+    }
+    if (!index_has_room(log)) {
+        rc = index_rebuild(log);
+        if (rc != PLOG_OK) {
+            return rc;
+        }
+        if (!index_has_room(log)) {
+            return PLOG_ERR_FULL;
+        }
+    }
+
+    if (log->write_off + size > PLOG_SECTOR_SIZE) {
+        rc = advance_head(log);
+        if (rc != PLOG_OK) {
+            return rc;
+        }
+    }
+
+    uint32_t rec_addr = sector_addr(log->head) + log->write_off;
+    uint8_t *rec = &log->batch[log->write_off - log->flushed_off];
+
+    put16(&rec[REC_MAGIC], PLOG_RECORD_MAGIC);
+    put16(&rec[REC_LEN], len);
+    memset(&rec[REC_STATE], 0xff, REC_HASH - REC_STATE);
+    memcpy(&rec[REC_HASH], hash, PLOG_HASH_LEN);
+    memcpy(&rec[PLOG_RECORD_HDR_LEN], data, len);
+    put32(&rec[REC_CRC], record_crc(rec, &rec[PLOG_RECORD_HDR_LEN], len));
+    log->write_off += size;
+
+    index_put(log, hash, rec_addr);
+    log->pending[log->head] += 1;
+    log->num_pending += 1;
+    if (addr != NULL) {
+        *addr = rec_addr;
+    }
+
+    if (log->batch_limit != 0 && log->write_off - log->flushed_off >= log->batch_limit) {
+        return plog_flush(log);
+    }
+    return PLOG_OK;
+}
+
+int
+plog_find(struct plog *log, const uint8_t hash[PLOG_HASH_LEN], uint32_t *addr)
+{
+    uint32_t slot;
+    int rc = index_find(log, hash, &slot);
+
+    if (rc == PLOG_OK) {
+        *addr = log->slots[slot].addr;
+    }
+    return rc;
+}
+
+int
+plog_read(struct plog *log, uint32_t addr, uint8_t hash[PLOG_HASH_LEN],
+          void *data, uint16_t *len)
+{
+    uint8_t hdr[PLOG_RECORD_HDR_LEN];
+
+    if (log_read(log, addr, hdr, sizeof(hdr)) != PLOG_OK) {
+        return PLOG_ERR_IO;
+    }
+    if (get16(&hdr[REC_MAGIC]) != PLOG_RECORD_MAGIC) {
+        return PLOG_ERR_NOT_FOUND;
+    }
+
+    uint16_t rec_len = get16(&hdr[REC_LEN]);
+    if (rec_len > *len) {
+        *len = rec_len;
+        return PLOG_ERR_PARAM;
+    }
+    if (log_read(log, addr + PLOG_RECORD_HDR_LEN, data, rec_len) != PLOG_OK) {
+        return PLOG_ERR_IO;
+    }
+    if (record_crc(hdr, data, rec_len) != get32(&hdr[REC_CRC])) {
+        return PLOG_ERR_CORRUPT;
+    }
+
+    *len = rec_len;
+    if (hash != NULL) {
+        memcpy(hash, &hdr[REC_HASH], PLOG_HASH_LEN);
+    }
+    return PLOG_OK;
+}
+
+int
+plog_next(struct plog *log, uint32_t addr, uint32_t *next)
+{
+    uint8_t hdr[REC_HASH];
+    uint32_t sector, off;
+
+    if (log->num_pending == 0) {
+        return PLOG_ERR_NOT_FOUND;
+    }
+
+    if (addr == PLOG_NONE) {
+        sector = log->tail;
+        off = PLOG_SECTOR_HDR_LEN;
+    } else {
+        if (log_read(log, addr, hdr, sizeof(hdr)) != PLOG_OK) {
+            return PLOG_ERR_IO;
+        }
+        sector = addr / PLOG_SECTOR_SIZE;
+        off = addr % PLOG_SECTOR_SIZE + record_size(get16(&hdr[REC_LEN]));
+    }
+
+    for (;;) {
+        uint32_t end = sector == log->head ? log->write_off : PLOG_SECTOR_SIZE;
+
+        /* skip sectors with nothing left to upload */
+        while (log->pending[sector] != 0 && off + PLOG_RECORD_HDR_LEN <= end) {
+            uint32_t rec_addr = sector_addr(sector) + off;
+            if (log_read(log, rec_addr, hdr, sizeof(hdr)) != PLOG_OK) {
+                return PLOG_ERR_IO;
+            }
+            uint16_t len = get16(&hdr[REC_LEN]);
+            if (get16(&hdr[REC_MAGIC]) != PLOG_RECORD_MAGIC || len > PLOG_MAX_DATA_LEN) {
+                break;
+            }
+            if (hdr[REC_STATE] == STATE_PENDING) {
+                *next = rec_addr;
+                return PLOG_OK;
+            }
+            off += record_size(len);
+        }
+
+        if (sector == log->head) {
+            return PLOG_ERR_NOT_FOUND;
+        }
+        sector = (sector + 1) % log->num_sectors;
+        off = PLOG_SECTOR_HDR_LEN;
+    }
+}
+
+int
+plog_consume(struct plog *log, uint32_t addr)
+{
+    uint8_t hdr[PLOG_RECORD_HDR_LEN];
+    uint32_t sector = addr / PLOG_SECTOR_SIZE;
+    uint32_t off = addr % PLOG_SECTOR_SIZE;
+    uint32_t slot;
+    int rc;
+
+    if (log_read(log, addr, hdr, sizeof(hdr)) != PLOG_OK) {
+        return PLOG_ERR_IO;
+    }
+    if (get16(&hdr[REC_MAGIC]) != PLOG_RECORD_MAGIC || hdr[REC_STATE] != STATE_PENDING) {
+        return PLOG_ERR_NOT_FOUND;
+    }
+
+    if (sector == log->head && off >= log->flushed_off) {
+        log->batch[off - log->flushed_off + REC_STATE] = STATE_UPLOADED;
+    } else {
+        uint8_t uploaded = STATE_UPLOADED;
+        if (log->flash->write(log->flash->ctx, addr + REC_STATE, &uploaded, 1) != 0) {
+            return PLOG_ERR_IO;
+        }
+    }
+
+    rc = index_find(log, &hdr[REC_HASH], &slot);
+    if (rc == PLOG_OK && log->slots[slot].addr == addr) {
+        log->slots[slot].addr = SLOT_TOMBSTONE;
+    }
+
+    log->pending[sector] -= 1;
+    log->num_pending -= 1;
+    advance_tail(log);
+    return PLOG_OK;
+}
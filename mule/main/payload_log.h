@@ -0,0 +1,143 @@
+/*
+ * Append-only payload log on a flash partition
+ *
+ * Payloads collected from sensors are appended as records to a ring of
+ * flash sectors and stay there until they are marked uploaded. Appends are
+ * batched in RAM and written one run at a time; an in-RAM index keyed by
+ * the payload's SHA-256 finds a record without scanning the log.
+ *
+ * Layout, all integers little endian:
+ *
+ *   sector:  magic "PLOG" (4) | seq (4) | ~seq (4) | record | record | ... | 0xff...
+ *   record:  magic 0x4c50 (2) | len (2) | state (1) | 0xff (3) |
+ *            hash (32) | crc32 of len, hash and data (4) | data | pad to 4
+ *
+ * Records never span sectors. Sector seq grows by one every time the head
+ * moves on (the inverted copy catches a header torn while it was written),
+ * so after a reset plog_open walks the sectors in seq order and
+ * rebuilds the index from every record whose crc matches. A record torn by
+ * a reset fails its crc, ends its sector, and appends go on in a fresh one.
+ * Marking a record uploaded only clears bits in its state byte, which flash
+ * allows without an erase.
+ *
+ * The flash is reached through struct plog_flash so the same code runs on
+ * an esp_partition and on the file-backed emulator used on the host.
+ */
+
+#ifndef H_PAYLOAD_LOG_
+#define H_PAYLOAD_LOG_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PLOG_SECTOR_SIZE    4096
+#define PLOG_MAX_SECTORS    512
+#define PLOG_HASH_LEN       32
+#define PLOG_SECTOR_HDR_LEN 12
+#define PLOG_RECORD_HDR_LEN 44
+#define PLOG_MAX_DATA_LEN   (PLOG_SECTOR_SIZE - PLOG_SECTOR_HDR_LEN - PLOG_RECORD_HDR_LEN)
+
+#define PLOG_NONE           0xffffffff  /* no record / start of the log */
+
+#define PLOG_OK             0
+#define PLOG_ERR_IO         -1  /* flash driver error */
+#define PLOG_ERR_FULL       -2  /* no sector or index slot left until records are uploaded */
+#define PLOG_ERR_TOO_BIG    -3  /* payload longer than PLOG_MAX_DATA_LEN */
+#define PLOG_ERR_EXISTS     -4  /* a pending record with this hash is already logged */
+#define PLOG_ERR_NOT_FOUND  -5
+#define PLOG_ERR_CORRUPT    -6  /* record failed its crc */
+#define PLOG_ERR_PARAM      -7
+
+struct plog_flash {
+    int (*read)(void *ctx, uint32_t addr, void *buf, size_t len);
+    int (*write)(void *ctx, uint32_t addr, const void *buf, size_t len);
+    int (*erase)(void *ctx, uint32_t addr, size_t len);  /* whole sectors */
+    uint32_t size;  /* bytes, a multiple of PLOG_SECTOR_SIZE */
+    void *ctx;
+};
+
+/* Index entry: the first 4 bytes of the hash and the record address */
+struct plog_slot {
+    uint32_t key;
+    uint32_t addr;
+};
+
+struct plog {
+    const struct plog_flash *flash;
+    uint32_t num_sectors;
+    uint32_t head;          /* sector appends go to */
+    uint32_t head_seq;
+    uint32_t tail;          /* oldest sector that may hold pending records */
+    uint32_t write_off;     /* next record offset in the head sector */
+    uint32_t flushed_off;   /* head sector bytes below this are on flash */
+    uint32_t batch_limit;   /* flush once this many bytes are batched */
+    uint16_t pending[PLOG_MAX_SECTORS];  /* records not uploaded, per sector */
+    uint32_t num_pending;
+
+    struct plog_slot *slots;
+    uint32_t num_slots;     /* power of two */
+    uint32_t slots_used;    /* live entries and tombstones */
+
+    /* head sector image from flushed_off on, written out by plog_flush */
+    uint8_t batch[PLOG_SECTOR_SIZE];
+};
+
+/*
+ * Mounts the log, recovering it from flash. slots is caller memory for the
+ * index (num_slots a power of two, at most 3/4 of it is used); batch_limit
+ * 0 means flush only when a sector fills or on plog_flush.
+ */
+int plog_open(struct plog *log, const struct plog_flash *flash,
+              struct plog_slot *slots, uint32_t num_slots, uint32_t batch_limit);
+
+/*
+ * Index size for a log of flash_size bytes: a power of two whose usable 3/4
+ * covers every record the flash can hold when no payload is shorter than
+ * min_len
+ */
+uint32_t plog_index_slots(uint32_t flash_size, uint16_t min_len);
+
+/* Erases the partition and starts an empty log */
+int plog_format(struct plog *log);
+
+/* Appends a payload keyed by hash. *addr (optional) gets the record address. */
+int plog_append(struct plog *log, const uint8_t hash[PLOG_HASH_LEN],
+                const void *data, uint16_t len, uint32_t *addr);
+
+/* Writes batched records to flash */
+int plog_flush(struct plog *log);
+
+/* Address of the pending record for hash */
+int plog_find(struct plog *log, const uint8_t hash[PLOG_HASH_LEN], uint32_t *addr);
+
+/*
+ * Reads a record. hash may be NULL; *len is the capacity of data on entry
+ * and the payload length on return.
+ */
+int plog_read(struct plog *log, uint32_t addr, uint8_t hash[PLOG_HASH_LEN],
+              void *data, uint16_t *len);
+
+/*
+ * Oldest pending record after addr (PLOG_NONE for the first one), for
+ * walking the log in upload order. Returns PLOG_ERR_NOT_FOUND at the end.
+ */
+int plog_next(struct plog *log, uint32_t addr, uint32_t *next);
+
+/* Marks a record uploaded so its sector can be reused */
+int plog_consume(struct plog *log, uint32_t addr);
+
+static inline uint32_t plog_count(const struct plog *log)
+{
+    return log->num_pending;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
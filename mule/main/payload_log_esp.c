@@ -0,0 +1,42 @@
+#include "esp_partition.h"
+#include "payload_log_esp.h"
+
+static int
+plog_esp_read(void *ctx, uint32_t addr, void *buf, size_t len)
+{
+    return esp_partition_read(ctx, addr, buf, len) == ESP_OK ? 0 : -1;
+}
+
+static int
+plog_esp_write(void *ctx, uint32_t addr, const void *buf, size_t len)
+{
+    return esp_partition_write(ctx, addr, buf, len) == ESP_OK ? 0 : -1;
+}
+
+static int
+plog_esp_erase(void *ctx, uint32_t addr, size_t len)
+{
+    return esp_partition_erase_range(ctx, addr, len) == ESP_OK ? 0 : -1;
+}
+
+int
+plog_esp_flash_init(struct plog_flash *flash, const char *label)
+{
+    const esp_partition_t *part = esp_partition_find_first(
+        ESP_PARTITION_TYPE_DATA, PLOG_PARTITION_SUBTYPE, label);
+
+    if (part == NULL) {
+        return PLOG_ERR_NOT_FOUND;
+    }
+
+    flash->read = plog_esp_read;
+    flash->write = plog_esp_write;
+    flash->erase = plog_esp_erase;
+    /* the log only uses whole sectors */
+    flash->size = part->size / PLOG_SECTOR_SIZE * PLOG_SECTOR_SIZE;
+    if (flash->size > PLOG_MAX_SECTORS * PLOG_SECTOR_SIZE) {
+        flash->size = PLOG_MAX_SECTORS * PLOG_SECTOR_SIZE;
+    }
+    flash->ctx = (void *)part;
+    return PLOG_OK;
+}
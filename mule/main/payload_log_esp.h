@@ -0,0 +1,23 @@
+/*
+ * struct plog_flash on an esp_partition
+ */
+
+#ifndef H_PAYLOAD_LOG_ESP_
+#define H_PAYLOAD_LOG_ESP_
+
+#include "payload_log.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PLOG_PARTITION_SUBTYPE 0x40  /* data partition, see partitions.csv */
+
+/* Binds flash to the data partition with the given label */
+int plog_esp_flash_init(struct plog_flash *flash, const char *label);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,338 @@
+/*
+ * Host build of the payload log with a file-backed flash emulator
+ *
+ * The emulator behaves like SPI NOR flash: erase sets a sector to 0xff and
+ * a write can only clear bits. It also charges every operation with a time
+ * from a simple ESP32 flash cost model, so the benchmark reports what an
+ * append costs on the mule rather than on the host.
+ *
+ *   plog_bench [flash_file] [payload_bytes] [num_payloads]
+ *
+ * Runs three things and exits non-zero if any check fails:
+ *  - throughput and per-append latency for a range of batch limits
+ *  - a ring that wraps while records are consumed, then is reopened
+ *  - resets in the middle of a flash write at many points, after which
+ *    every record flushed before the reset must still be readable
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "payload_log.h"
+
+#define FLASH_SECTORS   64
+#define NUM_SLOTS       2048
+
+/* ESP32 SPI flash, roughly: a 4 KB erase, a 256 B page program, and call overhead */
+#define COST_ERASE_US   45000
+#define COST_PAGE_US    700
+#define COST_CALL_US    20
+#define COST_READ_US_KB 25
+
+struct emu {
+    FILE *f;
+    uint32_t size;
+    long budget;        /* bytes left before a simulated reset, -1 for none */
+    unsigned long long cost_us;
+    unsigned long writes, erases;
+};
+
+static int emu_read(void *ctx, uint32_t addr, void *buf, size_t len)
+{
+    struct emu *e = ctx;
+    e->cost_us += COST_CALL_US + len * COST_READ_US_KB / 1024;
+    if (addr + len > e->size || fseek(e->f, addr, SEEK_SET) != 0) {
+        return -1;
+    }
+    return fread(buf, 1, len, e->f) == len ? 0 : -1;
+}
+
+static int emu_write(void *ctx, uint32_t addr, const void *buf, size_t len)
+{
+    struct emu *e = ctx;
+    const uint8_t *src = buf;
+    uint8_t old[PLOG_SECTOR_SIZE];
+    int torn = 0;
+
+    if (addr + len > e->size || len > sizeof(old)) {
+        return -1;
+    }
+    if (e->budget >= 0 && (long)len > e->budget) {
+        len = e->budget;
+        torn = 1;
+    }
+    if (e->budget >= 0) {
+        e->budget -= len;
+    }
+
+    fseek(e->f, addr, SEEK_SET);
+    if (fread(old, 1, len, e->f) != len) {
+        return -1;
+    }
+    for (size_t i = 0; i < len; i++) {
+        old[i] &= src[i];
+    }
+    fseek(e->f, addr, SEEK_SET);
+    fwrite(old, 1, len, e->f);
+
+    e->writes += 1;
+    e->cost_us += COST_CALL_US + ((addr + len + 255) / 256 - addr / 256) * COST_PAGE_US;
+    return torn ? -1 : 0;
+}
+
+static int emu_erase(void *ctx, uint32_t addr, size_t len)
+{
+    struct emu *e = ctx;
+    uint8_t ff[PLOG_SECTOR_SIZE];
+
+    if (addr % PLOG_SECTOR_SIZE || len % PLOG_SECTOR_SIZE || addr + len > e->size) {
+        return -1;
+    }
+    if (e->budget == 0) {
+        return -1;
+    }
+    memset(ff, 0xff, sizeof(ff));
+    fseek(e->f, addr, SEEK_SET);
+    for (size_t off = 0; off < len; off += sizeof(ff)) {
+        fwrite(ff, 1, sizeof(ff), e->f);
+        e->erases += 1;
+        e->cost_us += COST_ERASE_US;
+    }
+    return 0;
+}
+
+static struct emu emu;
+static struct plog_flash flash = {
+    .read = emu_read, .write = emu_write, .erase = emu_erase,
+    .size = FLASH_SECTORS * PLOG_SECTOR_SIZE, .ctx = &emu,
+};
+static struct plog log_;
+static struct plog_slot slots[NUM_SLOTS];
+static uint8_t payload[PLOG_MAX_DATA_LEN];
+static int failures;
+
+#define CHECK(cond, ...) do { if (!(cond)) { \
+    printf("FAIL %s:%d: ", __FILE__, __LINE__); printf(__VA_ARGS__); printf("\n"); \
+    failures += 1; } } while (0)
+
+/* Stand-in for the SHA-256 the mule computes: unique per payload id */
+static void make_hash(uint32_t id, uint8_t hash[PLOG_HASH_LEN])
+{
+    uint64_t x = id * 0x9e3779b97f4a7c15ull + 1;
+    for (int i = 0; i < PLOG_HASH_LEN; i++) {
+        x ^= x >> 29;
+        x *= 0xbf58476d1ce4e5b9ull;
+        hash[i] = x >> 56;
+    }
+}
+
+static void make_payload(uint32_t id, uint8_t *buf, uint16_t len)
+{
+    for (uint16_t i = 0; i < len; i++) {
+        buf[i] = (uint8_t)(id * 31 + i);
+    }
+}
+
+static uint32_t id_of(const uint8_t *buf)
+{
+    return buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((uint32_t)buf[3] << 24);
+}
+
+/* Payload ids are stored in the first four bytes so a read can be checked */
+static int append_id(uint32_t id, uint16_t len)
+{
+    uint8_t hash[PLOG_HASH_LEN];
+    make_hash(id, hash);
+    make_payload(id, payload, len);
+    memcpy(payload, &id, 4);
+    return plog_append(&log_, hash, payload, len, NULL);
+}
+
+static int check_record(uint32_t addr, uint16_t len)
+{
+    uint8_t hash[PLOG_HASH_LEN], want[PLOG_HASH_LEN];
+    uint8_t buf[PLOG_MAX_DATA_LEN];
+    uint16_t got = sizeof(buf);
+
+    if (plog_read(&log_, addr, hash, buf, &got) != PLOG_OK || got != len) {
+        return 0;
+    }
+    uint32_t id = id_of(buf);
+    make_hash(id, want);
+    make_payload(id, payload, len);
+    memcpy(payload, &id, 4);
+    return memcmp(hash, want, sizeof(want)) == 0 && memcmp(buf, payload, len) == 0;
+}
+
+static void emu_reset(const char *path)
+{
+    if (emu.f) {
+        fclose(emu.f);
+    }
+    emu.f = fopen(path, "w+b");
+    if (emu.f == NULL) {
+        perror(path);
+        exit(2);
+    }
+    emu.size = flash.size;
+    emu.budget = -1;
+    /* a partition fresh from the factory */
+    emu_erase(&emu, 0, emu.size);
+}
+
+static void emu_zero_stats(void)
+{
+    emu.cost_us = 0;
+    emu.writes = emu.erases = 0;
+}
+
+static void bench(const char *path, uint16_t len, uint32_t count)
+{
+    static const uint32_t limits[] = { 1, 256, 1024, 2048, 0 };
+
+    printf("%-8s %10s %10s %8s %8s %10s %10s\n",
+           "batch", "appends/s", "kB/s", "writes", "erases", "avg_us", "max_us");
+    for (size_t i = 0; i < sizeof(limits) / sizeof(limits[0]); i++) {
+        unsigned long long max_us = 0, before;
+        uint32_t n;
+
+        emu_reset(path);
+        plog_open(&log_, &flash, slots, NUM_SLOTS, limits[i]);
+        emu_zero_stats();
+
+        for (n = 0; n < count; n++) {
+            before = emu.cost_us;
+            int rc = append_id(n, len);
+            if (rc == PLOG_ERR_FULL) {
+                break;
+            }
+            CHECK(rc == PLOG_OK, "append %u rc=%d", n, rc);
+            if (emu.cost_us - before > max_us) {
+                max_us = emu.cost_us - before;
+            }
+        }
+        plog_flush(&log_);
+
+        double secs = emu.cost_us / 1e6;
+        char name[16];
+        snprintf(name, sizeof(name), limits[i] ? "%u" : "sector", limits[i]);
+        printf("%-8s %10.0f %10.1f %8lu %8lu %10.0f %10llu\n", name,
+               n / secs, n * (double)len / 1024 / secs, emu.writes, emu.erases,
+               emu.cost_us / (double)n, max_us);
+
+        /* every record comes back from a fresh mount */
+        plog_open(&log_, &flash, slots, NUM_SLOTS, limits[i]);
+        CHECK(plog_count(&log_) == n, "remount found %u of %u", plog_count(&log_), n);
+    }
+}
+
+static void wrap(const char *path, uint16_t len)
+{
+    uint32_t addr, next_id = 0, consumed = 0;
+    int rc;
+
+    emu_reset(path);
+    plog_open(&log_, &flash, slots, NUM_SLOTS, 1024);
+
+    /* go around the ring several times, uploading the oldest half whenever it fills */
+    while (next_id < 20u * FLASH_SECTORS * PLOG_SECTOR_SIZE / (len + PLOG_RECORD_HDR_LEN)) {
+        rc = append_id(next_id, len);
+        if (rc == PLOG_ERR_FULL) {
+            uint32_t half = plog_count(&log_) / 2;
+            for (uint32_t i = 0; i < half; i++) {
+                CHECK(plog_next(&log_, PLOG_NONE, &addr) == PLOG_OK, "next");
+                CHECK(check_record(addr, len), "wrap read at %u", addr);
+                CHECK(id_of(payload) == consumed, "upload order %u != %u", id_of(payload), consumed);
+                plog_consume(&log_, addr);
+                consumed += 1;
+            }
+            continue;
+        }
+        CHECK(rc == PLOG_OK, "wrap append rc=%d", rc);
+        next_id += 1;
+    }
+
+    /* a duplicate of a pending payload is refused, an uploaded one is not pending */
+    CHECK(append_id(next_id - 1, len) == PLOG_ERR_EXISTS, "duplicate accepted");
+
+    uint32_t pending = plog_count(&log_);
+    plog_flush(&log_);
+    plog_open(&log_, &flash, slots, NUM_SLOTS, 1024);
+    CHECK(plog_count(&log_) == pending, "wrap remount %u != %u", plog_count(&log_), pending);
+    CHECK(plog_next(&log_, PLOG_NONE, &addr) == PLOG_OK && check_record(addr, len) &&
+          id_of(payload) == consumed, "oldest after remount");
+    printf("wrap: %u appended, %u uploaded, %u pending after remount\n",
+           next_id, consumed, plog_count(&log_));
+}
+
+static void crash(const char *path, uint16_t len)
+{
+    int points = 0;
+
+    for (long budget = 0; budget < 3 * PLOG_SECTOR_SIZE; budget += 97) {
+        uint32_t durable = 0, n = 0, addr = PLOG_NONE;
+        int rc = PLOG_OK;
+
+        emu_reset(path);
+        plog_open(&log_, &flash, slots, NUM_SLOTS, 0);
+        emu.budget = budget;
+
+        /* flush after every third append; a flush that returns OK made them durable */
+        while (rc == PLOG_OK) {
+            rc = append_id(n, len);
+            if (rc != PLOG_OK) {
+                break;
+            }
+            n += 1;
+            if (n % 3 == 0) {
+                rc = plog_flush(&log_);
+                if (rc == PLOG_OK) {
+                    durable = n;
+                }
+            }
+        }
+
+        /* power comes back */
+        emu.budget = -1;
+        rc = plog_open(&log_, &flash, slots, NUM_SLOTS, 0);
+        CHECK(rc == PLOG_OK, "remount after reset at %ld rc=%d", budget, rc);
+
+        uint32_t found = 0;
+        while (plog_next(&log_, addr, &addr) == PLOG_OK) {
+            CHECK(check_record(addr, len), "bad record after reset at %ld", budget);
+            CHECK(id_of(payload) == found, "gap after reset at %ld", budget);
+            found += 1;
+        }
+        CHECK(found >= durable && found <= n, "reset at %ld: %u found, %u durable, %u appended",
+              budget, found, durable, n);
+
+        /* and the log takes appends again */
+        CHECK(append_id(1000000, len) == PLOG_OK && plog_flush(&log_) == PLOG_OK,
+              "append after reset at %ld", budget);
+        points += 1;
+    }
+    printf("crash: %d reset points recovered\n", points);
+}
+
+int main(int argc, char **argv)
+{
+    const char *path = argc > 1 ? argv[1] : "plog_flash.bin";
+    uint16_t len = argc > 2 ? atoi(argv[2]) : 1000;
+    uint32_t count = argc > 3 ? strtoul(argv[3], NULL, 0) : 200;
+
+    if (len < 4 || len > PLOG_MAX_DATA_LEN) {
+        fprintf(stderr, "payload_bytes must be 4..%d\n", PLOG_MAX_DATA_LEN);
+        return 2;
+    }
+
+    printf("%u sectors, %u B payloads, %u appends (modeled ESP32 flash time)\n",
+           FLASH_SECTORS, len, count);
+    bench(path, len, count);
+    wrap(path, len);
+    crash(path, len);
+
+    fclose(emu.f);
+    remove(path);
+    printf("%s\n", failures ? "FAILED" : "ok");
+    return failures ? 1 : 0;
+}
@@ -11,11 +11,11 @@ int main(void)
 
     uint8_t plaintext[] = "Your message here!";
     size_t length = sizeof(plaintext) - 1; // Subtract 1 to ignore the null-terminator
-    size_t payload_length = NRF_CRYPTO_AES_IV_SIZE + length + NRF_CRYPTO_AES_IV_SIZE;
+    size_t payload_length = NRF_CRYPTO_AES_IV_SIZE + length + AES_GCM_TAG_SIZE;
     uint8_t payload[payload_length];
 
     // Encrypt the character array
-    //encrypt_character_array(key, iv, plaintext, payload, length);
+    encrypt_character_array(key, iv, plaintext, payload, length);
 
     // Print the encrypted payload
     printf("Encrypted payload: ");
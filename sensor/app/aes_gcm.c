@@ -1,57 +1,63 @@
+#include <stdio.h>
+#include <string.h>
 #include "aes_gcm.h"
-#include "nrf_crypto.h"
-#include "nrf_crypto_aes.h"
 
-void encrypt_character_array(const uint8_t *key, const uint8_t *iv, const uint8_t *plaintext, uint8_t *payload, size_t length)
+int aes_gcm_start(struct aes_gcm_ctx *ctx, const uint8_t *key, const uint8_t *iv,
+                  const uint8_t *aad, size_t aad_len)
 {
-    ret_code_t ret_val;
-    nrf_crypto_aes_context_t aes_ctx;
-
-    // Initialize AES-128 GCM context
-    ret_val = nrf_crypto_aes_init(&aes_ctx, &g_nrf_crypto_aes_gcm_128_info, NRF_CRYPTO_ENCRYPT);
-    if (ret_val != NRF_SUCCESS)
-    {
-        printf("Failed to initialize AES context. Error: 0x%x\n", ret_val);
-        return;
-    }
+    int ret;
 
-    // Set the encryption key
-    ret_val = nrf_crypto_aes_key_set(&aes_ctx, key);
-    if (ret_val != NRF_SUCCESS)
-    {
-        printf("Failed to set AES key. Error: 0x%x\n", ret_val);
-        return;
+    mbedtls_gcm_init(&ctx->gcm);
+    ctx->partial = 0;
+    ret = mbedtls_gcm_setkey(&ctx->gcm, MBEDTLS_CIPHER_ID_AES, key, NRF_CRYPTO_AES_KEY_SIZE * 8);
+    if (ret != 0) {
+        return ret;
     }
+    return mbedtls_gcm_starts(&ctx->gcm, MBEDTLS_GCM_ENCRYPT, iv, NRF_CRYPTO_AES_IV_SIZE, aad, aad_len);
+}
 
-    // Set the IV
-    //ret_val = nrf_crypto_aes_iv_set(&aes_ctx, iv, NRF_CRYPTO_AES_IV_SIZE);
-    if (ret_val != NRF_SUCCESS)
-    {
-        printf("Failed to set AES IV. Error: 0x%x\n", ret_val);
-        return;
+int aes_gcm_update(struct aes_gcm_ctx *ctx, const uint8_t *in, uint8_t *out, size_t len)
+{
+    // mbedtls_gcm_update treats a short block as the end of the message
+    if (ctx->partial) {
+        return AES_GCM_ERR_BAD_INPUT;
     }
+    ctx->partial = len % AES_GCM_BLOCK_SIZE != 0;
+    return mbedtls_gcm_update(&ctx->gcm, len, in, out);
+}
 
-    // Encrypt the plaintext using AES-128 GCM
-    uint8_t ciphertext[length];
-    ret_val = nrf_crypto_aes_update(&aes_ctx, plaintext, length, ciphertext);
-    if (ret_val != NRF_SUCCESS)
-    {
-        printf("Encryption failed. Error: 0x%x\n", ret_val);
-        return;
-    }
+int aes_gcm_finish(struct aes_gcm_ctx *ctx, uint8_t *tag, size_t tag_len)
+{
+    return mbedtls_gcm_finish(&ctx->gcm, tag, tag_len);
+}
 
-    // Compute the authentication tag
-    uint8_t tag[NRF_CRYPTO_AES_IV_SIZE];
-    //ret_val = nrf_crypto_aes_finalize(&aes_ctx, tag, NRF_CRYPTO_AES_IV_SIZE);
-    if (ret_val != NRF_SUCCESS)
-    {
-        printf("Failed to compute authentication tag. Error: 0x%x\n", ret_val);
-        return;
-    }
+void aes_gcm_free(struct aes_gcm_ctx *ctx)
+{
+    // drops the key schedule and hash key as well
+    mbedtls_gcm_free(&ctx->gcm);
+}
+
+int encrypt_character_array(const uint8_t *key, const uint8_t *iv, const uint8_t *plaintext, uint8_t *payload, size_t length)
+{
+    struct aes_gcm_ctx ctx;
+    int ret;
 
-    // Create the payload with the structure: IV || Ciphertext || Authentication Tag
+    // IV first, so plaintext may already sit where the ciphertext goes
+    memmove(payload + NRF_CRYPTO_AES_IV_SIZE, plaintext, length);
     memcpy(payload, iv, NRF_CRYPTO_AES_IV_SIZE);
-    memcpy(payload + NRF_CRYPTO_AES_IV_SIZE, ciphertext, length);
-    memcpy(payload + NRF_CRYPTO_AES_IV_SIZE + length, tag, NRF_CRYPTO_AES_IV_SIZE);
-}
 
+    ret = aes_gcm_start(&ctx, key, iv, NULL, 0);
+    if (ret == 0) {
+        ret = aes_gcm_update(&ctx, payload + NRF_CRYPTO_AES_IV_SIZE,
+                             payload + NRF_CRYPTO_AES_IV_SIZE, length);
+    }
+    if (ret == 0) {
+        ret = aes_gcm_finish(&ctx, payload + NRF_CRYPTO_AES_IV_SIZE + length, AES_GCM_TAG_SIZE);
+    }
+    aes_gcm_free(&ctx);
+
+    if (ret != 0) {
+        printf("AES-GCM encryption failed. Error: %d\n", ret);
+    }
+    return ret;
+}
@@ -3,11 +3,39 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include "mbedtls/gcm.h"
 
 #define NRF_CRYPTO_AES_KEY_SIZE 16 // AES-128 bit key size
 #define NRF_CRYPTO_AES_IV_SIZE 12 // AES GCM uses a 12-byte IV
+#define AES_GCM_BLOCK_SIZE 16
+#define AES_GCM_TAG_SIZE 16
+#define AES_GCM_ERR_BAD_INPUT -1   // otherwise an mbedtls_gcm error code
 
-void encrypt_character_array(const uint8_t *key, const uint8_t *iv, const uint8_t *plaintext, uint8_t *payload, size_t length);
+/*
+ * Streaming AES-GCM encryption
+ *
+ * aes_gcm_update may encrypt in place (in == out), so a payload can be
+ * encrypted one BLE chunk at a time, right in the buffer the chunk is sent
+ * from, while earlier chunks are on the air. Every call but the last must
+ * be a whole number of AES_GCM_BLOCK_SIZE blocks; the last may be shorter.
+ *
+ * This is mbedtls_gcm, so its block cipher runs on the CC310 when the
+ * mbed TLS AES ALT hook is enabled (CRYPTO_BACKEND=cc310).
+ */
+struct aes_gcm_ctx {
+    mbedtls_gcm_context gcm;
+    uint8_t partial;            // the last update ended mid-block
+};
 
-#endif // AES_GCM_H
+int aes_gcm_start(struct aes_gcm_ctx *ctx, const uint8_t *key, const uint8_t *iv,
+                  const uint8_t *aad, size_t aad_len);
+int aes_gcm_update(struct aes_gcm_ctx *ctx, const uint8_t *in, uint8_t *out, size_t len);
+int aes_gcm_finish(struct aes_gcm_ctx *ctx, uint8_t *tag, size_t tag_len);
+void aes_gcm_free(struct aes_gcm_ctx *ctx);
+
+// Writes IV || ciphertext || tag to payload, which needs
+// NRF_CRYPTO_AES_IV_SIZE + length + AES_GCM_TAG_SIZE bytes. plaintext may
+// be payload + NRF_CRYPTO_AES_IV_SIZE to encrypt in place.
+int encrypt_character_array(const uint8_t *key, const uint8_t *iv, const uint8_t *plaintext, uint8_t *payload, size_t length);
 
+#endif // AES_GCM_H
@@ -0,0 +1,389 @@
+#ifdef CRYPTO_BENCH
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "nrf.h"
+#include "nrf_crypto.h"
+#include "mbedtls/aes.h"
+#include "mbedtls/sha256.h"
+#include "mbedtls/ecdsa.h"
+#include "mbedtls/ecdh.h"
+#include "mbedtls/platform.h"
+#include "mbedtls/ssl.h"
+#include "aes_gcm.h"
+#include "crypto_bench.h"
+
+#ifdef CRYPTO_BACKEND_CC310
+#define BACKEND "cc310"
+#else
+#define BACKEND "software"
+#endif
+
+// Runs op up to iters times, stopping at the first nonzero return
+#define BENCH(backend, name, iters, op) do {                        \
+        int ret_ = 0;                                               \
+        unsigned i_;                                                \
+        uint32_t start_ = DWT->CYCCNT;                              \
+        for (i_ = 0; i_ < (iters) && ret_ == 0; i_++) {             \
+            ret_ = (op);                                            \
+        }                                                           \
+        report(backend, name, DWT->CYCCNT - start_, i_, ret_);      \
+    } while (0)
+
+#ifndef CRYPTO_BENCH_PIPE_LEN
+#define CRYPTO_BENCH_PIPE_LEN 4096  // datagrams in flight per direction
+#endif
+
+static uint8_t buf[CRYPTO_BENCH_BUF_LEN];
+static const uint8_t key[NRF_CRYPTO_AES_KEY_SIZE] = { 0 };
+static const uint8_t iv[NRF_CRYPTO_AES_IV_SIZE] = { 0 };
+
+static void report(const char *backend, const char *name, uint32_t cycles, unsigned iters, int ret)
+{
+    if (ret != 0) {
+        printf("bench %-9s %-22s failed: %d\n", backend, name, ret);
+        return;
+    }
+    uint32_t per_op = cycles / iters;
+    printf("bench %-9s %-22s %10lu cycles/op %8lu us/op\n", backend, name,
+           (unsigned long)per_op, (unsigned long)(per_op / (SystemCoreClock / 1000000)));
+}
+
+// Keys only need to be valid here, not secret
+static int bench_rng(void *state, unsigned char *out, size_t len)
+{
+    uint32_t *x = state;
+    for (size_t i = 0; i < len; i++) {
+        *x ^= *x << 13;
+        *x ^= *x >> 17;
+        *x ^= *x << 5;
+        out[i] = (uint8_t)*x;
+    }
+    return 0;
+}
+
+static int gcm_once(void)
+{
+    struct aes_gcm_ctx ctx;
+    uint8_t tag[AES_GCM_TAG_SIZE];
+
+    int ret = aes_gcm_start(&ctx, key, iv, NULL, 0);
+    if (ret == 0) {
+        ret = aes_gcm_update(&ctx, buf, buf, sizeof(buf));
+    }
+    if (ret == 0) {
+        ret = aes_gcm_finish(&ctx, tag, sizeof(tag));
+    }
+    aes_gcm_free(&ctx);
+    return ret;
+}
+
+static void bench_mbedtls(void)
+{
+    uint32_t seed = 0x2545f491;
+    uint8_t hash[32] = { 0 };
+    mbedtls_aes_context aes;
+    mbedtls_ecdsa_context ecdsa;
+    mbedtls_mpi r, s, d, z;
+    mbedtls_ecp_point q;
+    int ret;
+
+    mbedtls_aes_init(&aes);
+    ret = mbedtls_aes_setkey_enc(&aes, key, NRF_CRYPTO_AES_KEY_SIZE * 8);
+    if (ret == 0) {
+        BENCH(BACKEND, "aes-128 block", 1000, mbedtls_aes_crypt_ecb(&aes, MBEDTLS_AES_ENCRYPT, buf, buf));
+    }
+    mbedtls_aes_free(&aes);
+
+    BENCH(BACKEND, "aes-gcm stream 1k", 10, gcm_once());
+    BENCH(BACKEND, "sha-256 1k", 20, mbedtls_sha256_ret(buf, sizeof(buf), hash, 0));
+
+    mbedtls_ecdsa_init(&ecdsa);
+    mbedtls_mpi_init(&r);
+    mbedtls_mpi_init(&s);
+    mbedtls_mpi_init(&d);
+    mbedtls_mpi_init(&z);
+    mbedtls_ecp_point_init(&q);
+
+    ret = mbedtls_ecdsa_genkey(&ecdsa, MBEDTLS_ECP_DP_SECP256R1, bench_rng, &seed);
+    if (ret != 0) {
+        report(BACKEND, "p-256 keygen", 0, 1, ret);
+    } else {
+        BENCH(BACKEND, "p-256 ecdsa sign", 4,
+              mbedtls_ecdsa_sign(&ecdsa.grp, &r, &s, &ecdsa.d, hash, sizeof(hash), bench_rng, &seed));
+        BENCH(BACKEND, "p-256 ecdsa verify", 4,
+              mbedtls_ecdsa_verify(&ecdsa.grp, hash, sizeof(hash), &ecdsa.Q, &r, &s));
+        BENCH(BACKEND, "p-256 ecdh gen public", 4,
+              mbedtls_ecdh_gen_public(&ecdsa.grp, &d, &q, bench_rng, &seed));
+        BENCH(BACKEND, "p-256 ecdh shared", 4,
+              mbedtls_ecdh_compute_shared(&ecdsa.grp, &z, &ecdsa.Q, &d, bench_rng, &seed));
+    }
+
+    mbedtls_ecp_point_free(&q);
+    mbedtls_mpi_free(&z);
+    mbedtls_mpi_free(&d);
+    mbedtls_mpi_free(&s);
+    mbedtls_mpi_free(&r);
+    mbedtls_ecdsa_free(&ecdsa);
+}
+
+#ifdef CRYPTO_BACKEND_CC310
+// A fresh context and key expansion for every block, which the AES hook
+// avoids by keeping one keyed context per mbedtls_aes_context
+static int aes_block_rekeyed(void)
+{
+    nrf_crypto_aes_context_t aes;
+    size_t size = NRF_CRYPTO_AES_BLOCK_SIZE;
+
+    return (int)nrf_crypto_aes_crypt(&aes, &g_nrf_crypto_aes_ecb_128_info, NRF_CRYPTO_ENCRYPT,
+                                     (uint8_t *)key, NULL, buf, NRF_CRYPTO_AES_BLOCK_SIZE, buf, &size);
+}
+
+static void bench_nrf_crypto(void)
+{
+    nrf_crypto_aes_context_t aes;
+    nrf_crypto_hash_context_t hash_ctx;
+    nrf_crypto_ecc_private_key_t private_key;
+    nrf_crypto_ecc_public_key_t public_key;
+    uint8_t hash[NRF_CRYPTO_HASH_SIZE_SHA256];
+    uint8_t sig[NRF_CRYPTO_ECDSA_SECP256R1_SIGNATURE_SIZE];
+    uint8_t shared[NRF_CRYPTO_ECDH_SECP256R1_SHARED_SECRET_SIZE];
+    size_t size;
+
+    ret_code_t err = nrf_crypto_aes_init(&aes, &g_nrf_crypto_aes_ecb_128_info, NRF_CRYPTO_ENCRYPT);
+    if (err == NRF_SUCCESS) {
+        err = nrf_crypto_aes_key_set(&aes, (uint8_t *)key);
+    }
+    if (err != NRF_SUCCESS) {
+        report("nrf_crypto", "aes-128 block", 0, 1, (int)err);
+    } else {
+        BENCH("nrf_crypto", "aes-128 block", 1000,
+              (int)nrf_crypto_aes_update(&aes, buf, NRF_CRYPTO_AES_BLOCK_SIZE, buf));
+    }
+    nrf_crypto_aes_uninit(&aes);
+    BENCH("nrf_crypto", "aes-128 block rekeyed", 1000, aes_block_rekeyed());
+
+    size = sizeof(hash);
+    BENCH("nrf_crypto", "sha-256 1k", 20,
+          (int)nrf_crypto_hash_calculate(&hash_ctx, &g_nrf_crypto_hash_sha256_info,
+                                         buf, sizeof(buf), hash, &size));
+
+    err = nrf_crypto_ecc_key_pair_generate(NULL, &g_nrf_crypto_ecc_secp256r1_curve_info,
+                                           &private_key, &public_key);
+    if (err != NRF_SUCCESS) {
+        report("nrf_crypto", "p-256 keygen", 0, 1, (int)err);
+        return;
+    }
+    size = sizeof(sig);
+    BENCH("nrf_crypto", "p-256 ecdsa sign", 4,
+          (int)nrf_crypto_ecdsa_sign(NULL, &private_key, hash, sizeof(hash), sig, &size));
+    BENCH("nrf_crypto", "p-256 ecdsa verify", 4,
+          (int)nrf_crypto_ecdsa_verify(NULL, &public_key, hash, sizeof(hash), sig, sizeof(sig)));
+    size = sizeof(shared);
+    BENCH("nrf_crypto", "p-256 ecdh shared", 4,
+          (int)nrf_crypto_ecdh_compute(NULL, &private_key, &public_key, shared, &size));
+
+    nrf_crypto_ecc_private_key_free(&private_key);
+    nrf_crypto_ecc_public_key_free(&public_key);
+}
+#endif
+
+// -- DTLS handshake over an in-memory link --
+
+// Datagrams queued one way as u16 length | bytes
+struct pipe {
+    uint8_t buf[CRYPTO_BENCH_PIPE_LEN];
+    size_t len;
+};
+
+struct endpoint {
+    struct pipe *tx, *rx;
+};
+
+static struct pipe to_server, to_client;
+static uint32_t server_cycles;
+static size_t heap_now, heap_peak;
+
+static int pipe_send(void *ctx, const unsigned char *data, size_t len)
+{
+    struct pipe *p = ((struct endpoint *)ctx)->tx;
+    if (len > UINT16_MAX || p->len + 2 + len > sizeof(p->buf)) {
+        return MBEDTLS_ERR_SSL_WANT_WRITE;
+    }
+    p->buf[p->len] = (uint8_t)len;
+    p->buf[p->len + 1] = (uint8_t)(len >> 8);
+    memcpy(&p->buf[p->len + 2], data, len);
+    p->len += 2 + len;
+    return (int)len;
+}
+
+// One datagram per call, cut to len like a UDP read
+static int pipe_recv(void *ctx, unsigned char *data, size_t len)
+{
+    struct pipe *p = ((struct endpoint *)ctx)->rx;
+    if (p->len == 0) {
+        return MBEDTLS_ERR_SSL_WANT_READ;
+    }
+    size_t dlen = p->buf[0] | (p->buf[1] << 8);
+    size_t copy = dlen < len ? dlen : len;
+    memcpy(data, &p->buf[2], copy);
+    p->len -= 2 + dlen;
+    memmove(p->buf, &p->buf[2 + dlen], p->len);
+    return (int)copy;
+}
+
+// Nothing is lost on the way, so retransmission timers never fire
+static void timer_set(void *ctx, uint32_t int_ms, uint32_t fin_ms)
+{
+    (void)ctx;
+    (void)int_ms;
+    (void)fin_ms;
+}
+
+static int timer_get(void *ctx)
+{
+    (void)ctx;
+    return 0;
+}
+
+// Counts what mbed TLS has allocated; each block carries its size in front,
+// so these stay installed from crypto_bench_init on
+static void *counting_calloc(size_t n, size_t size)
+{
+    if (size != 0 && n > (SIZE_MAX - sizeof(size_t)) / size) {
+        return NULL;
+    }
+    size_t *p = calloc(1, sizeof(size_t) + n * size);
+    if (p == NULL) {
+        return NULL;
+    }
+    p[0] = n * size;
+    heap_now += p[0];
+    if (heap_now > heap_peak) {
+        heap_peak = heap_now;
+    }
+    return p + 1;
+}
+
+static void counting_free(void *ptr)
+{
+    if (ptr == NULL) {
+        return;
+    }
+    size_t *p = (size_t *)ptr - 1;
+    heap_now -= p[0];
+    free(p);
+}
+
+static int step(mbedtls_ssl_context *ssl, int ret)
+{
+    if (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE) {
+        ret = mbedtls_ssl_handshake(ssl);
+    }
+    return ret;
+}
+
+static int handshake_once(mbedtls_ssl_config *server_conf, mbedtls_ssl_config *client_conf)
+{
+    struct endpoint server_end = { &to_client, &to_server };
+    struct endpoint client_end = { &to_server, &to_client };
+    mbedtls_ssl_context server, client;
+    int server_ret = MBEDTLS_ERR_SSL_WANT_READ;
+    int client_ret = MBEDTLS_ERR_SSL_WANT_READ;
+    int ret;
+
+    to_server.len = 0;
+    to_client.len = 0;
+    mbedtls_ssl_init(&server);
+    mbedtls_ssl_init(&client);
+
+    ret = mbedtls_ssl_setup(&server, server_conf);
+    if (ret == 0) {
+        ret = mbedtls_ssl_setup(&client, client_conf);
+    }
+    if (ret == 0) {
+        mbedtls_ssl_set_bio(&server, &server_end, pipe_send, pipe_recv, NULL);
+        mbedtls_ssl_set_bio(&client, &client_end, pipe_send, pipe_recv, NULL);
+        mbedtls_ssl_set_timer_cb(&server, NULL, timer_set, timer_get);
+        mbedtls_ssl_set_timer_cb(&client, NULL, timer_set, timer_get);
+
+        // each side runs until it waits for the other, a few flights in all
+        for (int i = 0; i < 16 && (server_ret != 0 || client_ret != 0); i++) {
+            client_ret = step(&client, client_ret);
+            uint32_t start = DWT->CYCCNT;
+            server_ret = step(&server, server_ret);
+            server_cycles += DWT->CYCCNT - start;
+        }
+        ret = client_ret != 0 ? client_ret : server_ret;
+    }
+
+    mbedtls_ssl_free(&client);
+    mbedtls_ssl_free(&server);
+    return ret;
+}
+
+static void bench_handshake(mbedtls_x509_crt *crt, mbedtls_pk_context *key,
+                            int (*f_rng)(void *, unsigned char *, size_t), void *p_rng)
+{
+    mbedtls_ssl_config server_conf, client_conf;
+    int ret;
+
+    mbedtls_ssl_config_init(&server_conf);
+    mbedtls_ssl_config_init(&client_conf);
+
+    ret = mbedtls_ssl_config_defaults(&server_conf, MBEDTLS_SSL_IS_SERVER,
+                                      MBEDTLS_SSL_TRANSPORT_DATAGRAM, MBEDTLS_SSL_PRESET_DEFAULT);
+    if (ret == 0) {
+        ret = mbedtls_ssl_config_defaults(&client_conf, MBEDTLS_SSL_IS_CLIENT,
+                                          MBEDTLS_SSL_TRANSPORT_DATAGRAM, MBEDTLS_SSL_PRESET_DEFAULT);
+    }
+    if (ret == 0) {
+        mbedtls_ssl_conf_rng(&server_conf, f_rng, p_rng);
+        mbedtls_ssl_conf_rng(&client_conf, f_rng, p_rng);
+        // no cookie exchange and no certificate check, just the key exchange
+        mbedtls_ssl_conf_dtls_cookies(&server_conf, NULL, NULL, NULL);
+        mbedtls_ssl_conf_authmode(&client_conf, MBEDTLS_SSL_VERIFY_NONE);
+        ret = mbedtls_ssl_conf_own_cert(&server_conf, crt, key);
+    }
+
+    if (ret != 0) {
+        report(BACKEND, "dtls handshake", 0, 1, ret);
+    } else {
+        size_t heap_base = heap_now;
+        server_cycles = 0;
+        heap_peak = heap_now;
+
+        BENCH(BACKEND, "dtls handshake", 2, handshake_once(&server_conf, &client_conf));
+        report(BACKEND, "dtls handshake server", server_cycles, 2, 0);
+        printf("bench %-9s %-22s %10lu bytes\n", BACKEND, "dtls handshake heap",
+               (unsigned long)(heap_peak - heap_base));
+    }
+
+    mbedtls_ssl_config_free(&client_conf);
+    mbedtls_ssl_config_free(&server_conf);
+}
+
+void crypto_bench_init(void)
+{
+    mbedtls_platform_set_calloc_free(counting_calloc, counting_free);
+}
+
+void crypto_bench_run(mbedtls_x509_crt *crt, mbedtls_pk_context *key,
+                      int (*f_rng)(void *, unsigned char *, size_t), void *p_rng)
+{
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CYCCNT = 0;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+
+    memset(buf, 0xa5, sizeof(buf));
+    printf("crypto bench: mbed TLS on the %s backend, %lu MHz\n", BACKEND,
+           (unsigned long)(SystemCoreClock / 1000000));
+    bench_mbedtls();
+#ifdef CRYPTO_BACKEND_CC310
+    bench_nrf_crypto();
+#endif
+    bench_handshake(crt, key, f_rng, p_rng);
+}
+
+#endif // CRYPTO_BENCH
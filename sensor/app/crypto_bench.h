@@ -0,0 +1,41 @@
+/*
+ * Crypto benchmark for the sensor
+ *
+ * Times the primitives the sensor uses through mbed TLS (AES-128 block,
+ * streaming AES-GCM, SHA-256, P-256 ECDSA and ECDH) with the DWT cycle
+ * counter and prints cycles per operation over RTT. The mbed TLS numbers
+ * come from whichever backend the firmware was built with, so flash once
+ * with CRYPTO_BACKEND=software and once with CRYPTO_BACKEND=cc310 to
+ * compare; the cc310 build also times nrf_crypto directly, which shows what
+ * the ALT hooks' conversions cost on top of the hardware, and an AES block
+ * with its key expanded every time against one keyed context.
+ *
+ * It then runs a DTLS handshake between a server using the sensor's
+ * certificate and a client, both in this firmware and linked by RAM
+ * buffers, and prints its cycles (both ends, and the server's share) and
+ * the peak heap mbed TLS used for it. Comparing builds with
+ * MBEDTLS_PROFILE=full and MBEDTLS_PROFILE=dtls gives the profile's
+ * handshake time and heap deltas.
+ *
+ * Built with CRYPTO_BENCH=1 (see Board.mk) and run once at boot, before
+ * advertising starts so radio events don't land in the measurements.
+ */
+
+#ifndef CRYPTO_BENCH_H
+#define CRYPTO_BENCH_H
+
+#include "mbedtls/pk.h"
+#include "mbedtls/x509_crt.h"
+
+#ifndef CRYPTO_BENCH_BUF_LEN
+#define CRYPTO_BENCH_BUF_LEN 1024   // bytes per GCM and SHA-256 operation
+#endif
+
+// Counts mbed TLS heap use from here on; call before anything else in mbed TLS
+void crypto_bench_init(void);
+
+// Must be called after nrf_crypto_init. crt and key are the server's.
+void crypto_bench_run(mbedtls_x509_crt *crt, mbedtls_pk_context *key,
+                      int (*f_rng)(void *, unsigned char *, size_t), void *p_rng);
+
+#endif // CRYPTO_BENCH_H
@@ -0,0 +1,124 @@
+#include <stdio.h>
+#include "app_error.h"
+#include "app_timer.h"
+#include "app_util_platform.h"
+#include "nrf_gpio.h"
+#include "nrf_nvic.h"
+#include "nrf_pwr_mgmt.h"
+#include "nrf_soc.h"
+#include "energy.h"
+
+struct energy_stats energy_last;
+
+// All times are in app_timer (RTC1) ticks, which keep running while asleep
+static volatile uint32_t radio_ticks;
+static volatile uint32_t radio_on_at;
+static volatile bool radio_on;
+static uint32_t sleep_ticks;
+
+static struct {
+    bool running;
+    uint32_t start;
+    uint32_t radio_ticks;
+    uint32_t sleep_ticks;
+} transfer;
+
+static uint32_t ticks_to_us(uint32_t ticks)
+{
+    return (uint32_t)(((uint64_t)ticks * 1000000 * (APP_TIMER_CONFIG_RTC_FREQUENCY + 1)) /
+                      APP_TIMER_CLOCK_FREQ);
+}
+
+// SoftDevice radio notification, fires before the radio turns on and after
+// it turns off for every radio event
+void SWI1_EGU1_IRQHandler(void)
+{
+    uint32_t now = app_timer_cnt_get();
+
+    radio_on = !radio_on;
+    if (radio_on) {
+        radio_on_at = now;
+    } else {
+        radio_ticks += app_timer_cnt_diff_compute(now, radio_on_at);
+    }
+}
+
+void energy_init(void)
+{
+    ret_code_t error_code;
+
+#ifdef ENERGY_PROBE_PIN
+    nrf_gpio_cfg_output(ENERGY_PROBE_PIN);
+    nrf_gpio_pin_clear(ENERGY_PROBE_PIN);
+#endif
+
+    error_code = sd_nvic_ClearPendingIRQ(SWI1_EGU1_IRQn);
+    APP_ERROR_CHECK(error_code);
+    error_code = sd_nvic_SetPriority(SWI1_EGU1_IRQn, APP_IRQ_PRIORITY_LOW);
+    APP_ERROR_CHECK(error_code);
+    error_code = sd_nvic_EnableIRQ(SWI1_EGU1_IRQn);
+    APP_ERROR_CHECK(error_code);
+
+    error_code = sd_radio_notification_cfg_set(NRF_RADIO_NOTIFICATION_TYPE_INT_ON_BOTH,
+                                               NRF_RADIO_NOTIFICATION_DISTANCE_800US);
+    APP_ERROR_CHECK(error_code);
+}
+
+void energy_idle(void)
+{
+    // interrupt handlers that run before we get back here count as sleep,
+    // they are short next to the connection interval
+    uint32_t before = app_timer_cnt_get();
+    nrf_pwr_mgmt_run();
+    sleep_ticks += app_timer_cnt_diff_compute(app_timer_cnt_get(), before);
+}
+
+void energy_transfer_start(void)
+{
+    transfer.running = true;
+    transfer.start = app_timer_cnt_get();
+    transfer.radio_ticks = radio_ticks;
+    transfer.sleep_ticks = sleep_ticks;
+
+#ifdef ENERGY_PROBE_PIN
+    nrf_gpio_pin_set(ENERGY_PROBE_PIN);
+#endif
+}
+
+void energy_transfer_end(size_t bytes, bool completed)
+{
+    if (!transfer.running) {
+        return;
+    }
+    transfer.running = false;
+
+#ifdef ENERGY_PROBE_PIN
+    nrf_gpio_pin_clear(ENERGY_PROBE_PIN);
+#endif
+
+    uint32_t elapsed = app_timer_cnt_diff_compute(app_timer_cnt_get(), transfer.start);
+    uint32_t asleep = sleep_ticks - transfer.sleep_ticks;
+    uint32_t radio = radio_ticks - transfer.radio_ticks;
+    uint32_t awake = elapsed > asleep ? elapsed - asleep : 0;
+
+    energy_last.bytes = bytes;
+    energy_last.elapsed_us = ticks_to_us(elapsed);
+    energy_last.cpu_us = ticks_to_us(awake);
+    energy_last.radio_us = ticks_to_us(radio);
+    energy_last.completed = completed;
+
+    // uA * us = pC
+    uint64_t charge_pc = (uint64_t)energy_last.cpu_us * ENERGY_CPU_UA +
+                         (uint64_t)energy_last.radio_us * ENERGY_RADIO_UA +
+                         (uint64_t)energy_last.elapsed_us * ENERGY_SLEEP_UA;
+    energy_last.charge_nc = (uint32_t)(charge_pc / 1000);
+
+    printf("energy: %s %lu B in %lu ms, cpu %lu us, radio %lu us, %lu nC (%lu nC/kB)\n",
+           completed ? "sent" : "aborted",
+           (unsigned long)energy_last.bytes,
+           (unsigned long)(energy_last.elapsed_us / 1000),
+           (unsigned long)energy_last.cpu_us,
+           (unsigned long)energy_last.radio_us,
+           (unsigned long)energy_last.charge_nc,
+           (unsigned long)(bytes ? (uint64_t)energy_last.charge_nc * 1024 / bytes : 0));
+}
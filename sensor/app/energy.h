@@ -0,0 +1,52 @@
+/*
+ * Per-transfer energy accounting for the sensor
+ *
+ * Tracks how long the CPU sleeps (around nrf_pwr_mgmt_run) and how long the
+ * radio is active (SoftDevice radio notifications) while a transfer is in
+ * flight, and estimates the charge it cost from datasheet currents. The
+ * result is printed over RTT when the transfer ends and kept in
+ * energy_last for a debugger.
+ *
+ * Define ENERGY_PROBE_PIN to also drive a GPIO high for the duration of
+ * each transfer, to gate an external current measurement (e.g. a PPK).
+ */
+
+#ifndef ENERGY_H
+#define ENERGY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// nRF52840 currents at 3 V with the DC/DC converter on (product spec 4.2)
+#ifndef ENERGY_CPU_UA
+#define ENERGY_CPU_UA   3300    // CPU running from flash, cache enabled
+#endif
+#ifndef ENERGY_RADIO_UA
+#define ENERGY_RADIO_UA 4800    // radio TX at 0 dBm / RX at 1 Mbps
+#endif
+#ifndef ENERGY_SLEEP_UA
+#define ENERGY_SLEEP_UA 3       // System ON, RTC running, RAM retained
+#endif
+
+struct energy_stats {
+    uint32_t bytes;
+    uint32_t elapsed_us;
+    uint32_t cpu_us;        // CPU awake (elapsed minus time in nrf_pwr_mgmt_run)
+    uint32_t radio_us;      // radio active, from radio notifications
+    uint32_t charge_nc;     // estimated charge in nC
+    bool completed;         // false if the transfer was aborted
+};
+
+extern struct energy_stats energy_last;
+
+// Must be called after the SoftDevice is enabled
+void energy_init(void);
+
+// nrf_pwr_mgmt_run() that also accounts the time spent asleep
+void energy_idle(void);
+
+void energy_transfer_start(void);
+void energy_transfer_end(size_t bytes, bool completed);
+
+#endif // ENERGY_H
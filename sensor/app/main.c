@@ -33,14 +33,28 @@
 #include "ble_advertising.h"
 #include "ble_conn_state.h"
 #include "ble.h"
+#include "nrf_sdh_ble.h"
+#include "app_scheduler.h"
+#include "nrf_pwr_mgmt.h"
 #include "certs.h"
 #include "data.h"
+#include "xfer.h"
+#include "dtls_gatt.h"
+#include "energy.h"
+#include "crypto_bench.h"
+#include "outbox.h"
 
 
 // Pin definitions
 #define LED NRF_GPIO_PIN_MAP(0,13)
-#define CHUNK_SIZE 200
 #define READ_TIMEOUT_MS 10000   /* 10 seconds */
+#define XFER_WINDOW 8           /* chunks in flight, the mule may lower it */
+#define LINK_OBSERVER_PRIO 3
+#define SCHED_QUEUE_SIZE 32
+#define DTLS_RECORD_LEN 512     /* application bytes per DTLS record */
+#define FRAME_HDR_LEN 4         /* length in front of every frame, little endian */
+#define NUM_SAMPLES (sizeof(data) / sizeof(data[0]))
+#define SAMPLE_INTERVAL_MS 1000 /* one sample from data.h per tick */
 
 // Intervals for advertising and connections
 static simple_ble_config_t ble_config = {
@@ -61,23 +75,70 @@ static simple_ble_service_t sensor_service = {{
 
 static simple_ble_char_t sensor_state_char = {.uuid16 = 0x8911};
 
-uint8_t sensor_state [CHUNK_SIZE]; //largest possible packet need to send chunks for larger
+uint8_t sensor_state [XFER_MAX_CHUNK_SIZE]; //largest possible packet need to send chunks for larger
 
 //Set up BLE characteristic for metadata connection with ESP
 
 static simple_ble_char_t metadata_state_char = {.uuid16 = 0x8912};
 
-uint8_t metadata_state [3]; // [0] = number of chunks to send, [1] = chunks recieved
+uint8_t metadata_state [XFER_META_LEN]; // see xfer.h for the layout
+
+// Negotiated link parameters, chunks are sized to fill one LL data PDU
+static uint16_t link_att_mtu = XFER_ATT_MTU_DEFAULT;
+static uint16_t link_max_tx_octets = XFER_LL_OCTETS_DEFAULT;
 
 simple_ble_app_t* simple_ble_app;
 
-uint8_t *read_buf;
+// DTLS session with the mule, records travel over the two characteristics
+static mbedtls_ssl_context ssl;
+static struct dtls_gatt transport;
+static uint8_t peer_addr[BLE_GAP_ADDR_LEN];    // mule's address, binds the DTLS cookie
+
+// Outbox frame being sent. Application data is a stream of frames, each
+// behind its length, cut into records of up to DTLS_RECORD_LEN bytes.
+static const uint8_t *tx_frame;     // straight from flash, valid until outbox_pop
+static size_t tx_frame_len;
+static size_t tx_frame_sent;        // stream bytes (length and frame) written
+static uint8_t tx_record[DTLS_RECORD_LEN];
+static size_t tx_record_len;        // record mbedtls has to be handed again
+
+// Everything below runs from the main loop; SoftDevice handlers only queue
+// one of these with app_sched_event_put
+enum sensor_evt_type {
+    EVT_CONNECTED,      // carries the mule's address
+    EVT_DISCONNECTED,
+    EVT_META_WRITTEN,   // proposal, window answer or ack from the mule
+    EVT_DATA_WRITTEN,   // chunk of a transfer from the mule
+    EVT_CCCD_WRITTEN,   // mule (un)subscribed to notifications
+    EVT_TX_COMPLETE,    // notifications left the SoftDevice queue
+    EVT_SAMPLE,         // time to produce the next sample
+    EVT_OUTBOX,         // an outbox flash operation finished
+    EVT_DTLS_TIMER,     // a handshake timer expired, retransmit if due
+};
+
+// Sized for a whole chunk, since write data only lives for the SoftDevice event
+struct sensor_evt {
+    uint8_t type;
+    uint16_t len;
+    uint8_t data[XFER_MAX_CHUNK_SIZE];
+};
+
+typedef enum {
+    APP_ADVERTISING,    // waiting for a mule
+    APP_HANDSHAKE,      // connected, DTLS handshake in progress
+    APP_CONNECTED,      // DTLS session up, no frame in flight
+    APP_SENDING,        // frame being written, or not acked by the mule yet
+} app_state_t;
+
+static app_state_t app_state = APP_ADVERTISING;
+static size_t sample_index;    // next sample to produce
 
+APP_TIMER_DEF(sample_timer_id);
 APP_TIMER_DEF(dtls_int_timer_id);
 APP_TIMER_DEF(dtls_fin_timer_id);
 
 // Prototype functions
-int ble_write(uint16_t *buf, uint16_t len, simple_ble_char_t *characteristic, int offset);
+int ble_write(const uint8_t *buf, uint16_t len, simple_ble_char_t *characteristic, int offset);
 
 int logging_init() {
     ret_code_t error_code = NRF_SUCCESS;
@@ -97,122 +158,124 @@ int entropy_source(void *data, unsigned char *output, size_t len, size_t *olen)
     return 0;
 }
 
-void ble_evt_write(ble_evt_t const * p_ble_evt) { 
-    // Check if the event if on the link for this central
-    if (p_ble_evt->evt.gatts_evt.conn_handle != simple_ble_app->conn_handle) {
-        return;
-    }
-    
-    //Check if data is metadata or data and store in correct variable
-    if (p_ble_evt->evt.gatts_evt.params.write.handle == metadata_state_char.char_handle.value_handle) {
-        printf("Metadata recieved!\n");
-        memcpy(metadata_state, p_ble_evt->evt.gatts_evt.params.write.data, p_ble_evt->evt.gatts_evt.params.write.len);
-    } 
-    if (p_ble_evt->evt.gatts_evt.params.write.handle == sensor_state_char.char_handle.value_handle) {
-        printf("Data recieved!\n");
-        //check metadata to see where to store data and store data 
-        int num_chunks = metadata_state[0];
-        int num_recieved_chunks = metadata_state[1];
-        int readiness = metadata_state[2];
-        memcpy(&read_buf[num_recieved_chunks*CHUNK_SIZE], p_ble_evt->evt.gatts_evt.params.write.data, p_ble_evt->evt.gatts_evt.params.write.len);
-        //increment metadata state since we recieved a chunk
-        metadata_state[1] +=1;
-        int error_code = ble_write(metadata_state, 3, &metadata_state_char, 0);
+static void sensor_evt_handler(void *p_event_data, uint16_t event_size);
+
+// Queues an event for the main loop, data is copied since it only lives for
+// the SoftDevice event
+static void schedule_evt(uint8_t type, const uint8_t *data, uint16_t len) {
+    struct sensor_evt evt = {.type = type};
+    if (data != NULL) {
+        evt.len = MIN(len, sizeof(evt.data));
+        memcpy(evt.data, data, evt.len);
     }
- 
+    ret_code_t error_code = app_sched_event_put(&evt, sizeof(evt), sensor_evt_handler);
+    APP_ERROR_CHECK(error_code);
 }
 
-int ble_write_long(void *p_ble_conn_handle, const unsigned char *buf, size_t len) 
-{
-    int error_code = 0;
-    int original_len = len;
-    uint16_t len_for_write = (uint16_t)len;
-
-    //check we're in a connection
-    if (simple_ble_app->conn_handle == BLE_CONN_HANDLE_INVALID) {
-        printf("not connected can't write\n");
-        return -1;
-    }
+static void link_evt_handler(ble_evt_t const * p_ble_evt, void * p_context) {
+    switch (p_ble_evt->header.evt_id) {
+        case BLE_GAP_EVT_CONNECTED:
+            link_att_mtu = XFER_ATT_MTU_DEFAULT;
+            link_max_tx_octets = XFER_LL_OCTETS_DEFAULT;
+            schedule_evt(EVT_CONNECTED, p_ble_evt->evt.gap_evt.params.connected.peer_addr.addr,
+                         BLE_GAP_ADDR_LEN);
+            break;
+
+        case BLE_GAP_EVT_DISCONNECTED:
+            schedule_evt(EVT_DISCONNECTED, NULL, 0);
+            break;
+
+        case BLE_GATTS_EVT_HVN_TX_COMPLETE:
+            schedule_evt(EVT_TX_COMPLETE, NULL, 0);
+            break;
+
+        case BLE_GATTS_EVT_EXCHANGE_MTU_REQUEST: {
+            //mule asked for a larger MTU, nrf_ble_gatt replies with ours
+            uint16_t client_mtu = p_ble_evt->evt.gatts_evt.params.exchange_mtu_request.client_rx_mtu;
+            link_att_mtu = MIN(client_mtu, NRF_SDH_BLE_GATT_MAX_MTU_SIZE);
+            printf("ATT MTU: %d\n", link_att_mtu);
+            break;
+        }
 
-    //now we can read and write the metadata state 
-    if (metadata_state[2] != 0x00) {
-        printf("ESP32 is not ready to receive data\n");
-        return -1;
-    }
-    
-    //write metadata test 
-    printf("writing metadata[0]%d\n", metadata_state[0]);
-
-    metadata_state[0] = ceil(len/(float)CHUNK_SIZE); //number of full packets to send
-    metadata_state[1] = 0x00;
-    metadata_state[2] = 0x01;
-    error_code = ble_write(metadata_state, 3, &metadata_state_char, 0);
-
-    //Now that sensor has a lock with metadata 
-    //Send data packets in chunks of 510 bytes
-    //TODO: change to for loop on both sensor and esp32 side
-    int counter = 0;
-    int num_sent_packets = 0;
-    while (len_for_write >= CHUNK_SIZE) {
-        int temp = counter + CHUNK_SIZE;
-        error_code = ble_write(&buf[counter],CHUNK_SIZE, &sensor_state_char, 0);
-        len_for_write -= CHUNK_SIZE;
-        counter = counter + CHUNK_SIZE;
-        num_sent_packets += 1;
-
-        //wait for ack to send next packet
-        while (metadata_state[1] != num_sent_packets) {
-            printf("waiting for ack\n");
-            printf("metadata state: %d\n", metadata_state[1]);
-            printf("num sent packets: %d\n", num_sent_packets);
-            nrf_delay_ms(500);
+        case BLE_GATTC_EVT_EXCHANGE_MTU_RSP: {
+            uint16_t server_mtu = p_ble_evt->evt.gattc_evt.params.exchange_mtu_rsp.server_rx_mtu;
+            link_att_mtu = MIN(server_mtu, NRF_SDH_BLE_GATT_MAX_MTU_SIZE);
+            printf("ATT MTU: %d\n", link_att_mtu);
+            break;
         }
 
-        printf("number sent packets: %d\n", metadata_state[1]);
-    }
+        case BLE_GAP_EVT_DATA_LENGTH_UPDATE:
+            link_max_tx_octets = p_ble_evt->evt.gap_evt.params.data_length_update.effective_params.max_tx_octets;
+            printf("LL max tx octets: %d\n", link_max_tx_octets);
+            break;
 
-    //wait for final ack from sensor
-    while (metadata_state[1] != num_sent_packets) {
-        printf("waiting for final ack\n");
-        nrf_delay_ms(500);
+        default:
+            break;
     }
+}
 
-    //set metadata state to signal that we are done sending data
-    metadata_state[1] = 0;
-    metadata_state[2] = 0x02;
+NRF_SDH_BLE_OBSERVER(m_link_observer, LINK_OBSERVER_PRIO, link_evt_handler, NULL);
 
-    error_code = ble_write(metadata_state, 3, &metadata_state_char, 0);
+static uint16_t link_chunk_size(void *link) {
+    return xfer_chunk_size(link_att_mtu, link_max_tx_octets);
+}
 
-    return len;
+// Notifies a value for the DTLS transport, see struct dtls_gatt_ops
+static int link_send(void *link, int chr, const uint8_t *buf, uint16_t len) {
+    simple_ble_char_t *characteristic = chr == DTLS_GATT_CHR_META ?
+                                        &metadata_state_char : &sensor_state_char;
+
+    int error_code = ble_write(buf, len, characteristic, 0);
+    switch (error_code) {
+        case NRF_SUCCESS:
+            return 0;
+
+        //queue full or the mule hasn't subscribed yet, the transport is
+        //pumped again on tx complete and CCCD writes
+        case NRF_ERROR_RESOURCES:
+        case NRF_ERROR_INVALID_STATE:
+        case BLE_ERROR_GATTS_SYS_ATTR_MISSING:
+            return DTLS_GATT_BUSY;
+
+        default:
+            return error_code < 0 ? error_code : MBEDTLS_ERR_NET_SEND_FAILED;
+    }
 }
 
-int ble_read_long(void *p_ble_conn_handle, unsigned char *buf, size_t len) 
-{
-    //Check metadata state
-    int error_code;
-    int num_chunks = metadata_state[0];
-    int num_recieved_chunks = metadata_state[1];
-    int readiness = metadata_state[2];
+// Never blocks: the main loop pumps the transport after every event
+static const struct dtls_gatt_ops link_ops = {
+    .send = link_send,
+    .chunk_size = link_chunk_size,
+};
 
-    read_buf = buf; //set global read_buf to buf so we can access it in the callback
+void ble_evt_write(ble_evt_t const * p_ble_evt) {
+    // Check if the event if on the link for this central
+    if (p_ble_evt->evt.gatts_evt.conn_handle != simple_ble_app->conn_handle) {
+        return;
+    }
 
-    // // Wait for metadata to signifiy we are ready to read
-    // while (readiness != 0x02) {
-    //     printf("not ready to read\n");
-    //     nrf_delay_ms(500);
-    // } TODO: put this back and fix metadata state perhaps 
+    ble_gatts_evt_write_t const *write = &p_ble_evt->evt.gatts_evt.params.write;
 
-    while (metadata_state[1] < metadata_state[0]) {
-        nrf_delay_ms(500);
+    //Check if data is metadata or data, both are handled from the main loop
+    if (write->handle == metadata_state_char.char_handle.value_handle) {
+        uint16_t len = MIN(write->len, sizeof(metadata_state));
+        memcpy(metadata_state, write->data, len);
+        schedule_evt(EVT_META_WRITTEN, write->data, len);
+    }
+    else if (write->handle == metadata_state_char.char_handle.cccd_handle ||
+             write->handle == sensor_state_char.char_handle.cccd_handle) {
+        //notifications that failed before the mule subscribed can go now
+        schedule_evt(EVT_CCCD_WRITTEN, NULL, 0);
+    }
+    else if (write->handle == sensor_state_char.char_handle.value_handle) {
+        schedule_evt(EVT_DATA_WRITTEN, write->data, write->len);
     }
-
-    read_buf = NULL;
-    return len;
- 
 }
 
-// Function to send data over BLE
-int ble_write(uint16_t *buf, uint16_t len, simple_ble_char_t *characteristic, int offset)
+// Function to send data over BLE, returns the SoftDevice error without
+// retrying: NRF_ERROR_RESOURCES when the notification queue is full and
+// NRF_ERROR_INVALID_STATE before the mule subscribed
+int ble_write(const uint8_t *buf, uint16_t len, simple_ble_char_t *characteristic, int offset)
 {
     // Check if BLE connection handle is valid
     if (simple_ble_app->conn_handle == BLE_CONN_HANDLE_INVALID) {
@@ -220,15 +283,6 @@ int ble_write(uint16_t *buf, uint16_t len, simple_ble_char_t *characteristic, in
         return MBEDTLS_ERR_NET_INVALID_CONTEXT;
     }
 
-    // Check connection status 
-    int ret_code;
-    ret_code = ble_conn_state_status(simple_ble_app->conn_handle);
-    while (ret_code != BLE_CONN_STATUS_CONNECTED) {
-        printf("Connection status: %d", ret_code);
-        nrf_delay_ms(1000);
-        ret_code = ble_conn_state_status(simple_ble_app->conn_handle);
-    }
-
     ble_gatts_hvx_params_t hvx_params;
     memset(&hvx_params, 0, sizeof(hvx_params));
     hvx_params.handle = characteristic->char_handle.value_handle;
@@ -237,75 +291,221 @@ int ble_write(uint16_t *buf, uint16_t len, simple_ble_char_t *characteristic, in
     hvx_params.p_len = &len;
     hvx_params.p_data = buf;
 
-    ret_code = sd_ble_gatts_hvx(simple_ble_app->conn_handle, &hvx_params);
-    while (ret_code == NRF_ERROR_INVALID_STATE) {
-        printf("Error writing try again\n");
-        nrf_delay_ms(1000);
-        ret_code = sd_ble_gatts_hvx(simple_ble_app->conn_handle, &hvx_params);
-    }
-
-    return ret_code;
-
+    return sd_ble_gatts_hvx(simple_ble_app->conn_handle, &hvx_params);
 }
 
 
-// Function to receive data over BLE
+// Function to receive data over BLE, the value arrives as a
+// BLE_GATTC_EVT_READ_RSP
 int ble_read(simple_ble_char_t *characteristic)
 {
-    int ret_code;
     // Check if BLE connection handle is valid
     if (simple_ble_app->conn_handle == BLE_CONN_HANDLE_INVALID) {
         return MBEDTLS_ERR_NET_INVALID_CONTEXT;
     }
 
-    // Check connection status 
-    ret_code = ble_conn_state_status(simple_ble_app->conn_handle);
-    while (ret_code == NRF_ERROR_BUSY) {
-        printf("Connection status: %d", ret_code);
-        nrf_delay_ms(1000);
-        ret_code = ble_conn_state_status(simple_ble_app->conn_handle);
+    return sd_ble_gattc_read(simple_ble_app->conn_handle, characteristic->char_handle.value_handle, 0);
+}
+
+// Seals the next sample into the outbox while no mule is around, so an
+// encounter is nothing but sending frames that are already in flash
+static void produce_sample(void) {
+    if (app_state != APP_ADVERTISING || sample_index >= NUM_SAMPLES) {
+        return;
     }
 
-    ret_code = sd_ble_gattc_read(simple_ble_app->conn_handle, characteristic->char_handle.value_handle, 0);
-    while (ret_code != NRF_SUCCESS) {
-        printf("Error reading try again\n");
-        ret_code = sd_ble_gattc_read(simple_ble_app->conn_handle, characteristic->char_handle.value_handle, 0);
-        nrf_delay_ms(1000);
+    int ret = outbox_put(data[sample_index], sizeof(data[0]));
+    if (ret == OUTBOX_ERR_BUSY || ret == OUTBOX_ERR_FULL) {
+        //tried again on the next tick
+        return;
     }
-    
-    return ret_code;
+    if (ret != 0) {
+        printf("failed to seal sample %u: %d\n", (unsigned)sample_index, ret);
+    }
+    sample_index += 1;
 }
 
-void data_test(uint16_t ble_conn_handle)
-{
-    printf("read and write data testing\n");
-    int error_code;
-    uint8_t data_buf [1000];
-    uint8_t data_back [1000];
-    //chill state to start with
-    metadata_state[0] = 0x00;
-    metadata_state[1] = 0x00;
-    metadata_state[2] = 0x00; 
-
-    //make random data 1kB
-    for (int i = 0; i < 1000; i++) {
-        data_buf[i] = 0x01; // rand() % 256;
-    }
-    printf("data_back address: %d\n", data_back);
-    error_code = ble_write_long(&ble_conn_handle, data_buf, 1000);
-    error_code = ble_read_long(&ble_conn_handle, data_back, 1000);
-
-    printf("data sent and received, checking for errors\n");
-    for (int i = 0; i < 1000; i++) {
-        if (data_buf[i] != data_back[i]) {
-            printf("error\n");
-            printf("data_buf[%d] = %d\n", i, data_buf[i]);
-            printf("data_back[%d] = %d\n", i, data_back[i]);
+// Fills tx_record with the next piece of the frame stream
+static void next_record(void) {
+    size_t n = MIN(FRAME_HDR_LEN + tx_frame_len - tx_frame_sent, sizeof(tx_record));
+
+    for (size_t i = 0; i < n; i++) {
+        size_t pos = tx_frame_sent + i;
+        tx_record[i] = pos < FRAME_HDR_LEN ? (uint8_t)(tx_frame_len >> (8 * pos)) :
+                                             tx_frame[pos - FRAME_HDR_LEN];
+    }
+    tx_record_len = n;
+}
+
+// Delivers the outbox frames one after another over the DTLS session. A
+// frame is only deleted once the mule acked all of it.
+static void send_next_sample(void) {
+    while (app_state == APP_CONNECTED || app_state == APP_SENDING) {
+        if (app_state == APP_CONNECTED) {
+            //a malformed record that can't be deleted holds up the rest,
+            //outbox_peek reports it once
+            if (outbox_peek(&tx_frame, &tx_frame_len) != 0 || tx_frame_len == 0) {
+                return;
+            }
+            tx_frame_sent = 0;
+            tx_record_len = 0;
+            app_state = APP_SENDING;
+            energy_transfer_start();
+        }
+
+        if (tx_frame_sent < FRAME_HDR_LEN + tx_frame_len) {
+            //after WANT_WRITE mbedtls expects the same record again
+            if (tx_record_len == 0) {
+                next_record();
+            }
+            int ret = mbedtls_ssl_write(&ssl, tx_record, tx_record_len);
+            if (ret == MBEDTLS_ERR_SSL_WANT_WRITE) {
+                return;
+            }
+            if (ret < 0) {
+                //the frame stays in flash for the next mule
+                printf("failed to send frame: -0x%x\n", (unsigned int)-ret);
+                sd_ble_gap_disconnect(simple_ble_app->conn_handle,
+                                      BLE_HCI_REMOTE_USER_TERMINATED_CONNECTION);
+                return;
+            }
+            tx_frame_sent += ret;
+            tx_record_len = 0;
             continue;
         }
+
+        if (!dtls_gatt_idle(&transport)) {
+            return;
+        }
+        outbox_pop();
+        energy_transfer_end(tx_frame_len, true);
+        printf("frame delivered, %lu left\n", (unsigned long)outbox_count());
+        app_state = APP_CONNECTED;
     }
 }
 
+// The mule sends nothing over the session after the handshake except
+// alerts such as close_notify. Reading drops them, so they don't sit in the
+// transport's receive buffer and hold up the link.
+static void drain_records(void) {
+    uint8_t discard[64];
+
+    //a read also flushes output, so a record mbedtls_ssl_write is waiting
+    //to retry would go out again on the retry
+    if ((app_state != APP_CONNECTED && app_state != APP_SENDING) || tx_record_len != 0) {
+        return;
+    }
+
+    for (;;) {
+        int ret = mbedtls_ssl_read(&ssl, discard, sizeof(discard));
+        if (ret > 0) {
+            continue;
+        }
+        if (ret == 0 || ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE) {
+            return;
+        }
+
+        if (ret == MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY) {
+            printf("mule closed the DTLS session\n");
+        } else {
+            printf("DTLS read failed: -0x%x\n", (unsigned int)-ret);
+        }
+        sd_ble_gap_disconnect(simple_ble_app->conn_handle,
+                              BLE_HCI_REMOTE_USER_TERMINATED_CONNECTION);
+        return;
+    }
+}
+
+// Runs the handshake as far as the mule's flights allow. Every event runs
+// it again, and the DTLS timers schedule one so retransmissions go out.
+static void dtls_step(void) {
+    if (app_state != APP_HANDSHAKE) {
+        return;
+    }
+
+    int ret = mbedtls_ssl_handshake(&ssl);
+    if (ret == MBEDTLS_ERR_SSL_HELLO_VERIFY_REQUIRED) {
+        //the mule's next ClientHello carries the cookie, on a fresh session
+        mbedtls_ssl_session_reset(&ssl);
+        ret = mbedtls_ssl_set_client_transport_id(&ssl, peer_addr, sizeof(peer_addr));
+    }
+    else if (ret == 0) {
+        printf("DTLS handshake done, %s\n", mbedtls_ssl_get_ciphersuite(&ssl));
+        app_state = APP_CONNECTED;
+        return;
+    }
+    else if (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE) {
+        return;
+    }
+
+    if (ret != 0) {
+        printf("DTLS handshake failed: -0x%x\n", (unsigned int)-ret);
+        sd_ble_gap_disconnect(simple_ble_app->conn_handle,
+                              BLE_HCI_REMOTE_USER_TERMINATED_CONNECTION);
+    }
+}
+
+static void sample_timer_handler(void *p_context) {
+    schedule_evt(EVT_SAMPLE, NULL, 0);
+}
+
+static void outbox_evt_handler(void) {
+    schedule_evt(EVT_OUTBOX, NULL, 0);
+}
+
+static void sensor_evt_handler(void *p_event_data, uint16_t event_size) {
+    struct sensor_evt const *evt = p_event_data;
+
+    switch (evt->type) {
+        case EVT_CONNECTED:
+            printf("BLE connected\n");
+            //fresh DTLS session, its cookie is bound to the mule's address
+            memcpy(peer_addr, evt->data, sizeof(peer_addr));
+            dtls_gatt_reset(&transport);
+            mbedtls_ssl_session_reset(&ssl);
+            mbedtls_ssl_set_client_transport_id(&ssl, peer_addr, sizeof(peer_addr));
+            tx_record_len = 0;
+            app_state = APP_HANDSHAKE;
+            break;
+
+        case EVT_DISCONNECTED:
+            printf("BLE disconnected\n");
+            if (app_state == APP_SENDING) {
+                energy_transfer_end(tx_frame_len, false);
+            }
+            app_state = APP_ADVERTISING;
+            return;
+
+        case EVT_META_WRITTEN:
+            dtls_gatt_on_meta(&transport, evt->data, evt->len);
+            break;
+
+        case EVT_DATA_WRITTEN:
+            dtls_gatt_on_chunk(&transport, evt->data, evt->len);
+            break;
+
+        case EVT_SAMPLE:
+            produce_sample();
+            break;
+
+        case EVT_CCCD_WRITTEN:
+        case EVT_TX_COMPLETE:
+        case EVT_OUTBOX:
+        case EVT_DTLS_TIMER:
+        default:
+            break;
+    }
+
+    if (app_state == APP_ADVERTISING) {
+        return;
+    }
+    dtls_step();
+    drain_records();
+    send_next_sample();
+    //a failure here means the link is gone, EVT_DISCONNECTED follows
+    dtls_gatt_pump(&transport);
+}
+
 struct dtls_delay_ctx {
     uint32_t int_ms;
     uint32_t fin_ms;
@@ -314,14 +514,18 @@ struct dtls_delay_ctx {
 };
 static struct dtls_delay_ctx delay_ctx;
 
+// The main loop sleeps until an event, so expiry schedules one for mbedtls
+// to see the timer and retransmit
 static void dtls_int_timer_handler(void * p_context) {
     struct dtls_delay_ctx *ctx = (struct dtls_delay_ctx *) p_context;
     ctx->int_timer_expired = true;
+    schedule_evt(EVT_DTLS_TIMER, NULL, 0);
 }
 
 static void dtls_fin_timer_handler(void * p_context) {
     struct dtls_delay_ctx *ctx = (struct dtls_delay_ctx *) p_context;
     ctx->fin_timer_expired = true;
+    schedule_evt(EVT_DTLS_TIMER, NULL, 0);
 }
 
 void dtls_set_delay(void *data, uint32_t int_ms, uint32_t fin_ms) {
@@ -332,7 +536,10 @@ void dtls_set_delay(void *data, uint32_t int_ms, uint32_t fin_ms) {
     ctx->int_timer_expired = false;
     ctx->fin_timer_expired = false;
 
-    ret_code_t error_code = app_timer_stop_all();
+    // only ours, the sample timer keeps running
+    ret_code_t error_code = app_timer_stop(dtls_int_timer_id);
+    APP_ERROR_CHECK(error_code);
+    error_code = app_timer_stop(dtls_fin_timer_id);
     APP_ERROR_CHECK(error_code);
 
     // don't restart timers if we don't have a delay
@@ -376,16 +583,27 @@ int main(void) {
     // Crypto initialization
     error_code = nrf_crypto_init();
 
+#ifdef CRYPTO_BENCH
+    crypto_bench_init();
+#endif
+
+    // SoftDevice handlers hand their work to the main loop through the scheduler
+    APP_SCHED_INIT(sizeof(struct sensor_evt), SCHED_QUEUE_SIZE);
+
+    error_code = nrf_pwr_mgmt_init();
+    APP_ERROR_CHECK(error_code);
+
     // put simple BLE up here so we can piggy-back on the app timer initialization
     simple_ble_app = simple_ble_init(&ble_config);
 
-    /*
+    // radio notifications need the SoftDevice
+    energy_init();
+
     error_code = app_timer_create(&dtls_int_timer_id, APP_TIMER_MODE_SINGLE_SHOT, dtls_int_timer_handler);
     APP_ERROR_CHECK(error_code);
 
     error_code = app_timer_create(&dtls_fin_timer_id, APP_TIMER_MODE_SINGLE_SHOT, dtls_fin_timer_handler);
     APP_ERROR_CHECK(error_code);
-    */
 
     //error_code = app_timer_start(dtls_int_timer_id, APP_TIMER_TICKS(1000), NULL);
     //APP_ERROR_CHECK(error_code);
@@ -402,7 +620,6 @@ int main(void) {
 
     mbedtls_entropy_context entropy;
     mbedtls_ctr_drbg_context ctr_drbg;
-    mbedtls_ssl_context ssl;
     mbedtls_ssl_config conf;
     mbedtls_x509_crt srvcert;
     mbedtls_pk_context pkey;
@@ -483,6 +700,10 @@ int main(void) {
 
     printf(" ok\n");
 
+#ifdef CRYPTO_BENCH
+    crypto_bench_run(&srvcert, &pkey, mbedtls_ctr_drbg_random, &ctr_drbg);
+#endif
+
     //TODO: I skipped setting up the listening UDP port since it's not needed in BLE dTLS
 
     /*
@@ -502,6 +723,7 @@ int main(void) {
     mbedtls_ssl_conf_rng(&conf, mbedtls_ctr_drbg_random, &ctr_drbg);
     //mbedtls_ssl_conf_dbg(&conf, my_debug, stdout); TODO: might need a my_debug function
     mbedtls_ssl_conf_read_timeout(&conf, READ_TIMEOUT_MS);
+    mbedtls_ssl_conf_handshake_timeout(&conf, DTLS_GATT_HS_TIMEOUT_MIN_MS, DTLS_GATT_HS_TIMEOUT_MAX_MS);
 
     mbedtls_ssl_conf_ca_chain(&conf, srvcert.next, NULL);
     if ((ret = mbedtls_ssl_conf_own_cert(&conf, &srvcert, &pkey)) != 0) {
@@ -523,6 +745,9 @@ int main(void) {
         
     }
 
+    //records go over the data and metadata characteristics, see dtls_gatt.h
+    dtls_gatt_init(&transport, &link_ops, NULL, XFER_WINDOW);
+    mbedtls_ssl_set_bio(&ssl, &transport, dtls_gatt_send, dtls_gatt_recv, dtls_gatt_recv_timeout);
     mbedtls_ssl_set_timer_cb(&ssl, &delay_ctx, dtls_set_delay, dtls_get_delay);
 
     printf(" ok\n");
@@ -539,6 +764,19 @@ int main(void) {
     */
     nrf_gpio_cfg_output(LED);
 
+    /*
+    * Outbox: samples are sealed on a timer and sent when a mule shows up
+    */
+    ret = outbox_init(&pkey, mbedtls_ctr_drbg_random, &ctr_drbg, outbox_evt_handler);
+    if (ret != 0) {
+        printf("outbox init failed: %d\n", ret);
+    }
+
+    error_code = app_timer_create(&sample_timer_id, APP_TIMER_MODE_REPEATED, sample_timer_handler);
+    APP_ERROR_CHECK(error_code);
+    error_code = app_timer_start(sample_timer_id, APP_TIMER_TICKS(SAMPLE_INTERVAL_MS), NULL);
+    APP_ERROR_CHECK(error_code);
+
     /*
     * BLE initialization
     */
@@ -556,103 +794,14 @@ int main(void) {
     // Start Advertising
     advertising_start();
 
-    //Wait for connection
-    uint16_t ble_conn_handle = simple_ble_app->conn_handle;
-
-    while (ble_conn_state_status(ble_conn_handle) != BLE_CONN_STATUS_CONNECTED) {
-        printf("waiting to connect..\n");
-        nrf_delay_ms(1000);
-        ble_conn_handle = simple_ble_app->conn_handle;
-    }
-
-    printf("BLE connected\n");//, start mbedtls handshake\n");
-
-    /*
-    * MBEDTLS handshake
-    */
-
-    
-    //Set bio to call ble connection TODO: 
-    //mbedtls_ssl_set_bio(&ssl, ble_conn_handle, ble_write_long, ble_read_long, NULL );
-
-    // // handshake
-    // ret = mbedtls_ssl_handshake(&ssl);
-    // // while( ret == MBEDTLS_ERR_SSL_WANT_READ ||
-    // //         ret == MBEDTLS_ERR_SSL_WANT_WRITE );
-
-    // if( ret != 0 )
-    // {
-    //     mbedtls_printf( " failed\n  ! mbedtls_ssl_handshake returned -0x%x\n\n", (unsigned int) -ret );
-    //     char error_buf[100];
-    //     mbedtls_strerror(ret, error_buf, sizeof(error_buf));
-    //     printf("SSL/TLS handshake error: %s\n", error_buf);
-    //     //abort();
-    // }
-    // else {
-    //     printf("mbedtls handshake successful\n");
-    // }
-
-
-    //TODO: actually send data over mbedtls
-
-    //stop ourselves from continuing on 
-    // while(true) {
-    //     nrf_delay_ms(1000);
-    // }
-
-    //Read and write test
-    //data_test(ble_conn_handle);
-
-    //End-to-End test
+    //End-to-End test: the DTLS handshake with a mule, sending the samples
+    //and acks all happen in sensor_evt_handler, we sleep until the
+    //SoftDevice or a timer has news
     while(true) {
-
-        while (ble_conn_state_status(ble_conn_handle) != BLE_CONN_STATUS_CONNECTED) {
-            printf("waiting to connect..\n");
-            nrf_delay_ms(1000);
-            ble_conn_handle = simple_ble_app->conn_handle;
-        }
-
-        uint8_t data[CHUNK_SIZE];
-        error_code = ble_write(data, CHUNK_SIZE, &sensor_state_char, 0);
-        printf("  write returned %d\n", error_code);
-        printf("connected....doot doot....\n");
-        nrf_delay_ms(500);
-
-        // if (metadata_state[2] == 2 ) {
-        //     printf("waiting for mule to send data back\n");
-        //     nrf_delay_ms(5000); // give em 5 seconds
-        //     metadata_state[0] = 0;
-        //     metadata_state[1] = 0;
-        //     metadata_state[2] = 0;
-        //     error_code = ble_write(metadata_state, 3, &metadata_state_char, 0);
-        // }
-        // else if (metadata_state[2] == 1) {
-        //     //already sending data
-        // }
-        // else {
-        //     // time to send some more data //todo make sensor state data
-        //     printf("time to send more!\n");
-        //     uint8_t data_test [1000];
-        //     error_code = ble_write_long(&ble_conn_handle, data, 1000);
-        //     printf("made it through sending data\n");
-        //     nrf_delay_ms(10000);
-
-        // }
+        app_sched_execute();
+        energy_idle();
     }
 
- 
-    
-    // Enter main loop.
-    // printf("main loop starting\n");
-    // int loop_counter = 0;
-    // while (loop_counter < 10) {
-    //     nrf_gpio_pin_toggle(LED);
-    //     nrf_delay_ms(1000);
-    //     printf("beep!\n");
-    // }
-
-    printf("done sending data, closing connection\n");
-
     // TODO: after mbedtls Cleanup 
     // printf("clean up!\n");
     // mbedtls_ecdh_free(&ctx_sensor);
@@ -0,0 +1,359 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include "fds.h"
+#include "mbedtls/ecdsa.h"
+#include "mbedtls/sha256.h"
+#include "aes_gcm.h"
+#include "wire.h"
+#include "outbox.h"
+
+// Identity and data key the cloud knows this sensor by (see
+// cloud/test_mule.py and cloud/aes_decrypt.py)
+#ifndef OUTBOX_SENSOR_ID
+#define OUTBOX_SENSOR_ID { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, \
+                           0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x01 }
+#endif
+#ifndef OUTBOX_DATA_KEY
+#define OUTBOX_DATA_KEY { 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, \
+                          0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f }
+#endif
+
+#define P256_BYTES 32
+#define HASH_LEN 32
+#define SIGNED_HASH_LEN (WIRE_SIGNED_HASH_PAYLOAD_PREFIX_LEN + WIRE_HASH_PAYLOAD_PREFIX_LEN)
+#define SEALED_MAX (NRF_CRYPTO_AES_IV_SIZE + OUTBOX_MAX_SAMPLE_LEN + AES_GCM_TAG_SIZE)
+#define FRAME_MAX (WIRE_SENSOR_DELIVERY_PREFIX_LEN + SIGNED_HASH_LEN + SEALED_MAX)
+
+// A record is the frame length (u32) followed by the frame, padded to words
+#define RECORD_HDR_LEN 4
+#define RECORD_WORDS ((RECORD_HDR_LEN + FRAME_MAX + 3) / 4)
+
+static const uint8_t sensor_id[WIRE_HASH_PAYLOAD_SENSOR_ID_LEN] = OUTBOX_SENSOR_ID;
+static const uint8_t data_key[NRF_CRYPTO_AES_KEY_SIZE] = OUTBOX_DATA_KEY;
+
+static struct {
+    mbedtls_pk_context *key;
+    int (*f_rng)(void *, unsigned char *, size_t);
+    void *p_rng;
+    void (*on_event)(void);
+
+    volatile bool ready;        // FDS initialized
+    volatile bool writing;      // record is being written from staging
+    volatile bool collecting;   // garbage collection in flight
+    volatile bool deleting;     // popped record is being deleted
+    bool stuck;                 // a malformed record could not be deleted
+    volatile uint32_t count;
+
+    bool open;                  // desc is the record handed out by outbox_peek
+    fds_record_desc_t desc;
+    const uint8_t *frame;
+    size_t frame_len;
+} outbox;
+
+// FDS writes from here until FDS_EVT_WRITE, so it can't live on the stack.
+// Each frame is built in it in place, so a sample is only held once.
+static uint32_t staging[RECORD_WORDS];
+
+static uint32_t count_records(void)
+{
+    fds_record_desc_t desc;
+    fds_find_token_t token;
+    uint32_t n = 0;
+
+    memset(&token, 0, sizeof(token));
+    while (fds_record_find(OUTBOX_FILE_ID, OUTBOX_RECORD_KEY, &desc, &token) == NRF_SUCCESS) {
+        n += 1;
+    }
+    return n;
+}
+
+static void fds_evt_handler(fds_evt_t const *evt)
+{
+    switch (evt->id) {
+        case FDS_EVT_INIT:
+            if (evt->result == NRF_SUCCESS) {
+                outbox.count = count_records();
+                outbox.ready = true;
+                printf("outbox: %lu frames in flash\n", (unsigned long)outbox.count);
+            } else {
+                printf("outbox: fds init failed: %lu\n", (unsigned long)evt->result);
+            }
+            break;
+
+        case FDS_EVT_WRITE:
+            if (evt->write.file_id != OUTBOX_FILE_ID) {
+                return;
+            }
+            outbox.writing = false;
+            if (evt->result == NRF_SUCCESS) {
+                outbox.count += 1;
+            } else {
+                printf("outbox: write failed: %lu\n", (unsigned long)evt->result);
+            }
+            break;
+
+        case FDS_EVT_DEL_RECORD:
+            if (evt->del.file_id != OUTBOX_FILE_ID) {
+                return;
+            }
+            outbox.deleting = false;
+            break;
+
+        case FDS_EVT_GC:
+            outbox.collecting = false;
+            break;
+
+        default:
+            return;
+    }
+
+    if (outbox.on_event != NULL) {
+        outbox.on_event();
+    }
+}
+
+int outbox_init(mbedtls_pk_context *key, int (*f_rng)(void *, unsigned char *, size_t),
+                void *p_rng, void (*on_event)(void))
+{
+    if (!mbedtls_pk_can_do(key, MBEDTLS_PK_ECKEY) ||
+        mbedtls_pk_ec(*key)->grp.id != MBEDTLS_ECP_DP_SECP256R1) {
+        return OUTBOX_ERR_KEY;
+    }
+
+    memset(&outbox, 0, sizeof(outbox));
+    outbox.key = key;
+    outbox.f_rng = f_rng;
+    outbox.p_rng = p_rng;
+    outbox.on_event = on_event;
+
+    ret_code_t error_code = fds_register(fds_evt_handler);
+    if (error_code == NRF_SUCCESS) {
+        error_code = fds_init();
+    }
+    if (error_code != NRF_SUCCESS) {
+        printf("outbox: fds init failed: %lu\n", (unsigned long)error_code);
+        return OUTBOX_ERR_FLASH;
+    }
+    return 0;
+}
+
+// Raw r || s over SHA-256(msg), the format the app server verifies
+static int sign(const uint8_t *msg, size_t len, uint8_t sig[2 * P256_BYTES])
+{
+    mbedtls_ecp_keypair *ec = mbedtls_pk_ec(*outbox.key);
+    uint8_t hash[HASH_LEN];
+    mbedtls_mpi r, s;
+    int ret;
+
+    mbedtls_mpi_init(&r);
+    mbedtls_mpi_init(&s);
+    ret = mbedtls_sha256_ret(msg, len, hash, 0);
+    if (ret == 0) {
+        ret = mbedtls_ecdsa_sign(&ec->grp, &r, &s, &ec->d, hash, sizeof(hash),
+                                 outbox.f_rng, outbox.p_rng);
+    }
+    if (ret == 0) {
+        ret = mbedtls_mpi_write_binary(&r, sig, P256_BYTES);
+    }
+    if (ret == 0) {
+        ret = mbedtls_mpi_write_binary(&s, sig + P256_BYTES, P256_BYTES);
+    }
+    mbedtls_mpi_free(&s);
+    mbedtls_mpi_free(&r);
+    return ret;
+}
+
+// Reserves flash for a record, collecting garbage if deleted records are in
+// the way
+static int reserve(fds_reserve_token_t *token, uint16_t length_words)
+{
+    fds_stat_t stat;
+    ret_code_t error_code = fds_reserve(token, length_words);
+
+    if (error_code == NRF_SUCCESS) {
+        return 0;
+    }
+    if (error_code != FDS_ERR_NO_SPACE_IN_FLASH) {
+        printf("outbox: reserve failed: %lu\n", (unsigned long)error_code);
+        return OUTBOX_ERR_FLASH;
+    }
+
+    if (fds_stat(&stat) != NRF_SUCCESS || stat.dirty_records == 0) {
+        return OUTBOX_ERR_FULL;
+    }
+    outbox.collecting = true;
+    if (fds_gc() != NRF_SUCCESS) {
+        outbox.collecting = false;
+        return OUTBOX_ERR_FLASH;
+    }
+    return OUTBOX_ERR_BUSY;
+}
+
+int outbox_put(const uint8_t *sample, size_t len)
+{
+    uint8_t iv[NRF_CRYPTO_AES_IV_SIZE];
+    uint8_t data_hash[HASH_LEN];
+    uint8_t signature[2 * P256_BYTES];
+    uint8_t *record = (uint8_t *)staging;
+    fds_reserve_token_t token;
+    int ret;
+
+    if (!outbox.ready || outbox.writing || outbox.collecting) {
+        return OUTBOX_ERR_BUSY;
+    }
+    if (len > OUTBOX_MAX_SAMPLE_LEN) {
+        return OUTBOX_ERR_TOO_LARGE;
+    }
+
+    size_t sealed_len = NRF_CRYPTO_AES_IV_SIZE + len + AES_GCM_TAG_SIZE;
+    size_t frame_len = WIRE_SENSOR_DELIVERY_PREFIX_LEN + SIGNED_HASH_LEN + sealed_len;
+    uint16_t length_words = (uint16_t)((RECORD_HDR_LEN + frame_len + 3) / 4);
+
+    // where each part of the frame goes: SensorDelivery prefix, then
+    // SignedHashPayload (prefix, HashPayload), then the sealed sample
+    uint8_t *frame = record + RECORD_HDR_LEN;
+    uint8_t *signed_hash = frame + WIRE_SENSOR_DELIVERY_PREFIX_LEN;
+    uint8_t *hash_payload = signed_hash + WIRE_SIGNED_HASH_PAYLOAD_PREFIX_LEN;
+    uint8_t *sealed = signed_hash + SIGNED_HASH_LEN;
+
+    // claim the flash before spending time on the crypto
+    ret = reserve(&token, length_words);
+    if (ret != 0) {
+        return ret;
+    }
+
+    // the fields are written in place below, so this only sets the prefix
+    struct wire_sensor_delivery delivery = {
+        .signed_hash_payload = signed_hash,
+        .signed_hash_payload_len = SIGNED_HASH_LEN,
+        .data = sealed,
+        .data_len = (uint32_t)sealed_len,
+    };
+    wire_sensor_delivery_encode(&delivery, frame, sizeof(staging) - RECORD_HDR_LEN);
+    wire_put_u32(record, (uint32_t)frame_len);
+
+    // copies the sample into the frame and encrypts it there
+    ret = outbox.f_rng(outbox.p_rng, iv, sizeof(iv));
+    if (ret == 0) {
+        ret = encrypt_character_array(data_key, iv, sample, sealed, len);
+    }
+    // the hash covers the data as the mule will deliver it, i.e. encrypted
+    if (ret == 0) {
+        ret = mbedtls_sha256_ret(sealed, sealed_len, data_hash, 0);
+    }
+
+    struct wire_hash_payload hp = {
+        .sensor_id = sensor_id,
+        .data_hash = data_hash,
+    };
+    if (ret == 0) {
+        wire_hash_payload_encode(&hp, hash_payload, WIRE_HASH_PAYLOAD_PREFIX_LEN);
+        ret = sign(hash_payload, WIRE_HASH_PAYLOAD_PREFIX_LEN, signature);
+    }
+
+    struct wire_signed_hash_payload shp = {
+        .hash_payload = hash_payload,
+        .hash_payload_len = WIRE_HASH_PAYLOAD_PREFIX_LEN,
+        .signature = signature,
+    };
+    if (ret == 0) {
+        wire_signed_hash_payload_encode(&shp, signed_hash, SIGNED_HASH_LEN);
+    }
+
+    if (ret != 0) {
+        fds_reserve_cancel(&token);
+        return ret;
+    }
+
+    fds_record_t rec = {
+        .file_id = OUTBOX_FILE_ID,
+        .key = OUTBOX_RECORD_KEY,
+        .data.p_data = staging,
+        .data.length_words = length_words,
+    };
+    outbox.writing = true;
+    ret_code_t error_code = fds_record_write_reserved(NULL, &rec, &token);
+    if (error_code != NRF_SUCCESS) {
+        outbox.writing = false;
+        fds_reserve_cancel(&token);
+        printf("outbox: write failed: %lu\n", (unsigned long)error_code);
+        return OUTBOX_ERR_FLASH;
+    }
+    return 0;
+}
+
+int outbox_peek(const uint8_t **frame, size_t *len)
+{
+    fds_flash_record_t rec;
+    fds_find_token_t token;
+
+    *len = 0;
+    if (outbox.stuck) {
+        return OUTBOX_ERR_FLASH;
+    }
+    if (!outbox.ready || outbox.deleting) {
+        return 0;
+    }
+
+    if (!outbox.open) {
+        memset(&token, 0, sizeof(token));
+        if (fds_record_find(OUTBOX_FILE_ID, OUTBOX_RECORD_KEY, &outbox.desc, &token) != NRF_SUCCESS ||
+            fds_record_open(&outbox.desc, &rec) != NRF_SUCCESS) {
+            return 0;
+        }
+
+        const uint8_t *data = rec.p_data;
+        size_t record_len = (size_t)rec.p_header->length_words * 4;
+        size_t frame_len = record_len >= RECORD_HDR_LEN ? wire_get_u32(data) : SIZE_MAX;
+        if (frame_len > record_len - RECORD_HDR_LEN) {
+            // not one of ours, drop it
+            printf("outbox: dropping a malformed record\n");
+            fds_record_close(&outbox.desc);
+            ret_code_t error_code = fds_record_delete(&outbox.desc);
+            if (error_code == FDS_ERR_NO_SPACE_IN_QUEUES) {
+                return OUTBOX_ERR_BUSY;
+            }
+            if (error_code != NRF_SUCCESS) {
+                // every later frame sits behind it, don't retry on each peek
+                printf("outbox: can't delete the malformed record: %lu\n", (unsigned long)error_code);
+                outbox.stuck = true;
+                return OUTBOX_ERR_FLASH;
+            }
+            outbox.deleting = true;
+            outbox.count -= 1;
+            return 0;
+        }
+
+        outbox.open = true;
+        outbox.frame = data + RECORD_HDR_LEN;
+        outbox.frame_len = frame_len;
+    }
+
+    *frame = outbox.frame;
+    *len = outbox.frame_len;
+    return 0;
+}
+
+void outbox_pop(void)
+{
+    if (!outbox.open) {
+        return;
+    }
+    fds_record_close(&outbox.desc);
+    outbox.open = false;
+
+    ret_code_t error_code = fds_record_delete(&outbox.desc);
+    if (error_code != NRF_SUCCESS) {
+        // still in flash, so it goes out again on the next peek
+        printf("outbox: delete failed: %lu\n", (unsigned long)error_code);
+        return;
+    }
+    outbox.deleting = true;
+    outbox.count -= 1;
+}
+
+uint32_t outbox_count(void)
+{
+    return outbox.count;
+}
@@ -0,0 +1,58 @@
+/*
+ * Outbox of sealed sensor payloads, kept in flash
+ *
+ * Right after a sample is produced, outbox_put encrypts it with AES-GCM,
+ * hashes the result, signs HashPayload(sensor_id, H(data)) with the sensor
+ * key and stores the finished SensorDelivery frame (see common/wire.h) as
+ * an FDS record. While a mule is connected the sensor only has to hand it
+ * what outbox_peek returns, which points straight into flash, so the
+ * contact window is spent on the radio instead of on SHA-256 and ECDSA.
+ *
+ * FDS works asynchronously: the callback passed to outbox_init runs (from
+ * the SoftDevice event handler) whenever a write, delete or garbage
+ * collection finishes, and OUTBOX_ERR_BUSY means try again after it.
+ * Frames survive a reset and are sent oldest page first.
+ */
+
+#ifndef OUTBOX_H
+#define OUTBOX_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "mbedtls/pk.h"
+
+#ifndef OUTBOX_MAX_SAMPLE_LEN
+#define OUTBOX_MAX_SAMPLE_LEN 1024
+#endif
+
+#define OUTBOX_FILE_ID    0x0b0c
+#define OUTBOX_RECORD_KEY 0x0001
+
+#define OUTBOX_ERR_BUSY      -1   // FDS not ready, a write or garbage collection in flight
+#define OUTBOX_ERR_FULL      -2   // flash holds nothing but undelivered frames
+#define OUTBOX_ERR_TOO_LARGE -3   // sample longer than OUTBOX_MAX_SAMPLE_LEN
+#define OUTBOX_ERR_KEY       -4   // signing key is not a P-256 key
+#define OUTBOX_ERR_FLASH     -5   // any other FDS error, printed over RTT
+
+// key signs the hash payloads, f_rng supplies IVs and signing nonces. All
+// three must outlive the outbox. on_event may be NULL.
+int outbox_init(mbedtls_pk_context *key, int (*f_rng)(void *, unsigned char *, size_t),
+                void *p_rng, void (*on_event)(void));
+
+// Seals a sample and starts writing its frame to flash. Returns 0, an
+// OUTBOX_ERR_* code, or an mbed TLS error from encrypting or signing.
+int outbox_put(const uint8_t *sample, size_t len);
+
+// Oldest frame in flash and its length in *len, 0 if there is none right
+// now. Returns the same frame until outbox_pop. Returns 0, OUTBOX_ERR_BUSY
+// if a malformed record is in the way and FDS can't take its delete yet,
+// or OUTBOX_ERR_FLASH from then on if it can't be deleted at all.
+int outbox_peek(const uint8_t **frame, size_t *len);
+
+// Deletes the frame returned by outbox_peek once the mule has it
+void outbox_pop(void);
+
+// Frames in flash that haven't been popped
+uint32_t outbox_count(void);
+
+#endif // OUTBOX_H
@@ -25,13 +25,61 @@ BOARD_AS = $(notdir $(wildcard $(BOARD_DIR)/./*.s))
 BOARD = PCA10056
 USE_BLE = 1
 
+# software: mbed TLS computes everything itself
+# cc310: mbed TLS AES, SHA-256 and P-256 ECDSA/ECDH run on the CC310
+CRYPTO_BACKEND ?= software
+# 1 to print cycles per crypto operation over RTT at boot
+CRYPTO_BENCH ?= 0
+# full: mbedtls_config.h, everything on
+# dtls: mbedtls_config_dtls.h, only what DTLS over BLE needs
+MBEDTLS_PROFILE ?= full
+
 # Additional #define's to be added to code by the compiler
 BOARD_VARS = \
 	BOARD_$(BOARD)\
 	USE_APP_CONFIG\
 	DEBUG\
 	DEBUG_NRF\
-	MBEDTLS_CONFIG_FILE=\"$(BOARD_DIR)/mbedtls_config.h\"\
+
+ifeq ($(MBEDTLS_PROFILE),full)
+BOARD_VARS += MBEDTLS_CONFIG_FILE=\"$(BOARD_DIR)/mbedtls_config.h\"
+else ifeq ($(MBEDTLS_PROFILE),dtls)
+BOARD_VARS += MBEDTLS_CONFIG_FILE=\"$(BOARD_DIR)/mbedtls_config_dtls.h\"
+else
+$(error MBEDTLS_PROFILE must be full or dtls)
+endif
+
+ifeq ($(CRYPTO_BACKEND),cc310)
+BOARD_VARS += CRYPTO_BACKEND_CC310
+BOARD_SOURCES += \
+	nrf_crypto_aes.c\
+	nrf_crypto_aes_shared.c\
+	nrf_crypto_ecc.c\
+	nrf_crypto_ecdsa.c\
+	nrf_crypto_hash.c\
+	nrf_crypto_rng.c\
+	nrf_crypto_shared.c\
+	cc310_backend_aes.c\
+	cc310_backend_aes_aead.c\
+	cc310_backend_ecc.c\
+	cc310_backend_ecdh.c\
+	cc310_backend_ecdsa.c\
+	cc310_backend_hash.c\
+	cc310_backend_init.c\
+	cc310_backend_mutex.c\
+	cc310_backend_rng.c\
+	cc310_backend_shared.c\
+
+BOARD_HEADER_PATHS += $(SDK_ROOT)external/nrf_cc310/include/
+# the CRYS_* runtime; Includes.mk only links it for Thread builds
+LIBS += $(SDK_ROOT)external/nrf_cc310/lib/libnrf_cc310_0.9.10.a
+else ifneq ($(CRYPTO_BACKEND),software)
+$(error CRYPTO_BACKEND must be software or cc310)
+endif
+
+ifeq ($(CRYPTO_BENCH),1)
+BOARD_VARS += CRYPTO_BENCH
+endif
 
 # Default SDK source files to be included
 BOARD_SOURCES += \
@@ -72,6 +120,10 @@ BOARD_SOURCES += \
 	nrf_queue.c\
 	nrf_drv_clock.c\
 	nrf_nvmc.c\
+	fds.c\
+	nrf_fstorage.c\
+	nrf_fstorage_sd.c\
+	nrf_sdh_soc.c\
 	nrfx_gpiote.c\
 	nrfx_prs.c\
 	nrfx_saadc.c\
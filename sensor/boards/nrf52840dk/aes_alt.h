@@ -0,0 +1,17 @@
+/*
+ * mbed TLS AES context for MBEDTLS_AES_ALT: the block cipher runs on the
+ * CC310 through nrf_crypto_aes (see cc310_alt.c). Only AES-128 is supported.
+ */
+
+#ifndef AES_ALT_H
+#define AES_ALT_H
+
+#include "nrf_crypto_aes.h"
+
+typedef struct mbedtls_aes_context {
+    nrf_crypto_aes_context_t aes;   // ECB, key expanded once by setkey
+    int mode;                       // MBEDTLS_AES_ENCRYPT or _DECRYPT, as keyed
+    int keyed;
+} mbedtls_aes_context;
+
+#endif // AES_ALT_H
@@ -15,10 +15,23 @@
 
 #define NRF_CRYPTO_ENABLED 1
 #define NRF_CRYPTO_BACKEND_CC310_LIB 1
-#define NRF_CRYPTO_BACKEND_NRF_HW_RNG_ENABLED 1
 #define NRF_CRYPTO_BACKEND_CIFRA_ENABLED 1
 #define NRF_CRYPTO_RNG_STATIC_MEMORY_BUFFERS_ENABLED 1
+#ifdef CRYPTO_BACKEND_CC310
+// mbed TLS calls into nrf_crypto here, so nrf_crypto must not call back
+// into mbed TLS
+#define NRF_CRYPTO_BACKEND_CC310_ENABLED 1
+#define NRF_CRYPTO_BACKEND_CC310_AES_ECB_ENABLED 1
+#define NRF_CRYPTO_BACKEND_CC310_HASH_SHA256_ENABLED 1
+#define NRF_CRYPTO_BACKEND_CC310_ECC_SECP256R1_ENABLED 1
+// nrf_crypto takes one RNG backend, the CC310's here
+#define NRF_CRYPTO_BACKEND_CC310_RNG_ENABLED 1
+#define NRF_CRYPTO_BACKEND_NRF_HW_RNG_ENABLED 0
+#define NRF_CRYPTO_BACKEND_MBEDTLS_ENABLED 0
+#else
+#define NRF_CRYPTO_BACKEND_NRF_HW_RNG_ENABLED 1
 #define NRF_CRYPTO_BACKEND_MBEDTLS_ENABLED 1
+#endif
 #define NRF_CRYPTO_RNG_AUTO_INIT_ENABLED 1
 #define NRF_CRYPTO_CURVE25519_BIG_ENDIAN_ENABLED 1
 
@@ -0,0 +1,471 @@
+/*
+ * mbed TLS *_ALT hooks that run AES, SHA-256 and P-256 ECDSA/ECDH on the
+ * CC310 through nrf_crypto. Only built with CRYPTO_BACKEND=cc310 (see
+ * Board.mk), which also turns the hooks on in mbedtls_config_board.h.
+ *
+ * The CC310 does AES-128 only, and the ECC hooks only handle secp256r1:
+ * other key sizes and curves fail instead of falling back to software,
+ * since the software code is compiled out once the hook is defined. The
+ * AES and SHA-256 contexts are redefined in aes_alt.h and sha256_alt.h.
+ */
+
+#ifdef CRYPTO_BACKEND_CC310
+
+#include <string.h>
+
+#include "nrf_crypto.h"
+#include "mbedtls/aes.h"
+#include "mbedtls/sha256.h"
+#include "mbedtls/ecdsa.h"
+#include "mbedtls/ecdh.h"
+
+#define P256_BYTES 32
+
+// -- AES --
+// setkey initialises one ECB context per mbedtls_aes_context and the CC310
+// keeps the expanded key in it; each block after that is a single update.
+// The modes are built on the block function as in mbed TLS's aes.c.
+
+void mbedtls_aes_init(mbedtls_aes_context *ctx)
+{
+    memset(ctx, 0, sizeof(*ctx));
+}
+
+void mbedtls_aes_free(mbedtls_aes_context *ctx)
+{
+    if (ctx == NULL) {
+        return;
+    }
+    if (ctx->keyed) {
+        nrf_crypto_aes_uninit(&ctx->aes);
+    }
+    volatile uint8_t *p = (volatile uint8_t *)ctx;
+    for (size_t i = 0; i < sizeof(*ctx); i++) {
+        p[i] = 0;
+    }
+}
+
+static int aes_setkey(mbedtls_aes_context *ctx, int mode, const unsigned char *key, unsigned int keybits)
+{
+    if (keybits != 128) {
+        return MBEDTLS_ERR_AES_INVALID_KEY_LENGTH;
+    }
+    if (ctx->keyed) {
+        nrf_crypto_aes_uninit(&ctx->aes);
+        ctx->keyed = 0;
+    }
+
+    ret_code_t err = nrf_crypto_aes_init(&ctx->aes, &g_nrf_crypto_aes_ecb_128_info,
+                                         mode == MBEDTLS_AES_ENCRYPT ? NRF_CRYPTO_ENCRYPT : NRF_CRYPTO_DECRYPT);
+    if (err == NRF_SUCCESS) {
+        err = nrf_crypto_aes_key_set(&ctx->aes, (uint8_t *)key);
+        if (err != NRF_SUCCESS) {
+            nrf_crypto_aes_uninit(&ctx->aes);
+        }
+    }
+    if (err != NRF_SUCCESS) {
+        return MBEDTLS_ERR_AES_HW_ACCEL_FAILED;
+    }
+    ctx->mode = mode;
+    ctx->keyed = 1;
+    return 0;
+}
+
+int mbedtls_aes_setkey_enc(mbedtls_aes_context *ctx, const unsigned char *key, unsigned int keybits)
+{
+    return aes_setkey(ctx, MBEDTLS_AES_ENCRYPT, key, keybits);
+}
+
+int mbedtls_aes_setkey_dec(mbedtls_aes_context *ctx, const unsigned char *key, unsigned int keybits)
+{
+    return aes_setkey(ctx, MBEDTLS_AES_DECRYPT, key, keybits);
+}
+
+int mbedtls_aes_crypt_ecb(mbedtls_aes_context *ctx, int mode,
+                          const unsigned char input[16], unsigned char output[16])
+{
+    // the direction is fixed when the key is set
+    if (!ctx->keyed || mode != ctx->mode) {
+        return MBEDTLS_ERR_AES_BAD_INPUT_DATA;
+    }
+    return nrf_crypto_aes_update(&ctx->aes, (uint8_t *)input, 16, output) == NRF_SUCCESS ?
+           0 : MBEDTLS_ERR_AES_HW_ACCEL_FAILED;
+}
+
+int mbedtls_internal_aes_encrypt(mbedtls_aes_context *ctx, const unsigned char input[16], unsigned char output[16])
+{
+    return mbedtls_aes_crypt_ecb(ctx, MBEDTLS_AES_ENCRYPT, input, output);
+}
+
+int mbedtls_internal_aes_decrypt(mbedtls_aes_context *ctx, const unsigned char input[16], unsigned char output[16])
+{
+    return mbedtls_aes_crypt_ecb(ctx, MBEDTLS_AES_DECRYPT, input, output);
+}
+
+#if !defined(MBEDTLS_DEPRECATED_REMOVED)
+void mbedtls_aes_encrypt(mbedtls_aes_context *ctx, const unsigned char input[16], unsigned char output[16])
+{
+    mbedtls_internal_aes_encrypt(ctx, input, output);
+}
+
+void mbedtls_aes_decrypt(mbedtls_aes_context *ctx, const unsigned char input[16], unsigned char output[16])
+{
+    mbedtls_internal_aes_decrypt(ctx, input, output);
+}
+#endif
+
+#if defined(MBEDTLS_CIPHER_MODE_CBC)
+int mbedtls_aes_crypt_cbc(mbedtls_aes_context *ctx, int mode, size_t length, unsigned char iv[16],
+                          const unsigned char *input, unsigned char *output)
+{
+    unsigned char temp[16];
+    int ret;
+
+    if (length % 16) {
+        return MBEDTLS_ERR_AES_INVALID_INPUT_LENGTH;
+    }
+    for (; length > 0; length -= 16, input += 16, output += 16) {
+        if (mode == MBEDTLS_AES_DECRYPT) {
+            memcpy(temp, input, 16);
+            ret = mbedtls_aes_crypt_ecb(ctx, mode, input, output);
+            for (int i = 0; i < 16; i++) {
+                output[i] ^= iv[i];
+            }
+            memcpy(iv, temp, 16);
+        } else {
+            for (int i = 0; i < 16; i++) {
+                output[i] = input[i] ^ iv[i];
+            }
+            ret = mbedtls_aes_crypt_ecb(ctx, mode, output, output);
+            memcpy(iv, output, 16);
+        }
+        if (ret != 0) {
+            return ret;
+        }
+    }
+    return 0;
+}
+#endif
+
+#if defined(MBEDTLS_CIPHER_MODE_CFB)
+int mbedtls_aes_crypt_cfb128(mbedtls_aes_context *ctx, int mode, size_t length, size_t *iv_off,
+                             unsigned char iv[16], const unsigned char *input, unsigned char *output)
+{
+    size_t n = *iv_off;
+    int ret;
+
+    while (length--) {
+        if (n == 0 && (ret = mbedtls_aes_crypt_ecb(ctx, MBEDTLS_AES_ENCRYPT, iv, iv)) != 0) {
+            return ret;
+        }
+        unsigned char c = *input++;
+        *output++ = c ^ iv[n];
+        iv[n] = mode == MBEDTLS_AES_DECRYPT ? c : output[-1];
+        n = (n + 1) & 0x0f;
+    }
+    *iv_off = n;
+    return 0;
+}
+
+int mbedtls_aes_crypt_cfb8(mbedtls_aes_context *ctx, int mode, size_t length,
+                           unsigned char iv[16], const unsigned char *input, unsigned char *output)
+{
+    unsigned char ov[17];
+    int ret;
+
+    while (length--) {
+        memcpy(ov, iv, 16);
+        if ((ret = mbedtls_aes_crypt_ecb(ctx, MBEDTLS_AES_ENCRYPT, iv, iv)) != 0) {
+            return ret;
+        }
+        if (mode == MBEDTLS_AES_DECRYPT) {
+            ov[16] = *input;
+        }
+        unsigned char c = *output++ = iv[0] ^ *input++;
+        if (mode == MBEDTLS_AES_ENCRYPT) {
+            ov[16] = c;
+        }
+        memcpy(iv, ov + 1, 16);
+    }
+    return 0;
+}
+#endif
+
+#if defined(MBEDTLS_CIPHER_MODE_CTR)
+int mbedtls_aes_crypt_ctr(mbedtls_aes_context *ctx, size_t length, size_t *nc_off,
+                          unsigned char nonce_counter[16], unsigned char stream_block[16],
+                          const unsigned char *input, unsigned char *output)
+{
+    size_t n = *nc_off;
+    int ret;
+
+    while (length--) {
+        if (n == 0) {
+            if ((ret = mbedtls_aes_crypt_ecb(ctx, MBEDTLS_AES_ENCRYPT, nonce_counter, stream_block)) != 0) {
+                return ret;
+            }
+            for (int i = 16; i > 0; i--) {
+                if (++nonce_counter[i - 1] != 0) {
+                    break;
+                }
+            }
+        }
+        *output++ = *input++ ^ stream_block[n];
+        n = (n + 1) & 0x0f;
+    }
+    *nc_off = n;
+    return 0;
+}
+#endif
+
+// -- SHA-256 --
+
+void mbedtls_sha256_init(mbedtls_sha256_context *ctx)
+{
+    memset(ctx, 0, sizeof(*ctx));
+}
+
+void mbedtls_sha256_free(mbedtls_sha256_context *ctx)
+{
+    if (ctx == NULL) {
+        return;
+    }
+    volatile uint8_t *p = (volatile uint8_t *)ctx;
+    for (size_t i = 0; i < sizeof(*ctx); i++) {
+        p[i] = 0;
+    }
+}
+
+void mbedtls_sha256_clone(mbedtls_sha256_context *dst, const mbedtls_sha256_context *src)
+{
+    *dst = *src;
+}
+
+int mbedtls_sha256_starts_ret(mbedtls_sha256_context *ctx, int is224)
+{
+    ctx->is224 = is224;
+    if (is224) {
+        return MBEDTLS_ERR_SHA256_HW_ACCEL_FAILED;
+    }
+    return nrf_crypto_hash_init(&ctx->hash, &g_nrf_crypto_hash_sha256_info) == NRF_SUCCESS ?
+           0 : MBEDTLS_ERR_SHA256_HW_ACCEL_FAILED;
+}
+
+int mbedtls_sha256_update_ret(mbedtls_sha256_context *ctx, const unsigned char *input, size_t ilen)
+{
+    if (ilen == 0) {
+        return 0;
+    }
+    return nrf_crypto_hash_update(&ctx->hash, input, ilen) == NRF_SUCCESS ?
+           0 : MBEDTLS_ERR_SHA256_HW_ACCEL_FAILED;
+}
+
+int mbedtls_sha256_finish_ret(mbedtls_sha256_context *ctx, unsigned char output[32])
+{
+    size_t digest_size = 32;
+    return nrf_crypto_hash_finalize(&ctx->hash, output, &digest_size) == NRF_SUCCESS ?
+           0 : MBEDTLS_ERR_SHA256_HW_ACCEL_FAILED;
+}
+
+int mbedtls_internal_sha256_process(mbedtls_sha256_context *ctx, const unsigned char data[64])
+{
+    return mbedtls_sha256_update_ret(ctx, data, 64);
+}
+
+#if !defined(MBEDTLS_DEPRECATED_REMOVED)
+void mbedtls_sha256_starts(mbedtls_sha256_context *ctx, int is224)
+{
+    mbedtls_sha256_starts_ret(ctx, is224);
+}
+
+void mbedtls_sha256_update(mbedtls_sha256_context *ctx, const unsigned char *input, size_t ilen)
+{
+    mbedtls_sha256_update_ret(ctx, input, ilen);
+}
+
+void mbedtls_sha256_finish(mbedtls_sha256_context *ctx, unsigned char output[32])
+{
+    mbedtls_sha256_finish_ret(ctx, output);
+}
+
+void mbedtls_sha256_process(mbedtls_sha256_context *ctx, const unsigned char data[64])
+{
+    mbedtls_internal_sha256_process(ctx, data);
+}
+#endif
+
+// -- P-256 ECDSA and ECDH --
+// nrf_crypto takes keys as raw big-endian integers: d for private keys, X || Y
+// for public keys, r || s for signatures.
+
+static int ecc_error(ret_code_t err)
+{
+    if (err == NRF_ERROR_CRYPTO_ECDSA_INVALID_SIGNATURE) {
+        return MBEDTLS_ERR_ECP_VERIFY_FAILED;
+    }
+    return MBEDTLS_ERR_ECP_HW_ACCEL_FAILED;
+}
+
+static int private_key_from_mpi(nrf_crypto_ecc_private_key_t *key, const mbedtls_mpi *d)
+{
+    uint8_t raw[P256_BYTES];
+    int ret = mbedtls_mpi_write_binary(d, raw, sizeof(raw));
+    if (ret == 0 && nrf_crypto_ecc_private_key_from_raw(&g_nrf_crypto_ecc_secp256r1_curve_info,
+                                                        key, raw, sizeof(raw)) != NRF_SUCCESS) {
+        ret = MBEDTLS_ERR_ECP_INVALID_KEY;
+    }
+    memset(raw, 0, sizeof(raw));
+    return ret;
+}
+
+static int public_key_from_point(nrf_crypto_ecc_public_key_t *key, const mbedtls_ecp_point *Q)
+{
+    uint8_t raw[2 * P256_BYTES];
+    int ret = mbedtls_mpi_write_binary(&Q->X, raw, P256_BYTES);
+    if (ret == 0) {
+        ret = mbedtls_mpi_write_binary(&Q->Y, raw + P256_BYTES, P256_BYTES);
+    }
+    if (ret == 0 && nrf_crypto_ecc_public_key_from_raw(&g_nrf_crypto_ecc_secp256r1_curve_info,
+                                                       key, raw, sizeof(raw)) != NRF_SUCCESS) {
+        ret = MBEDTLS_ERR_ECP_INVALID_KEY;
+    }
+    return ret;
+}
+
+int mbedtls_ecdsa_sign(mbedtls_ecp_group *grp, mbedtls_mpi *r, mbedtls_mpi *s,
+                       const mbedtls_mpi *d, const unsigned char *buf, size_t blen,
+                       int (*f_rng)(void *, unsigned char *, size_t), void *p_rng)
+{
+    nrf_crypto_ecc_private_key_t key;
+    uint8_t sig[2 * P256_BYTES];
+    size_t sig_size = sizeof(sig);
+    int ret;
+
+    // the nonce comes from the CC310's own RNG
+    (void)f_rng;
+    (void)p_rng;
+
+    if (grp->id != MBEDTLS_ECP_DP_SECP256R1) {
+        return MBEDTLS_ERR_ECP_FEATURE_UNAVAILABLE;
+    }
+    ret = private_key_from_mpi(&key, d);
+    if (ret != 0) {
+        return ret;
+    }
+
+    ret_code_t err = nrf_crypto_ecdsa_sign(NULL, &key, buf, blen, sig, &sig_size);
+    nrf_crypto_ecc_private_key_free(&key);
+    if (err != NRF_SUCCESS) {
+        return ecc_error(err);
+    }
+
+    ret = mbedtls_mpi_read_binary(r, sig, P256_BYTES);
+    if (ret == 0) {
+        ret = mbedtls_mpi_read_binary(s, sig + P256_BYTES, P256_BYTES);
+    }
+    return ret;
+}
+
+int mbedtls_ecdsa_verify(mbedtls_ecp_group *grp, const unsigned char *buf, size_t blen,
+                         const mbedtls_ecp_point *Q, const mbedtls_mpi *r, const mbedtls_mpi *s)
+{
+    nrf_crypto_ecc_public_key_t key;
+    uint8_t sig[2 * P256_BYTES];
+    int ret;
+
+    if (grp->id != MBEDTLS_ECP_DP_SECP256R1) {
+        return MBEDTLS_ERR_ECP_FEATURE_UNAVAILABLE;
+    }
+    // r and s that don't fit can't be valid
+    if (mbedtls_mpi_write_binary(r, sig, P256_BYTES) != 0 ||
+        mbedtls_mpi_write_binary(s, sig + P256_BYTES, P256_BYTES) != 0) {
+        return MBEDTLS_ERR_ECP_VERIFY_FAILED;
+    }
+    ret = public_key_from_point(&key, Q);
+    if (ret != 0) {
+        return ret;
+    }
+
+    ret_code_t err = nrf_crypto_ecdsa_verify(NULL, &key, buf, blen, sig, sizeof(sig));
+    nrf_crypto_ecc_public_key_free(&key);
+    return err == NRF_SUCCESS ? 0 : ecc_error(err);
+}
+
+int mbedtls_ecdh_gen_public(mbedtls_ecp_group *grp, mbedtls_mpi *d, mbedtls_ecp_point *Q,
+                            int (*f_rng)(void *, unsigned char *, size_t), void *p_rng)
+{
+    nrf_crypto_ecc_private_key_t private_key;
+    nrf_crypto_ecc_public_key_t public_key;
+    uint8_t raw[2 * P256_BYTES];
+    size_t size;
+    int ret;
+
+    (void)f_rng;
+    (void)p_rng;
+
+    if (grp->id != MBEDTLS_ECP_DP_SECP256R1) {
+        return MBEDTLS_ERR_ECP_FEATURE_UNAVAILABLE;
+    }
+    ret_code_t err = nrf_crypto_ecc_key_pair_generate(NULL, &g_nrf_crypto_ecc_secp256r1_curve_info,
+                                                      &private_key, &public_key);
+    if (err != NRF_SUCCESS) {
+        return ecc_error(err);
+    }
+
+    size = P256_BYTES;
+    err = nrf_crypto_ecc_private_key_to_raw(&private_key, raw, &size);
+    ret = err == NRF_SUCCESS ? mbedtls_mpi_read_binary(d, raw, size) : ecc_error(err);
+    if (ret == 0) {
+        size = sizeof(raw);
+        err = nrf_crypto_ecc_public_key_to_raw(&public_key, raw, &size);
+        ret = err == NRF_SUCCESS ? mbedtls_mpi_read_binary(&Q->X, raw, P256_BYTES) : ecc_error(err);
+    }
+    if (ret == 0) {
+        ret = mbedtls_mpi_read_binary(&Q->Y, raw + P256_BYTES, P256_BYTES);
+    }
+    if (ret == 0) {
+        ret = mbedtls_mpi_lset(&Q->Z, 1);
+    }
+
+    memset(raw, 0, sizeof(raw));
+    nrf_crypto_ecc_private_key_free(&private_key);
+    nrf_crypto_ecc_public_key_free(&public_key);
+    return ret;
+}
+
+int mbedtls_ecdh_compute_shared(mbedtls_ecp_group *grp, mbedtls_mpi *z,
+                                const mbedtls_ecp_point *Q, const mbedtls_mpi *d,
+                                int (*f_rng)(void *, unsigned char *, size_t), void *p_rng)
+{
+    nrf_crypto_ecc_private_key_t private_key;
+    nrf_crypto_ecc_public_key_t public_key;
+    uint8_t shared[P256_BYTES];
+    size_t shared_size = sizeof(shared);
+    int ret;
+
+    (void)f_rng;
+    (void)p_rng;
+
+    if (grp->id != MBEDTLS_ECP_DP_SECP256R1) {
+        return MBEDTLS_ERR_ECP_FEATURE_UNAVAILABLE;
+    }
+    ret = public_key_from_point(&public_key, Q);
+    if (ret != 0) {
+        return ret;
+    }
+    ret = private_key_from_mpi(&private_key, d);
+    if (ret != 0) {
+        nrf_crypto_ecc_public_key_free(&public_key);
+        return ret;
+    }
+
+    ret_code_t err = nrf_crypto_ecdh_compute(NULL, &private_key, &public_key, shared, &shared_size);
+    ret = err == NRF_SUCCESS ? mbedtls_mpi_read_binary(z, shared, shared_size) : ecc_error(err);
+
+    memset(shared, 0, sizeof(shared));
+    nrf_crypto_ecc_private_key_free(&private_key);
+    nrf_crypto_ecc_public_key_free(&public_key);
+    return ret;
+}
+
+#endif // CRYPTO_BACKEND_CC310
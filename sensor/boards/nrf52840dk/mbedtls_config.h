@@ -2596,6 +2596,8 @@
 #include MBEDTLS_USER_CONFIG_FILE
 #endif
 
+#include "mbedtls_config_board.h"
+
 #include "check_config.h"
 
 #endif /* MBEDTLS_CONFIG_H */
@@ -0,0 +1,55 @@
+/*
+ * Settings shared by every mbed TLS profile of this board, included at the
+ * end of mbedtls_config.h and mbedtls_config_dtls.h before check_config.h.
+ */
+
+#ifndef MBEDTLS_CONFIG_BOARD_H
+#define MBEDTLS_CONFIG_BOARD_H
+
+/*
+ * CRYPTO_BACKEND=cc310 (Board.mk) runs AES-128, SHA-256 and P-256
+ * ECDSA/ECDH on the CC310; the hooks are implemented in cc310_alt.c.
+ * AES-192/256, SHA-224 and other curves are unavailable in that build, so
+ * they are taken out of the handshake as well, and CTR_DRBG keys its AES
+ * with 128 bits instead of 256.
+ */
+#ifdef CRYPTO_BACKEND_CC310
+#define MBEDTLS_AES_ALT
+#define MBEDTLS_SHA256_ALT
+#define MBEDTLS_ECDSA_SIGN_ALT
+#define MBEDTLS_ECDSA_VERIFY_ALT
+#define MBEDTLS_ECDH_GEN_PUBLIC_ALT
+#define MBEDTLS_ECDH_COMPUTE_SHARED_ALT
+#define MBEDTLS_CTR_DRBG_USE_128_BIT_KEY
+
+#undef MBEDTLS_ECP_DP_SECP192R1_ENABLED
+#undef MBEDTLS_ECP_DP_SECP224R1_ENABLED
+#undef MBEDTLS_ECP_DP_SECP384R1_ENABLED
+#undef MBEDTLS_ECP_DP_SECP521R1_ENABLED
+#undef MBEDTLS_ECP_DP_SECP192K1_ENABLED
+#undef MBEDTLS_ECP_DP_SECP224K1_ENABLED
+#undef MBEDTLS_ECP_DP_SECP256K1_ENABLED
+#undef MBEDTLS_ECP_DP_BP256R1_ENABLED
+#undef MBEDTLS_ECP_DP_BP384R1_ENABLED
+#undef MBEDTLS_ECP_DP_BP512R1_ENABLED
+#undef MBEDTLS_ECP_DP_CURVE25519_ENABLED
+
+#ifndef MBEDTLS_SSL_CIPHERSUITES
+#define MBEDTLS_SSL_CIPHERSUITES                        \
+    MBEDTLS_TLS_ECDHE_ECDSA_WITH_AES_128_CCM,           \
+    MBEDTLS_TLS_ECDHE_ECDSA_WITH_AES_128_GCM_SHA256,    \
+    MBEDTLS_TLS_ECDHE_ECDSA_WITH_AES_128_CCM_8
+#endif
+#endif
+
+/*
+ * CRYPTO_BENCH=1 handshakes against itself over an in-memory link (see
+ * sensor/app/crypto_bench.c), which needs the client side, and counts the
+ * heap mbed TLS uses while doing so.
+ */
+#ifdef CRYPTO_BENCH
+#define MBEDTLS_SSL_CLI_C
+#define MBEDTLS_PLATFORM_MEMORY
+#endif
+
+#endif // MBEDTLS_CONFIG_BOARD_H
@@ -0,0 +1,89 @@
+/*
+ * Minimal mbed TLS profile for DTLS over BLE (MBEDTLS_PROFILE=dtls in
+ * Board.mk)
+ *
+ * Only what the sensor's DTLS server needs: DTLS 1.2, ECDHE-ECDSA on P-256
+ * with AES-128-CCM/GCM, and PEM certificates and keys. Records are sized to
+ * what one BLE transfer carries. mbedtls_config.h is the everything-on
+ * profile this one is measured against (see profile_report.sh).
+ */
+
+#ifndef MBEDTLS_CONFIG_H
+#define MBEDTLS_CONFIG_H
+
+/* System support */
+#define MBEDTLS_HAVE_ASM
+// no wall clock on the sensor: certificate dates aren't checked and
+// sessions don't expire by time
+//#define MBEDTLS_HAVE_TIME
+//#define MBEDTLS_HAVE_TIME_DATE
+#define MBEDTLS_NO_PLATFORM_ENTROPY
+
+/* Features */
+#define MBEDTLS_AES_ROM_TABLES
+#define MBEDTLS_ECP_DP_SECP256R1_ENABLED
+#define MBEDTLS_ECP_NIST_OPTIM
+#define MBEDTLS_ECDSA_DETERMINISTIC
+#define MBEDTLS_KEY_EXCHANGE_ECDHE_ECDSA_ENABLED
+#define MBEDTLS_ENTROPY_FORCE_SHA256
+
+#define MBEDTLS_SSL_PROTO_TLS1_2
+#define MBEDTLS_SSL_PROTO_DTLS
+#define MBEDTLS_SSL_DTLS_ANTI_REPLAY
+#define MBEDTLS_SSL_DTLS_HELLO_VERIFY
+#define MBEDTLS_SSL_DTLS_BADMAC_LIMIT
+#define MBEDTLS_SSL_EXTENDED_MASTER_SECRET
+#define MBEDTLS_SSL_MAX_FRAGMENT_LENGTH
+
+/* Modules */
+#define MBEDTLS_AES_C
+#define MBEDTLS_ASN1_PARSE_C
+#define MBEDTLS_ASN1_WRITE_C
+#define MBEDTLS_BASE64_C
+#define MBEDTLS_BIGNUM_C
+#define MBEDTLS_CCM_C
+#define MBEDTLS_CIPHER_C
+#define MBEDTLS_CTR_DRBG_C
+#define MBEDTLS_ECDH_C
+#define MBEDTLS_ECDSA_C
+#define MBEDTLS_ECP_C
+#define MBEDTLS_ENTROPY_C
+#define MBEDTLS_GCM_C
+#define MBEDTLS_HMAC_DRBG_C
+#define MBEDTLS_MD_C
+#define MBEDTLS_OID_C
+#define MBEDTLS_PEM_PARSE_C
+#define MBEDTLS_PK_C
+#define MBEDTLS_PK_PARSE_C
+#define MBEDTLS_PLATFORM_C
+#define MBEDTLS_SHA256_C
+#define MBEDTLS_SSL_COOKIE_C
+#define MBEDTLS_SSL_SRV_C
+#define MBEDTLS_SSL_TLS_C
+#define MBEDTLS_X509_USE_C
+#define MBEDTLS_X509_CRT_PARSE_C
+
+/* Sizes */
+// P-256 is the largest thing a bignum has to hold
+#define MBEDTLS_MPI_MAX_SIZE 32
+#define MBEDTLS_MPI_WINDOW_SIZE 2
+#define MBEDTLS_ECP_MAX_BITS 256
+#define MBEDTLS_ECP_WINDOW_SIZE 2
+#define MBEDTLS_ECP_FIXED_POINT_OPTIM 0
+
+// A whole record has to fit one BLE transfer into the transport's receive
+// buffer (DTLS_GATT_BUF_LEN in common/dtls_gatt.h): 960 bytes of content
+// plus the 13-byte DTLS header, 8-byte explicit nonce and 16-byte tag.
+// Both I/O buffers shrink from 16 KB each accordingly.
+#define MBEDTLS_SSL_MAX_CONTENT_LEN 960
+
+#define MBEDTLS_SSL_CIPHERSUITES                        \
+    MBEDTLS_TLS_ECDHE_ECDSA_WITH_AES_128_CCM,           \
+    MBEDTLS_TLS_ECDHE_ECDSA_WITH_AES_128_GCM_SHA256,    \
+    MBEDTLS_TLS_ECDHE_ECDSA_WITH_AES_128_CCM_8
+
+#include "mbedtls_config_board.h"
+
+#include "check_config.h"
+
+#endif /* MBEDTLS_CONFIG_H */
@@ -0,0 +1,57 @@
+#!/bin/sh
+# profile_report.sh
+# Builds the sensor app with the full and the dtls mbed TLS profile (see
+# MBEDTLS_PROFILE in Board.mk) and prints flash and static RAM of each and
+# the difference. Given the RTT output of a CRYPTO_BENCH=1 run of each
+# profile, it also compares the handshake cycles and heap crypto_bench.c
+# reports.
+#
+#   make profile-report [LOGS="full.log dtls.log"]     from sensor/app
+#   ../boards/nrf52840dk/profile_report.sh [full.log dtls.log]
+set -e
+
+SIZE=${SIZE:-arm-none-eabi-size}
+MAKE=${MAKE:-make}
+
+# flash (text + data) and static RAM (data + bss) of a profile's build
+sizes() {
+    $MAKE -s MBEDTLS_PROFILE="$1" BUILDDIR="_build_$1/" >/dev/null
+    elf=$(ls "_build_$1"/*.elf | head -n 1)
+    $SIZE -B "$elf" | awk 'NR == 2 { print $1 + $2, $2 + $3 }'
+}
+
+# value of a crypto_bench line in a log, e.g. "dtls handshake server"
+bench() {
+    grep "^bench .* $2 " "$1" | head -n 1 | awk -v name="$2" '{
+        sub(".*" name " *", ""); print $1 }'
+}
+
+row() {
+    printf '%-24s %12s %12s %12s\n' "$1" "$2" "$3" "$4"
+}
+
+delta() {
+    if [ -n "$1" ] && [ -n "$2" ]; then
+        echo $(($2 - $1))
+    fi
+}
+
+full_log=$1
+dtls_log=$2
+
+full=$(sizes full)
+dtls=$(sizes dtls)
+
+row "" full dtls delta
+row "flash (bytes)" "${full% *}" "${dtls% *}" "$(delta "${full% *}" "${dtls% *}")"
+row "static ram (bytes)" "${full#* }" "${dtls#* }" "$(delta "${full#* }" "${dtls#* }")"
+
+if [ -n "$full_log" ] && [ -n "$dtls_log" ]; then
+    for name in "dtls handshake" "dtls handshake server" "dtls handshake heap"; do
+        a=$(bench "$full_log" "$name")
+        b=$(bench "$dtls_log" "$name")
+        unit="(cycles)"
+        [ "$name" = "dtls handshake heap" ] && unit="(bytes)"
+        row "$name $unit" "$a" "$b" "$(delta "$a" "$b")"
+    done
+fi
@@ -0,0 +1,16 @@
+/*
+ * mbed TLS SHA-256 context for MBEDTLS_SHA256_ALT: the hash runs on the
+ * CC310 through nrf_crypto_hash (see cc310_alt.c). SHA-224 is not supported.
+ */
+
+#ifndef SHA256_ALT_H
+#define SHA256_ALT_H
+
+#include "nrf_crypto_hash.h"
+
+typedef struct mbedtls_sha256_context {
+    nrf_crypto_hash_context_t hash;
+    int is224;
+} mbedtls_sha256_context;
+
+#endif // SHA256_ALT_H